@@ -35,11 +35,15 @@
 #include "hw/boards.h"
 
 int tcg_tb_size;
+const char *tcg_tb_cache;
 static bool tcg_allowed = true;
 
 static int tcg_init(MachineState *ms)
 {
     tcg_exec_init(tcg_tb_size * 1024 * 1024);
+    if (tcg_tb_cache) {
+        tb_cache_init(tcg_tb_cache);
+    }
     return 0;
 }
 
@@ -17,17 +17,167 @@
 #include "block/block.h"
 #include "qemu/queue.h"
 #include "qemu/sockets.h"
+#ifdef CONFIG_EPOLL_CREATE1
+#include <sys/epoll.h>
+#endif
 
 struct AioHandler
 {
     GPollFD pfd;
     IOHandler *io_read;
     IOHandler *io_write;
+    AioPollFn *io_poll;
     int deleted;
     void *opaque;
     QLIST_ENTRY(AioHandler) node;
 };
 
+/* Number of polled fds above which aio_poll() switches to epoll.  Below
+ * it, building the pollfd array is cheaper than the epoll_ctl() calls
+ * needed to keep the epoll set up to date.
+ */
+#define EPOLL_ENABLE_THRESHOLD 64
+
+#ifdef CONFIG_EPOLL_CREATE1
+
+/* Stop using epoll for good, for example because an fd cannot be added
+ * to the epoll set (regular files cannot).  aio_poll() goes back to
+ * ppoll, which works for every fd.
+ */
+static void aio_epoll_disable(AioContext *ctx)
+{
+    ctx->epoll_available = false;
+    ctx->epoll_enabled = false;
+    if (ctx->epollfd >= 0) {
+        close(ctx->epollfd);
+        ctx->epollfd = -1;
+    }
+}
+
+static int epoll_events_from_pfd(int pfd_events)
+{
+    return (pfd_events & G_IO_IN ? EPOLLIN : 0) |
+           (pfd_events & G_IO_OUT ? EPOLLOUT : 0) |
+           (pfd_events & G_IO_HUP ? EPOLLHUP : 0) |
+           (pfd_events & G_IO_ERR ? EPOLLERR : 0);
+}
+
+static int pfd_events_from_epoll(int epoll_events)
+{
+    return (epoll_events & EPOLLIN ? G_IO_IN : 0) |
+           (epoll_events & EPOLLOUT ? G_IO_OUT : 0) |
+           (epoll_events & EPOLLHUP ? G_IO_HUP : 0) |
+           (epoll_events & EPOLLERR ? G_IO_ERR : 0);
+}
+
+/* Keep the epoll set in sync with NODE, whose events just changed.  */
+static void aio_epoll_update(AioContext *ctx, AioHandler *node, bool is_new)
+{
+    struct epoll_event event;
+    int r;
+
+    if (!ctx->epoll_enabled) {
+        return;
+    }
+    if (!node->pfd.events) {
+        r = epoll_ctl(ctx->epollfd, EPOLL_CTL_DEL, node->pfd.fd, &event);
+    } else {
+        event.data.ptr = node;
+        event.events = epoll_events_from_pfd(node->pfd.events);
+        r = epoll_ctl(ctx->epollfd, is_new ? EPOLL_CTL_ADD : EPOLL_CTL_MOD,
+                      node->pfd.fd, &event);
+    }
+    if (r) {
+        aio_epoll_disable(ctx);
+    }
+}
+
+static void aio_epoll_try_enable(AioContext *ctx)
+{
+    AioHandler *node;
+    struct epoll_event event;
+
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        if (node->deleted || !node->pfd.events) {
+            continue;
+        }
+        event.data.ptr = node;
+        event.events = epoll_events_from_pfd(node->pfd.events);
+        if (epoll_ctl(ctx->epollfd, EPOLL_CTL_ADD, node->pfd.fd, &event)) {
+            aio_epoll_disable(ctx);
+            return;
+        }
+    }
+    ctx->epoll_enabled = true;
+}
+
+static int aio_epoll(AioContext *ctx, int64_t timeout)
+{
+    AioHandler *node;
+    struct epoll_event events[128];
+    int i, ret = 0;
+
+    if (timeout > 0) {
+        /* epoll_wait() only takes milliseconds; the epoll fd becomes
+         * readable when any fd in the set is ready, so wait for it with
+         * ppoll and then collect the events without blocking.
+         */
+        GPollFD pfd = {
+            .fd = ctx->epollfd,
+            .events = G_IO_IN | G_IO_HUP | G_IO_ERR,
+        };
+
+        ret = qemu_poll_ns(&pfd, 1, timeout);
+        if (ret <= 0) {
+            return ret;
+        }
+        timeout = 0;
+    }
+    ret = epoll_wait(ctx->epollfd, events, ARRAY_SIZE(events),
+                     timeout < 0 ? -1 : 0);
+    for (i = 0; i < ret; i++) {
+        node = events[i].data.ptr;
+        node->pfd.revents = pfd_events_from_epoll(events[i].events);
+    }
+    return ret;
+}
+
+#else
+
+static void aio_epoll_update(AioContext *ctx, AioHandler *node, bool is_new)
+{
+}
+
+static void aio_epoll_try_enable(AioContext *ctx)
+{
+}
+
+static int aio_epoll(AioContext *ctx, int64_t timeout)
+{
+    abort();
+}
+
+#endif
+
+void aio_context_setup(AioContext *ctx)
+{
+    ctx->epoll_enabled = false;
+    ctx->epoll_available = false;
+    ctx->epollfd = -1;
+#ifdef CONFIG_EPOLL_CREATE1
+    ctx->epollfd = epoll_create1(EPOLL_CLOEXEC);
+    ctx->epoll_available = ctx->epollfd >= 0;
+#endif
+}
+
+void aio_context_destroy(AioContext *ctx)
+{
+    if (ctx->epollfd >= 0) {
+        close(ctx->epollfd);
+        ctx->epollfd = -1;
+    }
+}
+
 static AioHandler *find_aio_handler(AioContext *ctx, int fd)
 {
     AioHandler *node;
@@ -54,7 +204,13 @@ void aio_set_fd_handler(AioContext *ctx,
     /* Are we deleting the fd handler? */
     if (!io_read && !io_write) {
         if (node) {
+            if (node->io_poll) {
+                node->io_poll = NULL;
+                ctx->poll_handlers--;
+            }
             g_source_remove_poll(&ctx->source, &node->pfd);
+            node->pfd.events = 0;
+            aio_epoll_update(ctx, node, false);
 
             /* If the lock is held, just mark the node as deleted */
             if (ctx->walking_handlers) {
@@ -70,6 +226,8 @@ void aio_set_fd_handler(AioContext *ctx,
             }
         }
     } else {
+        bool is_new = false;
+
         if (node == NULL) {
             /* Alloc and insert if it's not already there */
             node = g_new0(AioHandler, 1);
@@ -77,6 +235,7 @@ void aio_set_fd_handler(AioContext *ctx,
             QLIST_INSERT_HEAD(&ctx->aio_handlers, node, node);
 
             g_source_add_poll(&ctx->source, &node->pfd);
+            is_new = true;
         }
         /* Update handler with latest information */
         node->io_read = io_read;
@@ -85,6 +244,7 @@ void aio_set_fd_handler(AioContext *ctx,
 
         node->pfd.events = (io_read ? G_IO_IN | G_IO_HUP | G_IO_ERR : 0);
         node->pfd.events |= (io_write ? G_IO_OUT | G_IO_ERR : 0);
+        aio_epoll_update(ctx, node, is_new);
     }
 
     aio_notify(ctx);
@@ -98,6 +258,44 @@ void aio_set_event_notifier(AioContext *ctx,
                        (IOHandler *)io_read, NULL, notifier);
 }
 
+void aio_set_fd_poll(AioContext *ctx, int fd, AioPollFn *io_poll)
+{
+    AioHandler *node = find_aio_handler(ctx, fd);
+
+    if (!node) {
+        assert(!io_poll);
+        return;
+    }
+    ctx->poll_handlers += !!io_poll - !!node->io_poll;
+    node->io_poll = io_poll;
+
+    aio_notify(ctx);
+}
+
+void aio_set_event_notifier_poll(AioContext *ctx,
+                                 EventNotifier *notifier,
+                                 AioPollFn *io_poll)
+{
+    aio_set_fd_poll(ctx, event_notifier_get_fd(notifier), io_poll);
+}
+
+void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
+                                 int64_t grow, int64_t shrink,
+                                 Error **errp)
+{
+    if (max_ns < 0 || grow < 0 || shrink < 0) {
+        error_setg(errp, "AioContext polling parameters must not be negative");
+        return;
+    }
+
+    ctx->poll_max_ns = max_ns;
+    ctx->poll_ns = 0;
+    ctx->poll_grow = grow;
+    ctx->poll_shrink = shrink;
+
+    aio_notify(ctx);
+}
+
 bool aio_prepare(AioContext *ctx)
 {
     return false;
@@ -230,6 +428,85 @@ static void add_pollfd(AioHandler *node)
     npfd++;
 }
 
+/* Initial polling time once polling starts to pay off, and default
+ * growth factor.
+ */
+#define POLL_NS_INITIAL 4000
+#define POLL_GROW_DEFAULT 2
+
+static bool run_poll_handlers_once(AioContext *ctx)
+{
+    AioHandler *node;
+    bool progress = false;
+
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        if (!node->deleted && node->io_poll &&
+            node->io_poll(node->opaque)) {
+            progress = true;
+        }
+    }
+
+    return progress;
+}
+
+/* Spin on the io_poll callbacks for up to ctx->poll_ns, or until the
+ * deadline given by @timeout.  Clears @timeout if work was found, so that
+ * the following ppoll/epoll_wait does not block.
+ *
+ * Returns whether any io_poll callback made progress.
+ */
+static bool try_poll_mode(AioContext *ctx, int64_t *timeout)
+{
+    int64_t end_time;
+    bool progress;
+
+    if (*timeout == 0 || ctx->poll_ns == 0 || ctx->poll_handlers == 0) {
+        return false;
+    }
+
+    end_time = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) +
+               (*timeout < 0 ? ctx->poll_ns : MIN(*timeout, ctx->poll_ns));
+    do {
+        progress = run_poll_handlers_once(ctx);
+    } while (!progress && !atomic_read(&ctx->notified) &&
+             qemu_clock_get_ns(QEMU_CLOCK_REALTIME) < end_time);
+
+    if (progress) {
+        ctx->poll_hits++;
+        *timeout = 0;
+    } else {
+        ctx->poll_misses++;
+    }
+    return progress;
+}
+
+/* Adjust the polling time after a blocking aio_poll() took @block_ns,
+ * polling included.
+ */
+static void adjust_poll_ns(AioContext *ctx, int64_t block_ns)
+{
+    if (block_ns <= ctx->poll_ns) {
+        /* Polling caught the event, no adjustment needed */
+    } else if (block_ns > ctx->poll_max_ns) {
+        /* We would have to poll for too long, poll less */
+        if (ctx->poll_shrink) {
+            ctx->poll_ns /= ctx->poll_shrink;
+        } else {
+            ctx->poll_ns = 0;
+        }
+    } else if (ctx->poll_ns < ctx->poll_max_ns) {
+        /* Polling a little longer would have avoided the wait */
+        int64_t grow = ctx->poll_grow ? ctx->poll_grow : POLL_GROW_DEFAULT;
+
+        if (ctx->poll_ns == 0) {
+            ctx->poll_ns = POLL_NS_INITIAL;
+        } else {
+            ctx->poll_ns *= grow;
+        }
+        ctx->poll_ns = MIN(ctx->poll_ns, ctx->poll_max_ns);
+    }
+}
+
 bool aio_poll(AioContext *ctx, bool blocking)
 {
     AioHandler *node;
@@ -237,6 +514,7 @@ bool aio_poll(AioContext *ctx, bool blocking)
     int i, ret;
     bool progress;
     int64_t timeout;
+    int64_t start = 0;
 
     aio_context_acquire(ctx);
     was_dispatching = ctx->dispatching;
@@ -252,32 +530,58 @@ bool aio_poll(AioContext *ctx, bool blocking)
      * In that case we can restore it just before returning, but we
      * have to clear it now.
      */
+    atomic_set(&ctx->notified, false);
     aio_set_dispatching(ctx, !blocking);
 
     ctx->walking_handlers++;
 
     assert(npfd == 0);
 
-    /* fill pollfds */
-    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
-        if (!node->deleted && node->pfd.events) {
-            add_pollfd(node);
+    timeout = blocking ? aio_compute_timeout(ctx) : 0;
+
+    /* spin for a while before blocking in the kernel */
+    if (timeout && ctx->poll_max_ns) {
+        start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        if (try_poll_mode(ctx, &timeout)) {
+            progress = true;
         }
     }
 
-    timeout = blocking ? aio_compute_timeout(ctx) : 0;
+    /* fill pollfds; with epoll, the kernel already has the fd set */
+    if (!ctx->epoll_enabled) {
+        QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+            if (!node->deleted && node->pfd.events) {
+                add_pollfd(node);
+            }
+        }
+        if (ctx->epoll_available && npfd > EPOLL_ENABLE_THRESHOLD) {
+            aio_epoll_try_enable(ctx);
+            if (ctx->epoll_enabled) {
+                npfd = 0;
+            }
+        }
+    }
 
     /* wait until next event */
     if (timeout) {
         aio_context_release(ctx);
     }
-    ret = qemu_poll_ns((GPollFD *)pollfds, npfd, timeout);
+    if (ctx->epoll_enabled) {
+        ret = aio_epoll(ctx, timeout);
+    } else {
+        ret = qemu_poll_ns((GPollFD *)pollfds, npfd, timeout);
+    }
     if (timeout) {
         aio_context_acquire(ctx);
+        ctx->poll_sleeps++;
+    }
+
+    if (start) {
+        adjust_poll_ns(ctx, qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start);
     }
 
     /* if we have any readable fds, dispatch event */
-    if (ret > 0) {
+    if (ret > 0 && npfd) {
         for (i = 0; i < npfd; i++) {
             nodes[i]->pfd.revents = pollfds[i].revents;
         }
@@ -144,6 +144,36 @@ void aio_set_event_notifier(AioContext *ctx,
     aio_notify(ctx);
 }
 
+/* Polling is not implemented on Windows; handlers are only ever
+ * dispatched when their event is signaled.
+ */
+void aio_set_fd_poll(AioContext *ctx, int fd, AioPollFn *io_poll)
+{
+}
+
+void aio_set_event_notifier_poll(AioContext *ctx,
+                                 EventNotifier *notifier,
+                                 AioPollFn *io_poll)
+{
+}
+
+void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
+                                 int64_t grow, int64_t shrink,
+                                 Error **errp)
+{
+    if (max_ns) {
+        error_setg(errp, "AioContext polling is not implemented on Windows");
+    }
+}
+
+void aio_context_setup(AioContext *ctx)
+{
+}
+
+void aio_context_destroy(AioContext *ctx)
+{
+}
+
 bool aio_prepare(AioContext *ctx)
 {
     static struct timeval tv0;
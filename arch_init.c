@@ -24,7 +24,6 @@
 #include <stdint.h>
 #include <stdarg.h>
 #include <stdlib.h>
-#include <zlib.h>
 #ifndef _WIN32
 #include <sys/types.h>
 #include <sys/mman.h>
@@ -41,10 +40,12 @@
 #include "hw/audio/audio.h"
 #include "sysemu/kvm.h"
 #include "migration/migration.h"
+#include "migration/postcopy-ram.h"
 #include "hw/i386/smbios.h"
 #include "exec/address-spaces.h"
 #include "hw/audio/pcspk.h"
 #include "migration/page_cache.h"
+#include "migration/page-compress.h"
 #include "qemu/config-file.h"
 #include "qemu/error-report.h"
 #include "qmp-commands.h"
@@ -54,6 +55,7 @@
 #include "hw/acpi/acpi.h"
 #include "qemu/host-utils.h"
 #include "qemu/rcu_queue.h"
+#include "qemu/sockets.h"
 
 #ifdef DEBUG_ARCH_INIT
 #define DPRINTF(fmt, ...) \
@@ -111,9 +113,9 @@ int graphic_depth = 32;
 #endif
 
 const uint32_t arch_type = QEMU_ARCH;
-static bool mig_throttle_on;
 static int dirty_rate_high_cnt;
-static void check_guest_throttling(void);
+static void mig_throttle_guest_down(uint64_t bytes_dirty,
+                                    uint64_t bytes_xfer);
 
 static uint64_t bitmap_sync_count;
 
@@ -129,6 +131,11 @@ static uint64_t bitmap_sync_count;
 #define RAM_SAVE_FLAG_XBZRLE   0x40
 /* 0x80 is reserved in migration.h start with 0x100 next */
 #define RAM_SAVE_FLAG_COMPRESS_PAGE    0x100
+/* 0x200 is the last free bit with 1k target pages */
+#define RAM_SAVE_FLAG_MULTIFD_SYNC     0x200
+/* A MEM_SIZE record with this set ends with the page compression codec */
+#define RAM_SAVE_FLAG_MEM_SIZE_CODEC \
+    (RAM_SAVE_FLAG_MEM_SIZE | RAM_SAVE_FLAG_COMPRESS_PAGE)
 
 static struct defconfig_file {
     const char *filename;
@@ -200,7 +207,6 @@ static void XBZRLE_cache_unlock(void)
  */
 int64_t xbzrle_cache_resize(int64_t new_size)
 {
-    PageCache *new_cache;
     int64_t ret;
 
     if (new_size < TARGET_PAGE_SIZE) {
@@ -213,16 +219,12 @@ int64_t xbzrle_cache_resize(int64_t new_size)
         if (pow2floor(new_size) == migrate_xbzrle_cache_size()) {
             goto out_new_size;
         }
-        new_cache = cache_init(new_size / TARGET_PAGE_SIZE,
-                                        TARGET_PAGE_SIZE);
-        if (!new_cache) {
-            error_report("Error creating cache");
+        /* Cached pages are kept, so XBZRLE goes on working */
+        if (cache_resize(XBZRLE.cache, new_size / TARGET_PAGE_SIZE) < 0) {
+            error_report("Error resizing cache");
             ret = -1;
             goto out;
         }
-
-        cache_fini(XBZRLE.cache);
-        XBZRLE.cache = new_cache;
     }
 
 out_new_size:
@@ -242,7 +244,11 @@ typedef struct AccountingInfo {
     uint64_t xbzrle_pages;
     uint64_t xbzrle_cache_miss;
     double xbzrle_cache_miss_rate;
+    int64_t xbzrle_cache_suggested_size;
     uint64_t xbzrle_overflows;
+    uint64_t copied_bytes;
+    uint64_t zerocopy_sends;
+    uint64_t zerocopy_fallbacks;
 } AccountingInfo;
 
 static AccountingInfo acct_info;
@@ -302,11 +308,32 @@ double xbzrle_mig_cache_miss_rate(void)
     return acct_info.xbzrle_cache_miss_rate;
 }
 
+/* Returns: the cache size advised by the last dirty bitmap sync, in bytes */
+int64_t xbzrle_mig_cache_suggested_size(void)
+{
+    return acct_info.xbzrle_cache_suggested_size;
+}
+
 uint64_t xbzrle_mig_pages_overflow(void)
 {
     return acct_info.xbzrle_overflows;
 }
 
+uint64_t copied_mig_bytes_transferred(void)
+{
+    return acct_info.copied_bytes;
+}
+
+uint64_t zerocopy_mig_sends(void)
+{
+    return acct_info.zerocopy_sends;
+}
+
+uint64_t zerocopy_mig_fallbacks(void)
+{
+    return acct_info.zerocopy_fallbacks;
+}
+
 /* This is the last block that we have visited serching for dirty pages
  */
 static RAMBlock *last_seen_block;
@@ -318,21 +345,43 @@ static uint64_t migration_dirty_pages;
 static uint32_t last_version;
 static bool ram_bulk_stage;
 
+/* Pages handed to a compression thread per wake-up */
+#define COMPRESS_BATCH_PAGES 32
+/* Longest page header: offset, idstr length and idstr */
+#define COMPRESS_PAGE_HEADER_MAX (8 + 1 + 256)
+
 struct CompressParam {
-    bool start;
-    bool done;
-    QEMUFile *file;
+    /* Set by the migration thread to hand the batch over, under @mutex;
+     * cleared by the compression thread once it is done, under
+     * comp_done_lock.  Whoever does not own the batch must not touch
+     * the fields below.
+     */
+    bool busy;
     QemuMutex mutex;
     QemuCond cond;
+    PageCompressor *comp;
+    /* Pages to compress, all from the same block */
     RAMBlock *block;
-    ram_addr_t offset;
+    ram_addr_t offsets[COMPRESS_BATCH_PAGES];
+    int nr_pages;
+    /* Compressed pages with their headers, ready to go on the wire */
+    uint8_t *out;
+    size_t out_len;
+    /* Copy of the page being compressed, so the guest cannot change it
+     * under the codec and make it emit a stream that fails to decode
+     */
+    uint8_t *page;
 };
 typedef struct CompressParam CompressParam;
 
 struct DecompressParam {
+    /* Set by the main thread under @mutex, cleared by the decompression
+     * thread under both @mutex and decomp_done_lock
+     */
     bool start;
     QemuMutex mutex;
     QemuCond cond;
+    PageCompressor *comp;
     void *des;
     uint8 *compbuf;
     int len;
@@ -341,79 +390,96 @@ typedef struct DecompressParam DecompressParam;
 
 static CompressParam *comp_param;
 static QemuThread *compress_threads;
+static int comp_thread_count;
+/* Worst case compressed size of one page with the chosen codec */
+static size_t comp_bound;
+/* Batch the migration thread is filling, if any */
+static CompressParam *comp_fill;
+/* Where to start looking for an idle thread, to spread the work */
+static int comp_next_idx;
 /* comp_done_cond is used to wake up the migration thread when
  * one of the compression threads has finished the compression.
  * comp_done_lock is used to co-work with comp_done_cond.
  */
 static QemuMutex *comp_done_lock;
 static QemuCond *comp_done_cond;
-/* The empty QEMUFileOps will be used by file in CompressParam */
-static const QEMUFileOps empty_ops = { };
 
 static bool compression_switch;
 static bool quit_comp_thread;
 static bool quit_decomp_thread;
 static DecompressParam *decomp_param;
 static QemuThread *decompress_threads;
+static int decomp_thread_count;
+static size_t decomp_bound;
 static uint8_t *compressed_data_buf;
+/* decomp_done_cond is signalled, under decomp_done_lock, whenever a
+ * decompression thread finishes a page; decomp_error keeps the first
+ * failure so that ram_load() can fail the migration.
+ */
+static QemuMutex decomp_done_lock;
+static QemuCond decomp_done_cond;
+static int decomp_error;
 
-static int do_compress_ram_page(CompressParam *param);
+static void do_compress_ram_batch(CompressParam *param);
 
 static void *do_data_compress(void *opaque)
 {
     CompressParam *param = opaque;
 
+    qemu_mutex_lock(&param->mutex);
+    /* Re-checking quit_comp_thread under the mutex makes sure that a
+     * terminate_compression_threads() racing with the wait is noticed.
+     */
     while (!quit_comp_thread) {
-        qemu_mutex_lock(&param->mutex);
-        /* Re-check the quit_comp_thread in case of
-         * terminate_compression_threads is called just before
-         * qemu_mutex_lock(&param->mutex) and after
-         * while(!quit_comp_thread), re-check it here can make
-         * sure the compression thread terminate as expected.
-         */
-        while (!param->start && !quit_comp_thread) {
+        if (!param->busy) {
             qemu_cond_wait(&param->cond, &param->mutex);
+            continue;
         }
-        if (!quit_comp_thread) {
-            do_compress_ram_page(param);
-        }
-        param->start = false;
         qemu_mutex_unlock(&param->mutex);
 
+        do_compress_ram_batch(param);
+
         qemu_mutex_lock(comp_done_lock);
-        param->done = true;
+        param->busy = false;
         qemu_cond_signal(comp_done_cond);
         qemu_mutex_unlock(comp_done_lock);
+
+        qemu_mutex_lock(&param->mutex);
     }
+    qemu_mutex_unlock(&param->mutex);
 
     return NULL;
 }
 
 static inline void terminate_compression_threads(void)
 {
-    int idx, thread_count;
+    int idx;
 
-    thread_count = migrate_compress_threads();
     quit_comp_thread = true;
-    for (idx = 0; idx < thread_count; idx++) {
+    for (idx = 0; idx < comp_thread_count; idx++) {
         qemu_mutex_lock(&comp_param[idx].mutex);
         qemu_cond_signal(&comp_param[idx].cond);
         qemu_mutex_unlock(&comp_param[idx].mutex);
     }
+    /* Wake a migration thread waiting for a batch that will not finish */
+    qemu_mutex_lock(comp_done_lock);
+    qemu_cond_broadcast(comp_done_cond);
+    qemu_mutex_unlock(comp_done_lock);
 }
 
 void migrate_compress_threads_join(void)
 {
-    int i, thread_count;
+    int i;
 
-    if (!migrate_use_compression()) {
+    if (!comp_param) {
         return;
     }
     terminate_compression_threads();
-    thread_count = migrate_compress_threads();
-    for (i = 0; i < thread_count; i++) {
+    for (i = 0; i < comp_thread_count; i++) {
         qemu_thread_join(compress_threads + i);
-        qemu_fclose(comp_param[i].file);
+        page_compressor_free(comp_param[i].comp);
+        g_free(comp_param[i].out);
+        g_free(comp_param[i].page);
         qemu_mutex_destroy(&comp_param[i].mutex);
         qemu_cond_destroy(&comp_param[i].cond);
     }
@@ -425,32 +491,39 @@ void migrate_compress_threads_join(void)
     g_free(comp_done_lock);
     compress_threads = NULL;
     comp_param = NULL;
+    comp_fill = NULL;
     comp_done_cond = NULL;
     comp_done_lock = NULL;
 }
 
 void migrate_compress_threads_create(void)
 {
-    int i, thread_count;
+    MigrationCompressMethod method = migrate_compress_method();
+    int level = migrate_compress_level();
+    int i;
 
     if (!migrate_use_compression()) {
         return;
     }
     quit_comp_thread = false;
     compression_switch = true;
-    thread_count = migrate_compress_threads();
-    compress_threads = g_new0(QemuThread, thread_count);
-    comp_param = g_new0(CompressParam, thread_count);
+    comp_fill = NULL;
+    comp_next_idx = 0;
+    comp_thread_count = migrate_compress_threads();
+    comp_bound = page_compress_bound(method, TARGET_PAGE_SIZE);
+    compress_threads = g_new0(QemuThread, comp_thread_count);
+    comp_param = g_new0(CompressParam, comp_thread_count);
     comp_done_cond = g_new0(QemuCond, 1);
     comp_done_lock = g_new0(QemuMutex, 1);
     qemu_cond_init(comp_done_cond);
     qemu_mutex_init(comp_done_lock);
-    for (i = 0; i < thread_count; i++) {
-        /* com_param[i].file is just used as a dummy buffer to save data, set
-         * it's ops to empty.
-         */
-        comp_param[i].file = qemu_fopen_ops(NULL, &empty_ops);
-        comp_param[i].done = true;
+    for (i = 0; i < comp_thread_count; i++) {
+        comp_param[i].comp = page_compressor_new(method, level);
+        assert(comp_param[i].comp);
+        comp_param[i].out = g_malloc(COMPRESS_BATCH_PAGES *
+                                     (COMPRESS_PAGE_HEADER_MAX + 4 +
+                                      MAX(comp_bound, TARGET_PAGE_SIZE)));
+        comp_param[i].page = g_malloc(TARGET_PAGE_SIZE);
         qemu_mutex_init(&comp_param[i].mutex);
         qemu_cond_init(&comp_param[i].cond);
         qemu_thread_create(compress_threads + i, "compress",
@@ -459,6 +532,507 @@ void migrate_compress_threads_create(void)
     }
 }
 
+/* Multifd: RAM pages striped over several extra connections
+ *
+ * Each connection carries packets of up to MULTIFD_PAGES_PER_PACKET pages
+ * of one RAMBlock: a header with the block name and page offsets, then
+ * the page data.  The main stream only carries the pages that are not
+ * sent this way (zero and XBZRLE pages) plus a RAM_SAVE_FLAG_MULTIFD_SYNC
+ * marker after each dirty bitmap sync.  Before writing that marker the
+ * source sends a sync packet on every connection, and the destination
+ * waits for all of them, so a page resent in a later round can never be
+ * overtaken by an older copy travelling on another connection.
+ */
+#define MULTIFD_MAGIC 0x11223344U
+#define MULTIFD_VERSION 1
+#define MULTIFD_PAGES_PER_PACKET 64
+
+#define MULTIFD_FLAG_SYNC (1 << 0)
+
+typedef struct {
+    RAMBlock *block;
+    uint32_t used;
+    ram_addr_t offset[MULTIFD_PAGES_PER_PACKET];
+} MultiFDPages;
+
+typedef struct {
+    uint8_t id;
+    QemuThread thread;
+    QEMUFile *file;
+    /* Posted when there is a packet to send, or on quit */
+    QemuSemaphore sem;
+    /* Protects the fields below */
+    QemuMutex mutex;
+    bool quit;
+    /* A packet has been handed over and is not sent yet */
+    bool pending_job;
+    /* The packet is a sync packet */
+    bool sync;
+    MultiFDPages *pages;
+} MultiFDSendParams;
+
+static struct {
+    MultiFDSendParams *params;
+    int count;
+    /* Pages being gathered by the migration thread */
+    MultiFDPages *pages;
+    /* Channel the next packet is offered to first */
+    int next_channel;
+    /* Counts the channels that are idle */
+    QemuSemaphore channels_ready;
+    /* A dirty bitmap sync happened since the last sync marker */
+    bool sync_needed;
+} *multifd_send_state;
+
+static void multifd_send_packet(QEMUFile *f, uint32_t flags,
+                                MultiFDPages *pages)
+{
+    uint8_t *host = NULL;
+    int i;
+
+    if (flags & MULTIFD_FLAG_SYNC) {
+        /* Nothing sent before the bitmap sync may still be in flight */
+        qemu_file_zerocopy_sync(f);
+    }
+
+    qemu_put_be32(f, flags);
+    qemu_put_be32(f, pages->used);
+    if (pages->used) {
+        int len = strlen(pages->block->idstr);
+
+        qemu_put_byte(f, len);
+        qemu_put_buffer(f, (uint8_t *)pages->block->idstr, len);
+        for (i = 0; i < pages->used; i++) {
+            qemu_put_be64(f, pages->offset[i]);
+        }
+        host = memory_region_get_ram_ptr(pages->block->mr);
+    }
+    for (i = 0; i < pages->used; i++) {
+        qemu_put_buffer_async(f, host + pages->offset[i], TARGET_PAGE_SIZE);
+    }
+    qemu_fflush(f);
+}
+
+static void *multifd_send_thread(void *opaque)
+{
+    MultiFDSendParams *p = opaque;
+    QEMUFile *f = p->file;
+
+    qemu_put_be32(f, MULTIFD_MAGIC);
+    qemu_put_be32(f, MULTIFD_VERSION);
+    qemu_put_byte(f, p->id);
+    qemu_fflush(f);
+
+    while (true) {
+        qemu_sem_wait(&p->sem);
+        qemu_mutex_lock(&p->mutex);
+        if (p->quit) {
+            qemu_mutex_unlock(&p->mutex);
+            break;
+        }
+        if (p->pending_job) {
+            uint32_t flags = p->sync ? MULTIFD_FLAG_SYNC : 0;
+
+            p->sync = false;
+            qemu_mutex_unlock(&p->mutex);
+
+            /* After an error, packets are just dropped so that the
+             * migration thread never waits for us; it notices the error
+             * on the main stream.
+             */
+            if (!qemu_file_get_error(f)) {
+                multifd_send_packet(f, flags, p->pages);
+                if (qemu_file_get_error(f)) {
+                    error_report("multifd channel %d: send failed: %s",
+                                 p->id, strerror(-qemu_file_get_error(f)));
+                    qemu_file_set_error(migrate_get_current()->file,
+                                        qemu_file_get_error(f));
+                }
+            }
+            if (p->pages->used) {
+                memory_region_unref(p->pages->block->mr);
+            }
+
+            qemu_mutex_lock(&p->mutex);
+            p->pages->used = 0;
+            p->pending_job = false;
+            qemu_mutex_unlock(&p->mutex);
+            qemu_sem_post(&multifd_send_state->channels_ready);
+        } else {
+            qemu_mutex_unlock(&p->mutex);
+        }
+    }
+
+    return NULL;
+}
+
+/* Returns 0 on success, -1 if a connection could not be opened */
+int multifd_save_setup(MigrationState *s)
+{
+    int thread_count = migrate_multifd_channels();
+    int i;
+
+    multifd_send_state = g_malloc0(sizeof(*multifd_send_state));
+    multifd_send_state->params = g_new0(MultiFDSendParams, thread_count);
+    multifd_send_state->pages = g_new0(MultiFDPages, 1);
+    qemu_sem_init(&multifd_send_state->channels_ready, 0);
+
+    for (i = 0; i < thread_count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+        Error *local_err = NULL;
+        int fd;
+
+        fd = inet_connect(s->multifd_host_port, &local_err);
+        if (fd < 0) {
+            error_report("multifd channel %d: %s", i,
+                         error_get_pretty(local_err));
+            error_free(local_err);
+            return -1;
+        }
+
+        p->id = i;
+        p->file = qemu_fopen_socket(fd, "wb");
+        if (migrate_use_zerocopy()) {
+            /* Falls back to copying quietly; the main stream reports it */
+            qemu_file_enable_zerocopy(p->file);
+        }
+        p->pages = g_new0(MultiFDPages, 1);
+        qemu_sem_init(&p->sem, 0);
+        qemu_mutex_init(&p->mutex);
+        qemu_thread_create(&p->thread, "multifd_send", multifd_send_thread,
+                           p, QEMU_THREAD_JOINABLE);
+        multifd_send_state->count++;
+        qemu_sem_post(&multifd_send_state->channels_ready);
+    }
+
+    return 0;
+}
+
+/* Unblock the channels if they are stuck sending to a dead destination */
+void multifd_send_shutdown(void)
+{
+    int i;
+
+    if (!multifd_send_state) {
+        return;
+    }
+    for (i = 0; i < multifd_send_state->count; i++) {
+        qemu_file_shutdown(multifd_send_state->params[i].file);
+    }
+}
+
+void multifd_save_cleanup(void)
+{
+    int i;
+
+    if (!multifd_send_state) {
+        return;
+    }
+    for (i = 0; i < multifd_send_state->count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        qemu_mutex_lock(&p->mutex);
+        p->quit = true;
+        qemu_mutex_unlock(&p->mutex);
+        qemu_sem_post(&p->sem);
+        qemu_thread_join(&p->thread);
+
+        /* A failed migration can leave a packet that was never sent */
+        if (p->pending_job && p->pages->used) {
+            memory_region_unref(p->pages->block->mr);
+        }
+        qemu_fclose(p->file);
+        qemu_sem_destroy(&p->sem);
+        qemu_mutex_destroy(&p->mutex);
+        g_free(p->pages);
+    }
+    qemu_sem_destroy(&multifd_send_state->channels_ready);
+    g_free(multifd_send_state->params);
+    g_free(multifd_send_state->pages);
+    g_free(multifd_send_state);
+    multifd_send_state = NULL;
+}
+
+/* Hand the gathered pages over to the first idle channel */
+static void multifd_send_pages(void)
+{
+    MultiFDSendParams *p;
+    MultiFDPages *pages;
+    int i;
+
+    qemu_sem_wait(&multifd_send_state->channels_ready);
+    for (i = multifd_send_state->next_channel;; i = (i + 1) %
+         multifd_send_state->count) {
+        p = &multifd_send_state->params[i];
+        qemu_mutex_lock(&p->mutex);
+        if (!p->pending_job) {
+            break;
+        }
+        qemu_mutex_unlock(&p->mutex);
+    }
+    multifd_send_state->next_channel = (i + 1) % multifd_send_state->count;
+
+    pages = multifd_send_state->pages;
+    multifd_send_state->pages = p->pages;
+    p->pages = pages;
+    if (pages->used) {
+        memory_region_ref(pages->block->mr);
+    }
+    p->pending_job = true;
+    qemu_mutex_unlock(&p->mutex);
+    qemu_sem_post(&p->sem);
+}
+
+static void multifd_queue_page(RAMBlock *block, ram_addr_t offset)
+{
+    MultiFDPages *pages = multifd_send_state->pages;
+
+    if (pages->used && pages->block != block) {
+        multifd_send_pages();
+        pages = multifd_send_state->pages;
+    }
+    pages->block = block;
+    pages->offset[pages->used++] = offset;
+    if (pages->used == MULTIFD_PAGES_PER_PACKET) {
+        multifd_send_pages();
+    }
+}
+
+/*
+ * Called by the migration thread, within the RAM section, after a dirty
+ * bitmap sync (or with @force at the end of migration): flush what is
+ * queued, put a sync packet on every channel and the matching marker on
+ * the main stream.
+ */
+static void multifd_send_sync_main(QEMUFile *f, bool force)
+{
+    int i;
+
+    if (!multifd_send_state ||
+        !(force || multifd_send_state->sync_needed)) {
+        return;
+    }
+    multifd_send_state->sync_needed = false;
+    trace_multifd_send_sync_main();
+
+    if (multifd_send_state->pages->used) {
+        multifd_send_pages();
+    }
+    /* Wait for every channel to be idle, then give each one a sync */
+    for (i = 0; i < multifd_send_state->count; i++) {
+        qemu_sem_wait(&multifd_send_state->channels_ready);
+    }
+    for (i = 0; i < multifd_send_state->count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        qemu_mutex_lock(&p->mutex);
+        p->sync = true;
+        p->pending_job = true;
+        qemu_mutex_unlock(&p->mutex);
+        qemu_sem_post(&p->sem);
+    }
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_MULTIFD_SYNC);
+}
+
+typedef struct {
+    uint8_t id;
+    QemuThread thread;
+    QEMUFile *file;
+    /* Posted by the main thread to release us from a sync point */
+    QemuSemaphore sem_sync;
+} MultiFDRecvParams;
+
+static struct {
+    MultiFDRecvParams *params;
+    /* Number of channels connected so far */
+    int count;
+    /* Posted by each channel reaching a sync point, or failing */
+    QemuSemaphore sem_sync;
+    bool quit;
+    bool error;
+} *multifd_recv_state;
+
+static int multifd_recv_packet(QEMUFile *f, uint32_t *flags)
+{
+    char idstr[256];
+    ram_addr_t offset[MULTIFD_PAGES_PER_PACKET];
+    RAMBlock *block = NULL;
+    uint8_t *host;
+    uint32_t used;
+    int len, i;
+    int ret = 0;
+
+    *flags = qemu_get_be32(f);
+    used = qemu_get_be32(f);
+    if (used > MULTIFD_PAGES_PER_PACKET) {
+        error_report("multifd: packet with %u pages", used);
+        return -EINVAL;
+    }
+    if (!used) {
+        return qemu_file_get_error(f);
+    }
+
+    len = qemu_get_byte(f);
+    qemu_get_buffer(f, (uint8_t *)idstr, len);
+    idstr[len] = 0;
+    for (i = 0; i < used; i++) {
+        offset[i] = qemu_get_be64(f);
+    }
+    ret = qemu_file_get_error(f);
+    if (ret) {
+        return ret;
+    }
+
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        if (!strcmp(idstr, block->idstr)) {
+            break;
+        }
+    }
+    if (!block) {
+        error_report("multifd: unknown RAMBlock '%s'", idstr);
+        ret = -EINVAL;
+        goto out;
+    }
+    host = memory_region_get_ram_ptr(block->mr);
+    for (i = 0; i < used; i++) {
+        if ((offset[i] & ~TARGET_PAGE_MASK) ||
+            offset[i] >= block->used_length) {
+            error_report("multifd: bad offset " RAM_ADDR_FMT " in '%s'",
+                         offset[i], idstr);
+            ret = -EINVAL;
+            goto out;
+        }
+        qemu_get_buffer(f, host + offset[i], TARGET_PAGE_SIZE);
+    }
+    ret = qemu_file_get_error(f);
+
+out:
+    rcu_read_unlock();
+    return ret;
+}
+
+static void *multifd_recv_thread(void *opaque)
+{
+    MultiFDRecvParams *p = opaque;
+    QEMUFile *f = p->file;
+    int ret;
+
+    rcu_register_thread();
+
+    if (qemu_get_be32(f) != MULTIFD_MAGIC ||
+        qemu_get_be32(f) != MULTIFD_VERSION) {
+        error_report("multifd: bad channel header");
+        ret = -EINVAL;
+        goto out;
+    }
+    p->id = qemu_get_byte(f);
+
+    while (true) {
+        uint32_t flags;
+
+        ret = multifd_recv_packet(f, &flags);
+        if (ret) {
+            break;
+        }
+        if (flags & MULTIFD_FLAG_SYNC) {
+            qemu_sem_post(&multifd_recv_state->sem_sync);
+            qemu_sem_wait(&p->sem_sync);
+        }
+    }
+
+out:
+    /*
+     * The source closes the channels once migration is complete, and we
+     * are shut down by multifd_load_cleanup(); an error only matters if
+     * the main thread still waits for us, and it reports it.
+     */
+    if (!atomic_read(&multifd_recv_state->quit)) {
+        trace_multifd_recv_thread_error(p->id, ret);
+        atomic_set(&multifd_recv_state->error, true);
+        qemu_sem_post(&multifd_recv_state->sem_sync);
+    }
+    rcu_unregister_thread();
+
+    return NULL;
+}
+
+/*
+ * Called for each connection accepted after the main one.
+ * Returns: true once all the channels are connected
+ */
+bool multifd_recv_new_channel(int fd)
+{
+    int thread_count = migrate_multifd_channels();
+    MultiFDRecvParams *p;
+
+    if (!multifd_recv_state) {
+        multifd_recv_state = g_malloc0(sizeof(*multifd_recv_state));
+        multifd_recv_state->params = g_new0(MultiFDRecvParams, thread_count);
+        qemu_sem_init(&multifd_recv_state->sem_sync, 0);
+    }
+
+    p = &multifd_recv_state->params[multifd_recv_state->count];
+    qemu_set_block(fd);
+    p->file = qemu_fopen_socket(fd, "rb");
+    qemu_sem_init(&p->sem_sync, 0);
+    qemu_thread_create(&p->thread, "multifd_recv", multifd_recv_thread, p,
+                       QEMU_THREAD_JOINABLE);
+
+    return ++multifd_recv_state->count == thread_count;
+}
+
+/*
+ * Called by the main thread on a RAM_SAVE_FLAG_MULTIFD_SYNC marker: wait
+ * until every channel has loaded all the pages sent before it.
+ */
+static int multifd_recv_sync_main(void)
+{
+    int i;
+
+    if (!multifd_recv_state) {
+        error_report("multifd sync received, but multifd is not enabled");
+        return -EINVAL;
+    }
+    trace_multifd_recv_sync_main();
+    for (i = 0; i < multifd_recv_state->count; i++) {
+        qemu_sem_wait(&multifd_recv_state->sem_sync);
+        if (atomic_read(&multifd_recv_state->error)) {
+            error_report("multifd: a channel failed");
+            return -EIO;
+        }
+    }
+    for (i = 0; i < multifd_recv_state->count; i++) {
+        qemu_sem_post(&multifd_recv_state->params[i].sem_sync);
+    }
+
+    return 0;
+}
+
+void multifd_load_cleanup(void)
+{
+    int i;
+
+    if (!multifd_recv_state) {
+        return;
+    }
+    atomic_set(&multifd_recv_state->quit, true);
+    for (i = 0; i < multifd_recv_state->count; i++) {
+        MultiFDRecvParams *p = &multifd_recv_state->params[i];
+
+        qemu_file_shutdown(p->file);
+        qemu_sem_post(&p->sem_sync);
+        qemu_thread_join(&p->thread);
+        qemu_fclose(p->file);
+        qemu_sem_destroy(&p->sem_sync);
+    }
+    qemu_sem_destroy(&multifd_recv_state->sem_sync);
+    g_free(multifd_recv_state->params);
+    g_free(multifd_recv_state);
+    multifd_recv_state = NULL;
+}
+
 /**
  * save_page_header: Write page header to wire
  *
@@ -630,35 +1204,69 @@ static void migration_bitmap_sync_range(ram_addr_t start, ram_addr_t length)
 
     /* start address is aligned at the start of a word? */
     if (((page * BITS_PER_LONG) << TARGET_PAGE_BITS) == start) {
-        int k;
-        int nr = BITS_TO_LONGS(length >> TARGET_PAGE_BITS);
-        unsigned long *src = ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION];
+        DirtyMemoryBlocks *blocks;
+        unsigned long k;
+        unsigned long nr = BITS_TO_LONGS(length >> TARGET_PAGE_BITS);
+        unsigned long idx = (page * BITS_PER_LONG) / DIRTY_MEMORY_BLOCK_SIZE;
+        unsigned long offset = BIT_WORD((page * BITS_PER_LONG) %
+                                        DIRTY_MEMORY_BLOCK_SIZE);
+
+        blocks =
+            atomic_rcu_read(&ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION]);
 
         for (k = page; k < page + nr; k++) {
-            if (src[k]) {
+            unsigned long *src = &blocks->blocks[idx][offset];
+
+            if (atomic_read(src)) {
+                unsigned long bits = atomic_xchg(src, 0);
                 unsigned long new_dirty;
                 new_dirty = ~migration_bitmap[k];
-                migration_bitmap[k] |= src[k];
-                new_dirty &= src[k];
+                migration_bitmap[k] |= bits;
+                new_dirty &= bits;
                 migration_dirty_pages += ctpopl(new_dirty);
-                src[k] = 0;
+            }
+
+            if (++offset >= BITS_TO_LONGS(DIRTY_MEMORY_BLOCK_SIZE)) {
+                offset = 0;
+                idx++;
             }
         }
     } else {
+        ram_addr_t first = length, last = 0;
+        bool locked;
+
         for (addr = 0; addr < length; addr += TARGET_PAGE_SIZE) {
-            if (cpu_physical_memory_get_dirty(start + addr,
-                                              TARGET_PAGE_SIZE,
-                                              DIRTY_MEMORY_MIGRATION)) {
-                cpu_physical_memory_reset_dirty(start + addr,
-                                                TARGET_PAGE_SIZE,
-                                                DIRTY_MEMORY_MIGRATION);
+            if (cpu_physical_memory_test_and_clear_dirty_bits(
+                        start + addr, TARGET_PAGE_SIZE,
+                        DIRTY_MEMORY_MIGRATION)) {
                 migration_bitmap_set_dirty(start + addr);
+                first = MIN(first, addr);
+                last = addr;
             }
         }
+
+        if (first == length || !tcg_enabled()) {
+            return;
+        }
+
+        /*
+         * The single-threaded TCG loop fills the TLBs with the iothread
+         * lock held, so only rewrite the vCPUs' write entries while
+         * holding it (MTTCG threads are covered by the cmpxchg in
+         * tlb_reset_dirty_range).  We may be called with or without it.
+         */
+        locked = qemu_mutex_iothread_locked();
+        if (!locked) {
+            qemu_mutex_lock_iothread();
+        }
+        tlb_reset_dirty_range_all(start + first,
+                                  last + TARGET_PAGE_SIZE - first);
+        if (!locked) {
+            qemu_mutex_unlock_iothread();
+        }
     }
 }
 
-
 /* Fix me: there are too many global variables used in migration process. */
 static int64_t start_time;
 static int64_t bytes_xfer_prev;
@@ -675,14 +1283,31 @@ static void migration_bitmap_sync_init(void)
     iterations_prev = 0;
 }
 
-/* Called with iothread lock held, to protect ram_list.dirty_memory[] */
-static void migration_bitmap_sync(void)
+/*
+ * Pull the dirty log of every memory listener (KVM, vhost, ...) into
+ * ram_list.dirty_memory[].  This walks the memory listeners and so needs
+ * the iothread lock; it should be kept as short as possible.
+ */
+static void migration_bitmap_sync_log(void)
+{
+    address_space_sync_dirty_bitmap(&address_space_memory);
+}
+
+/*
+ * Move the bits collected in ram_list.dirty_memory[] into the migration
+ * bitmap.  The dirty memory blocks are only ever updated atomically, so
+ * this does not need the iothread lock, just an RCU critical section.
+ * The rates in MigrationState are read by query-migrate under the lock,
+ * hence the atomic accesses.
+ */
+static void migration_bitmap_sync_dirty(void)
 {
     RAMBlock *block;
     uint64_t num_dirty_pages_init = migration_dirty_pages;
     MigrationState *s = migrate_get_current();
     int64_t end_time;
     int64_t bytes_xfer_now;
+    int64_t dirty_pages_rate;
 
     bitmap_sync_count++;
 
@@ -695,7 +1320,6 @@ static void migration_bitmap_sync(void)
     }
 
     trace_migration_bitmap_sync_start();
-    address_space_sync_dirty_bitmap(&address_space_memory);
 
     rcu_read_lock();
     QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
@@ -705,29 +1329,35 @@ static void migration_bitmap_sync(void)
 
     trace_migration_bitmap_sync_end(migration_dirty_pages
                                     - num_dirty_pages_init);
+    if (multifd_send_state) {
+        /* Pages dirtied again must not overtake their older copies */
+        multifd_send_state->sync_needed = true;
+    }
     num_dirty_pages_period += migration_dirty_pages - num_dirty_pages_init;
     end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
 
     /* more than 1 second = 1000 millisecons */
     if (end_time > start_time + 1000) {
         if (migrate_auto_converge()) {
-            /* The following detection logic can be refined later. For now:
-               Check to see if the dirtied bytes is 50% more than the approx.
-               amount of bytes that just got transferred since the last time we
-               were in this routine. If that happens >N times (for now N==4)
-               we turn on the throttle down logic */
+            /* Check to see if the dirtied bytes is more than half of the
+               amount of bytes that just got transferred since the last time
+               we were in this routine.  If that happens twice in a row,
+               start or increase throttling, in proportion to how far the
+               dirty rate is from what we can send. */
             bytes_xfer_now = ram_bytes_transferred();
-            if (s->dirty_pages_rate &&
+            if (atomic_read(&s->dirty_pages_rate) &&
                (num_dirty_pages_period * TARGET_PAGE_SIZE >
-                   (bytes_xfer_now - bytes_xfer_prev)/2) &&
-               (dirty_rate_high_cnt++ > 4)) {
-                    trace_migration_throttle();
-                    mig_throttle_on = true;
+                   (bytes_xfer_now - bytes_xfer_prev) / 2)) {
+                if (++dirty_rate_high_cnt >= 2) {
                     dirty_rate_high_cnt = 0;
-             }
-             bytes_xfer_prev = bytes_xfer_now;
-        } else {
-             mig_throttle_on = false;
+                    mig_throttle_guest_down(num_dirty_pages_period *
+                                            TARGET_PAGE_SIZE,
+                                            bytes_xfer_now - bytes_xfer_prev);
+                }
+            } else {
+                dirty_rate_high_cnt = 0;
+            }
+            bytes_xfer_prev = bytes_xfer_now;
         }
         if (migrate_use_xbzrle()) {
             if (iterations_prev != acct_info.iterations) {
@@ -738,14 +1368,28 @@ static void migration_bitmap_sync(void)
             }
             iterations_prev = acct_info.iterations;
             xbzrle_cache_miss_prev = acct_info.xbzrle_cache_miss;
+            XBZRLE_cache_lock();
+            if (XBZRLE.cache) {
+                acct_info.xbzrle_cache_suggested_size =
+                    cache_suggest_size(XBZRLE.cache) * TARGET_PAGE_SIZE;
+            }
+            XBZRLE_cache_unlock();
         }
-        s->dirty_pages_rate = num_dirty_pages_period * 1000
+        dirty_pages_rate = num_dirty_pages_period * 1000
             / (end_time - start_time);
-        s->dirty_bytes_rate = s->dirty_pages_rate * TARGET_PAGE_SIZE;
+        atomic_set(&s->dirty_pages_rate, dirty_pages_rate);
+        atomic_set(&s->dirty_bytes_rate, dirty_pages_rate * TARGET_PAGE_SIZE);
         start_time = end_time;
         num_dirty_pages_period = 0;
     }
-    s->dirty_sync_count = bitmap_sync_count;
+    atomic_set(&s->dirty_sync_count, bitmap_sync_count);
+}
+
+/* Called with iothread lock held */
+static void migration_bitmap_sync(void)
+{
+    migration_bitmap_sync_log();
+    migration_bitmap_sync_dirty();
 }
 
 /**
@@ -831,7 +1475,9 @@ static int ram_save_page(QEMUFile *f, RAMBlock* block, ram_addr_t offset,
              * page would be stale
              */
             xbzrle_cache_zero_page(current_addr);
-        } else if (!ram_bulk_stage && migrate_use_xbzrle()) {
+        } else if (!ram_bulk_stage && migrate_use_xbzrle() &&
+                   !migration_in_postcopy(migrate_get_current())) {
+            /* The destination can only place whole pages in postcopy */
             pages = save_xbzrle_page(f, &p, current_addr, block,
                                      offset, last_stage, bytes_transferred);
             if (!last_stage) {
@@ -843,6 +1489,17 @@ static int ram_save_page(QEMUFile *f, RAMBlock* block, ram_addr_t offset,
         }
     }
 
+    /* Normal pages go over the multifd channels, off the main stream */
+    if (pages == -1 && multifd_send_state) {
+        multifd_queue_page(block, offset & TARGET_PAGE_MASK);
+        qemu_update_position(f, TARGET_PAGE_SIZE);
+        qemu_file_update_transfer(f, TARGET_PAGE_SIZE);
+        *bytes_transferred += TARGET_PAGE_SIZE;
+        acct_info.norm_pages++;
+        XBZRLE_cache_unlock();
+        return 1;
+    }
+
     /* XBZRLE overflow or normal page */
     if (pages == -1) {
         *bytes_transferred += save_page_header(f, block,
@@ -859,32 +1516,69 @@ static int ram_save_page(QEMUFile *f, RAMBlock* block, ram_addr_t offset,
 
     XBZRLE_cache_unlock();
 
+    if (pages > 0) {
+        last_sent_block = block;
+    }
+
     return pages;
 }
 
-static int do_compress_ram_page(CompressParam *param)
+/* Like save_page_header(), into a buffer */
+static size_t put_page_header(uint8_t *buf, RAMBlock *block,
+                              ram_addr_t offset)
 {
-    int bytes_sent, blen;
-    uint8_t *p;
-    RAMBlock *block = param->block;
-    ram_addr_t offset = param->offset;
+    size_t size, len;
 
-    p = memory_region_get_ram_ptr(block->mr) + (offset & TARGET_PAGE_MASK);
+    stq_be_p(buf, offset);
+    size = 8;
 
-    bytes_sent = save_page_header(param->file, block, offset |
-                                  RAM_SAVE_FLAG_COMPRESS_PAGE);
-    blen = qemu_put_compression_data(param->file, p, TARGET_PAGE_SIZE,
-                                     migrate_compress_level());
-    bytes_sent += blen;
+    if (!(offset & RAM_SAVE_FLAG_CONTINUE)) {
+        len = strlen(block->idstr);
+        buf[size] = len;
+        memcpy(buf + size + 1, block->idstr, len);
+        size += 1 + len;
+    }
+    return size;
+}
+
+/*
+ * Compress the queued pages of @param into @param->out, each with its
+ * header.  A page the codec fails on is sent uncompressed instead.
+ */
+static void do_compress_ram_batch(CompressParam *param)
+{
+    RAMBlock *block = param->block;
+    uint8_t *base = memory_region_get_ram_ptr(block->mr);
+    uint8_t *out = param->out + param->out_len;
+    ssize_t blen;
+    int i;
 
-    return bytes_sent;
+    for (i = 0; i < param->nr_pages; i++) {
+        ram_addr_t offset = param->offsets[i];
+        uint8_t *p = param->page;
+        size_t hlen = put_page_header(out, block,
+                                      offset | RAM_SAVE_FLAG_COMPRESS_PAGE);
+
+        memcpy(p, base + (offset & TARGET_PAGE_MASK), TARGET_PAGE_SIZE);
+        blen = page_compress(param->comp, out + hlen + 4, comp_bound,
+                             p, TARGET_PAGE_SIZE);
+        if (blen < 0) {
+            hlen = put_page_header(out, block, offset | RAM_SAVE_FLAG_PAGE);
+            memcpy(out + hlen, p, TARGET_PAGE_SIZE);
+            out += hlen + TARGET_PAGE_SIZE;
+        } else {
+            stl_be_p(out + hlen, blen);
+            out += hlen + 4 + blen;
+        }
+    }
+    param->out_len = out - param->out;
+    param->nr_pages = 0;
 }
 
 static inline void start_compression(CompressParam *param)
 {
-    param->done = false;
     qemu_mutex_lock(&param->mutex);
-    param->start = true;
+    param->busy = true;
     qemu_cond_signal(&param->cond);
     qemu_mutex_unlock(&param->mutex);
 }
@@ -899,65 +1593,90 @@ static inline void start_decompression(DecompressParam *param)
 
 static uint64_t bytes_transferred;
 
+/* Send the output of a batch; the caller must own @param */
+static void compress_send_output(QEMUFile *f, CompressParam *param,
+                                 uint64_t *bytes_transferred)
+{
+    if (param->out_len) {
+        qemu_put_buffer(f, param->out, param->out_len);
+        *bytes_transferred += param->out_len;
+        param->out_len = 0;
+    }
+}
+
 static void flush_compressed_data(QEMUFile *f)
 {
-    int idx, len, thread_count;
+    int idx;
 
-    if (!migrate_use_compression()) {
+    if (!migrate_use_compression() || !comp_param) {
         return;
     }
-    thread_count = migrate_compress_threads();
-    for (idx = 0; idx < thread_count; idx++) {
-        if (!comp_param[idx].done) {
-            qemu_mutex_lock(comp_done_lock);
-            while (!comp_param[idx].done && !quit_comp_thread) {
-                qemu_cond_wait(comp_done_cond, comp_done_lock);
-            }
-            qemu_mutex_unlock(comp_done_lock);
+    if (comp_fill) {
+        start_compression(comp_fill);
+        comp_fill = NULL;
+    }
+    for (idx = 0; idx < comp_thread_count; idx++) {
+        qemu_mutex_lock(comp_done_lock);
+        while (comp_param[idx].busy && !quit_comp_thread) {
+            qemu_cond_wait(comp_done_cond, comp_done_lock);
         }
+        qemu_mutex_unlock(comp_done_lock);
         if (!quit_comp_thread) {
-            len = qemu_put_qemu_file(f, comp_param[idx].file);
-            bytes_transferred += len;
+            compress_send_output(f, &comp_param[idx], &bytes_transferred);
         }
     }
 }
 
-static inline void set_compress_params(CompressParam *param, RAMBlock *block,
-                                       ram_addr_t offset)
-{
-    param->block = block;
-    param->offset = offset;
-}
-
+/*
+ * Queue a page for compression.  Pages are collected in the batch of an
+ * idle thread, which is only woken once the batch is full; the output
+ * of its previous batch is sent when the thread is picked again.
+ */
 static int compress_page_with_multi_thread(QEMUFile *f, RAMBlock *block,
                                            ram_addr_t offset,
                                            uint64_t *bytes_transferred)
 {
-    int idx, thread_count, bytes_xmit = -1, pages = -1;
+    CompressParam *param = comp_fill;
+    int idx;
 
-    thread_count = migrate_compress_threads();
-    qemu_mutex_lock(comp_done_lock);
-    while (true) {
-        for (idx = 0; idx < thread_count; idx++) {
-            if (comp_param[idx].done) {
-                bytes_xmit = qemu_put_qemu_file(f, comp_param[idx].file);
-                set_compress_params(&comp_param[idx], block, offset);
-                start_compression(&comp_param[idx]);
-                pages = 1;
-                acct_info.norm_pages++;
-                *bytes_transferred += bytes_xmit;
-                break;
+    if (param && param->block != block) {
+        start_compression(param);
+        param = NULL;
+    }
+
+    if (!param) {
+        qemu_mutex_lock(comp_done_lock);
+        while (!param && !quit_comp_thread) {
+            for (idx = 0; idx < comp_thread_count; idx++) {
+                CompressParam *p = &comp_param[(comp_next_idx + idx) %
+                                               comp_thread_count];
+                if (!p->busy) {
+                    param = p;
+                    break;
+                }
+            }
+            if (!param) {
+                qemu_cond_wait(comp_done_cond, comp_done_lock);
             }
         }
-        if (pages > 0) {
-            break;
-        } else {
-            qemu_cond_wait(comp_done_cond, comp_done_lock);
+        qemu_mutex_unlock(comp_done_lock);
+        if (!param) {
+            return -1;
         }
+        comp_next_idx = (param - comp_param + 1) % comp_thread_count;
+        compress_send_output(f, param, bytes_transferred);
+        param->block = block;
     }
-    qemu_mutex_unlock(comp_done_lock);
 
-    return pages;
+    param->offsets[param->nr_pages++] = offset;
+    if (param->nr_pages == COMPRESS_BATCH_PAGES) {
+        start_compression(param);
+        param = NULL;
+    }
+    comp_fill = param;
+    acct_info.norm_pages++;
+
+    return 1;
 }
 
 /**
@@ -1012,14 +1731,16 @@ static int ram_save_compressed_page(QEMUFile *f, RAMBlock *block,
             flush_compressed_data(f);
             pages = save_zero_page(f, block, offset, p, bytes_transferred);
             if (pages == -1) {
-                set_compress_params(&comp_param[0], block, offset);
                 /* Use the qemu thread to compress the data to make sure the
-                 * first page is sent out before other pages
+                 * first page is sent out before other pages; after the
+                 * flush every compression thread is idle.
                  */
-                bytes_xmit = do_compress_ram_page(&comp_param[0]);
+                comp_param[0].block = block;
+                comp_param[0].offsets[0] = offset;
+                comp_param[0].nr_pages = 1;
+                do_compress_ram_batch(&comp_param[0]);
+                compress_send_output(f, &comp_param[0], bytes_transferred);
                 acct_info.norm_pages++;
-                qemu_put_qemu_file(f, comp_param[0].file);
-                *bytes_transferred += bytes_xmit;
                 pages = 1;
             }
         } else {
@@ -1034,6 +1755,142 @@ static int ram_save_compressed_page(QEMUFile *f, RAMBlock *block,
     return pages;
 }
 
+/* Must be called from within a rcu critical section */
+static RAMBlock *ram_find_block_by_idstr(const char *id)
+{
+    RAMBlock *block;
+
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        if (!strcmp(id, block->idstr)) {
+            return block;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Unqueue the next page requested by the destination during postcopy,
+ * skipping pages that have already been sent (i.e. are no longer dirty).
+ * Called within an RCU critical section.
+ *
+ * Returns: true if a page was found, with @block and @offset set to it
+ */
+static bool get_queued_page(MigrationState *ms, RAMBlock **block,
+                            ram_addr_t *offset)
+{
+    MigrationSrcPageRequest *entry;
+    bool found = false;
+
+    qemu_mutex_lock(&ms->src_page_req_mutex);
+    while (!found && !QSIMPLEQ_EMPTY(&ms->src_page_requests)) {
+        RAMBlock *rb;
+        ram_addr_t rb_offset;
+
+        entry = QSIMPLEQ_FIRST(&ms->src_page_requests);
+        rb = entry->rb;
+        rb_offset = entry->offset;
+
+        if (entry->len > TARGET_PAGE_SIZE) {
+            entry->len -= TARGET_PAGE_SIZE;
+            entry->offset += TARGET_PAGE_SIZE;
+        } else {
+            memory_region_unref(rb->mr);
+            QSIMPLEQ_REMOVE_HEAD(&ms->src_page_requests, next_req);
+            g_free(entry);
+        }
+
+        if (test_and_clear_bit((rb->offset + rb_offset) >> TARGET_PAGE_BITS,
+                               migration_bitmap)) {
+            migration_dirty_pages--;
+            *block = rb;
+            *offset = rb_offset;
+            found = true;
+        }
+    }
+    qemu_mutex_unlock(&ms->src_page_req_mutex);
+
+    return found;
+}
+
+/*
+ * Drop any page requests still queued from the destination; the queue
+ * is normally empty by now, except after a failed migration.
+ */
+void flush_page_queue(MigrationState *ms)
+{
+    MigrationSrcPageRequest *mspr, *next_mspr;
+
+    rcu_read_lock();
+    QSIMPLEQ_FOREACH_SAFE(mspr, &ms->src_page_requests, next_req, next_mspr) {
+        memory_region_unref(mspr->rb->mr);
+        QSIMPLEQ_REMOVE_HEAD(&ms->src_page_requests, next_req);
+        g_free(mspr);
+    }
+    rcu_read_unlock();
+}
+
+/**
+ * ram_save_queue_pages: queue a page request from the destination
+ *
+ * Called from the return path thread; the pages are sent ahead of the
+ * background scan by ram_find_and_save_block.
+ *
+ * Returns: 0 on success, -1 on a bad request
+ *
+ * @ms: current migration state
+ * @rbname: the RAMBlock of the request, NULL means the same as the last one
+ * @start: offset of the first byte requested within the RAMBlock
+ * @len: length in bytes of the request
+ */
+int ram_save_queue_pages(MigrationState *ms, const char *rbname,
+                         ram_addr_t start, ram_addr_t len)
+{
+    MigrationSrcPageRequest *new_entry;
+    RAMBlock *ramblock;
+
+    rcu_read_lock();
+    if (!rbname) {
+        /* Reuse last RAMBlock */
+        ramblock = ms->last_req_rb;
+        if (!ramblock) {
+            error_report("ram_save_queue_pages no previous block");
+            goto err;
+        }
+    } else {
+        ramblock = ram_find_block_by_idstr(rbname);
+        if (!ramblock) {
+            error_report("ram_save_queue_pages no block '%s'", rbname);
+            goto err;
+        }
+        ms->last_req_rb = ramblock;
+    }
+    trace_ram_save_queue_pages(ramblock->idstr, start, len);
+    if (start + len > ramblock->used_length) {
+        error_report("%s request overrun start=" RAM_ADDR_FMT " len="
+                     RAM_ADDR_FMT " blocklen=" RAM_ADDR_FMT,
+                     __func__, start, len, ramblock->used_length);
+        goto err;
+    }
+
+    new_entry = g_new0(MigrationSrcPageRequest, 1);
+    new_entry->rb = ramblock;
+    new_entry->offset = start;
+    new_entry->len = len;
+
+    memory_region_ref(ramblock->mr);
+    qemu_mutex_lock(&ms->src_page_req_mutex);
+    QSIMPLEQ_INSERT_TAIL(&ms->src_page_requests, new_entry, next_req);
+    qemu_mutex_unlock(&ms->src_page_req_mutex);
+    rcu_read_unlock();
+
+    return 0;
+
+err:
+    rcu_read_unlock();
+    return -1;
+}
+
 /**
  * ram_find_and_save_block: Finds a dirty page and sends it to f
  *
@@ -1050,12 +1907,27 @@ static int ram_save_compressed_page(QEMUFile *f, RAMBlock *block,
 static int ram_find_and_save_block(QEMUFile *f, bool last_stage,
                                    uint64_t *bytes_transferred)
 {
+    MigrationState *ms = migrate_get_current();
     RAMBlock *block = last_seen_block;
     ram_addr_t offset = last_offset;
     bool complete_round = false;
     int pages = 0;
     MemoryRegion *mr;
 
+    /* Pages the destination has faulted on go before anything else */
+    if (migration_in_postcopy(ms) && get_queued_page(ms, &block, &offset)) {
+        pages = ram_save_page(f, block, offset, last_stage,
+                              bytes_transferred);
+        if (pages > 0) {
+            /* The guest is likely to want the neighbours next */
+            last_seen_block = block;
+            last_offset = offset;
+            return pages;
+        }
+        block = last_seen_block;
+        offset = last_offset;
+    }
+
     if (!block)
         block = QLIST_FIRST_RCU(&ram_list.blocks);
 
@@ -1085,14 +1957,19 @@ static int ram_find_and_save_block(QEMUFile *f, bool last_stage,
             if (compression_switch && migrate_use_compression()) {
                 pages = ram_save_compressed_page(f, block, offset, last_stage,
                                                  bytes_transferred);
+                if (pages > 0) {
+                    last_sent_block = block;
+                }
             } else {
+                /* Sets last_sent_block itself, unless the page went to
+                 * a multifd channel rather than the main stream
+                 */
                 pages = ram_save_page(f, block, offset, last_stage,
                                       bytes_transferred);
             }
 
             /* if page is unmodified, continue to the next */
             if (pages > 0) {
-                last_sent_block = block;
                 break;
             }
         }
@@ -1197,7 +2074,6 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
     RAMBlock *block;
     int64_t ram_bitmap_pages; /* Size of bitmap in pages, including gaps */
 
-    mig_throttle_on = false;
     dirty_rate_high_cnt = 0;
     bitmap_sync_count = 0;
     migration_bitmap_sync_init();
@@ -1232,7 +2108,7 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
         acct_clear();
     }
 
-    /* iothread lock needed for ram_list.dirty_memory[] */
+    /* iothread lock needed to start dirty logging and pull the first log */
     qemu_mutex_lock_iothread();
     qemu_mutex_lock_ramlist();
     rcu_read_lock();
@@ -1254,7 +2130,11 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
     qemu_mutex_unlock_ramlist();
     qemu_mutex_unlock_iothread();
 
-    qemu_put_be64(f, ram_bytes_total() | RAM_SAVE_FLAG_MEM_SIZE);
+    if (migrate_use_compression()) {
+        qemu_put_be64(f, ram_bytes_total() | RAM_SAVE_FLAG_MEM_SIZE_CODEC);
+    } else {
+        qemu_put_be64(f, ram_bytes_total() | RAM_SAVE_FLAG_MEM_SIZE);
+    }
 
     QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
         qemu_put_byte(f, strlen(block->idstr));
@@ -1262,6 +2142,10 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
         qemu_put_be64(f, block->used_length);
     }
 
+    if (migrate_use_compression()) {
+        qemu_put_byte(f, migrate_compress_method());
+    }
+
     rcu_read_unlock();
 
     ram_control_before_iterate(f, RAM_CONTROL_SETUP);
@@ -1289,6 +2173,8 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
 
     ram_control_before_iterate(f, RAM_CONTROL_ROUND);
 
+    multifd_send_sync_main(f, false);
+
     t0 = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     i = 0;
     while ((ret = qemu_file_rate_limit(f)) == 0) {
@@ -1301,7 +2187,6 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
         }
         pages_sent += pages;
         acct_info.iterations++;
-        check_guest_throttling();
         /* we want to check in the 1st loop, just in case it was the 1st time
            and we had to sync the dirty bitmap.
            qemu_get_clock_ns() is a bit expensive, so we only check each some
@@ -1337,15 +2222,40 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
     return pages_sent;
 }
 
+/*
+ * Gather the copy counters of the main stream and of the multifd
+ * channels, which are updated by their own threads as they go.
+ */
+static void ram_update_copy_stats(QEMUFile *f)
+{
+    uint64_t copied, sends, fallbacks;
+    int i;
+
+    qemu_file_get_copy_stats(f, &acct_info.copied_bytes,
+                             &acct_info.zerocopy_sends,
+                             &acct_info.zerocopy_fallbacks);
+    for (i = 0; multifd_send_state && i < multifd_send_state->count; i++) {
+        qemu_file_get_copy_stats(multifd_send_state->params[i].file,
+                                 &copied, &sends, &fallbacks);
+        acct_info.copied_bytes += copied;
+        acct_info.zerocopy_sends += sends;
+        acct_info.zerocopy_fallbacks += fallbacks;
+    }
+}
+
 /* Called with iothread lock */
 static int ram_save_complete(QEMUFile *f, void *opaque)
 {
     rcu_read_lock();
 
+    /* Pages still in flight must not be queued a second time */
+    qemu_file_zerocopy_sync(f);
     migration_bitmap_sync();
 
     ram_control_before_iterate(f, RAM_CONTROL_FINISH);
 
+    multifd_send_sync_main(f, false);
+
     /* try transferring iterative blocks of memory */
 
     /* flush all remaining blocks regardless of rate limiting */
@@ -1360,7 +2270,10 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
     }
 
     flush_compressed_data(f);
+    /* Everything must be loaded before the destination sees EOS */
+    multifd_send_sync_main(f, true);
     ram_control_after_iterate(f, RAM_CONTROL_FINISH);
+    ram_update_copy_stats(f);
     migration_end();
 
     rcu_read_unlock();
@@ -1374,18 +2287,123 @@ static uint64_t ram_save_pending(QEMUFile *f, void *opaque, uint64_t max_size)
     uint64_t remaining_size;
 
     remaining_size = ram_save_remaining() * TARGET_PAGE_SIZE;
+    ram_update_copy_stats(f);
 
     if (remaining_size < max_size) {
+        /* Pages still in flight must not be queued a second time */
+        qemu_file_zerocopy_sync(f);
+        /* Only the dirty log pull needs the iothread lock */
         qemu_mutex_lock_iothread();
+        migration_bitmap_sync_log();
+        qemu_mutex_unlock_iothread();
         rcu_read_lock();
-        migration_bitmap_sync();
+        migration_bitmap_sync_dirty();
         rcu_read_unlock();
-        qemu_mutex_unlock_iothread();
         remaining_size = ram_save_remaining() * TARGET_PAGE_SIZE;
     }
     return remaining_size;
 }
 
+/*
+ * Called with the iothread lock held and the source stopped, as we switch
+ * to postcopy.  Every page still dirty in the migration bitmap (whether
+ * resent after being dirtied, or never sent at all) is discarded on the
+ * destination so that it faults and gets fetched from us.  The bitmap is
+ * walked a run of set bits at a time, so each RAMBlock costs one message
+ * per MAX_DISCARDS_PER_COMMAND runs rather than one per page.
+ *
+ * Returns: 0 on success, negative on a stream error
+ */
+int ram_postcopy_send_discard_bitmap(MigrationState *ms)
+{
+    RAMBlock *block;
+
+    rcu_read_lock();
+
+    /* This should be our last sync, the src is now paused */
+    qemu_file_zerocopy_sync(ms->file);
+    migration_bitmap_sync();
+
+    /*
+     * Restart the scan from the beginning; the bulk stage shortcut
+     * assumes every page is dirty, which no longer holds once requested
+     * pages are pulled out of order.
+     */
+    last_seen_block = NULL;
+    last_sent_block = NULL;
+    last_offset = 0;
+    ram_bulk_stage = false;
+
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        unsigned long first = block->offset >> TARGET_PAGE_BITS;
+        unsigned long last = first + (block->used_length >> TARGET_PAGE_BITS);
+        PostcopyDiscardState *pds = postcopy_discard_send_init(ms,
+                                                               block->idstr);
+        unsigned long run_start = find_next_bit(migration_bitmap, last, first);
+
+        while (run_start < last) {
+            unsigned long run_end = find_next_zero_bit(migration_bitmap, last,
+                                                       run_start + 1);
+
+            postcopy_discard_send_range(ms, pds,
+                (uint64_t)(run_start - first) << TARGET_PAGE_BITS,
+                (uint64_t)(run_end - run_start) << TARGET_PAGE_BITS);
+            if (run_end >= last) {
+                break;
+            }
+            run_start = find_next_bit(migration_bitmap, last, run_end + 1);
+        }
+        postcopy_discard_send_finish(ms, pds);
+    }
+
+    rcu_read_unlock();
+
+    return qemu_file_get_error(ms->file);
+}
+
+/*
+ * Discard the pages of @block_name between @start and @start + @length
+ * on the destination, so that they will be faulted in from the source.
+ *
+ * Returns: 0 on success, negative on error
+ */
+int ram_discard_range(MigrationIncomingState *mis, const char *block_name,
+                      uint64_t start, size_t length)
+{
+    int ret = -1;
+    RAMBlock *rb;
+
+    rcu_read_lock();
+    rb = ram_find_block_by_idstr(block_name);
+    if (!rb) {
+        error_report("ram_discard_range: Failed to find block '%s'",
+                     block_name);
+        goto err;
+    }
+
+    if ((start | length) & ~TARGET_PAGE_MASK) {
+        error_report("ram_discard_range: Unaligned start address: %" PRIx64
+                     " or length: %zx", start, length);
+        goto err;
+    }
+
+    if (start + length > rb->used_length || start + length < start) {
+        error_report("ram_discard_range: Overrun block '%s' (%" PRIu64
+                     "/%zx/" RAM_ADDR_FMT")",
+                     block_name, start, length, rb->used_length);
+        goto err;
+    }
+
+    ret = postcopy_ram_discard_range(mis,
+                    (uint8_t *)memory_region_get_ram_ptr(rb->mr) + start,
+                    length);
+
+err:
+    rcu_read_unlock();
+
+    return ret;
+}
+
 static int load_xbzrle(QEMUFile *f, ram_addr_t addr, void *host)
 {
     unsigned int xh_len;
@@ -1470,43 +2488,77 @@ void ram_handle_compressed(void *host, uint8_t ch, uint64_t size)
 static void *do_data_decompress(void *opaque)
 {
     DecompressParam *param = opaque;
-    unsigned long pagesize;
+    ssize_t ret;
 
+    qemu_mutex_lock(&param->mutex);
     while (!quit_decomp_thread) {
-        qemu_mutex_lock(&param->mutex);
-        while (!param->start && !quit_decomp_thread) {
+        if (!param->start) {
             qemu_cond_wait(&param->cond, &param->mutex);
-            pagesize = TARGET_PAGE_SIZE;
-            if (!quit_decomp_thread) {
-                /* uncompress() will return failed in some case, especially
-                 * when the page is dirted when doing the compression, it's
-                 * not a problem because the dirty page will be retransferred
-                 * and uncompress() won't break the data in other pages.
-                 */
-                uncompress((Bytef *)param->des, &pagesize,
-                           (const Bytef *)param->compbuf, param->len);
-            }
-            param->start = false;
+            continue;
         }
-        qemu_mutex_unlock(&param->mutex);
+        /* The source compresses a private copy of each page, so any
+         * failure here means a corrupt stream or a codec mismatch.
+         */
+        ret = page_decompress(param->comp, param->des, TARGET_PAGE_SIZE,
+                              param->compbuf, param->len);
+
+        qemu_mutex_lock(&decomp_done_lock);
+        if (ret != TARGET_PAGE_SIZE && !decomp_error) {
+            decomp_error = -EINVAL;
+        }
+        param->start = false;
+        qemu_cond_signal(&decomp_done_cond);
+        qemu_mutex_unlock(&decomp_done_lock);
     }
+    qemu_mutex_unlock(&param->mutex);
 
     return NULL;
 }
 
+/* Wait for the pages handed to the decompression threads to land */
+static int wait_for_decompress_done(void)
+{
+    int idx, ret;
+
+    if (!decomp_param) {
+        /* Loading a snapshot, not an incoming migration */
+        return 0;
+    }
+    qemu_mutex_lock(&decomp_done_lock);
+    for (idx = 0; idx < decomp_thread_count; idx++) {
+        while (decomp_param[idx].start) {
+            qemu_cond_wait(&decomp_done_cond, &decomp_done_lock);
+        }
+    }
+    ret = decomp_error;
+    qemu_mutex_unlock(&decomp_done_lock);
+
+    if (ret) {
+        error_report("Failed to decompress a compressed page");
+    }
+    return ret;
+}
+
 void migrate_decompress_threads_create(void)
 {
-    int i, thread_count;
+    MigrationCompressMethod method = migrate_compress_method();
+    int i;
 
-    thread_count = migrate_decompress_threads();
-    decompress_threads = g_new0(QemuThread, thread_count);
-    decomp_param = g_new0(DecompressParam, thread_count);
-    compressed_data_buf = g_malloc0(compressBound(TARGET_PAGE_SIZE));
+    decomp_thread_count = migrate_decompress_threads();
+    decomp_bound = page_compress_bound(method, TARGET_PAGE_SIZE);
+    decompress_threads = g_new0(QemuThread, decomp_thread_count);
+    decomp_param = g_new0(DecompressParam, decomp_thread_count);
+    compressed_data_buf = g_malloc0(decomp_bound);
+    qemu_mutex_init(&decomp_done_lock);
+    qemu_cond_init(&decomp_done_cond);
+    decomp_error = 0;
     quit_decomp_thread = false;
-    for (i = 0; i < thread_count; i++) {
+    for (i = 0; i < decomp_thread_count; i++) {
         qemu_mutex_init(&decomp_param[i].mutex);
         qemu_cond_init(&decomp_param[i].cond);
-        decomp_param[i].compbuf = g_malloc0(compressBound(TARGET_PAGE_SIZE));
+        decomp_param[i].comp = page_compressor_new(method, 0);
+        assert(decomp_param[i].comp);
+        decomp_param[i].compbuf = g_malloc0(decomp_bound);
         qemu_thread_create(decompress_threads + i, "decompress",
                            do_data_decompress, decomp_param + i,
                            QEMU_THREAD_JOINABLE);
@@ -1515,21 +2567,23 @@ void migrate_decompress_threads_create(void)
 
 void migrate_decompress_threads_join(void)
 {
-    int i, thread_count;
+    int i;
 
     quit_decomp_thread = true;
-    thread_count = migrate_decompress_threads();
-    for (i = 0; i < thread_count; i++) {
+    for (i = 0; i < decomp_thread_count; i++) {
         qemu_mutex_lock(&decomp_param[i].mutex);
         qemu_cond_signal(&decomp_param[i].cond);
         qemu_mutex_unlock(&decomp_param[i].mutex);
     }
-    for (i = 0; i < thread_count; i++) {
+    for (i = 0; i < decomp_thread_count; i++) {
         qemu_thread_join(decompress_threads + i);
         qemu_mutex_destroy(&decomp_param[i].mutex);
         qemu_cond_destroy(&decomp_param[i].cond);
+        page_compressor_free(decomp_param[i].comp);
         g_free(decomp_param[i].compbuf);
     }
+    qemu_mutex_destroy(&decomp_done_lock);
+    qemu_cond_destroy(&decomp_done_cond);
     g_free(decompress_threads);
     g_free(decomp_param);
     g_free(compressed_data_buf);
@@ -1538,26 +2592,106 @@ void migrate_decompress_threads_join(void)
     compressed_data_buf = NULL;
 }
 
-static void decompress_data_with_multi_threads(uint8_t *compbuf,
-                                               void *host, int len)
+static int decompress_data_with_multi_threads(uint8_t *compbuf,
+                                              void *host, int len)
 {
-    int idx, thread_count;
+    int idx, thread_count, ret;
 
-    thread_count = migrate_decompress_threads();
+    thread_count = decomp_thread_count;
+    qemu_mutex_lock(&decomp_done_lock);
     while (true) {
         for (idx = 0; idx < thread_count; idx++) {
             if (!decomp_param[idx].start) {
-                memcpy(decomp_param[idx].compbuf, compbuf, len);
-                decomp_param[idx].des = host;
-                decomp_param[idx].len = len;
-                start_decompression(&decomp_param[idx]);
                 break;
             }
         }
         if (idx < thread_count) {
             break;
         }
+        qemu_cond_wait(&decomp_done_cond, &decomp_done_lock);
+    }
+    ret = decomp_error;
+    qemu_mutex_unlock(&decomp_done_lock);
+
+    if (!ret) {
+        /* Only we set @start, so the thread stays idle until we do */
+        memcpy(decomp_param[idx].compbuf, compbuf, len);
+        decomp_param[idx].des = host;
+        decomp_param[idx].len = len;
+        start_decompression(&decomp_param[idx]);
+    }
+    return ret;
+}
+
+/*
+ * Load RAM once the destination is running in postcopy: the pages can no
+ * longer be written in place, since the guest might see a half written
+ * page, so each one is assembled in a temporary page and then placed
+ * atomically, which also wakes any thread that faulted on it.
+ */
+static int ram_load_postcopy(QEMUFile *f)
+{
+    int flags = 0, ret = 0;
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    void *postcopy_host_page = postcopy_get_tmp_page(mis);
+
+    if (!postcopy_host_page) {
+        return -ENOMEM;
+    }
+
+    rcu_read_lock();
+    while (!ret && !(flags & RAM_SAVE_FLAG_EOS)) {
+        ram_addr_t addr;
+        void *host = NULL;
+        uint8_t ch;
+
+        addr = qemu_get_be64(f);
+        flags = addr & ~TARGET_PAGE_MASK;
+        addr &= TARGET_PAGE_MASK;
+
+        trace_ram_load_postcopy_loop((uint64_t)addr, flags);
+        if (flags & (RAM_SAVE_FLAG_COMPRESS | RAM_SAVE_FLAG_PAGE)) {
+            host = host_from_stream_offset(f, addr, flags);
+            if (!host) {
+                error_report("Illegal RAM offset " RAM_ADDR_FMT, addr);
+                ret = -EINVAL;
+                break;
+            }
+        }
+
+        switch (flags & ~RAM_SAVE_FLAG_CONTINUE) {
+        case RAM_SAVE_FLAG_COMPRESS:
+            ch = qemu_get_byte(f);
+            if (ch) {
+                memset(postcopy_host_page, ch, TARGET_PAGE_SIZE);
+                ret = postcopy_place_page(mis, host, postcopy_host_page);
+            } else {
+                ret = postcopy_place_page_zero(mis, host);
+            }
+            break;
+        case RAM_SAVE_FLAG_PAGE:
+            qemu_get_buffer(f, postcopy_host_page, TARGET_PAGE_SIZE);
+            /* Don't place a page that was only partially read */
+            ret = qemu_file_get_error(f);
+            if (!ret) {
+                ret = postcopy_place_page(mis, host, postcopy_host_page);
+            }
+            break;
+        case RAM_SAVE_FLAG_EOS:
+            /* normal exit */
+            break;
+        default:
+            error_report("Unknown combination of migration flags: %#x"
+                         " (postcopy mode)", flags);
+            ret = -EINVAL;
+        }
+        if (!ret) {
+            ret = qemu_file_get_error(f);
+        }
     }
+    rcu_read_unlock();
+
+    return ret;
 }
 
 static int ram_load(QEMUFile *f, void *opaque, int version_id)
@@ -1572,6 +2706,16 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
         ret = -EINVAL;
     }
 
+    /* Once listening, pages must be placed atomically */
+    if (!ret) {
+        PostcopyState ps = postcopy_state_get();
+
+        if (ps == POSTCOPY_INCOMING_LISTENING ||
+            ps == POSTCOPY_INCOMING_RUNNING) {
+            return ram_load_postcopy(f);
+        }
+    }
+
     /* This RCU critical section can be very long running.
      * When RCU reclaims in the code start to become numerous,
      * it will be necessary to reduce the granularity of this
@@ -1589,6 +2733,7 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
 
         switch (flags & ~RAM_SAVE_FLAG_CONTINUE) {
         case RAM_SAVE_FLAG_MEM_SIZE:
+        case RAM_SAVE_FLAG_MEM_SIZE_CODEC:
             /* Synchronize RAM block list */
             total_ram_bytes = addr;
             while (!ret && total_ram_bytes) {
@@ -1624,6 +2769,20 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
 
                 total_ram_bytes -= length;
             }
+            if (!ret && (flags & RAM_SAVE_FLAG_COMPRESS_PAGE)) {
+                MigrationCompressMethod method = qemu_get_byte(f);
+
+                if (method != migrate_compress_method()) {
+                    error_report("Compressed pages use codec %s, but "
+                                 "x-compress-method is %s",
+                                 method < MIGRATION_COMPRESS_METHOD_MAX ?
+                                 MigrationCompressMethod_lookup[method] :
+                                 "unknown",
+                                 MigrationCompressMethod_lookup[
+                                     migrate_compress_method()]);
+                    ret = -EINVAL;
+                }
+            }
             break;
         case RAM_SAVE_FLAG_COMPRESS:
             host = host_from_stream_offset(f, addr, flags);
@@ -1653,13 +2812,17 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
             }
 
             len = qemu_get_be32(f);
-            if (len < 0 || len > compressBound(TARGET_PAGE_SIZE)) {
+            if (len < 0 || len > decomp_bound) {
                 error_report("Invalid compressed data length: %d", len);
                 ret = -EINVAL;
                 break;
             }
             qemu_get_buffer(f, compressed_data_buf, len);
-            decompress_data_with_multi_threads(compressed_data_buf, host, len);
+            if (decompress_data_with_multi_threads(compressed_data_buf,
+                                                   host, len)) {
+                error_report("Failed to decompress a compressed page");
+                ret = -EINVAL;
+            }
             break;
         case RAM_SAVE_FLAG_XBZRLE:
             host = host_from_stream_offset(f, addr, flags);
@@ -1675,8 +2838,12 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                 break;
             }
             break;
+        case RAM_SAVE_FLAG_MULTIFD_SYNC:
+            ret = multifd_recv_sync_main();
+            break;
         case RAM_SAVE_FLAG_EOS:
             /* normal exit */
+            ret = wait_for_decompress_done();
             break;
         default:
             if (flags & RAM_SAVE_FLAG_HOOK) {
@@ -1698,7 +2865,13 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
     return ret;
 }
 
+static bool ram_can_postcopy(void *opaque)
+{
+    return migrate_postcopy_ram();
+}
+
 static SaveVMHandlers savevm_ram_handlers = {
+    .can_postcopy = ram_can_postcopy,
     .save_live_setup = ram_save_setup,
     .save_live_iterate = ram_save_iterate,
     .save_live_complete = ram_save_complete,
@@ -1913,51 +3086,37 @@ TargetInfo *qmp_query_target(Error **errp)
     return info;
 }
 
-/* Stub function that's gets run on the vcpu when its brought out of the
-   VM to run inside qemu via async_run_on_cpu()*/
-static void mig_sleep_cpu(void *opq)
-{
-    qemu_mutex_unlock_iothread();
-    g_usleep(30*1000);
-    qemu_mutex_lock_iothread();
-}
-
-/* To reduce the dirty rate explicitly disallow the VCPUs from spending
-   much time in the VM. The migration thread will try to catchup.
-   Workload will experience a performance drop.
-*/
-static void mig_throttle_guest_down(void)
-{
-    CPUState *cpu;
-
-    qemu_mutex_lock_iothread();
-    CPU_FOREACH(cpu) {
-        async_run_on_cpu(cpu, mig_sleep_cpu, NULL);
-    }
-    qemu_mutex_unlock_iothread();
-}
-
-static void check_guest_throttling(void)
+/*
+ * Slow the guest down until it dirties memory no faster than half the rate
+ * at which we send it.  A guest throttled to p% runs (100 - p)% of the time,
+ * and its dirty rate is assumed to scale with that, so the percentage that
+ * meets the target is
+ *
+ *     100 - (100 - p) * (bytes_xfer / 2) / bytes_dirty
+ *
+ * Once throttling, always step up by at least x-cpu-throttle-increment so
+ * that a guest whose dirty rate does not scale with run time still
+ * converges; never go beyond x-cpu-throttle-max.
+ */
+static void mig_throttle_guest_down(uint64_t bytes_dirty, uint64_t bytes_xfer)
 {
-    static int64_t t0;
-    int64_t        t1;
-
-    if (!mig_throttle_on) {
-        return;
-    }
-
-    if (!t0)  {
-        t0 = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
-        return;
+    MigrationState *s = migrate_get_current();
+    int pct_initial = s->parameters[MIGRATION_PARAMETER_X_CPU_THROTTLE_INITIAL];
+    int pct_increment =
+        s->parameters[MIGRATION_PARAMETER_X_CPU_THROTTLE_INCREMENT];
+    int pct_max = s->parameters[MIGRATION_PARAMETER_X_CPU_THROTTLE_MAX];
+    int pct_cur = cpu_throttle_get_percentage();
+    int pct_target, pct;
+
+    pct_target = 100 - (int)((100 - pct_cur) * ((double)bytes_xfer / 2) /
+                             bytes_dirty);
+    if (cpu_throttle_active()) {
+        pct = MAX(pct_cur + pct_increment, pct_target);
+    } else {
+        pct = MAX(pct_initial, pct_target);
     }
+    pct = MIN(pct, pct_max);
 
-    t1 = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
-
-    /* If it has been more than 40 ms since the last time the guest
-     * was throttled then do it again.
-     */
-    if (40 < (t1-t0)/1000000) {
-        mig_throttle_guest_down();
-        t0 = t1;
-    }
+    trace_migration_throttle(bytes_dirty, bytes_xfer, pct);
+    cpu_throttle_set(pct);
 }
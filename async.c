@@ -228,6 +228,7 @@ aio_ctx_finalize(GSource     *source)
     thread_pool_free(ctx->thread_pool);
     aio_set_event_notifier(ctx, &ctx->notifier, NULL);
     event_notifier_cleanup(&ctx->notifier);
+    aio_context_destroy(ctx);
     rfifolock_destroy(&ctx->lock);
     qemu_mutex_destroy(&ctx->bh_lock);
     timerlistgroup_deinit(&ctx->tlg);
@@ -271,6 +272,7 @@ void aio_notify(AioContext *ctx)
     /* Write e.g. bh->scheduled before reading ctx->dispatching.  */
     smp_mb();
     if (!ctx->dispatching) {
+        atomic_set(&ctx->notified, true);
         event_notifier_set(&ctx->notifier);
     }
 }
@@ -285,8 +287,10 @@ AioContext *aio_context_new(Error **errp)
     int ret;
     AioContext *ctx;
     ctx = (AioContext *) g_source_new(&aio_source_funcs, sizeof(AioContext));
+    aio_context_setup(ctx);
     ret = event_notifier_init(&ctx->notifier, false);
     if (ret < 0) {
+        aio_context_destroy(ctx);
         g_source_destroy(&ctx->source);
         error_setg_errno(errp, -ret, "Failed to initialize event notifier");
         return NULL;
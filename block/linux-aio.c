@@ -152,6 +152,47 @@ static void qemu_laio_completion_cb(EventNotifier *e)
     }
 }
 
+/* The kernel maps the completion ring of an io_context_t into user space,
+ * with this header at its start.  Completions are available when head and
+ * tail differ, which can be checked without a system call.
+ */
+struct aio_ring {
+    unsigned id;
+    unsigned nr;
+    unsigned head;
+    unsigned tail;
+    unsigned magic;
+    unsigned compat_features;
+    unsigned incompat_features;
+    unsigned header_length;
+};
+
+#define AIO_RING_MAGIC 0xa10a10a1
+
+static bool io_ring_has_events(io_context_t ctx)
+{
+    struct aio_ring *ring = (struct aio_ring *)ctx;
+
+    if (ring->magic != AIO_RING_MAGIC) {
+        return false;
+    }
+    return atomic_read(&ring->head) != atomic_read(&ring->tail);
+}
+
+/* Called repeatedly while the AioContext is polling */
+static bool qemu_laio_poll_cb(void *opaque)
+{
+    EventNotifier *e = opaque;
+    struct qemu_laio_state *s = container_of(e, struct qemu_laio_state, e);
+
+    if (!io_ring_has_events(s->ctx)) {
+        return false;
+    }
+    smp_rmb();
+    qemu_laio_completion_bh(s);
+    return true;
+}
+
 static void laio_cancel(BlockAIOCB *blockacb)
 {
     struct qemu_laiocb *laiocb = (struct qemu_laiocb *)blockacb;
@@ -297,6 +338,7 @@ void laio_attach_aio_context(void *s_, AioContext *new_context)
 
     s->completion_bh = aio_bh_new(new_context, qemu_laio_completion_bh, s);
     aio_set_event_notifier(new_context, &s->e, qemu_laio_completion_cb);
+    aio_set_event_notifier_poll(new_context, &s->e, qemu_laio_poll_cb);
 }
 
 void *laio_init(void)
@@ -30,17 +30,36 @@
 typedef struct Qcow2CachedTable {
     int64_t  offset;
     bool     dirty;
-    uint64_t lru_counter;
     int      ref;
+    int      hash_next;     /* next entry in the same hash bucket, or -1 */
+    bool     on_lru;        /* linked into the LRU list */
+    int      lru_prev;      /* neighbours in the LRU list, or -1 */
+    int      lru_next;
 } Qcow2CachedTable;
 
 struct Qcow2Cache {
     Qcow2CachedTable       *entries;
     struct Qcow2Cache      *depends;
-    int                     size;
+    int                     size;       /* entries in use */
+    int                     max_size;   /* entries the cache may grow to */
     bool                    depends_on_flush;
     void                   *table_array;
-    uint64_t                lru_counter;
+
+    /* Hash index of the cached offsets; each bucket is the head of a chain
+     * linked through hash_next.  Empty entries (offset 0) are not indexed.
+     */
+    int                    *hash;
+    unsigned int            hash_mask;
+
+    /* Entries with no references, least recently used first */
+    int                     lru_first;
+    int                     lru_last;
+
+    /* Tables evicted since the cache last grew */
+    int                     evictions;
+
+    uint64_t                hits;
+    uint64_t                misses;
 };
 
 static inline void *qcow2_cache_get_table_addr(BlockDriverState *bs,
@@ -60,24 +79,164 @@ static inline int qcow2_cache_get_table_idx(BlockDriverState *bs,
     return idx;
 }
 
-Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables)
+static inline unsigned int qcow2_cache_hash(BlockDriverState *bs,
+                  Qcow2Cache *c, uint64_t offset)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t cluster = offset >> s->cluster_bits;
+
+    return (cluster * 0x9e3779b97f4a7c15ULL >> 32) & c->hash_mask;
+}
+
+static void qcow2_cache_hash_insert(BlockDriverState *bs, Qcow2Cache *c,
+                                    int i)
+{
+    unsigned int h = qcow2_cache_hash(bs, c, c->entries[i].offset);
+
+    c->entries[i].hash_next = c->hash[h];
+    c->hash[h] = i;
+}
+
+static void qcow2_cache_hash_remove(BlockDriverState *bs, Qcow2Cache *c,
+                                    int i)
+{
+    int *p = &c->hash[qcow2_cache_hash(bs, c, c->entries[i].offset)];
+
+    while (*p != i) {
+        assert(*p >= 0);
+        p = &c->entries[*p].hash_next;
+    }
+    *p = c->entries[i].hash_next;
+    c->entries[i].hash_next = -1;
+}
+
+static int qcow2_cache_lookup(BlockDriverState *bs, Qcow2Cache *c,
+                              uint64_t offset)
+{
+    int i = c->hash[qcow2_cache_hash(bs, c, offset)];
+
+    while (i >= 0 && c->entries[i].offset != offset) {
+        i = c->entries[i].hash_next;
+    }
+    return i;
+}
+
+static void qcow2_cache_lru_remove(Qcow2Cache *c, int i)
+{
+    Qcow2CachedTable *t = &c->entries[i];
+
+    assert(t->on_lru);
+    if (t->lru_prev >= 0) {
+        c->entries[t->lru_prev].lru_next = t->lru_next;
+    } else {
+        c->lru_first = t->lru_next;
+    }
+    if (t->lru_next >= 0) {
+        c->entries[t->lru_next].lru_prev = t->lru_prev;
+    } else {
+        c->lru_last = t->lru_prev;
+    }
+    t->lru_prev = t->lru_next = -1;
+    t->on_lru = false;
+}
+
+/* Make entry i the most recently used one */
+static void qcow2_cache_lru_append(Qcow2Cache *c, int i)
+{
+    assert(!c->entries[i].on_lru);
+    c->entries[i].on_lru = true;
+    c->entries[i].lru_prev = c->lru_last;
+    c->entries[i].lru_next = -1;
+    if (c->lru_last >= 0) {
+        c->entries[c->lru_last].lru_next = i;
+    } else {
+        c->lru_first = i;
+    }
+    c->lru_last = i;
+}
+
+/* Make entry i the first one to be replaced */
+static void qcow2_cache_lru_prepend(Qcow2Cache *c, int i)
+{
+    assert(!c->entries[i].on_lru);
+    c->entries[i].on_lru = true;
+    c->entries[i].lru_prev = -1;
+    c->entries[i].lru_next = c->lru_first;
+    if (c->lru_first >= 0) {
+        c->entries[c->lru_first].lru_prev = i;
+    } else {
+        c->lru_last = i;
+    }
+    c->lru_first = i;
+}
+
+/* Reset entries [first, last) to empty and queue them for reuse */
+static void qcow2_cache_init_entries(Qcow2Cache *c, int first, int last)
+{
+    int i;
+
+    for (i = first; i < last; i++) {
+        c->entries[i] = (Qcow2CachedTable) {
+            .hash_next = -1,
+            .lru_prev = -1,
+            .lru_next = -1,
+        };
+        qcow2_cache_lru_prepend(c, i);
+    }
+}
+
+/* Grow the cache once it has replaced as many tables as it holds, which
+ * means the working set does not fit.  The memory for all max_size tables
+ * is allocated up front, but pages are only touched once an entry is used.
+ */
+static void qcow2_cache_maybe_grow(Qcow2Cache *c)
+{
+    int new_size;
+
+    if (c->size == c->max_size || c->evictions < c->size) {
+        return;
+    }
+
+    new_size = MIN((int64_t) c->size * 2, c->max_size);
+    qcow2_cache_init_entries(c, c->size, new_size);
+    c->size = new_size;
+    c->evictions = 0;
+}
+
+Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
+                               int max_tables)
 {
     BDRVQcowState *s = bs->opaque;
     Qcow2Cache *c;
+    unsigned int hash_size;
+    int i;
+
+    assert(num_tables > 0 && max_tables >= num_tables);
+    hash_size = pow2ceil(max_tables);
 
     c = g_new0(Qcow2Cache, 1);
     c->size = num_tables;
-    c->entries = g_try_new0(Qcow2CachedTable, num_tables);
+    c->max_size = max_tables;
+    c->entries = g_try_new0(Qcow2CachedTable, max_tables);
+    c->hash = g_try_new(int, hash_size);
+    c->hash_mask = hash_size - 1;
     c->table_array = qemu_try_blockalign(bs->file,
-                                         (size_t) num_tables * s->cluster_size);
+                                         (size_t) max_tables * s->cluster_size);
 
-    if (!c->entries || !c->table_array) {
+    if (!c->entries || !c->hash || !c->table_array) {
         qemu_vfree(c->table_array);
+        g_free(c->hash);
         g_free(c->entries);
         g_free(c);
-        c = NULL;
+        return NULL;
     }
 
+    for (i = 0; i < hash_size; i++) {
+        c->hash[i] = -1;
+    }
+    c->lru_first = c->lru_last = -1;
+    qcow2_cache_init_entries(c, 0, c->size);
+
     return c;
 }
 
@@ -90,12 +249,26 @@ int qcow2_cache_destroy(BlockDriverState *bs, Qcow2Cache *c)
     }
 
     qemu_vfree(c->table_array);
+    g_free(c->hash);
     g_free(c->entries);
     g_free(c);
 
     return 0;
 }
 
+void qcow2_cache_get_stats(BlockDriverState *bs, Qcow2Cache *c,
+                           Qcow2CacheStats *stats)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    *stats = (Qcow2CacheStats) {
+        .size       = (int64_t) c->size * s->cluster_size,
+        .max_size   = (int64_t) c->max_size * s->cluster_size,
+        .hits       = c->hits,
+        .misses     = c->misses,
+    };
+}
+
 static int qcow2_cache_flush_dependency(BlockDriverState *bs, Qcow2Cache *c)
 {
     int ret;
@@ -233,11 +406,13 @@ int qcow2_cache_empty(BlockDriverState *bs, Qcow2Cache *c)
 
     for (i = 0; i < c->size; i++) {
         assert(c->entries[i].ref == 0);
-        c->entries[i].offset = 0;
-        c->entries[i].lru_counter = 0;
     }
-
-    c->lru_counter = 0;
+    for (i = 0; i <= c->hash_mask; i++) {
+        c->hash[i] = -1;
+    }
+    c->lru_first = c->lru_last = -1;
+    qcow2_cache_init_entries(c, 0, c->size);
+    c->evictions = 0;
 
     return 0;
 }
@@ -248,51 +423,58 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
     BDRVQcowState *s = bs->opaque;
     int i;
     int ret;
-    int lookup_index;
-    uint64_t min_lru_counter = UINT64_MAX;
-    int min_lru_index = -1;
 
     trace_qcow2_cache_get(qemu_coroutine_self(), c == s->l2_table_cache,
                           offset, read_from_disk);
 
-    /* Check if the table is already cached */
-    i = lookup_index = (offset / s->cluster_size * 4) % c->size;
-    do {
-        const Qcow2CachedTable *t = &c->entries[i];
-        if (t->offset == offset) {
-            goto found;
-        }
-        if (t->ref == 0 && t->lru_counter < min_lru_counter) {
-            min_lru_counter = t->lru_counter;
-            min_lru_index = i;
+retry:
+    /* Check if the table is already cached.  An unreferenced entry may be
+     * off the LRU list because it is being written back for replacement;
+     * taking a reference makes the replacing request pick another entry. */
+    i = qcow2_cache_lookup(bs, c, offset);
+    if (i >= 0) {
+        c->hits++;
+        if (c->entries[i].on_lru) {
+            qcow2_cache_lru_remove(c, i);
         }
-        if (++i == c->size) {
-            i = 0;
-        }
-    } while (i != lookup_index);
+        goto found;
+    }
 
-    if (min_lru_index == -1) {
+    qcow2_cache_maybe_grow(c);
+    i = c->lru_first;
+    if (i < 0) {
         /* This can't happen in current synchronous code, but leave the check
          * here as a reminder for whoever starts using AIO with the cache */
         abort();
     }
 
-    /* Cache miss: write a table back and replace it */
-    i = min_lru_index;
+    /* Cache miss: write a table back and replace it.  Take the entry off
+     * the LRU list while doing I/O, so that nobody else picks it. */
     trace_qcow2_cache_get_replace_entry(qemu_coroutine_self(),
                                         c == s->l2_table_cache, i);
-    if (i < 0) {
-        return i;
-    }
+    qcow2_cache_lru_remove(c, i);
 
     ret = qcow2_cache_entry_flush(bs, c, i);
+    if (c->entries[i].ref) {
+        /* Somebody started using the table while it was written back, and
+         * will put it back on the LRU list when done */
+        if (ret < 0) {
+            return ret;
+        }
+        goto retry;
+    }
     if (ret < 0) {
+        qcow2_cache_lru_prepend(c, i);
         return ret;
     }
 
     trace_qcow2_cache_get_read(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
-    c->entries[i].offset = 0;
+    if (c->entries[i].offset) {
+        qcow2_cache_hash_remove(bs, c, i);
+        c->entries[i].offset = 0;
+        c->evictions++;
+    }
     if (read_from_disk) {
         if (c == s->l2_table_cache) {
             BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
@@ -301,11 +483,14 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
         ret = bdrv_pread(bs->file, offset, qcow2_cache_get_table_addr(bs, c, i),
                          s->cluster_size);
         if (ret < 0) {
+            qcow2_cache_lru_prepend(c, i);
             return ret;
         }
     }
 
     c->entries[i].offset = offset;
+    qcow2_cache_hash_insert(bs, c, i);
+    c->misses++;
 
     /* And return the right table */
 found:
@@ -338,7 +523,7 @@ void qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table)
     *table = NULL;
 
     if (c->entries[i].ref == 0) {
-        c->entries[i].lru_counter = ++c->lru_counter;
+        qcow2_cache_lru_append(c, i);
     }
 
     assert(c->entries[i].ref >= 0);
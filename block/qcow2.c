@@ -468,6 +468,11 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_SIZE,
             .help = "Maximum refcount block cache size",
         },
+        {
+            .name = QCOW2_OPT_L2_CACHE_MAX_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Size up to which the L2 table cache may grow",
+        },
         { /* end of list */ }
     },
 };
@@ -483,20 +488,29 @@ static const char *overlap_bool_option_names[QCOW2_OL_MAX_BITNR] = {
     [QCOW2_OL_INACTIVE_L2_BITNR]    = QCOW2_OPT_OVERLAP_INACTIVE_L2,
 };
 
+/*
+ * *l2_cache_max_size is set to 0 if the caller should pick the growth limit
+ * itself; an explicitly sized L2 cache does not grow unless asked to.
+ */
 static void read_cache_sizes(QemuOpts *opts, uint64_t *l2_cache_size,
+                             uint64_t *l2_cache_max_size,
                              uint64_t *refcount_cache_size, Error **errp)
 {
     uint64_t combined_cache_size;
     bool l2_cache_size_set, refcount_cache_size_set, combined_cache_size_set;
+    bool l2_cache_max_size_set;
 
     combined_cache_size_set = qemu_opt_get(opts, QCOW2_OPT_CACHE_SIZE);
     l2_cache_size_set = qemu_opt_get(opts, QCOW2_OPT_L2_CACHE_SIZE);
     refcount_cache_size_set = qemu_opt_get(opts, QCOW2_OPT_REFCOUNT_CACHE_SIZE);
+    l2_cache_max_size_set = qemu_opt_get(opts, QCOW2_OPT_L2_CACHE_MAX_SIZE);
 
     combined_cache_size = qemu_opt_get_size(opts, QCOW2_OPT_CACHE_SIZE, 0);
     *l2_cache_size = qemu_opt_get_size(opts, QCOW2_OPT_L2_CACHE_SIZE, 0);
     *refcount_cache_size = qemu_opt_get_size(opts,
                                              QCOW2_OPT_REFCOUNT_CACHE_SIZE, 0);
+    *l2_cache_max_size = qemu_opt_get_size(opts,
+                                           QCOW2_OPT_L2_CACHE_MAX_SIZE, 0);
 
     if (combined_cache_size_set) {
         if (l2_cache_size_set && refcount_cache_size_set) {
@@ -536,6 +550,18 @@ static void read_cache_sizes(QemuOpts *opts, uint64_t *l2_cache_size,
                                  / DEFAULT_L2_REFCOUNT_SIZE_RATIO;
         }
     }
+
+    if (l2_cache_max_size_set) {
+        if (*l2_cache_max_size < *l2_cache_size) {
+            error_setg(errp, QCOW2_OPT_L2_CACHE_MAX_SIZE " may not be smaller "
+                       "than the L2 cache size");
+            return;
+        }
+    } else if (l2_cache_size_set || combined_cache_size_set) {
+        *l2_cache_max_size = *l2_cache_size;
+    } else {
+        *l2_cache_max_size = 0;
+    }
 }
 
 static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
@@ -551,7 +577,7 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     uint64_t l1_vm_state_index;
     const char *opt_overlap_check, *opt_overlap_check_template;
     int overlap_check_template = 0;
-    uint64_t l2_cache_size, refcount_cache_size;
+    uint64_t l2_cache_size, l2_cache_max_size, refcount_cache_size;
 
     ret = bdrv_pread(bs->file, 0, &header, sizeof(header));
     if (ret < 0) {
@@ -803,7 +829,8 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         goto fail;
     }
 
-    read_cache_sizes(opts, &l2_cache_size, &refcount_cache_size, &local_err);
+    read_cache_sizes(opts, &l2_cache_size, &l2_cache_max_size,
+                     &refcount_cache_size, &local_err);
     if (local_err) {
         error_propagate(errp, local_err);
         ret = -EINVAL;
@@ -820,6 +847,26 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         goto fail;
     }
 
+    if (l2_cache_max_size == 0 && !(flags & BDRV_O_RDWR)) {
+        /* Read-only images, usually backing files, don't grow by default */
+        l2_cache_max_size = l2_cache_size * s->cluster_size;
+    } else if (l2_cache_max_size == 0) {
+        /* Enough L2 tables to map the whole image, within reason */
+        l2_cache_max_size = DIV_ROUND_UP(header.size, s->cluster_size)
+                            * sizeof(uint64_t);
+        l2_cache_max_size = MIN(l2_cache_max_size,
+                                DEFAULT_L2_CACHE_MAX_BYTE_SIZE);
+    }
+    l2_cache_max_size = DIV_ROUND_UP(l2_cache_max_size, s->cluster_size);
+    if (l2_cache_max_size < l2_cache_size) {
+        l2_cache_max_size = l2_cache_size;
+    }
+    if (l2_cache_max_size > INT_MAX) {
+        error_setg(errp, "L2 cache maximum size too big");
+        ret = -EINVAL;
+        goto fail;
+    }
+
     refcount_cache_size /= s->cluster_size;
     if (refcount_cache_size < MIN_REFCOUNT_CACHE_SIZE) {
         refcount_cache_size = MIN_REFCOUNT_CACHE_SIZE;
@@ -831,8 +878,10 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     }
 
     /* alloc L2 table/refcount block cache */
-    s->l2_table_cache = qcow2_cache_create(bs, l2_cache_size);
-    s->refcount_block_cache = qcow2_cache_create(bs, refcount_cache_size);
+    s->l2_table_cache = qcow2_cache_create(bs, l2_cache_size,
+                                           l2_cache_max_size);
+    s->refcount_block_cache = qcow2_cache_create(bs, refcount_cache_size,
+                                                 refcount_cache_size);
     if (s->l2_table_cache == NULL || s->refcount_block_cache == NULL) {
         error_setg(errp, "Could not allocate metadata caches");
         ret = -ENOMEM;
@@ -2555,6 +2604,23 @@ static ImageInfoSpecific *qcow2_get_specific_info(BlockDriverState *bs)
     return spec_info;
 }
 
+static BlockStatsSpecific *qcow2_get_specific_stats(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    BlockStatsSpecific *stats = g_new0(BlockStatsSpecific, 1);
+
+    stats->kind = BLOCK_STATS_SPECIFIC_KIND_QCOW2;
+    stats->qcow2 = g_new0(BlockStatsSpecificQcow2, 1);
+    stats->qcow2->l2_cache = g_new0(Qcow2CacheStats, 1);
+    stats->qcow2->refcount_cache = g_new0(Qcow2CacheStats, 1);
+
+    qcow2_cache_get_stats(bs, s->l2_table_cache, stats->qcow2->l2_cache);
+    qcow2_cache_get_stats(bs, s->refcount_block_cache,
+                          stats->qcow2->refcount_cache);
+
+    return stats;
+}
+
 #if 0
 static void dump_refcounts(BlockDriverState *bs)
 {
@@ -2957,6 +3023,7 @@ BlockDriver bdrv_qcow2 = {
     .bdrv_snapshot_load_tmp = qcow2_snapshot_load_tmp,
     .bdrv_get_info          = qcow2_get_info,
     .bdrv_get_specific_info = qcow2_get_specific_info,
+    .bdrv_get_specific_stats = qcow2_get_specific_stats,
 
     .bdrv_save_vmstate    = qcow2_save_vmstate,
     .bdrv_load_vmstate    = qcow2_load_vmstate,
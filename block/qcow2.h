@@ -69,6 +69,10 @@
 
 #define DEFAULT_L2_CACHE_BYTE_SIZE 1048576 /* bytes */
 
+/* Upper bound for the default L2 cache growth budget; enough to cover 64 GB
+ * with 64 kB clusters */
+#define DEFAULT_L2_CACHE_MAX_BYTE_SIZE (8 * 1048576) /* bytes */
+
 /* The refblock cache needs only a fourth of the L2 cache size to cover as many
  * clusters */
 #define DEFAULT_L2_REFCOUNT_SIZE_RATIO 4
@@ -93,6 +97,7 @@
 #define QCOW2_OPT_CACHE_SIZE "cache-size"
 #define QCOW2_OPT_L2_CACHE_SIZE "l2-cache-size"
 #define QCOW2_OPT_REFCOUNT_CACHE_SIZE "refcount-cache-size"
+#define QCOW2_OPT_L2_CACHE_MAX_SIZE "l2-cache-max-size"
 
 typedef struct QCowHeader {
     uint32_t magic;
@@ -571,7 +576,8 @@ void qcow2_free_snapshots(BlockDriverState *bs);
 int qcow2_read_snapshots(BlockDriverState *bs);
 
 /* qcow2-cache.c functions */
-Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables);
+Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
+                               int max_tables);
 int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c);
 
 void qcow2_cache_entry_mark_dirty(BlockDriverState *bs, Qcow2Cache *c,
@@ -588,5 +594,7 @@ int qcow2_cache_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
 int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     void **table);
 void qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table);
+void qcow2_cache_get_stats(BlockDriverState *bs, Qcow2Cache *c,
+                           Qcow2CacheStats *stats);
 
 #endif
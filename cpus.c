@@ -39,6 +39,7 @@
 #include "qemu/main-loop.h"
 #include "qemu/bitmap.h"
 #include "qemu/seqlock.h"
+#include "qemu/rcu.h"
 #include "qapi-event.h"
 #include "hw/nmi.h"
 
@@ -68,6 +69,9 @@ static CPUState *next_cpu;
 int64_t max_delay;
 int64_t max_advance;
 
+/* Multi-threaded TCG: one host thread per vCPU, see qemu_tcg_configure() */
+static bool mttcg_enabled;
+
 bool cpu_is_stopped(CPUState *cpu)
 {
     return cpu->stopped || !runstate_is_running();
@@ -115,6 +119,16 @@ static QEMUTimer *icount_rt_timer;
 static QEMUTimer *icount_vm_timer;
 static QEMUTimer *icount_warp_timer;
 
+/* vCPU throttling: every vCPU sleeps for the throttled share of each
+ * CPU_THROTTLE_TIMESLICE_NS of run time.
+ */
+#define CPU_THROTTLE_PCT_MIN 1
+#define CPU_THROTTLE_PCT_MAX 99
+#define CPU_THROTTLE_TIMESLICE_NS 10000000
+
+static QEMUTimer *throttle_timer;
+static unsigned int throttle_percentage;
+
 typedef struct TimersState {
     /* Protected by BQL.  */
     int64_t cpu_ticks_prev;
@@ -486,10 +500,78 @@ static const VMStateDescription vmstate_timers = {
     }
 };
 
+static void cpu_throttle_thread(void *opaque)
+{
+    CPUState *cpu = opaque;
+    double pct;
+    long sleeptime_ns;
+
+    if (!cpu_throttle_get_percentage()) {
+        return;
+    }
+
+    /* Sleep so that we run (100 - pct)% of the time */
+    pct = (double)cpu_throttle_get_percentage() / 100;
+    sleeptime_ns = (long)(pct / (1 - pct) * CPU_THROTTLE_TIMESLICE_NS);
+
+    qemu_mutex_unlock_iothread();
+    atomic_set(&cpu->throttle_thread_scheduled, false);
+    g_usleep(sleeptime_ns / 1000);
+    qemu_mutex_lock_iothread();
+}
+
+static void cpu_throttle_timer_tick(void *opaque)
+{
+    CPUState *cpu;
+    double pct;
+
+    /* Stop the timer once throttling is off */
+    if (!cpu_throttle_get_percentage()) {
+        return;
+    }
+    CPU_FOREACH(cpu) {
+        if (!atomic_xchg(&cpu->throttle_thread_scheduled, true)) {
+            async_run_on_cpu(cpu, cpu_throttle_thread, cpu);
+        }
+    }
+
+    pct = (double)cpu_throttle_get_percentage() / 100;
+    timer_mod(throttle_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL_RT) +
+                              CPU_THROTTLE_TIMESLICE_NS / (1 - pct));
+}
+
+void cpu_throttle_set(int new_throttle_pct)
+{
+    new_throttle_pct = MIN(new_throttle_pct, CPU_THROTTLE_PCT_MAX);
+    new_throttle_pct = MAX(new_throttle_pct, CPU_THROTTLE_PCT_MIN);
+
+    atomic_set(&throttle_percentage, new_throttle_pct);
+
+    timer_mod(throttle_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL_RT) +
+                              CPU_THROTTLE_TIMESLICE_NS);
+}
+
+void cpu_throttle_stop(void)
+{
+    atomic_set(&throttle_percentage, 0);
+}
+
+bool cpu_throttle_active(void)
+{
+    return cpu_throttle_get_percentage() != 0;
+}
+
+int cpu_throttle_get_percentage(void)
+{
+    return atomic_read(&throttle_percentage);
+}
+
 void cpu_ticks_init(void)
 {
     seqlock_init(&timers_state.vm_clock_seqlock, NULL);
     vmstate_register(NULL, 0, &vmstate_timers, &timers_state);
+    throttle_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL_RT,
+                                  cpu_throttle_timer_tick, NULL);
 }
 
 void configure_icount(QemuOpts *opts, Error **errp)
@@ -541,6 +623,56 @@ void configure_icount(QemuOpts *opts, Error **errp)
                    get_ticks_per_sec() / 10);
 }
 
+/* Parallel execution of the vCPUs is only correct if the guest's atomic
+ * instructions are emulated with host atomics (TARGET_SUPPORTS_MTTCG) and
+ * if the host orders memory accesses at least as strongly as the guest
+ * expects, since TCG does not translate guest barriers into host ones.
+ * Only strongly ordered hosts qualify for now.
+ */
+#if defined(__i386__) || defined(__x86_64__) || defined(__s390x__)
+#define HOST_ORDERS_MEMORY_STRONGLY 1
+#else
+#define HOST_ORDERS_MEMORY_STRONGLY 0
+#endif
+
+void qemu_tcg_configure(QemuOpts *opts, Error **errp)
+{
+    const char *t = qemu_opt_get(opts, "thread");
+
+    if (!t || strcmp(t, "single") == 0) {
+        mttcg_enabled = false;
+        return;
+    }
+    if (strcmp(t, "multi") != 0) {
+        error_setg(errp, "Invalid 'thread' setting %s", t);
+        return;
+    }
+    if (!tcg_enabled()) {
+        error_setg(errp, "thread=multi is only supported with TCG");
+        return;
+    }
+#ifndef TARGET_SUPPORTS_MTTCG
+    error_setg(errp, "Guest CPU does not support thread=multi: its atomic "
+               "instructions assume a single vCPU thread");
+    return;
+#endif
+    if (!HOST_ORDERS_MEMORY_STRONGLY) {
+        error_setg(errp, "thread=multi needs a host with a strongly "
+                   "ordered memory model");
+        return;
+    }
+    if (use_icount) {
+        error_setg(errp, "thread=multi is not compatible with -icount");
+        return;
+    }
+    mttcg_enabled = true;
+}
+
+bool qemu_tcg_mttcg_enabled(void)
+{
+    return mttcg_enabled;
+}
+
 /***********************************************************/
 void hw_error(const char *fmt, ...)
 {
@@ -785,11 +917,20 @@ static QemuThread io_thread;
 static QemuThread *tcg_cpu_thread;
 static QemuCond *tcg_halt_cond;
 
+/* Whether the current thread holds qemu_global_mutex */
+static __thread bool iothread_locked;
+
+/* MTTCG vCPU threads currently inside cpu_exec(), protected by the BQL */
+static int tcg_running_cpus;
+static QemuCond qemu_tcg_exclusive_cond;
+
 /* cpu creation */
 static QemuCond qemu_cpu_cond;
 /* system init */
 static QemuCond qemu_pause_cond;
 static QemuCond qemu_work_cond;
+/* broadcast when a vCPU drained its TLB flush queue or left cpu_exec() */
+static QemuCond qemu_tlb_flush_cond;
 
 void qemu_init_cpu_loop(void)
 {
@@ -797,12 +938,26 @@ void qemu_init_cpu_loop(void)
     qemu_cond_init(&qemu_cpu_cond);
     qemu_cond_init(&qemu_pause_cond);
     qemu_cond_init(&qemu_work_cond);
+    qemu_cond_init(&qemu_tlb_flush_cond);
     qemu_cond_init(&qemu_io_proceeded_cond);
+    qemu_cond_init(&qemu_tcg_exclusive_cond);
     qemu_mutex_init(&qemu_global_mutex);
 
     qemu_thread_get_self(&io_thread);
 }
 
+/* Wait for another vCPU to make progress on its TLB flush queue, see
+ * tlb_flush_async_wait().  Called with the BQL held.  */
+void qemu_tlb_flush_wait(void)
+{
+    qemu_cond_wait(&qemu_tlb_flush_cond, &qemu_global_mutex);
+}
+
+void qemu_tlb_flush_signal(void)
+{
+    qemu_cond_broadcast(&qemu_tlb_flush_cond);
+}
+
 void run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data)
 {
     struct qemu_work_item wi;
@@ -925,6 +1080,7 @@ static void *qemu_kvm_cpu_thread_fn(void *arg)
     int r;
 
     qemu_mutex_lock(&qemu_global_mutex);
+    iothread_locked = true;
     qemu_thread_get_self(cpu->thread);
     cpu->thread_id = qemu_get_thread_id();
     cpu->can_do_io = 1;
@@ -999,15 +1155,18 @@ static void *qemu_dummy_cpu_thread_fn(void *arg)
 }
 
 static void tcg_exec_all(void);
+static int tcg_cpu_exec(CPUArchState *env);
 
 static void *qemu_tcg_cpu_thread_fn(void *arg)
 {
     CPUState *cpu = arg;
 
+    rcu_register_thread();
     qemu_tcg_init_cpu_signals();
     qemu_thread_get_self(cpu->thread);
 
     qemu_mutex_lock(&qemu_global_mutex);
+    iothread_locked = true;
     CPU_FOREACH(cpu) {
         cpu->thread_id = qemu_get_thread_id();
         cpu->created = true;
@@ -1044,6 +1203,81 @@ static void *qemu_tcg_cpu_thread_fn(void *arg)
     return NULL;
 }
 
+static void qemu_tcg_mttcg_wait_io_event(CPUState *cpu)
+{
+    while (cpu_thread_is_idle(cpu)) {
+        qemu_cond_wait(cpu->halt_cond, &qemu_global_mutex);
+    }
+
+    qemu_wait_io_event_common(cpu);
+}
+
+/* Recycle the code region that tb_gen_code() ran out of.  Other vCPUs may
+ * still be executing translated code from it, so kick them all out of
+ * cpu_exec() and wait until none is left inside.  Called with the BQL held.
+ */
+static void qemu_tcg_mttcg_evict_tbs(CPUState *cpu)
+{
+    CPUState *other;
+
+    CPU_FOREACH(other) {
+        cpu_exit(other);
+    }
+    while (tcg_running_cpus > 0) {
+        qemu_cond_wait(&qemu_tcg_exclusive_cond, &qemu_global_mutex);
+    }
+    tb_evict_pending_region(cpu);
+}
+
+static void *qemu_tcg_mttcg_cpu_thread_fn(void *arg)
+{
+    CPUState *cpu = arg;
+    int r;
+
+    rcu_register_thread();
+    qemu_tcg_init_cpu_signals();
+    qemu_thread_get_self(cpu->thread);
+
+    qemu_mutex_lock_iothread();
+    cpu->thread_id = qemu_get_thread_id();
+    cpu->created = true;
+    cpu->can_do_io = 1;
+    qemu_cond_signal(&qemu_cpu_cond);
+
+    /* wait for initial kick-off after machine start */
+    while (cpu->stopped) {
+        qemu_cond_wait(cpu->halt_cond, &qemu_global_mutex);
+        qemu_wait_io_event_common(cpu);
+    }
+
+    while (1) {
+        if (tb_evict_pending()) {
+            qemu_tcg_mttcg_evict_tbs(cpu);
+        }
+        if (cpu_can_run(cpu)) {
+            /* Guest code runs without the BQL; device accesses and
+             * interrupt delivery take it again as needed.
+             */
+            tcg_running_cpus++;
+            cpu->tcg_executing = true;
+            qemu_mutex_unlock_iothread();
+            r = tcg_cpu_exec(cpu->env_ptr);
+            qemu_mutex_lock_iothread();
+            cpu->tcg_executing = false;
+            qemu_tlb_flush_signal();
+            if (--tcg_running_cpus == 0) {
+                qemu_cond_broadcast(&qemu_tcg_exclusive_cond);
+            }
+            if (r == EXCP_DEBUG) {
+                cpu_handle_guest_debug(cpu);
+            }
+        }
+        qemu_tcg_mttcg_wait_io_event(cpu);
+    }
+
+    return NULL;
+}
+
 static void qemu_cpu_kick_thread(CPUState *cpu)
 {
 #ifndef _WIN32
@@ -1086,7 +1320,10 @@ static void qemu_cpu_kick_thread(CPUState *cpu)
 void qemu_cpu_kick(CPUState *cpu)
 {
     qemu_cond_broadcast(cpu->halt_cond);
-    if (!tcg_enabled() && !cpu->thread_kicked) {
+    if (tcg_enabled() && mttcg_enabled) {
+        /* the vCPU may be running guest code without the BQL */
+        cpu_exit(cpu);
+    } else if (!tcg_enabled() && !cpu->thread_kicked) {
         qemu_cpu_kick_thread(cpu);
         cpu->thread_kicked = true;
     }
@@ -1119,7 +1356,10 @@ bool qemu_in_vcpu_thread(void)
 void qemu_mutex_lock_iothread(void)
 {
     atomic_inc(&iothread_requesting_mutex);
-    if (!tcg_enabled() || !first_cpu || !first_cpu->thread) {
+    /* In MTTCG mode the vCPU threads drop the BQL while running guest code,
+     * so there is no need to kick them.
+     */
+    if (!tcg_enabled() || mttcg_enabled || !first_cpu || !first_cpu->thread) {
         qemu_mutex_lock(&qemu_global_mutex);
         atomic_dec(&iothread_requesting_mutex);
     } else {
@@ -1130,13 +1370,20 @@ void qemu_mutex_lock_iothread(void)
         atomic_dec(&iothread_requesting_mutex);
         qemu_cond_broadcast(&qemu_io_proceeded_cond);
     }
+    iothread_locked = true;
 }
 
 void qemu_mutex_unlock_iothread(void)
 {
+    iothread_locked = false;
     qemu_mutex_unlock(&qemu_global_mutex);
 }
 
+bool qemu_mutex_iothread_locked(void)
+{
+    return iothread_locked;
+}
+
 static int all_vcpus_paused(void)
 {
     CPUState *cpu;
@@ -1162,7 +1409,7 @@ void pause_all_vcpus(void)
 
     if (qemu_in_vcpu_thread()) {
         cpu_stop_current();
-        if (!kvm_enabled()) {
+        if (!kvm_enabled() && !mttcg_enabled) {
             CPU_FOREACH(cpu) {
                 cpu->stop = false;
                 cpu->stopped = true;
@@ -1205,6 +1452,24 @@ static void qemu_tcg_init_vcpu(CPUState *cpu)
 
     tcg_cpu_address_space_init(cpu, cpu->as);
 
+    if (mttcg_enabled) {
+        cpu->thread = g_malloc0(sizeof(QemuThread));
+        cpu->halt_cond = g_malloc0(sizeof(QemuCond));
+        qemu_cond_init(cpu->halt_cond);
+        snprintf(thread_name, VCPU_THREAD_NAME_SIZE, "CPU %d/TCG",
+                 cpu->cpu_index);
+        qemu_thread_create(cpu->thread, thread_name,
+                           qemu_tcg_mttcg_cpu_thread_fn,
+                           cpu, QEMU_THREAD_JOINABLE);
+#ifdef _WIN32
+        cpu->hThread = qemu_thread_get_handle(cpu->thread);
+#endif
+        while (!cpu->created) {
+            qemu_cond_wait(&qemu_cpu_cond, &qemu_global_mutex);
+        }
+        return;
+    }
+
     /* share a single thread for all cpus with TCG */
     if (!tcg_cpu_thread) {
         cpu->thread = g_malloc0(sizeof(QemuThread));
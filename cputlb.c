@@ -29,12 +29,86 @@
 #include "exec/memory-internal.h"
 #include "exec/ram_addr.h"
 #include "tcg/tcg.h"
+#include "qemu/main-loop.h"
+#include "sysemu/cpus.h"
 
 //#define DEBUG_TLB
 //#define DEBUG_TLB_CHECK
 
 /* statistics */
 int tlb_flush_count;
+int tlb_flush_async_count;
+int tlb_flush_coalesced_count;
+
+/* Flushes of a mode whose vtlb stayed under a quarter full, after which
+   the vtlb is halved.  */
+#define VTLB_SHRINK_DELAY 16
+
+static inline unsigned int vtlb_size(CPUArchState *env, int mmu_idx)
+{
+    return CPU_VTLB_WAYS * (CPU_VTLB_MIN_SETS << env->vtlb_shift[mmu_idx]);
+}
+
+/* Return the index of the first way of the vtlb set for page ADDR.
+   Entries that collide in the main tlb share its index bits, so mix in
+   the bits above them.  */
+static inline unsigned int vtlb_set(CPUArchState *env, int mmu_idx,
+                                    target_ulong addr)
+{
+    target_ulong page = addr >> TARGET_PAGE_BITS;
+    unsigned int nsets = CPU_VTLB_MIN_SETS << env->vtlb_shift[mmu_idx];
+
+    return ((page ^ (page >> CPU_TLB_BITS)) & (nsets - 1)) * CPU_VTLB_WAYS;
+}
+
+static inline bool tlb_entry_is_empty(const CPUTLBEntry *te)
+{
+    return te->addr_read == -1 && te->addr_write == -1
+           && te->addr_code == -1;
+}
+
+static inline target_ulong tlb_entry_vaddr(const CPUTLBEntry *te)
+{
+    if (te->addr_read != -1) {
+        return te->addr_read & TARGET_PAGE_MASK;
+    } else if (te->addr_write != -1) {
+        return te->addr_write & TARGET_PAGE_MASK;
+    }
+    return te->addr_code & TARGET_PAGE_MASK;
+}
+
+/* Resize the vtlb of MMU_IDX according to how full it got since the last
+   flush, and empty it.  */
+static void tlb_flush_vtlb(CPUArchState *env, int mmu_idx)
+{
+    unsigned int size = vtlb_size(env, mmu_idx);
+    unsigned int used = env->vtlb_used[mmu_idx];
+    int shift = env->vtlb_shift[mmu_idx];
+
+    if (used * 4 >= size * 3) {
+        env->vtlb_idle[mmu_idx] = 0;
+        if (shift < CPU_VTLB_MAX_SHIFT) {
+            shift++;
+        }
+    } else if (used * 4 < size && shift > 0) {
+        if (++env->vtlb_idle[mmu_idx] >= VTLB_SHRINK_DELAY) {
+            env->vtlb_idle[mmu_idx] = 0;
+            shift--;
+        }
+    } else {
+        env->vtlb_idle[mmu_idx] = 0;
+    }
+    if (shift != env->vtlb_shift[mmu_idx]) {
+        env->vtlb_shift[mmu_idx] = shift;
+        env->tlb_stats[mmu_idx].resizes++;
+    }
+
+    /* Entries past the old size may never have been initialized, so
+       always clear the new size in full.  */
+    memset(env->tlb_v_table[mmu_idx], -1,
+           vtlb_size(env, mmu_idx) * sizeof(CPUTLBEntry));
+    env->vtlb_used[mmu_idx] = 0;
+}
 
 /* NOTE:
  * If flush_global is true (the usual case), flush all tlb entries.
@@ -51,6 +125,7 @@ int tlb_flush_count;
 void tlb_flush(CPUState *cpu, int flush_global)
 {
     CPUArchState *env = cpu->env_ptr;
+    int mmu_idx;
 
 #if defined(DEBUG_TLB)
     printf("tlb_flush:\n");
@@ -59,17 +134,31 @@ void tlb_flush(CPUState *cpu, int flush_global)
        links while we are modifying them */
     cpu->current_tb = NULL;
 
-    memset(env->tlb_table, -1, sizeof(env->tlb_table));
-    memset(env->tlb_v_table, -1, sizeof(env->tlb_v_table));
+    /* Modes that have not been filled since the last flush need no work;
+       this matters for targets with many MMU modes.  */
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        if (env->tlb_clean_modes & (1 << mmu_idx)) {
+            continue;
+        }
+        memset(env->tlb_table[mmu_idx], -1, sizeof(env->tlb_table[0]));
+        tlb_flush_vtlb(env, mmu_idx);
+        env->tlb_stats[mmu_idx].flushes++;
+    }
+    env->tlb_clean_modes = (1 << NB_MMU_MODES) - 1;
     memset(cpu->tb_jmp_cache, 0, sizeof(cpu->tb_jmp_cache));
 
+    /* anything queued by other CPUs is covered now */
+    cpu->tlb_flush_pending = false;
+    cpu->tlb_flush_nb_ranges = 0;
+
     env->vtlb_index = 0;
     env->tlb_flush_addr = -1;
     env->tlb_flush_mask = 0;
     tlb_flush_count++;
 }
 
-static inline void tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
+/* Returns true if the entry mapped ADDR and has been invalidated.  */
+static inline bool tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
 {
     if (addr == (tlb_entry->addr_read &
                  (TARGET_PAGE_MASK | TLB_INVALID_MASK)) ||
@@ -78,7 +167,9 @@ static inline void tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
         addr == (tlb_entry->addr_code &
                  (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
         memset(tlb_entry, -1, sizeof(*tlb_entry));
+        return true;
     }
+    return false;
 }
 
 void tlb_flush_page(CPUState *cpu, target_ulong addr)
@@ -107,20 +198,215 @@ void tlb_flush_page(CPUState *cpu, target_ulong addr)
     addr &= TARGET_PAGE_MASK;
     i = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        unsigned int set;
+        int k;
+
+        if (env->tlb_clean_modes & (1 << mmu_idx)) {
+            continue;
+        }
         tlb_flush_entry(&env->tlb_table[mmu_idx][i], addr);
-    }
 
-    /* check whether there are entries that need to be flushed in the vtlb */
-    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
-        int k;
-        for (k = 0; k < CPU_VTLB_SIZE; k++) {
-            tlb_flush_entry(&env->tlb_v_table[mmu_idx][k], addr);
+        /* the page can only be in one set of the vtlb */
+        set = vtlb_set(env, mmu_idx, addr);
+        for (k = 0; k < CPU_VTLB_WAYS; k++) {
+            if (tlb_flush_entry(&env->tlb_v_table[mmu_idx][set + k], addr)) {
+                env->vtlb_used[mmu_idx]--;
+            }
         }
+        env->tlb_stats[mmu_idx].page_flushes++;
     }
 
     tb_flush_jmp_cache(cpu, addr);
 }
 
+/* Flushes of another CPU's TLB.  They are queued and done by that CPU
+ * when it next enters cpu_exec(), which turns a burst of invalidations
+ * (TLBI loops, for example) into a few page ranges, or a single full
+ * flush.  With a single TCG thread, a CPU other than the current one is
+ * never in the middle of a TB, so that is soon enough.  With MTTCG the
+ * other vCPUs keep running; callers that need the flush to be complete
+ * before they continue use tlb_flush_async_wait().
+ */
+
+/* Ranges longer than this many pages are done as a full flush.  */
+#define TLB_FLUSH_RANGE_MAX_PAGES (CPU_TLB_SIZE / 4)
+
+static inline bool tlb_flush_is_local(CPUState *cpu)
+{
+    /* With no CPU running, flushing immediately is just as safe.  That
+       does not hold for MTTCG, where the other vCPU threads keep going.  */
+    return cpu == current_cpu ||
+           (current_cpu == NULL && !qemu_tcg_mttcg_enabled());
+}
+
+/* The flush queue of a CPU is protected by the BQL, since with MTTCG the
+   requester and the CPU draining it run in different threads.  Returns
+   true if the caller must drop the lock again.  */
+static bool tlb_flush_queue_lock(void)
+{
+    if (!qemu_mutex_iothread_locked()) {
+        qemu_mutex_lock_iothread();
+        return true;
+    }
+    return false;
+}
+
+static void tlb_flush_queue_all(CPUState *cpu)
+{
+    cpu->tlb_flush_pending = true;
+    cpu->tlb_flush_nb_ranges = 0;
+}
+
+void tlb_flush_async(CPUState *cpu, int flush_global)
+{
+    bool unlock;
+
+    if (tlb_flush_is_local(cpu)) {
+        tlb_flush(cpu, flush_global);
+        return;
+    }
+    unlock = tlb_flush_queue_lock();
+    tlb_flush_async_count++;
+    if (cpu->tlb_flush_pending) {
+        tlb_flush_coalesced_count++;
+    }
+    tlb_flush_queue_all(cpu);
+    /* get it to drain the queue soon if it is running */
+    qemu_cpu_kick(cpu);
+    if (unlock) {
+        qemu_mutex_unlock_iothread();
+    }
+}
+
+static void tlb_flush_queue_page(CPUState *cpu, target_ulong addr)
+{
+    CPUTLBFlushRange *r;
+    int i;
+
+    tlb_flush_async_count++;
+    if (cpu->tlb_flush_pending) {
+        tlb_flush_coalesced_count++;
+        return;
+    }
+
+    addr &= TARGET_PAGE_MASK;
+    for (i = 0; i < cpu->tlb_flush_nb_ranges; i++) {
+        r = &cpu->tlb_flush_ranges[i];
+        if (addr >= r->addr && addr - r->addr <= r->len) {
+            /* inside the range, or just past its end */
+            if (addr - r->addr == r->len) {
+                r->len += TARGET_PAGE_SIZE;
+            }
+            goto merged;
+        }
+        if (addr + TARGET_PAGE_SIZE == r->addr) {
+            r->addr = addr;
+            r->len += TARGET_PAGE_SIZE;
+            goto merged;
+        }
+    }
+
+    if (cpu->tlb_flush_nb_ranges == CPU_TLB_FLUSH_RANGES) {
+        tlb_flush_coalesced_count++;
+        tlb_flush_queue_all(cpu);
+        return;
+    }
+    r = &cpu->tlb_flush_ranges[cpu->tlb_flush_nb_ranges++];
+    r->addr = addr;
+    r->len = TARGET_PAGE_SIZE;
+    return;
+
+merged:
+    tlb_flush_coalesced_count++;
+    if (r->len > TLB_FLUSH_RANGE_MAX_PAGES * TARGET_PAGE_SIZE) {
+        tlb_flush_queue_all(cpu);
+    }
+}
+
+void tlb_flush_page_async(CPUState *cpu, target_ulong addr)
+{
+    bool unlock;
+
+    if (tlb_flush_is_local(cpu)) {
+        tlb_flush_page(cpu, addr);
+        return;
+    }
+    unlock = tlb_flush_queue_lock();
+    tlb_flush_queue_page(cpu, addr);
+    qemu_cpu_kick(cpu);
+    if (unlock) {
+        qemu_mutex_unlock_iothread();
+    }
+}
+
+/* Perform the flushes queued for CPU.  Called by CPU itself before it
+   executes any code.  */
+void tlb_flush_drain(CPUState *cpu)
+{
+    int i;
+    bool unlock;
+    vaddr ofs;
+
+    if (!atomic_read(&cpu->tlb_flush_pending) &&
+        !atomic_read(&cpu->tlb_flush_nb_ranges)) {
+        return;
+    }
+
+    /* The queue is only emptied once the flushes are done, so that
+       tlb_flush_async_wait() can tell when they are.  */
+    unlock = tlb_flush_queue_lock();
+    if (cpu->tlb_flush_pending) {
+        tlb_flush(cpu, 1);
+    } else {
+        for (i = 0; i < cpu->tlb_flush_nb_ranges; i++) {
+            CPUTLBFlushRange *r = &cpu->tlb_flush_ranges[i];
+
+            for (ofs = 0; ofs < r->len; ofs += TARGET_PAGE_SIZE) {
+                tlb_flush_page(cpu, r->addr + ofs);
+            }
+        }
+    }
+    cpu->tlb_flush_pending = false;
+    cpu->tlb_flush_nb_ranges = 0;
+    if (qemu_tcg_mttcg_enabled()) {
+        qemu_tlb_flush_signal();
+    }
+    if (unlock) {
+        qemu_mutex_unlock_iothread();
+    }
+}
+
+/* Wait until every CPU executing guest code has done the flushes queued
+   for it, so that none translates through a stale entry afterwards.  A CPU
+   outside cpu_exec() drains its queue before it executes anything, so it
+   is not waited for.  The flushes queued for the current CPU are done while
+   waiting, since another CPU may be waiting for them in turn.  */
+void tlb_flush_async_wait(void)
+{
+    CPUState *cpu;
+    bool unlock;
+
+    if (!qemu_tcg_mttcg_enabled()) {
+        return;
+    }
+
+    unlock = tlb_flush_queue_lock();
+retry:
+    if (current_cpu) {
+        tlb_flush_drain(current_cpu);
+    }
+    CPU_FOREACH(cpu) {
+        if (cpu != current_cpu && cpu->tcg_executing &&
+            (cpu->tlb_flush_pending || cpu->tlb_flush_nb_ranges)) {
+            qemu_tlb_flush_wait();
+            goto retry;
+        }
+    }
+    if (unlock) {
+        qemu_mutex_unlock_iothread();
+    }
+}
+
 /* update the TLBs so that writes to code in the virtual page 'addr'
    can be detected */
 void tlb_protect_code(ram_addr_t ram_addr)
@@ -137,20 +423,28 @@ void tlb_unprotect_code_phys(CPUState *cpu, ram_addr_t ram_addr,
     cpu_physical_memory_set_dirty_flag(ram_addr, DIRTY_MEMORY_CODE);
 }
 
-static bool tlb_is_dirty_ram(CPUTLBEntry *tlbe)
+static bool tlb_is_dirty_ram(target_ulong addr_write)
 {
-    return (tlbe->addr_write & (TLB_INVALID_MASK|TLB_MMIO|TLB_NOTDIRTY)) == 0;
+    return (addr_write & (TLB_INVALID_MASK|TLB_MMIO|TLB_NOTDIRTY)) == 0;
 }
 
+/* With MTTCG this may run while the vCPU owning the entry refills it.
+   tlb_set_page_with_attrs() invalidates addr_write before it changes the
+   addend and stores the new addr_write last, so the entry is only updated
+   if addr_write did not change in the meantime.  */
 void tlb_reset_dirty_range(CPUTLBEntry *tlb_entry, uintptr_t start,
                            uintptr_t length)
 {
+    target_ulong addr_write = atomic_read(&tlb_entry->addr_write);
     uintptr_t addr;
 
-    if (tlb_is_dirty_ram(tlb_entry)) {
-        addr = (tlb_entry->addr_write & TARGET_PAGE_MASK) + tlb_entry->addend;
+    if (tlb_is_dirty_ram(addr_write)) {
+        smp_rmb();
+        addr = (addr_write & TARGET_PAGE_MASK)
+               + atomic_read(&tlb_entry->addend);
         if ((addr - start) < length) {
-            tlb_entry->addr_write |= TLB_NOTDIRTY;
+            atomic_cmpxchg(&tlb_entry->addr_write, addr_write,
+                           addr_write | TLB_NOTDIRTY);
         }
     }
 }
@@ -183,7 +477,7 @@ void cpu_tlb_reset_dirty_all(ram_addr_t start1, ram_addr_t length)
                                       start1, length);
             }
 
-            for (i = 0; i < CPU_VTLB_SIZE; i++) {
+            for (i = 0; i < vtlb_size(env, mmu_idx); i++) {
                 tlb_reset_dirty_range(&env->tlb_v_table[mmu_idx][i],
                                       start1, length);
             }
@@ -193,9 +487,7 @@ void cpu_tlb_reset_dirty_all(ram_addr_t start1, ram_addr_t length)
 
 static inline void tlb_set_dirty1(CPUTLBEntry *tlb_entry, target_ulong vaddr)
 {
-    if (tlb_entry->addr_write == (vaddr | TLB_NOTDIRTY)) {
-        tlb_entry->addr_write = vaddr;
-    }
+    atomic_cmpxchg(&tlb_entry->addr_write, vaddr | TLB_NOTDIRTY, vaddr);
 }
 
 /* update the TLB corresponding to virtual page vaddr
@@ -212,9 +504,11 @@ void tlb_set_dirty(CPUArchState *env, target_ulong vaddr)
     }
 
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        unsigned int set = vtlb_set(env, mmu_idx, vaddr);
         int k;
-        for (k = 0; k < CPU_VTLB_SIZE; k++) {
-            tlb_set_dirty1(&env->tlb_v_table[mmu_idx][k], vaddr);
+
+        for (k = 0; k < CPU_VTLB_WAYS; k++) {
+            tlb_set_dirty1(&env->tlb_v_table[mmu_idx][set + k], vaddr);
         }
     }
 }
@@ -242,6 +536,38 @@ static void tlb_add_large_page(CPUArchState *env, target_ulong vaddr,
     env->tlb_flush_mask = mask;
 }
 
+/* Move the translation in slot INDEX of the main tlb to the victim tlb,
+   rather than discarding it.  The slot is left unchanged.  */
+static void tlb_evict_to_vtlb(CPUArchState *env, int mmu_idx,
+                              unsigned int index)
+{
+    CPUTLBEntry *te = &env->tlb_table[mmu_idx][index];
+    CPUTLBEntry *vtlb;
+    unsigned int set, vidx;
+    int k;
+
+    if (tlb_entry_is_empty(te)) {
+        return;
+    }
+
+    /* prefer a free way, otherwise replace round-robin */
+    set = vtlb_set(env, mmu_idx, tlb_entry_vaddr(te));
+    vidx = set + env->vtlb_index++ % CPU_VTLB_WAYS;
+    for (k = 0; k < CPU_VTLB_WAYS; k++) {
+        if (tlb_entry_is_empty(&env->tlb_v_table[mmu_idx][set + k])) {
+            vidx = set + k;
+            break;
+        }
+    }
+
+    vtlb = &env->tlb_v_table[mmu_idx][vidx];
+    if (tlb_entry_is_empty(vtlb)) {
+        env->vtlb_used[mmu_idx]++;
+    }
+    *vtlb = *te;
+    env->iotlb_v[mmu_idx][vidx] = env->iotlb[mmu_idx][index];
+}
+
 /* Add a new TLB entry. At most one entry for a given virtual address
  * is permitted. Only a single TARGET_PAGE_SIZE region is mapped, the
  * supplied size is only used by tlb_flush_page.
@@ -258,10 +584,10 @@ void tlb_set_page_with_attrs(CPUState *cpu, target_ulong vaddr,
     unsigned int index;
     target_ulong address;
     target_ulong code_address;
+    target_ulong addr_write;
     uintptr_t addend;
     CPUTLBEntry *te;
     hwaddr iotlb, xlat, sz;
-    unsigned vidx = env->vtlb_index++ % CPU_VTLB_SIZE;
 
     assert(size >= TARGET_PAGE_SIZE);
     if (size != TARGET_PAGE_SIZE) {
@@ -297,10 +623,12 @@ void tlb_set_page_with_attrs(CPUState *cpu, target_ulong vaddr,
     te = &env->tlb_table[mmu_idx][index];
 
     /* do not discard the translation in te, evict it into a victim tlb */
-    env->tlb_v_table[mmu_idx][vidx] = *te;
-    env->iotlb_v[mmu_idx][vidx] = env->iotlb[mmu_idx][index];
+    tlb_evict_to_vtlb(env, mmu_idx, index);
+    env->tlb_clean_modes &= ~(1 << mmu_idx);
 
-    /* refill the tlb */
+    /* refill the tlb; see tlb_reset_dirty_range() for the ordering */
+    atomic_set(&te->addr_write, -1);
+    smp_wmb();
     env->iotlb[mmu_idx][index].addr = iotlb - vaddr;
     env->iotlb[mmu_idx][index].attrs = attrs;
     te->addend = addend - vaddr;
@@ -319,16 +647,16 @@ void tlb_set_page_with_attrs(CPUState *cpu, target_ulong vaddr,
         if ((memory_region_is_ram(section->mr) && section->readonly)
             || memory_region_is_romd(section->mr)) {
             /* Write access calls the I/O callback.  */
-            te->addr_write = address | TLB_MMIO;
+            addr_write = address | TLB_MMIO;
         } else if (memory_region_is_ram(section->mr)
                    && cpu_physical_memory_is_clean(section->mr->ram_addr
                                                    + xlat)) {
-            te->addr_write = address | TLB_NOTDIRTY;
+            addr_write = address | TLB_NOTDIRTY;
         } else {
-            te->addr_write = address;
+            addr_write = address;
         }
-    } else {
-        te->addr_write = -1;
+        smp_wmb();
+        atomic_set(&te->addr_write, addr_write);
     }
 }
 
@@ -377,6 +705,73 @@ tb_page_addr_t get_page_addr_code(CPUArchState *env1, target_ulong addr)
     return qemu_ram_addr_from_host_nofail(p);
 }
 
+/* Called on a miss in the main tlb.  If page PAGE is in the victim tlb,
+   with the field at ELT_OFS of the entry matching, swap it into slot
+   INDEX of the main tlb and return true.  */
+static bool victim_tlb_hit(CPUArchState *env, int mmu_idx, unsigned int index,
+                           size_t elt_ofs, target_ulong page)
+{
+    unsigned int set = vtlb_set(env, mmu_idx, page);
+    int k;
+
+    for (k = 0; k < CPU_VTLB_WAYS; k++) {
+        CPUTLBEntry *vtlb = &env->tlb_v_table[mmu_idx][set + k];
+        target_ulong cmp = *(target_ulong *)((uintptr_t)vtlb + elt_ofs);
+
+        if (cmp == page) {
+            CPUTLBEntry tmptlb = *vtlb;
+            CPUIOTLBEntry tmpiotlb = env->iotlb_v[mmu_idx][set + k];
+
+            /* The old main entry may belong to another set, so free this
+               way and evict it normally.  */
+            memset(vtlb, -1, sizeof(*vtlb));
+            env->vtlb_used[mmu_idx]--;
+            tlb_evict_to_vtlb(env, mmu_idx, index);
+            env->tlb_table[mmu_idx][index] = tmptlb;
+            env->iotlb[mmu_idx][index] = tmpiotlb;
+            env->tlb_stats[mmu_idx].victim_hits++;
+            return true;
+        }
+    }
+    env->tlb_stats[mmu_idx].victim_misses++;
+    return false;
+}
+
+void tlb_dump_statistics(FILE *f, fprintf_function cpu_fprintf)
+{
+    CPUState *cpu;
+    int mmu_idx;
+
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        CPUTLBStats sum = { 0 };
+        unsigned int max_size = 0;
+        uint64_t lookups;
+
+        CPU_FOREACH(cpu) {
+            CPUArchState *env = cpu->env_ptr;
+            CPUTLBStats *st = &env->tlb_stats[mmu_idx];
+
+            sum.victim_hits += st->victim_hits;
+            sum.victim_misses += st->victim_misses;
+            sum.flushes += st->flushes;
+            sum.page_flushes += st->page_flushes;
+            sum.resizes += st->resizes;
+            max_size = MAX(max_size, vtlb_size(env, mmu_idx));
+        }
+        lookups = sum.victim_hits + sum.victim_misses;
+        if (lookups == 0 && sum.flushes == 0) {
+            continue;
+        }
+        cpu_fprintf(f, "TLB mode %d          %" PRIu64 " misses, %0.2f%% "
+                    "in victim tlb (%u entries max, %" PRIu64 " resizes)\n",
+                    mmu_idx, lookups,
+                    lookups ? (double)sum.victim_hits / lookups * 100 : 0,
+                    max_size, sum.resizes);
+        cpu_fprintf(f, "                    %" PRIu64 " flushes, %" PRIu64
+                    " page flushes\n", sum.flushes, sum.page_flushes);
+    }
+}
+
 #define MMUSUFFIX _mmu
 
 #define SHIFT 0
@@ -25,6 +25,7 @@
 #include "qapi/opts-visitor.h"
 #include "qapi/string-output-visitor.h"
 #include "qapi-visit.h"
+#include "qapi/util.h"
 #include "ui/console.h"
 #include "block/qapi.h"
 #include "qemu-io.h"
@@ -203,6 +204,19 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
             monitor_printf(mon, "dirty pages rate: %" PRIu64 " pages\n",
                            info->ram->dirty_pages_rate);
         }
+        if (info->ram->has_copied_bytes) {
+            monitor_printf(mon, "copied bytes: %" PRIu64 " kbytes\n",
+                           info->ram->copied_bytes >> 10);
+            monitor_printf(mon, "zero-copy sends: %" PRIu64 "\n",
+                           info->ram->zero_copy_sends);
+            monitor_printf(mon, "zero-copy fallbacks: %" PRIu64 "\n",
+                           info->ram->zero_copy_fallbacks);
+        }
+    }
+
+    if (info->has_x_cpu_throttle_percentage) {
+        monitor_printf(mon, "cpu throttle percentage: %" PRIu64 "\n",
+                       info->x_cpu_throttle_percentage);
     }
 
     if (info->has_disk) {
@@ -227,6 +241,8 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->xbzrle_cache->cache_miss_rate);
         monitor_printf(mon, "xbzrle overflow : %" PRIu64 "\n",
                        info->xbzrle_cache->overflow);
+        monitor_printf(mon, "xbzrle suggested cache size: %" PRIu64
+                       " bytes\n", info->xbzrle_cache->suggested_cache_size);
     }
 
     qapi_free_MigrationInfo(info);
@@ -269,6 +285,24 @@ void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, " %s: %" PRId64,
             MigrationParameter_lookup[MIGRATION_PARAMETER_DECOMPRESS_THREADS],
             params->decompress_threads);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_X_MULTIFD_CHANNELS],
+            params->x_multifd_channels);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_X_CPU_THROTTLE_INITIAL],
+            params->x_cpu_throttle_initial);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_X_CPU_THROTTLE_INCREMENT],
+            params->x_cpu_throttle_increment);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_X_CPU_THROTTLE_MAX],
+            params->x_cpu_throttle_max);
+        monitor_printf(mon, " %s: %s",
+            MigrationParameter_lookup[MIGRATION_PARAMETER_X_COMPRESS_METHOD],
+            MigrationCompressMethod_lookup[params->x_compress_method]);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_X_VMSTATE_THREADS],
+            params->x_vmstate_threads);
         monitor_printf(mon, "\n");
     }
 
@@ -1141,6 +1175,14 @@ void hmp_migrate_cancel(Monitor *mon, const QDict *qdict)
     qmp_migrate_cancel(NULL);
 }
 
+void hmp_migrate_start_postcopy(Monitor *mon, const QDict *qdict)
+{
+    Error *err = NULL;
+
+    qmp_migrate_start_postcopy(&err);
+    hmp_handle_error(mon, &err);
+}
+
 void hmp_migrate_incoming(Monitor *mon, const QDict *qdict)
 {
     Error *err = NULL;
@@ -1211,15 +1253,39 @@ void hmp_migrate_set_capability(Monitor *mon, const QDict *qdict)
 void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
 {
     const char *param = qdict_get_str(qdict, "parameter");
-    int value = qdict_get_int(qdict, "value");
+    const char *valuestr = qdict_get_str(qdict, "value");
+    int value = 0;
+    MigrationCompressMethod x_compress_method = MIGRATION_COMPRESS_METHOD_ZLIB;
+    char *end;
     Error *err = NULL;
     bool has_compress_level = false;
     bool has_compress_threads = false;
     bool has_decompress_threads = false;
+    bool has_x_multifd_channels = false;
+    bool has_x_cpu_throttle_initial = false;
+    bool has_x_cpu_throttle_increment = false;
+    bool has_x_cpu_throttle_max = false;
+    bool has_x_compress_method = false;
+    bool has_x_vmstate_threads = false;
     int i;
 
     for (i = 0; i < MIGRATION_PARAMETER_MAX; i++) {
         if (strcmp(param, MigrationParameter_lookup[i]) == 0) {
+            if (i == MIGRATION_PARAMETER_X_COMPRESS_METHOD) {
+                x_compress_method =
+                    qapi_enum_parse(MigrationCompressMethod_lookup, valuestr,
+                                    MIGRATION_COMPRESS_METHOD_MAX, -1, &err);
+                if (err) {
+                    break;
+                }
+            } else {
+                value = strtol(valuestr, &end, 0);
+                if (!*valuestr || *end) {
+                    error_set(&err, QERR_INVALID_PARAMETER_VALUE, param,
+                              "an integer");
+                    break;
+                }
+            }
             switch (i) {
             case MIGRATION_PARAMETER_COMPRESS_LEVEL:
                 has_compress_level = true;
@@ -1230,10 +1296,34 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
             case MIGRATION_PARAMETER_DECOMPRESS_THREADS:
                 has_decompress_threads = true;
                 break;
+            case MIGRATION_PARAMETER_X_MULTIFD_CHANNELS:
+                has_x_multifd_channels = true;
+                break;
+            case MIGRATION_PARAMETER_X_CPU_THROTTLE_INITIAL:
+                has_x_cpu_throttle_initial = true;
+                break;
+            case MIGRATION_PARAMETER_X_CPU_THROTTLE_INCREMENT:
+                has_x_cpu_throttle_increment = true;
+                break;
+            case MIGRATION_PARAMETER_X_CPU_THROTTLE_MAX:
+                has_x_cpu_throttle_max = true;
+                break;
+            case MIGRATION_PARAMETER_X_COMPRESS_METHOD:
+                has_x_compress_method = true;
+                break;
+            case MIGRATION_PARAMETER_X_VMSTATE_THREADS:
+                has_x_vmstate_threads = true;
+                break;
             }
             qmp_migrate_set_parameters(has_compress_level, value,
                                        has_compress_threads, value,
                                        has_decompress_threads, value,
+                                       has_x_multifd_channels, value,
+                                       has_x_cpu_throttle_initial, value,
+                                       has_x_cpu_throttle_increment, value,
+                                       has_x_cpu_throttle_max, value,
+                                       has_x_compress_method, x_compress_method,
+                                       has_x_vmstate_threads, value,
                                        &err);
             break;
         }
@@ -1455,9 +1545,11 @@ void hmp_migrate(Monitor *mon, const QDict *qdict)
     int blk = qdict_get_try_bool(qdict, "blk", 0);
     int inc = qdict_get_try_bool(qdict, "inc", 0);
     const char *uri = qdict_get_str(qdict, "uri");
+    const char *bitmap = qdict_get_try_str(qdict, "bitmap");
     Error *err = NULL;
 
-    qmp_migrate(uri, !!blk, blk, !!inc, inc, false, false, &err);
+    qmp_migrate(uri, !!blk, blk, !!inc, inc, false, false,
+                !!bitmap, bitmap, &err);
     if (err) {
         monitor_printf(mon, "migrate: %s\n", error_get_pretty(err));
         error_free(err);
@@ -26,6 +26,24 @@
 #include "hw/virtio/virtio-bus.h"
 #include "qom/object_interfaces.h"
 
+/* Per-virtqueue state.  Note that host_notifier is assigned by value.  This
+ * is fine as long as you do not call event_notifier_cleanup on it (because
+ * you don't own the file descriptor or handle; you just use it).
+ *
+ * Requests are popped in the queue's AioContext, but complete in the
+ * BlockBackend's AioContext, so the vring is protected by a lock.
+ */
+typedef struct {
+    VirtIOBlockDataPlane *s;
+    VirtQueue *vq;
+    AioContext *ctx;                /* where the vring is processed */
+    QemuMutex lock;                 /* protects vring */
+    Vring vring;                    /* virtqueue vring */
+    EventNotifier *guest_notifier;  /* irq */
+    EventNotifier host_notifier;    /* doorbell */
+    QEMUBH *bh;                     /* bh for guest notification */
+} VirtIOBlockDataPlaneQueue;
+
 struct VirtIOBlockDataPlane {
     bool started;
     bool starting;
@@ -35,19 +53,19 @@ struct VirtIOBlockDataPlane {
     VirtIOBlkConf *conf;
 
     VirtIODevice *vdev;
-    Vring vring;                    /* virtqueue vring */
-    EventNotifier *guest_notifier;  /* irq */
-    QEMUBH *bh;                     /* bh for guest notification */
+    VirtIOBlockDataPlaneQueue *queues;
+    unsigned num_queues;
 
-    /* Note that these EventNotifiers are assigned by value.  This is
-     * fine as long as you do not call event_notifier_cleanup on them
-     * (because you don't own the file descriptor or handle; you just
-     * use it).
+    /* The BlockBackend is used from the AioContext of iothread.  Queue i is
+     * processed by iothreads[i % num_iothreads] if the iothreads property is
+     * set, or by iothread otherwise.  Queues in other AioContexts acquire
+     * the BlockBackend's one to submit requests.
      */
     IOThread *iothread;
     IOThread internal_iothread_obj;
     AioContext *ctx;
-    EventNotifier host_notifier;    /* doorbell */
+    IOThread **iothreads;
+    unsigned num_iothreads;
 
     /* Operation blocker on BDS */
     Error *blocker;
@@ -56,57 +74,68 @@ struct VirtIOBlockDataPlane {
 };
 
 /* Raise an interrupt to signal guest, if necessary */
-static void notify_guest(VirtIOBlockDataPlane *s)
+static void notify_guest(VirtIOBlockDataPlaneQueue *q)
 {
-    if (!vring_should_notify(s->vdev, &s->vring)) {
+    if (!vring_should_notify(q->s->vdev, &q->vring)) {
         return;
     }
 
-    event_notifier_set(s->guest_notifier);
+    event_notifier_set(q->guest_notifier);
 }
 
 static void notify_guest_bh(void *opaque)
 {
-    VirtIOBlockDataPlane *s = opaque;
+    VirtIOBlockDataPlaneQueue *q = opaque;
 
-    notify_guest(s);
+    qemu_mutex_lock(&q->lock);
+    notify_guest(q);
+    qemu_mutex_unlock(&q->lock);
 }
 
 static void complete_request_vring(VirtIOBlockReq *req, unsigned char status)
 {
     VirtIOBlockDataPlane *s = req->dev->dataplane;
+    VirtIOBlockDataPlaneQueue *q;
+
+    q = &s->queues[virtio_get_queue_index(req->vq)];
+
     stb_p(&req->in->status, status);
 
-    vring_push(s->vdev, &req->dev->dataplane->vring, &req->elem, req->in_len);
+    qemu_mutex_lock(&q->lock);
+    vring_push(s->vdev, &q->vring, &req->elem, req->in_len);
+    qemu_mutex_unlock(&q->lock);
 
     /* Suppress notification to guest by BH and its scheduled
      * flag because requests are completed as a batch after io
      * plug & unplug is introduced, and the BH can still be
      * executed in dataplane aio context even after it is
      * stopped, so needn't worry about notification loss with BH.
+     * The BH runs in the queue's AioContext, which need not be the
+     * one that completed the request.
      */
-    qemu_bh_schedule(s->bh);
+    qemu_bh_schedule(q->bh);
 }
 
-static void handle_notify(EventNotifier *e)
+static void process_vring(VirtIOBlockDataPlaneQueue *q)
 {
-    VirtIOBlockDataPlane *s = container_of(e, VirtIOBlockDataPlane,
-                                           host_notifier);
+    VirtIOBlockDataPlane *s = q->s;
     VirtIOBlock *vblk = VIRTIO_BLK(s->vdev);
 
-    event_notifier_test_and_clear(&s->host_notifier);
-    blk_io_plug(s->conf->conf.blk);
     for (;;) {
         MultiReqBuffer mrb = {};
+        VirtIOBlockReq *reqs = NULL, **tail = &reqs;
+        bool done;
         int ret;
 
+        qemu_mutex_lock(&q->lock);
+
         /* Disable guest->host notifies to avoid unnecessary vmexits */
-        vring_disable_notification(s->vdev, &s->vring);
+        vring_disable_notification(s->vdev, &q->vring);
 
         for (;;) {
-            VirtIOBlockReq *req = virtio_blk_alloc_request(vblk);
+            VirtIOBlockReq *req = virtio_blk_alloc_request(vblk, q->vq);
 
-            ret = vring_pop(s->vdev, &s->vring, &req->elem);
+            ret = vring_pop(s->vdev, &q->vring, &req->elem);
             if (ret < 0) {
                 virtio_blk_free_request(req);
                 break; /* no more requests */
@@ -115,26 +144,72 @@ static void handle_notify(EventNotifier *e)
             trace_virtio_blk_data_plane_process_request(s, req->elem.out_num,
                                                         req->elem.in_num,
                                                         req->elem.index);
+            *tail = req;
+            tail = &req->next;
+        }
+
+        qemu_mutex_unlock(&q->lock);
+
+        /* Requests may complete right away, which takes q->lock again */
+        if (q->ctx != s->ctx) {
+            aio_context_acquire(s->ctx);
+        }
+        blk_io_plug(s->conf->conf.blk);
+        while (reqs) {
+            VirtIOBlockReq *req = reqs;
 
+            reqs = req->next;
+            req->next = NULL;
             virtio_blk_handle_request(req, &mrb);
         }
 
         if (mrb.num_reqs) {
             virtio_blk_submit_multireq(s->conf->conf.blk, &mrb);
         }
+        blk_io_unplug(s->conf->conf.blk);
+        if (q->ctx != s->ctx) {
+            aio_context_release(s->ctx);
+        }
 
         if (likely(ret == -EAGAIN)) { /* vring emptied */
             /* Re-enable guest->host notifies and stop processing the vring.
              * But if the guest has snuck in more descriptors, keep processing.
              */
-            if (vring_enable_notification(s->vdev, &s->vring)) {
+            qemu_mutex_lock(&q->lock);
+            done = vring_enable_notification(s->vdev, &q->vring);
+            qemu_mutex_unlock(&q->lock);
+            if (done) {
                 break;
             }
         } else { /* fatal error */
             break;
         }
     }
-    blk_io_unplug(s->conf->conf.blk);
+}
+
+static void handle_notify(EventNotifier *e)
+{
+    VirtIOBlockDataPlaneQueue *q = container_of(e, VirtIOBlockDataPlaneQueue,
+                                                host_notifier);
+
+    event_notifier_test_and_clear(&q->host_notifier);
+    process_vring(q);
+}
+
+/* Called repeatedly while the iothread is polling: look for new requests
+ * in the vring without waiting for the guest's kick.
+ */
+static bool handle_notify_poll(void *opaque)
+{
+    EventNotifier *e = opaque;
+    VirtIOBlockDataPlaneQueue *q = container_of(e, VirtIOBlockDataPlaneQueue,
+                                                host_notifier);
+
+    if (!vring_more_avail(q->s->vdev, &q->vring)) {
+        return false;
+    }
+    process_vring(q);
+    return true;
 }
 
 /* Context: QEMU global mutex held */
@@ -144,12 +219,18 @@ void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
 {
     VirtIOBlockDataPlane *s;
     Error *local_err = NULL;
+    unsigned i;
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
 
     *dataplane = NULL;
 
-    if (!conf->data_plane && !conf->iothread) {
+    if (!conf->data_plane && !conf->iothread && !conf->iothreads) {
+        return;
+    }
+
+    if (conf->iothread && conf->iothreads) {
+        error_setg(errp, "iothread and iothreads may not be used together");
         return;
     }
 
@@ -175,8 +256,30 @@ void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
     s = g_new0(VirtIOBlockDataPlane, 1);
     s->vdev = vdev;
     s->conf = conf;
-
-    if (conf->iothread) {
+    s->num_queues = conf->num_queues;
+
+    if (conf->iothreads) {
+        char **ids = g_strsplit(conf->iothreads, ":", 0);
+
+        s->num_iothreads = g_strv_length(ids);
+        s->iothreads = g_new0(IOThread *, s->num_iothreads);
+        for (i = 0; i < s->num_iothreads; i++) {
+            s->iothreads[i] = iothread_find(ids[i]);
+            if (!s->iothreads[i]) {
+                error_setg(errp, "iothread '%s' not found", ids[i]);
+                g_strfreev(ids);
+                goto fail_iothreads;
+            }
+            object_ref(OBJECT(s->iothreads[i]));
+        }
+        g_strfreev(ids);
+        if (!s->num_iothreads) {
+            error_setg(errp, "iothreads property is empty");
+            goto fail_iothreads;
+        }
+        s->iothread = s->iothreads[0];
+        object_ref(OBJECT(s->iothread));
+    } else if (conf->iothread) {
         s->iothread = conf->iothread;
         object_ref(OBJECT(s->iothread));
     } else {
@@ -191,7 +294,21 @@ void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
         s->iothread = &s->internal_iothread_obj;
     }
     s->ctx = iothread_get_aio_context(s->iothread);
-    s->bh = aio_bh_new(s->ctx, notify_guest_bh, s);
+
+    s->queues = g_new0(VirtIOBlockDataPlaneQueue, s->num_queues);
+    for (i = 0; i < s->num_queues; i++) {
+        VirtIOBlockDataPlaneQueue *q = &s->queues[i];
+
+        q->s = s;
+        if (s->num_iothreads) {
+            q->ctx = iothread_get_aio_context(
+                s->iothreads[i % s->num_iothreads]);
+        } else {
+            q->ctx = s->ctx;
+        }
+        qemu_mutex_init(&q->lock);
+        q->bh = aio_bh_new(q->ctx, notify_guest_bh, q);
+    }
 
     error_setg(&s->blocker, "block device is in use by data plane");
     blk_op_block_all(conf->conf.blk, s->blocker);
@@ -211,11 +328,21 @@ void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
     blk_op_unblock(conf->conf.blk, BLOCK_OP_TYPE_REPLACE, s->blocker);
 
     *dataplane = s;
+    return;
+
+fail_iothreads:
+    while (i--) {
+        object_unref(OBJECT(s->iothreads[i]));
+    }
+    g_free(s->iothreads);
+    g_free(s);
 }
 
 /* Context: QEMU global mutex held */
 void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
 {
+    unsigned i;
+
     if (!s) {
         return;
     }
@@ -223,8 +350,16 @@ void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
     virtio_blk_data_plane_stop(s);
     blk_op_unblock_all(s->conf->conf.blk, s->blocker);
     error_free(s->blocker);
+    for (i = 0; i < s->num_queues; i++) {
+        qemu_bh_delete(s->queues[i].bh);
+        qemu_mutex_destroy(&s->queues[i].lock);
+    }
     object_unref(OBJECT(s->iothread));
-    qemu_bh_delete(s->bh);
+    for (i = 0; i < s->num_iothreads; i++) {
+        object_unref(OBJECT(s->iothreads[i]));
+    }
+    g_free(s->iothreads);
+    g_free(s->queues);
     g_free(s);
 }
 
@@ -234,7 +369,7 @@ void virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(s->vdev)));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
     VirtIOBlock *vblk = VIRTIO_BLK(s->vdev);
-    VirtQueue *vq;
+    unsigned i, nvqs = s->num_queues;
     int r;
 
     if (s->started || s->disabled) {
@@ -247,27 +382,36 @@ void virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
 
     s->starting = true;
 
-    vq = virtio_get_queue(s->vdev, 0);
-    if (!vring_setup(&s->vring, s->vdev, 0)) {
-        goto fail_vring;
+    for (i = 0; i < nvqs; i++) {
+        s->queues[i].vq = virtio_get_queue(s->vdev, i);
+        if (!vring_setup(&s->queues[i].vring, s->vdev, i)) {
+            goto fail_vring;
+        }
     }
 
     /* Set up guest notifier (irq) */
-    r = k->set_guest_notifiers(qbus->parent, 1, true);
+    r = k->set_guest_notifiers(qbus->parent, nvqs, true);
     if (r != 0) {
         fprintf(stderr, "virtio-blk failed to set guest notifier (%d), "
                 "ensure -enable-kvm is set\n", r);
         goto fail_guest_notifiers;
     }
-    s->guest_notifier = virtio_queue_get_guest_notifier(vq);
+    for (i = 0; i < nvqs; i++) {
+        s->queues[i].guest_notifier =
+            virtio_queue_get_guest_notifier(s->queues[i].vq);
+    }
 
     /* Set up virtqueue notify */
-    r = k->set_host_notifier(qbus->parent, 0, true);
-    if (r != 0) {
-        fprintf(stderr, "virtio-blk failed to set host notifier (%d)\n", r);
-        goto fail_host_notifier;
+    for (i = 0; i < nvqs; i++) {
+        r = k->set_host_notifier(qbus->parent, i, true);
+        if (r != 0) {
+            fprintf(stderr, "virtio-blk failed to set host notifier (%d)\n",
+                    r);
+            goto fail_host_notifier;
+        }
+        s->queues[i].host_notifier =
+            *virtio_queue_get_host_notifier(s->queues[i].vq);
     }
-    s->host_notifier = *virtio_queue_get_host_notifier(vq);
 
     s->saved_complete_request = vblk->complete_request;
     vblk->complete_request = complete_request_vring;
@@ -279,20 +423,39 @@ void virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
     blk_set_aio_context(s->conf->conf.blk, s->ctx);
 
     /* Kick right away to begin processing requests already in vring */
-    event_notifier_set(virtio_queue_get_host_notifier(vq));
+    for (i = 0; i < nvqs; i++) {
+        event_notifier_set(virtio_queue_get_host_notifier(s->queues[i].vq));
+    }
 
     /* Get this show started by hooking up our callbacks */
-    aio_context_acquire(s->ctx);
-    aio_set_event_notifier(s->ctx, &s->host_notifier, handle_notify);
-    aio_context_release(s->ctx);
+    for (i = 0; i < nvqs; i++) {
+        VirtIOBlockDataPlaneQueue *q = &s->queues[i];
+
+        aio_context_acquire(q->ctx);
+        aio_set_event_notifier(q->ctx, &q->host_notifier, handle_notify);
+        aio_set_event_notifier_poll(q->ctx, &q->host_notifier,
+                                    handle_notify_poll);
+        aio_context_release(q->ctx);
+    }
     return;
 
   fail_host_notifier:
-    k->set_guest_notifiers(qbus->parent, 1, false);
+    while (i--) {
+        k->set_host_notifier(qbus->parent, i, false);
+    }
+    k->set_guest_notifiers(qbus->parent, nvqs, false);
   fail_guest_notifiers:
-    vring_teardown(&s->vring, s->vdev, 0);
+    for (i = 0; i < nvqs; i++) {
+        vring_teardown(&s->queues[i].vring, s->vdev, i);
+    }
     s->disabled = true;
+    s->starting = false;
+    return;
+
   fail_vring:
+    while (i--) {
+        vring_teardown(&s->queues[i].vring, s->vdev, i);
+    }
     s->starting = false;
 }
 
@@ -302,6 +465,7 @@ void virtio_blk_data_plane_stop(VirtIOBlockDataPlane *s)
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(s->vdev)));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
     VirtIOBlock *vblk = VIRTIO_BLK(s->vdev);
+    unsigned i;
 
 
     /* Better luck next time. */
@@ -316,26 +480,51 @@ void virtio_blk_data_plane_stop(VirtIOBlockDataPlane *s)
     vblk->complete_request = s->saved_complete_request;
     trace_virtio_blk_data_plane_stop(s);
 
-    aio_context_acquire(s->ctx);
+    /* Stop notifications for new requests from guest.  Once this returns
+     * the queue's iothread is not processing the vring anymore.
+     */
+    for (i = 0; i < s->num_queues; i++) {
+        VirtIOBlockDataPlaneQueue *q = &s->queues[i];
 
-    /* Stop notifications for new requests from guest */
-    aio_set_event_notifier(s->ctx, &s->host_notifier, NULL);
+        aio_context_acquire(q->ctx);
+        aio_set_event_notifier(q->ctx, &q->host_notifier, NULL);
+        aio_context_release(q->ctx);
+    }
 
     /* Drain and switch bs back to the QEMU main loop */
+    aio_context_acquire(s->ctx);
     blk_set_aio_context(s->conf->conf.blk, qemu_get_aio_context());
 
     aio_context_release(s->ctx);
 
-    /* Sync vring state back to virtqueue so that non-dataplane request
-     * processing can continue when we disable the host notifier below.
-     */
-    vring_teardown(&s->vring, s->vdev, 0);
+    for (i = 0; i < s->num_queues; i++) {
+        /* Sync vring state back to virtqueue so that non-dataplane request
+         * processing can continue when we disable the host notifier below.
+         */
+        vring_teardown(&s->queues[i].vring, s->vdev, i);
 
-    k->set_host_notifier(qbus->parent, 0, false);
+        k->set_host_notifier(qbus->parent, i, false);
+    }
 
     /* Clean up guest notifier (irq) */
-    k->set_guest_notifiers(qbus->parent, 1, false);
+    k->set_guest_notifiers(qbus->parent, s->num_queues, false);
 
     s->started = false;
     s->stopping = false;
 }
+
+/* Hand a guest kick that did not go through the host notifier over to the
+ * iothread of its queue.  Returns false if dataplane is not running, in
+ * which case the caller processes the queue itself.
+ *
+ * Context: QEMU global mutex held
+ */
+bool virtio_blk_data_plane_notify(VirtIOBlockDataPlane *s, VirtQueue *vq)
+{
+    if (!s->started) {
+        return false;
+    }
+
+    event_notifier_set(&s->queues[virtio_get_queue_index(vq)].host_notifier);
+    return true;
+}
@@ -47,6 +47,7 @@ void qemu_aio_ref(void *p);
 typedef struct AioHandler AioHandler;
 typedef void QEMUBHFunc(void *opaque);
 typedef void IOHandler(void *opaque);
+typedef bool AioPollFn(void *opaque);
 
 struct AioContext {
     GSource source;
@@ -87,11 +88,57 @@ struct AioContext {
 
     /* TimerLists for calling timers - one per clock type */
     QEMUTimerListGroup tlg;
+
+    /* epoll(7) set mirroring aio_handlers, used by aio_poll() instead of
+     * ppoll once there are many handlers.  epoll_available is cleared
+     * for good if an fd cannot be added to the set.
+     */
+    int epollfd;
+    bool epoll_enabled;
+    bool epoll_available;
+
+    /* Adaptive polling.  A blocking aio_poll() first spins for up to
+     * poll_ns nanoseconds on the handlers' io_poll callbacks, and only
+     * then blocks in the kernel.  poll_ns is grown or shrunk after each
+     * wait depending on how long the wait turned out to be, and never
+     * exceeds poll_max_ns; a poll_max_ns of zero disables polling.
+     */
+    int64_t poll_max_ns;
+    int64_t poll_ns;
+    int64_t poll_grow;          /* polling time growth factor */
+    int64_t poll_shrink;        /* polling time shrink factor */
+    int poll_handlers;          /* number of handlers with io_poll */
+
+    /* Set by aio_notify() while aio_poll() may be waiting, so that a
+     * polling aio_poll() stops spinning.
+     */
+    bool notified;
+
+    /* Polling statistics */
+    uint64_t poll_hits;         /* spins that found work */
+    uint64_t poll_misses;       /* spins that timed out */
+    uint64_t poll_sleeps;       /* waits that blocked in the kernel */
 };
 
 /* Used internally to synchronize aio_poll against qemu_bh_schedule.  */
 void aio_set_dispatching(AioContext *ctx, bool dispatching);
 
+/**
+ * aio_context_setup:
+ * @ctx: the aio context
+ *
+ * Initialize the aio context's platform-specific polling state.
+ */
+void aio_context_setup(AioContext *ctx);
+
+/**
+ * aio_context_destroy:
+ * @ctx: the aio context
+ *
+ * Release what aio_context_setup() allocated.
+ */
+void aio_context_destroy(AioContext *ctx);
+
 /**
  * aio_context_new: Allocate a new AioContext.
  *
@@ -264,6 +311,22 @@ void aio_set_event_notifier(AioContext *ctx,
                             EventNotifier *notifier,
                             EventNotifierHandler *io_read);
 
+/* Set a polling callback for a file descriptor that is already registered
+ * with aio_set_fd_handler.  While an AioContext is polling (see
+ * aio_context_set_poll_params), @io_poll is called repeatedly with the
+ * handler's opaque pointer instead of waiting for the file descriptor to
+ * become ready.  It should check for new work without blocking, process
+ * it, and return true if it did anything.  Pass NULL to stop polling.
+ */
+void aio_set_fd_poll(AioContext *ctx, int fd, AioPollFn *io_poll);
+
+/* Like aio_set_fd_poll, for a registered event notifier.  @io_poll is
+ * called with the notifier as its argument.
+ */
+void aio_set_event_notifier_poll(AioContext *ctx,
+                                 EventNotifier *notifier,
+                                 AioPollFn *io_poll);
+
 /* Return a GSource that lets the main loop poll the file descriptors attached
  * to this AioContext.
  */
@@ -323,4 +386,18 @@ static inline void aio_timer_init(AioContext *ctx,
  */
 int64_t aio_compute_timeout(AioContext *ctx);
 
+/**
+ * aio_context_set_poll_params:
+ * @ctx: the aio context
+ * @max_ns: how long to spin on io_poll callbacks at most, 0 disables polling
+ * @grow: factor by which to grow the polling time, 0 selects the default
+ * @shrink: factor by which to shrink the polling time, 0 means reset to 0
+ * @errp: error object
+ *
+ * Configure adaptive polling of the aio context.
+ */
+void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
+                                 int64_t grow, int64_t shrink,
+                                 Error **errp);
+
 #endif
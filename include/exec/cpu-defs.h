@@ -72,8 +72,14 @@ typedef uint64_t target_ulong;
 #if !defined(CONFIG_USER_ONLY)
 #define CPU_TLB_BITS 8
 #define CPU_TLB_SIZE (1 << CPU_TLB_BITS)
-/* use a fully associative victim tlb of 8 entries */
-#define CPU_VTLB_SIZE 8
+/* The victim tlb is set associative.  Each MMU mode starts with
+   CPU_VTLB_MIN_SETS sets and grows (or shrinks back) at flush time,
+   up to CPU_VTLB_MAX_SIZE entries, depending on how full it became.  */
+#define CPU_VTLB_WAYS 4
+#define CPU_VTLB_MIN_SETS 2
+#define CPU_VTLB_MAX_SHIFT 6
+#define CPU_VTLB_MAX_SIZE \
+    (CPU_VTLB_WAYS * (CPU_VTLB_MIN_SETS << CPU_VTLB_MAX_SHIFT))
 
 #if HOST_LONG_BITS == 32 && TARGET_LONG_BITS == 32
 #define CPU_TLB_ENTRY_BITS 4
@@ -113,15 +119,30 @@ typedef struct CPUIOTLBEntry {
     MemTxAttrs attrs;
 } CPUIOTLBEntry;
 
+typedef struct CPUTLBStats {
+    uint64_t victim_hits;       /* fast path misses served by the vtlb */
+    uint64_t victim_misses;     /* fast path misses that walk the MMU */
+    uint64_t flushes;
+    uint64_t page_flushes;
+    uint64_t resizes;
+} CPUTLBStats;
+
 #define CPU_COMMON_TLB \
     /* The meaning of the MMU modes is defined in the target code. */   \
     CPUTLBEntry tlb_table[NB_MMU_MODES][CPU_TLB_SIZE];                  \
-    CPUTLBEntry tlb_v_table[NB_MMU_MODES][CPU_VTLB_SIZE];               \
+    CPUTLBEntry tlb_v_table[NB_MMU_MODES][CPU_VTLB_MAX_SIZE];           \
     CPUIOTLBEntry iotlb[NB_MMU_MODES][CPU_TLB_SIZE];                    \
-    CPUIOTLBEntry iotlb_v[NB_MMU_MODES][CPU_VTLB_SIZE];                 \
+    CPUIOTLBEntry iotlb_v[NB_MMU_MODES][CPU_VTLB_MAX_SIZE];             \
     target_ulong tlb_flush_addr;                                        \
     target_ulong tlb_flush_mask;                                        \
     target_ulong vtlb_index;                                            \
+    /* All of the following are zero after CPU reset, which is the      \
+       correct initial state.  */                                       \
+    uint32_t tlb_clean_modes;   /* bit set: the mode's tlb is empty */  \
+    uint32_t vtlb_used[NB_MMU_MODES];   /* vtlb slots filled */         \
+    uint8_t vtlb_shift[NB_MMU_MODES];   /* log2 of sets / MIN_SETS */   \
+    uint8_t vtlb_idle[NB_MMU_MODES];    /* flushes spent underused */   \
+    CPUTLBStats tlb_stats[NB_MMU_MODES];                                \
 
 #else
 
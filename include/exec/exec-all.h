@@ -88,6 +88,7 @@ void QEMU_NORETURN cpu_io_recompile(CPUState *cpu, uintptr_t retaddr);
 TranslationBlock *tb_gen_code(CPUState *cpu,
                               target_ulong pc, target_ulong cs_base, int flags,
                               int cflags);
+void tb_gen_trace(CPUState *cpu, TranslationBlock *tb);
 void cpu_exec_init(CPUArchState *env);
 void QEMU_NORETURN cpu_loop_exit(CPUState *cpu);
 int page_unprotect(target_ulong address, uintptr_t pc, void *puc);
@@ -102,6 +103,10 @@ void tcg_cpu_address_space_init(CPUState *cpu, AddressSpace *as);
 /* cputlb.c */
 void tlb_flush_page(CPUState *cpu, target_ulong addr);
 void tlb_flush(CPUState *cpu, int flush_global);
+void tlb_flush_page_async(CPUState *cpu, target_ulong addr);
+void tlb_flush_async(CPUState *cpu, int flush_global);
+void tlb_flush_drain(CPUState *cpu);
+void tlb_flush_async_wait(void);
 void tlb_set_page(CPUState *cpu, target_ulong vaddr,
                   hwaddr paddr, int prot,
                   int mmu_idx, target_ulong size);
@@ -117,12 +122,29 @@ static inline void tlb_flush_page(CPUState *cpu, target_ulong addr)
 static inline void tlb_flush(CPUState *cpu, int flush_global)
 {
 }
+
+static inline void tlb_flush_page_async(CPUState *cpu, target_ulong addr)
+{
+}
+
+static inline void tlb_flush_async(CPUState *cpu, int flush_global)
+{
+}
+
+static inline void tlb_flush_drain(CPUState *cpu)
+{
+}
+
+static inline void tlb_flush_async_wait(void)
+{
+}
 #endif
 
 #define CODE_GEN_ALIGN           16 /* must be >= of the size of a icache line */
 
-#define CODE_GEN_PHYS_HASH_BITS     15
-#define CODE_GEN_PHYS_HASH_SIZE     (1 << CODE_GEN_PHYS_HASH_BITS)
+/* initial number of TBs the physical hash table is sized for */
+#define CODE_GEN_HTABLE_BITS     15
+#define CODE_GEN_HTABLE_SIZE     (1 << CODE_GEN_HTABLE_BITS)
 
 /* estimated block size for TB allocation */
 /* XXX: use a per code average code fragment size and modulate it
@@ -153,10 +175,15 @@ struct TranslationBlock {
 #define CF_LAST_IO     0x8000 /* Last insn may be an IO access.  */
 #define CF_NOCACHE     0x10000 /* To be freed after execution */
 #define CF_USE_ICOUNT  0x20000
+#define CF_INVALID     0x40000 /* Removed by tb_phys_invalidate() */
+#define CF_HOT_COUNT   0x80000 /* Count executions, see tb_trace_threshold */
+#define CF_TRACE       0x100000 /* Multi-block trace, see TARGET_HAS_TB_TRACE */
+
+    /* with CF_HOT_COUNT, executions left before the TB asks to be
+       retranslated as a trace */
+    uint32_t hot_count;
 
     void *tc_ptr;    /* pointer to the translated code */
-    /* next matching tb for physical address. */
-    struct TranslationBlock *phys_hash_next;
     /* first and second physical page containing code. The lower bit
        of the pointer tells the index in page_next[] */
     struct TranslationBlock *page_next[2];
@@ -179,22 +206,51 @@ struct TranslationBlock {
 };
 
 #include "exec/spinlock.h"
+#include "qemu/thread.h"
+#include "qemu/qht.h"
 
 typedef struct TBContext TBContext;
+typedef struct TBRegion TBRegion;
+
+/* The code buffer is carved into regions that are filled one after the
+   other and recycled in FIFO order, so that running out of space only
+   throws away the oldest code instead of everything.  */
+struct TBRegion {
+    void *start;                /* first byte of code in the region */
+    void *end;                  /* no new TB may start at or past this */
+    void *ptr;                  /* code high-water mark once filled */
+    TranslationBlock *tbs;      /* TBs of the region, in tc_ptr order */
+    int nb_tbs;
+    int max_tbs;
+};
 
 struct TBContext {
 
     TranslationBlock *tbs;
-    TranslationBlock *tb_phys_hash[CODE_GEN_PHYS_HASH_SIZE];
+    /* TBs indexed by tb_hash_func(), readable without tb_lock */
+    QHT htable;
     int nb_tbs;
-    /* any access to the tbs or the page table must use this lock */
-    spinlock_t tb_lock;
+    TBRegion *regions;
+    int nb_regions;
+    int cur_region;
+    size_t region_size;
+    /* any access to the tbs or the page table must use this lock,
+       see tb_lock() */
+    QemuMutex tb_lock;
 
     /* statistics */
     int tb_flush_count;
     int tb_phys_invalidate_count;
+    int tb_region_evict_count;
+    int tb_trace_count;             /* hot TBs turned into traces */
+    int64_t tb_evicted_count;       /* TBs dropped by region eviction */
+    int64_t tb_gen_count;           /* TBs translated */
+    int64_t tb_retranslate_count;   /* ... on a page that lost TBs to
+                                       eviction */
 
     int tb_invalidated_flag;
+    /* a full code region awaits tb_evict_pending_region() (MTTCG) */
+    bool evict_pending;
 };
 
 static inline unsigned int tb_jmp_cache_hash_page(target_ulong pc)
@@ -212,13 +268,31 @@ static inline unsigned int tb_jmp_cache_hash_func(target_ulong pc)
 	    | (tmp & TB_JMP_ADDR_MASK));
 }
 
-static inline unsigned int tb_phys_hash_func(tb_page_addr_t pc)
+/* Hash for the physical TB table.  All of the key goes in so that
+   TBs for the same code in different CPU modes land in different
+   chains; the final avalanche step is the MurmurHash3 fmix64.  */
+static inline uint32_t tb_hash_func(tb_page_addr_t phys_pc, target_ulong pc,
+                                    uint64_t flags)
 {
-    return (pc >> 2) & (CODE_GEN_PHYS_HASH_SIZE - 1);
+    uint64_t h = (uint64_t)phys_pc;
+
+    h ^= (uint64_t)pc * 0x9e3779b97f4a7c15ull;
+    h ^= flags * 0xc2b2ae3d27d4eb4full;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
 }
 
+void tb_lock(void);
+void tb_unlock(void);
+void tb_lock_reset(void);
 void tb_free(TranslationBlock *tb);
 void tb_flush(CPUArchState *env);
+bool tb_evict_pending(void);
+void tb_evict_pending_region(CPUState *cpu);
 void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr);
 
 #if defined(USE_DIRECT_JUMP)
@@ -8,6 +8,7 @@
 static TCGArg *icount_arg;
 static TCGLabel *icount_label;
 static TCGLabel *exitreq_label;
+static TCGLabel *hot_label;
 
 static inline void gen_tb_start(TranslationBlock *tb)
 {
@@ -21,6 +22,19 @@ static inline void gen_tb_start(TranslationBlock *tb)
     tcg_gen_brcondi_i32(TCG_COND_NE, flag, 0, exitreq_label);
     tcg_temp_free_i32(flag);
 
+    if (tb->cflags & CF_HOT_COUNT) {
+        TCGv_ptr ptr = tcg_const_ptr(&tb->hot_count);
+
+        hot_label = gen_new_label();
+        count = tcg_temp_new_i32();
+        tcg_gen_ld_i32(count, ptr, 0);
+        tcg_gen_subi_i32(count, count, 1);
+        tcg_gen_st_i32(count, ptr, 0);
+        tcg_gen_brcondi_i32(TCG_COND_EQ, count, 0, hot_label);
+        tcg_temp_free_i32(count);
+        tcg_temp_free_ptr(ptr);
+    }
+
     if (!(tb->cflags & CF_USE_ICOUNT)) {
         return;
     }
@@ -58,6 +72,18 @@ static void gen_tb_end(TranslationBlock *tb, int num_insns)
         tcg_gen_exit_tb((uintptr_t)tb + TB_EXIT_ICOUNT_EXPIRED);
     }
 
+    if (tb->cflags & CF_HOT_COUNT) {
+        /* leave before running anything, as for an exit request, and
+           let cpu_exec() replace the TB with a trace */
+        TCGv_ptr ptr;
+
+        gen_set_label(hot_label);
+        ptr = tcg_const_ptr(tb);
+        tcg_gen_st_ptr(ptr, cpu_env, offsetof(CPUState, hot_tb) - ENV_OFFSET);
+        tcg_temp_free_ptr(ptr);
+        tcg_gen_exit_tb((uintptr_t)tb + TB_EXIT_REQUESTED);
+    }
+
     /* Terminate the linked list.  */
     tcg_ctx.gen_op_buf[tcg_ctx.gen_last_op_idx].next = -1;
 }
@@ -180,6 +180,7 @@ struct MemoryRegion {
     bool rom_device;
     bool warning_printed; /* For reservations */
     bool flush_coalesced_mmio;
+    bool global_locking;
     MemoryRegion *alias;
     hwaddr alias_offset;
     int32_t priority;
@@ -527,6 +528,19 @@ bool memory_region_is_skip_dump(MemoryRegion *mr);
  */
 void memory_region_set_skip_dump(MemoryRegion *mr);
 
+/**
+ * memory_region_clear_global_locking: Declares that access processing does
+ *                                     not depend on the QEMU global lock.
+ *
+ * By default, accesses to a region are dispatched with the global lock
+ * held; vCPU threads that run guest code without it (multi-threaded TCG)
+ * take it for the duration of the access.  Regions whose callbacks only
+ * touch state of the accessing vCPU can opt out of this.
+ *
+ * @mr: the memory region to be updated.
+ */
+void memory_region_clear_global_locking(MemoryRegion *mr);
+
 /**
  * memory_region_is_romd: check whether a memory region is in ROMD mode
  *
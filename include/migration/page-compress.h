@@ -0,0 +1,83 @@
+/*
+ * Page compression codecs for migration
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef PAGE_COMPRESS_H
+#define PAGE_COMPRESS_H
+
+#include "qemu-common.h"
+#include "qapi-types.h"
+
+/* Per-thread codec state; not safe to share between threads */
+typedef struct PageCompressor PageCompressor;
+
+/**
+ * page_compress_method_supported: Check a codec was built in
+ *
+ * Returns true if @method can be used in this binary
+ *
+ * @method: the codec
+ */
+bool page_compress_method_supported(MigrationCompressMethod method);
+
+/**
+ * page_compress_bound: Worst case compressed size
+ *
+ * Returns the largest output page_compress() can produce for @len
+ * bytes of input
+ *
+ * @method: the codec
+ * @len: input length
+ */
+size_t page_compress_bound(MigrationCompressMethod method, size_t len);
+
+/**
+ * page_compressor_new: Set up codec state for one thread
+ *
+ * Returns new allocated state or NULL on error
+ *
+ * @method: the codec
+ * @level: compression level, 0-9; lz4 has a single level and ignores it
+ */
+PageCompressor *page_compressor_new(MigrationCompressMethod method,
+                                    int level);
+
+/**
+ * page_compressor_free: free all codec resources
+ *
+ * @c: codec state, may be NULL
+ */
+void page_compressor_free(PageCompressor *c);
+
+/**
+ * page_compress: Compress a buffer
+ *
+ * Returns the compressed length, or -1 if the output did not fit
+ *
+ * @c: codec state
+ * @dst: output buffer
+ * @dlen: output buffer size
+ * @src: input buffer
+ * @slen: input length
+ */
+ssize_t page_compress(PageCompressor *c, uint8_t *dst, size_t dlen,
+                      const uint8_t *src, size_t slen);
+
+/**
+ * page_decompress: Decompress a buffer
+ *
+ * Returns the decompressed length, or -1 on corrupt input
+ *
+ * @c: codec state
+ * @dst: output buffer
+ * @dlen: output buffer size
+ * @src: compressed data
+ * @slen: compressed length
+ */
+ssize_t page_decompress(PageCompressor *c, uint8_t *dst, size_t dlen,
+                        const uint8_t *src, size_t slen);
+
+#endif
@@ -1,6 +1,6 @@
 /*
  * Page cache for QEMU
- * The cache is base on a hash of the page address
+ * The cache is set associative, sets are picked by page address
  *
  * Copyright 2012 Red Hat, Inc. and/or its affiliates
  *
@@ -45,8 +45,7 @@ void cache_fini(PageCache *cache);
  * @addr: page addr
  * @current_age: current bitmap generation
  */
-bool cache_is_cached(const PageCache *cache, uint64_t addr,
-                     uint64_t current_age);
+bool cache_is_cached(PageCache *cache, uint64_t addr, uint64_t current_age);
 
 /**
  * get_cached_data: Get the data cached for an addr
@@ -56,7 +55,7 @@ bool cache_is_cached(const PageCache *cache, uint64_t addr,
  * @cache pointer to the PageCache struct
  * @addr: page addr
  */
-uint8_t *get_cached_data(const PageCache *cache, uint64_t addr);
+uint8_t *get_cached_data(PageCache *cache, uint64_t addr);
 
 /**
  * cache_insert: insert the page into the cache. the page cache
@@ -74,7 +73,8 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
 
 /**
  * cache_resize: resize the page cache. In case of size reduction the extra
- * pages will be freed
+ * pages will be freed. Cached pages are kept; they are moved to the new
+ * table a set at a time by the following cache operations.
  *
  * Returns -1 on error new cache size on success
  *
@@ -83,4 +83,16 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
  */
 int64_t cache_resize(PageCache *cache, int64_t num_pages);
 
+/**
+ * cache_suggest_size: advise a cache size from the observed reuse
+ * distance of the pages looked up, i.e. the smallest size (up to 4 times
+ * the current one) that would have turned most reuses into hits.
+ * Older lookups weigh half as much after each call.
+ *
+ * Returns the suggested number of pages
+ *
+ * @cache pointer to the PageCache struct
+ */
+int64_t cache_suggest_size(PageCache *cache);
+
 #endif
@@ -60,6 +60,16 @@ typedef int (QEMUFileGetFD)(void *opaque);
 typedef ssize_t (QEMUFileWritevBufferFunc)(void *opaque, struct iovec *iov,
                                            int iovcnt, int64_t pos);
 
+/*
+ * Zero-copy sending: zerocopy_setup turns it on for the transport and
+ * returns 0 or -errno.  writev_zerocopy then sends without copying, so
+ * the data must stay unchanged until the kernel is done with it;
+ * zerocopy_wait reaps completions until every send made before the last
+ * writev_zerocopy call (or every send at all, if @all) has completed.
+ */
+typedef int (QEMUFileZerocopySetupFunc)(void *opaque);
+typedef int (QEMUFileZerocopyWaitFunc)(void *opaque, bool all);
+
 /*
  * This function provides hooks around different
  * stages of RAM migration.
@@ -92,6 +102,11 @@ typedef size_t (QEMURamSaveFunc)(QEMUFile *f, void *opaque,
  */
 typedef int (QEMUFileShutdownFunc)(void *opaque, bool rd, bool wr);
 
+/*
+ * Return a QEMUFile for comms in the opposite direction
+ */
+typedef QEMUFile *(QEMURetPathFunc)(void *opaque);
+
 typedef struct QEMUFileOps {
     QEMUFilePutBufferFunc *put_buffer;
     QEMUFileGetBufferFunc *get_buffer;
@@ -103,6 +118,10 @@ typedef struct QEMUFileOps {
     QEMURamHookFunc *hook_ram_load;
     QEMURamSaveFunc *save_page;
     QEMUFileShutdownFunc *shut_down;
+    QEMURetPathFunc *get_return_path;
+    QEMUFileZerocopySetupFunc *zerocopy_setup;
+    QEMUFileWritevBufferFunc *writev_zerocopy;
+    QEMUFileZerocopyWaitFunc *zerocopy_wait;
 } QEMUFileOps;
 
 struct QEMUSizedBuffer {
@@ -131,6 +150,11 @@ void qemu_put_byte(QEMUFile *f, int v);
 void qemu_put_buffer_async(QEMUFile *f, const uint8_t *buf, int size);
 bool qemu_file_mode_is_not_valid(const char *mode);
 bool qemu_file_is_writable(QEMUFile *f);
+int qemu_file_enable_zerocopy(QEMUFile *f);
+void qemu_file_zerocopy_sync(QEMUFile *f);
+void qemu_file_get_copy_stats(QEMUFile *f, uint64_t *copied_bytes,
+                              uint64_t *zerocopy_sends,
+                              uint64_t *zerocopy_fallbacks);
 
 QEMUSizedBuffer *qsb_create(const uint8_t *buffer, size_t len);
 void qsb_free(QEMUSizedBuffer *);
@@ -159,9 +183,6 @@ void qemu_put_be32(QEMUFile *f, unsigned int v);
 void qemu_put_be64(QEMUFile *f, uint64_t v);
 int qemu_peek_buffer(QEMUFile *f, uint8_t *buf, int size, size_t offset);
 int qemu_get_buffer(QEMUFile *f, uint8_t *buf, int size);
-ssize_t qemu_put_compression_data(QEMUFile *f, const uint8_t *p, size_t size,
-                                  int level);
-int qemu_put_qemu_file(QEMUFile *f_des, QEMUFile *f_src);
 /*
  * Note that you can only peek continuous bytes from where the current pointer
  * is; you aren't guaranteed to be able to peak to +n bytes unless you've
@@ -185,11 +206,13 @@ uint64_t qemu_get_be64(QEMUFile *f);
 
 int qemu_file_rate_limit(QEMUFile *f);
 void qemu_file_reset_rate_limit(QEMUFile *f);
+void qemu_file_update_transfer(QEMUFile *f, int64_t len);
 void qemu_file_set_rate_limit(QEMUFile *f, int64_t new_rate);
 int64_t qemu_file_get_rate_limit(QEMUFile *f);
 int qemu_file_get_error(QEMUFile *f);
 void qemu_file_set_error(QEMUFile *f, int ret);
 int qemu_file_shutdown(QEMUFile *f);
+QEMUFile *qemu_file_get_return_path(QEMUFile *f);
 void qemu_fflush(QEMUFile *f);
 
 static inline void qemu_put_be64s(QEMUFile *f, const uint64_t *pv)
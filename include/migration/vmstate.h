@@ -45,6 +45,11 @@ typedef struct SaveVMHandlers {
     /* This runs both outside and inside the iothread lock.  */
     bool (*is_active)(void *opaque);
 
+    /* True if this live section carries on iterating after the switch
+     * to postcopy; other live sections are completed at that point.
+     */
+    bool (*can_postcopy)(void *opaque);
+
     /* This runs outside the iothread lock in the migration case, and
      * within the lock in the savevm case.  The callback had better only
      * use data that is local to the migration thread or protected
@@ -135,6 +140,21 @@ struct VMStateDescription {
     int (*pre_load)(void *opaque);
     int (*post_load)(void *opaque, int version_id);
     void (*pre_save)(void *opaque);
+    /*
+     * When device state is saved and loaded by several threads, the
+     * fields of a run of sections are handled concurrently in worker
+     * threads.  The top level hooks above still run in the migration
+     * thread, each kind in stream order, but pre_load of every section in
+     * the run comes before its fields are loaded and post_load of every
+     * section after all of them are; so a section's pre_load may run
+     * before the post_load of the section preceding it.
+     * Set this if that is not safe: if field handlers or nested hooks
+     * touch state outside the device (the memory map, say), or if the
+     * device depends on the state of another one.  A section using an
+     * ordered description anywhere is saved and loaded on its own, after
+     * every section before it and before every section after it.
+     */
+    bool ordered;
     VMStateField *fields;
     const VMStateSubsection *subsections;
 };
@@ -816,6 +836,11 @@ int vmstate_load_state(QEMUFile *f, const VMStateDescription *vmsd,
                        void *opaque, int version_id);
 void vmstate_save_state(QEMUFile *f, const VMStateDescription *vmsd,
                         void *opaque, QJSON *vmdesc);
+int vmstate_load_state_fields(QEMUFile *f, const VMStateDescription *vmsd,
+                              void *opaque, int version_id);
+void vmstate_save_state_fields(QEMUFile *f, const VMStateDescription *vmsd,
+                               void *opaque, QJSON *vmdesc);
+bool vmstate_is_ordered(const VMStateDescription *vmsd);
 
 int vmstate_register_with_alias_id(DeviceState *dev, int instance_id,
                                    const VMStateDescription *vmsd,
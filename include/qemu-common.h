@@ -264,6 +264,8 @@ typedef struct PCIHostDeviceAddress {
 } PCIHostDeviceAddress;
 
 void tcg_exec_init(unsigned long tb_size);
+void tb_cache_init(const char *path);
+extern int tb_trace_threshold;
 bool tcg_enabled(void);
 
 void cpu_exec_init_all(void);
@@ -472,6 +474,7 @@ can_use_buffer_find_nonzero_offset(const void *buf, size_t len)
             && ((uintptr_t) buf) % sizeof(VECTYPE) == 0);
 }
 size_t buffer_find_nonzero_offset(const void *buf, size_t len);
+bool host_cpu_has_avx2(void);
 
 /*
  * helper to parse debug environment variables
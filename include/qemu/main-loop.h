@@ -299,6 +299,18 @@ void qemu_mutex_lock_iothread(void);
  */
 void qemu_mutex_unlock_iothread(void);
 
+/**
+ * qemu_mutex_iothread_locked: Return lock status of the main loop mutex.
+ *
+ * Returns true if the main loop mutex is held by the current thread.
+ * vCPU threads running guest code with multi-threaded TCG do not hold
+ * it, and must take it before touching device state.
+ *
+ * NOTE: tools currently are single-threaded and this always returns true
+ * there.
+ */
+bool qemu_mutex_iothread_locked(void);
+
 /* internal interfaces */
 
 void qemu_fd_register(int fd);
@@ -0,0 +1,130 @@
+/*
+ * Concurrent hash table with lock-free lookups
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_QHT_H
+#define QEMU_QHT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "qemu/thread.h"
+
+/* Concurrent hash table
+ *
+ * Lookups are lock-free: they run inside an RCU read-side critical
+ * section and validate each bucket chain against a per-bucket seqlock, so
+ * they never block on writers.  Insertions, removals and resizes are
+ * serialized by an internal mutex.
+ *
+ * Objects are stored as opaque pointers together with a caller-computed
+ * 32-bit hash; the table itself never dereferences them, but lookup
+ * callbacks do, so a removed object must stay valid until the next RCU
+ * grace period.  The same pointer can be inserted only once.
+ *
+ * A lookup that races with a resize may still be walking the old bucket
+ * array and so miss an object inserted after the resize began.  Callers
+ * that must not see false negatives (e.g. before inserting a new object
+ * for the same key) should repeat the lookup while serialized with the
+ * writers.
+ */
+typedef struct QHT QHT;
+typedef struct QHTMap QHTMap;
+
+struct QHT {
+    QHTMap *map;
+    QemuMutex lock; /* serializes writers */
+    unsigned int mode;
+};
+
+/* Grow the table automatically when bucket chains get too long */
+#define QHT_MODE_AUTO_RESIZE 0x1
+
+/* Number of (hash, pointer) slots per bucket */
+#define QHT_BUCKET_ENTRIES 4
+
+/* Buckets of the chain-length histogram; the last one collects every
+ * chain at least that long.
+ */
+#define QHT_STATS_CHAIN_MAX 8
+
+typedef struct QHTStats {
+    size_t head_buckets;        /* size of the bucket array */
+    size_t used_head_buckets;   /* head buckets holding at least one entry */
+    size_t entries;             /* objects in the table */
+    size_t chain_buckets;       /* buckets in used chains, heads included */
+    /* chain_hist[i]: used chains made of i + 1 buckets */
+    size_t chain_hist[QHT_STATS_CHAIN_MAX];
+} QHTStats;
+
+/* Returns true if @obj matches the key pointed to by @userp */
+typedef bool (*QHTLookupFunc)(const void *obj, const void *userp);
+typedef void (*QHTIterFunc)(QHT *ht, void *p, uint32_t hash, void *userp);
+
+/**
+ * qht_init: Initialize a hash table sized for @n_elems objects.
+ * @mode: bitmask of QHT_MODE_* flags
+ */
+void qht_init(QHT *ht, size_t n_elems, unsigned int mode);
+
+/**
+ * qht_destroy: Free all memory used by @ht.  There must be no concurrent
+ * readers or writers.
+ */
+void qht_destroy(QHT *ht);
+
+/**
+ * qht_insert: Add @p to the table under @hash.
+ *
+ * Returns false if @p was already in the table.
+ */
+bool qht_insert(QHT *ht, void *p, uint32_t hash);
+
+/**
+ * qht_lookup: Find the first object under @hash for which @func returns
+ * true.  Must be called within an RCU read-side critical section.
+ *
+ * Returns the object, or NULL if none matches.
+ */
+void *qht_lookup(QHT *ht, QHTLookupFunc func, const void *userp,
+                 uint32_t hash);
+
+/**
+ * qht_remove: Remove @p, which was inserted under @hash.
+ *
+ * Returns false if @p was not in the table.
+ */
+bool qht_remove(QHT *ht, const void *p, uint32_t hash);
+
+/**
+ * qht_reset: Remove all objects, keeping the current size.
+ */
+void qht_reset(QHT *ht);
+
+/**
+ * qht_reset_size: Remove all objects and resize the table for @n_elems
+ * objects.
+ */
+void qht_reset_size(QHT *ht, size_t n_elems);
+
+/**
+ * qht_resize: Rehash all objects into a table sized for @n_elems objects.
+ */
+void qht_resize(QHT *ht, size_t n_elems);
+
+/**
+ * qht_iter: Call @func on every object in the table.  Writers are locked
+ * out for the duration; @func must not modify @ht.
+ */
+void qht_iter(QHT *ht, QHTIterFunc func, void *userp);
+
+/**
+ * qht_statistics: Fill @stats with the current occupancy of @ht.
+ */
+void qht_statistics(QHT *ht, QHTStats *stats);
+
+#endif
@@ -117,6 +117,8 @@ struct TranslationBlock;
  * @cpu_exec_enter: Callback for cpu_exec preparation.
  * @cpu_exec_exit: Callback for cpu_exec cleanup.
  * @cpu_exec_interrupt: Callback for processing interrupts in cpu_exec.
+ * @translator_features: Callback for appending to a #GByteArray the CPU
+ * configuration, beyond the CPU model, that the translator depends on.
  *
  * Represents a CPU family or model.
  */
@@ -172,6 +174,7 @@ typedef struct CPUClass {
     void (*cpu_exec_enter)(CPUState *cpu);
     void (*cpu_exec_exit)(CPUState *cpu);
     bool (*cpu_exec_interrupt)(CPUState *cpu, int interrupt_request);
+    void (*translator_features)(CPUState *cpu, GByteArray *buf);
 } CPUClass;
 
 #ifdef HOST_WORDS_BIGENDIAN
@@ -207,6 +210,15 @@ struct kvm_run;
 #define TB_JMP_CACHE_BITS 12
 #define TB_JMP_CACHE_SIZE (1 << TB_JMP_CACHE_BITS)
 
+/* Number of distinct page ranges a CPU can have pending flushes for
+   before they are turned into a full TLB flush.  */
+#define CPU_TLB_FLUSH_RANGES 8
+
+typedef struct CPUTLBFlushRange {
+    vaddr addr;
+    vaddr len;
+} CPUTLBFlushRange;
+
 /**
  * CPUState:
  * @cpu_index: CPU index (informative).
@@ -230,6 +242,9 @@ struct kvm_run;
  * @can_do_io: Nonzero if memory-mapped IO is safe.
  * @env_ptr: Pointer to subclass-specific CPUArchState field.
  * @current_tb: Currently executing TB.
+ * @tlb_flush_pending: A full TLB flush was requested by another CPU.
+ * @tlb_flush_ranges: TLB page ranges other CPUs asked to be flushed.
+ * @tcg_executing: #true while a multi-threaded TCG vCPU is in cpu_exec().
  * @gdb_regs: Additional GDB registers.
  * @gdb_num_regs: Number of total registers accessible to GDB.
  * @gdb_num_g_regs: Number of registers in GDB 'g' packets.
@@ -238,6 +253,7 @@ struct kvm_run;
  * @mem_io_pc: Host Program Counter at which the memory was accessed.
  * @mem_io_vaddr: Target virtual address at which the memory was accessed.
  * @kvm_fd: vCPU file descriptor for KVM.
+ * @throttle_thread_scheduled: A throttle sleep is queued on this vCPU.
  *
  * State of one CPU core or thread.
  */
@@ -260,6 +276,7 @@ struct CPUState {
     struct QemuCond *halt_cond;
     struct qemu_work_item *queued_work_first, *queued_work_last;
     bool thread_kicked;
+    bool throttle_thread_scheduled;
     bool created;
     bool stop;
     bool stopped;
@@ -275,7 +292,14 @@ struct CPUState {
 
     void *env_ptr; /* CPUArchState */
     struct TranslationBlock *current_tb;
+    /* set by generated code when a TB became hot, see tb_gen_trace() */
+    struct TranslationBlock *hot_tb;
     struct TranslationBlock *tb_jmp_cache[TB_JMP_CACHE_SIZE];
+    /* done on the next entry to cpu_exec(), see tlb_flush_async() */
+    bool tlb_flush_pending;
+    int tlb_flush_nb_ranges;
+    CPUTLBFlushRange tlb_flush_ranges[CPU_TLB_FLUSH_RANGES];
+    bool tcg_executing;
     struct GDBRegisterState *gdb_regs;
     int gdb_num_regs;
     int gdb_num_g_regs;
@@ -533,6 +557,42 @@ void run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data);
  */
 void async_run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data);
 
+/**
+ * cpu_throttle_set:
+ * @new_throttle_pct: Percent of sleep time. Valid range is 1 to 99.
+ *
+ * Throttles all vcpus by making each of them sleep for the given percentage
+ * of wall-clock time; at 25, a vcpu sleeps 10ms for every 30ms it runs.
+ * Values outside the valid range are clamped.
+ *
+ * May be called again at any time to change the percentage.  Throttling
+ * stays in effect until cpu_throttle_stop() is called.
+ */
+void cpu_throttle_set(int new_throttle_pct);
+
+/**
+ * cpu_throttle_stop:
+ *
+ * Stops the vcpu throttling started by cpu_throttle_set.
+ */
+void cpu_throttle_stop(void);
+
+/**
+ * cpu_throttle_active:
+ *
+ * Returns: %true if the vcpus are currently being throttled, %false otherwise.
+ */
+bool cpu_throttle_active(void);
+
+/**
+ * cpu_throttle_get_percentage:
+ *
+ * Returns the vcpu throttle percentage. See cpu_throttle_set for details.
+ *
+ * Returns: The throttle percentage in range 1 to 99.
+ */
+int cpu_throttle_get_percentage(void);
+
 /**
  * qemu_get_cpu:
  * @index: The CPUState@cpu_index value of the CPU to obtain.
@@ -14,6 +14,11 @@ void cpu_clean_all_dirty(void);
 
 void qtest_clock_warp(int64_t dest);
 
+void qemu_tcg_configure(QemuOpts *opts, Error **errp);
+bool qemu_tcg_mttcg_enabled(void);
+void qemu_tlb_flush_wait(void);
+void qemu_tlb_flush_signal(void);
+
 #ifndef CONFIG_USER_ONLY
 /* vl.c */
 extern int smp_cores;
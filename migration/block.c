@@ -20,6 +20,7 @@
 #include "hw/hw.h"
 #include "qemu/queue.h"
 #include "qemu/timer.h"
+#include "qemu/hbitmap.h"
 #include "migration/block.h"
 #include "migration/migration.h"
 #include "sysemu/blockdev.h"
@@ -63,6 +64,9 @@ typedef struct BlkMigDevState {
     int64_t completed_sectors;
     BdrvDirtyBitmap *dirty_bitmap;
     Error *blocker;
+
+    /* Frozen user bitmap; the bulk phase only sends the sectors it marks */
+    BdrvDirtyBitmap *sync_bitmap;
 } BlkMigDevState;
 
 typedef struct BlkMigBlock {
@@ -84,6 +88,7 @@ typedef struct BlkMigState {
     /* Written during setup phase.  Can be read without a lock.  */
     int blk_enable;
     int shared_base;
+    char *sync_bitmap_name;
     QSIMPLEQ_HEAD(bmds_list, BlkMigDevState) bmds_list;
     int64_t total_sector_sum;
     bool zero_blocks;
@@ -118,9 +123,23 @@ static void blk_mig_unlock(void)
  * or the VM will stall.
  */
 
-static void blk_send(QEMUFile *f, BlkMigBlock * blk)
+static void blk_send_header(QEMUFile *f, BlkMigDevState *bmds,
+                            int64_t sector, uint64_t flags)
 {
     int len;
+
+    /* sector number and flags */
+    qemu_put_be64(f, (sector << BDRV_SECTOR_BITS)
+                     | flags);
+
+    /* device name */
+    len = strlen(bdrv_get_device_name(bmds->bs));
+    qemu_put_byte(f, len);
+    qemu_put_buffer(f, (uint8_t *)bdrv_get_device_name(bmds->bs), len);
+}
+
+static void blk_send(QEMUFile *f, BlkMigBlock * blk)
+{
     uint64_t flags = BLK_MIG_FLAG_DEVICE_BLOCK;
 
     if (block_mig_state.zero_blocks &&
@@ -128,14 +147,7 @@ static void blk_send(QEMUFile *f, BlkMigBlock * blk)
         flags |= BLK_MIG_FLAG_ZERO_BLOCK;
     }
 
-    /* sector number and flags */
-    qemu_put_be64(f, (blk->sector << BDRV_SECTOR_BITS)
-                     | flags);
-
-    /* device name */
-    len = strlen(bdrv_get_device_name(blk->bmds->bs));
-    qemu_put_byte(f, len);
-    qemu_put_buffer(f, (uint8_t *)bdrv_get_device_name(blk->bmds->bs), len);
+    blk_send_header(f, blk->bmds, blk->sector, flags);
 
     /* if a block is zero we need to flush here since the network
      * bandwidth is now a lot higher than the storage device bandwidth.
@@ -250,6 +262,32 @@ static void blk_mig_read_cb(void *opaque, int ret)
     blk_mig_unlock();
 }
 
+/* Called with iothread lock taken.
+ *
+ * If the chunk at @sector is known to read as zeroes, send it without
+ * reading it and return true.
+ */
+static bool mig_save_zero_chunk(QEMUFile *f, BlkMigDevState *bmds,
+                                int64_t sector, int nr_sectors)
+{
+    int64_t status;
+    int pnum;
+
+    if (!block_mig_state.zero_blocks) {
+        return false;
+    }
+
+    status = bdrv_get_block_status(bmds->bs, sector, nr_sectors, &pnum);
+    if (status < 0 || !(status & BDRV_BLOCK_ZERO) || pnum < nr_sectors) {
+        return false;
+    }
+
+    blk_send_header(f, bmds, sector,
+                    BLK_MIG_FLAG_DEVICE_BLOCK | BLK_MIG_FLAG_ZERO_BLOCK);
+    bdrv_reset_dirty_bitmap(bmds->dirty_bitmap, sector, nr_sectors);
+    return true;
+}
+
 /* Called with no lock taken.  */
 
 static int mig_save_device_bulk(QEMUFile *f, BlkMigDevState *bmds)
@@ -260,6 +298,21 @@ static int mig_save_device_bulk(QEMUFile *f, BlkMigDevState *bmds)
     BlkMigBlock *blk;
     int nr_sectors;
 
+    if (bmds->sync_bitmap) {
+        HBitmapIter hbi;
+        int64_t next;
+
+        /* Skip to the next sector the destination doesn't have yet */
+        qemu_mutex_lock_iothread();
+        bdrv_dirty_iter_init(bmds->sync_bitmap, &hbi);
+        bdrv_set_dirty_iter(&hbi, cur_sector);
+        next = hbitmap_iter_next(&hbi);
+        qemu_mutex_unlock_iothread();
+
+        /* With a coarse bitmap, the dirty granule may start before us */
+        cur_sector = next < 0 ? total_sectors : MAX(next, cur_sector);
+    }
+
     if (bmds->shared_base) {
         qemu_mutex_lock_iothread();
         while (cur_sector < total_sectors &&
@@ -286,6 +339,16 @@ static int mig_save_device_bulk(QEMUFile *f, BlkMigDevState *bmds)
         nr_sectors = total_sectors - cur_sector;
     }
 
+    qemu_mutex_lock_iothread();
+    if (mig_save_zero_chunk(f, bmds, cur_sector, nr_sectors)) {
+        qemu_mutex_unlock_iothread();
+        /* Nothing is left in flight, so the chunk is done already */
+        bmds->cur_sector = cur_sector + nr_sectors;
+        bmds->completed_sectors = bmds->cur_sector;
+        return (bmds->cur_sector >= total_sectors);
+    }
+    qemu_mutex_unlock_iothread();
+
     blk = g_new(BlkMigBlock, 1);
     blk->buf = g_malloc(BLOCK_SIZE);
     blk->bmds = bmds;
@@ -311,6 +374,73 @@ static int mig_save_device_bulk(QEMUFile *f, BlkMigDevState *bmds)
     return (bmds->cur_sector >= total_sectors);
 }
 
+/* Called with iothread lock taken.
+ *
+ * Unfreeze the bitmaps used by freeze_sync_bitmaps(): clear them once
+ * the whole disk has been sent, or merge back the writes made meanwhile.
+ */
+static void release_sync_bitmaps(bool completed)
+{
+    BlkMigDevState *bmds;
+    BdrvDirtyBitmap *bm;
+
+    QSIMPLEQ_FOREACH(bmds, &block_mig_state.bmds_list, entry) {
+        if (!bmds->sync_bitmap) {
+            continue;
+        }
+        if (completed) {
+            /* Both images are the same now, start tracking afresh */
+            bm = bdrv_dirty_bitmap_abdicate(bmds->bs, bmds->sync_bitmap, NULL);
+            assert(bm);
+            if (bdrv_dirty_bitmap_enabled(bm)) {
+                bdrv_clear_dirty_bitmap(bm);
+            }
+        } else {
+            bm = bdrv_reclaim_dirty_bitmap(bmds->bs, bmds->sync_bitmap, NULL);
+            assert(bm);
+        }
+        bmds->sync_bitmap = NULL;
+    }
+}
+
+/* Called with iothread lock taken.
+ *
+ * If migrating with a bitmap, writes made from now on go to a successor
+ * of the bitmap (and to our own dirty bitmap), so that it can be walked
+ * during the bulk phase.
+ */
+static int freeze_sync_bitmaps(void)
+{
+    BlkMigDevState *bmds;
+    BdrvDirtyBitmap *bm;
+    Error *local_err = NULL;
+
+    if (!block_mig_state.sync_bitmap_name) {
+        return 0;
+    }
+
+    QSIMPLEQ_FOREACH(bmds, &block_mig_state.bmds_list, entry) {
+        bm = bdrv_find_dirty_bitmap(bmds->bs,
+                                    block_mig_state.sync_bitmap_name);
+        if (!bm) {
+            DPRINTF("No bitmap %s on %s, copying it in full\n",
+                    block_mig_state.sync_bitmap_name,
+                    bdrv_get_device_name(bmds->bs));
+            continue;
+        }
+        if (bdrv_dirty_bitmap_create_successor(bmds->bs, bm, &local_err) < 0) {
+            error_report("Block migration of %s: %s",
+                         bdrv_get_device_name(bmds->bs),
+                         error_get_pretty(local_err));
+            error_free(local_err);
+            release_sync_bitmaps(false);
+            return -EBUSY;
+        }
+        bmds->sync_bitmap = bm;
+    }
+    return 0;
+}
+
 /* Called with iothread lock taken.  */
 
 static int set_dirty_tracking(void)
@@ -326,6 +456,11 @@ static int set_dirty_tracking(void)
             goto fail;
         }
     }
+
+    ret = freeze_sync_bitmaps();
+    if (ret) {
+        goto fail;
+    }
     return 0;
 
 fail:
@@ -383,7 +518,11 @@ static void init_blk_migration(QEMUFile *f)
 
         block_mig_state.total_sector_sum += sectors;
 
-        if (bmds->shared_base) {
+        if (block_mig_state.sync_bitmap_name) {
+            DPRINTF("Start migration for %s with bitmap %s\n",
+                    bdrv_get_device_name(bs),
+                    block_mig_state.sync_bitmap_name);
+        } else if (bmds->shared_base) {
             DPRINTF("Start migration for %s with shared base image\n",
                     bdrv_get_device_name(bs));
         } else {
@@ -452,8 +591,20 @@ static int mig_save_device_dirty(QEMUFile *f, BlkMigDevState *bmds,
     int64_t sector;
     int nr_sectors;
     int ret = -EIO;
+    HBitmapIter hbi;
+    int64_t next;
 
+    bdrv_dirty_iter_init(bmds->dirty_bitmap, &hbi);
     for (sector = bmds->cur_dirty; sector < bmds->total_sectors;) {
+        /* Jump straight to the next dirty chunk */
+        bdrv_set_dirty_iter(&hbi, sector);
+        next = hbitmap_iter_next(&hbi);
+        if (next < 0) {
+            bmds->cur_dirty = bmds->total_sectors;
+            break;
+        }
+        sector = bmds->cur_dirty = next;
+
         blk_mig_lock();
         if (bmds_aio_inflight(bmds, sector)) {
             blk_mig_unlock();
@@ -591,7 +742,7 @@ static int64_t get_remaining_dirty(void)
 
 /* Called with iothread lock taken.  */
 
-static void blk_mig_cleanup(void)
+static void blk_mig_cleanup(bool completed)
 {
     BlkMigDevState *bmds;
     BlkMigBlock *blk;
@@ -599,6 +750,7 @@ static void blk_mig_cleanup(void)
     bdrv_drain_all();
 
     unset_dirty_tracking();
+    release_sync_bitmaps(completed);
 
     blk_mig_lock();
     while ((bmds = QSIMPLEQ_FIRST(&block_mig_state.bmds_list)) != NULL) {
@@ -620,7 +772,7 @@ static void blk_mig_cleanup(void)
 
 static void block_migration_cancel(void *opaque)
 {
-    blk_mig_cleanup();
+    blk_mig_cleanup(false);
 }
 
 static int block_save_setup(QEMUFile *f, void *opaque)
@@ -670,7 +822,7 @@ static int block_save_iterate(QEMUFile *f, void *opaque)
     blk_mig_lock();
     while ((block_mig_state.submitted +
             block_mig_state.read_done) * BLOCK_SIZE <
-           qemu_file_get_rate_limit(f)) {
+           qemu_file_get_rate_limit(f) && !qemu_file_rate_limit(f)) {
         blk_mig_unlock();
         if (block_mig_state.bulk_completed == 0) {
             /* first finish the bulk phase */
@@ -750,7 +902,7 @@ static int block_save_complete(QEMUFile *f, void *opaque)
 
     qemu_put_be64(f, BLK_MIG_FLAG_EOS);
 
-    blk_mig_cleanup();
+    blk_mig_cleanup(true);
     return 0;
 }
 
@@ -863,6 +1015,8 @@ static void block_set_params(const MigrationParams *params, void *opaque)
 {
     block_mig_state.blk_enable = params->blk;
     block_mig_state.shared_base = params->shared;
+    g_free(block_mig_state.sync_bitmap_name);
+    block_mig_state.sync_bitmap_name = g_strdup(params->bitmap);
 
     /* shared base means that blk_enable = 1 */
     block_mig_state.blk_enable |= params->shared;
@@ -0,0 +1,207 @@
+/*
+ * Page compression codecs for migration
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include <zlib.h>
+#ifdef CONFIG_LZ4
+#include <lz4.h>
+#endif
+#ifdef CONFIG_ZSTD
+#include <zstd.h>
+#endif
+#include "migration/page-compress.h"
+
+struct PageCompressor {
+    MigrationCompressMethod method;
+    int level;
+    /* Streams are set up on first use, as most threads only go one way */
+    bool deflate_ready;
+    bool inflate_ready;
+    z_stream deflate;
+    z_stream inflate;
+#ifdef CONFIG_ZSTD
+    ZSTD_CCtx *zstd_cctx;
+    ZSTD_DCtx *zstd_dctx;
+#endif
+};
+
+bool page_compress_method_supported(MigrationCompressMethod method)
+{
+    switch (method) {
+    case MIGRATION_COMPRESS_METHOD_ZLIB:
+        return true;
+#ifdef CONFIG_LZ4
+    case MIGRATION_COMPRESS_METHOD_LZ4:
+        return true;
+#endif
+#ifdef CONFIG_ZSTD
+    case MIGRATION_COMPRESS_METHOD_ZSTD:
+        return true;
+#endif
+    default:
+        return false;
+    }
+}
+
+size_t page_compress_bound(MigrationCompressMethod method, size_t len)
+{
+    switch (method) {
+#ifdef CONFIG_LZ4
+    case MIGRATION_COMPRESS_METHOD_LZ4:
+        return LZ4_compressBound(len);
+#endif
+#ifdef CONFIG_ZSTD
+    case MIGRATION_COMPRESS_METHOD_ZSTD:
+        return ZSTD_compressBound(len);
+#endif
+    default:
+        return compressBound(len);
+    }
+}
+
+PageCompressor *page_compressor_new(MigrationCompressMethod method,
+                                    int level)
+{
+    PageCompressor *c;
+
+    if (!page_compress_method_supported(method)) {
+        return NULL;
+    }
+
+    c = g_new0(PageCompressor, 1);
+    c->method = method;
+    c->level = level;
+    return c;
+}
+
+void page_compressor_free(PageCompressor *c)
+{
+    if (!c) {
+        return;
+    }
+    if (c->deflate_ready) {
+        deflateEnd(&c->deflate);
+    }
+    if (c->inflate_ready) {
+        inflateEnd(&c->inflate);
+    }
+#ifdef CONFIG_ZSTD
+    ZSTD_freeCCtx(c->zstd_cctx);
+    ZSTD_freeDCtx(c->zstd_dctx);
+#endif
+    g_free(c);
+}
+
+/* Same zlib format as compress2(), but without reallocating the stream */
+static ssize_t zlib_compress(PageCompressor *c, uint8_t *dst, size_t dlen,
+                             const uint8_t *src, size_t slen)
+{
+    z_stream *zs = &c->deflate;
+
+    if (!c->deflate_ready) {
+        if (deflateInit(zs, c->level) != Z_OK) {
+            return -1;
+        }
+        c->deflate_ready = true;
+    } else if (deflateReset(zs) != Z_OK) {
+        return -1;
+    }
+
+    zs->next_in = (Bytef *)src;
+    zs->avail_in = slen;
+    zs->next_out = dst;
+    zs->avail_out = dlen;
+    if (deflate(zs, Z_FINISH) != Z_STREAM_END) {
+        return -1;
+    }
+    return dlen - zs->avail_out;
+}
+
+static ssize_t zlib_decompress(PageCompressor *c, uint8_t *dst, size_t dlen,
+                               const uint8_t *src, size_t slen)
+{
+    z_stream *zs = &c->inflate;
+
+    if (!c->inflate_ready) {
+        if (inflateInit(zs) != Z_OK) {
+            return -1;
+        }
+        c->inflate_ready = true;
+    } else if (inflateReset(zs) != Z_OK) {
+        return -1;
+    }
+
+    zs->next_in = (Bytef *)src;
+    zs->avail_in = slen;
+    zs->next_out = dst;
+    zs->avail_out = dlen;
+    if (inflate(zs, Z_FINISH) != Z_STREAM_END) {
+        return -1;
+    }
+    return dlen - zs->avail_out;
+}
+
+ssize_t page_compress(PageCompressor *c, uint8_t *dst, size_t dlen,
+                      const uint8_t *src, size_t slen)
+{
+    switch (c->method) {
+#ifdef CONFIG_LZ4
+    case MIGRATION_COMPRESS_METHOD_LZ4: {
+        int ret = LZ4_compress_default((const char *)src, (char *)dst,
+                                       slen, dlen);
+        return ret > 0 ? ret : -1;
+    }
+#endif
+#ifdef CONFIG_ZSTD
+    case MIGRATION_COMPRESS_METHOD_ZSTD: {
+        size_t ret;
+
+        if (!c->zstd_cctx) {
+            c->zstd_cctx = ZSTD_createCCtx();
+            if (!c->zstd_cctx) {
+                return -1;
+            }
+        }
+        ret = ZSTD_compressCCtx(c->zstd_cctx, dst, dlen, src, slen,
+                                c->level);
+        return ZSTD_isError(ret) ? -1 : ret;
+    }
+#endif
+    default:
+        return zlib_compress(c, dst, dlen, src, slen);
+    }
+}
+
+ssize_t page_decompress(PageCompressor *c, uint8_t *dst, size_t dlen,
+                        const uint8_t *src, size_t slen)
+{
+    switch (c->method) {
+#ifdef CONFIG_LZ4
+    case MIGRATION_COMPRESS_METHOD_LZ4: {
+        int ret = LZ4_decompress_safe((const char *)src, (char *)dst,
+                                      slen, dlen);
+        return ret >= 0 ? ret : -1;
+    }
+#endif
+#ifdef CONFIG_ZSTD
+    case MIGRATION_COMPRESS_METHOD_ZSTD: {
+        size_t ret;
+
+        if (!c->zstd_dctx) {
+            c->zstd_dctx = ZSTD_createDCtx();
+            if (!c->zstd_dctx) {
+                return -1;
+            }
+        }
+        ret = ZSTD_decompressDCtx(c->zstd_dctx, dst, dlen, src, slen);
+        return ZSTD_isError(ret) ? -1 : ret;
+    }
+#endif
+    default:
+        return zlib_decompress(c, dst, dlen, src, slen);
+    }
+}
@@ -28,8 +28,8 @@
 #include "qemu-common.h"
 #include "qemu/iov.h"
 
-#define IO_BUF_SIZE 32768
-#define MAX_IOV_SIZE MIN(IOV_MAX, 64)
+#define IO_BUF_SIZE 131072
+#define MAX_IOV_SIZE MIN(IOV_MAX, 512)
 
 struct QEMUFile {
     const QEMUFileOps *ops;
@@ -42,11 +42,20 @@ struct QEMUFile {
                     when reading */
     int buf_index;
     int buf_size; /* 0 when writing */
+    int buf_limit; /* end of the part of buf being filled, when writing */
     uint8_t buf[IO_BUF_SIZE];
 
     struct iovec iov[MAX_IOV_SIZE];
     unsigned int iovcnt;
 
+    /* Writes go out with writev_zerocopy, alternating between the two
+     * halves of buf so that the one still being sent is left alone.
+     */
+    bool zerocopy;
+    uint64_t copied_bytes; /* written through buf rather than in place */
+    uint64_t zerocopy_sends;
+    uint64_t zerocopy_fallbacks; /* sends the kernel had to copy anyway */
+
     int last_error;
 };
 
@@ -23,30 +23,261 @@
  */
 #include "qemu-common.h"
 #include "qemu/iov.h"
+#include "qemu/bitmap.h"
 #include "qemu/sockets.h"
 #include "block/coroutine.h"
 #include "migration/qemu-file.h"
 #include "migration/qemu-file-internal.h"
+#ifdef CONFIG_LINUX
+#include <linux/errqueue.h>
+#endif
+
+#if defined(CONFIG_LINUX) && defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY) && \
+    defined(SO_EE_ORIGIN_ZEROCOPY)
+#define QEMU_FILE_ZEROCOPY 1
+#endif
+
+/* Most MSG_ZEROCOPY sends in flight at once */
+#define ZEROCOPY_WINDOW 256
 
 typedef struct QEMUFileSocket {
     int fd;
     QEMUFile *file;
+    /* The kernel numbers MSG_ZEROCOPY sends from 0 in the order they are
+     * made, but they can complete in any order (e.g. on retransmit).
+     * zc_done is the first send not known to be complete, so all those
+     * before it are; zc_completed has the bit, modulo ZEROCOPY_WINDOW,
+     * of each later send that has already completed.
+     */
+    uint32_t zc_sent;
+    uint32_t zc_done;
+    DECLARE_BITMAP(zc_completed, ZEROCOPY_WINDOW);
+    /* First send of the last socket_writev_zerocopy() */
+    uint32_t zc_flush_start;
 } QEMUFileSocket;
 
+/* Block the calling thread until @fd is ready for @events */
+static void socket_wait_fd(int fd, int events)
+{
+    GPollFD pfd;
+
+    pfd.fd = fd;
+    pfd.events = events | G_IO_ERR | G_IO_HUP;
+    pfd.revents = 0;
+    g_poll(&pfd, 1 /* 1 fd */, -1 /* no timeout */);
+}
+
 static ssize_t socket_writev_buffer(void *opaque, struct iovec *iov, int iovcnt,
                                     int64_t pos)
 {
     QEMUFileSocket *s = opaque;
     ssize_t len;
     ssize_t size = iov_size(iov, iovcnt);
+    ssize_t offset = 0;
+    int     err;
 
-    len = iov_send(s->fd, iov, iovcnt, 0, size);
-    if (len < size) {
-        len = -socket_error();
+    while (size > 0) {
+        len = iov_send(s->fd, iov, iovcnt, offset, size);
+
+        if (len > 0) {
+            size -= len;
+            offset += len;
+        }
+
+        if (size > 0) {
+            err = socket_error();
+
+            if (err != EAGAIN && err != EWOULDBLOCK) {
+                return -err;
+            }
+
+            /* Emulate blocking; a return path may share a non-blocking
+             * fd with a file that is read from a coroutine.
+             */
+            socket_wait_fd(s->fd, G_IO_OUT);
+        }
     }
-    return len;
+
+    return offset;
+}
+
+#ifdef QEMU_FILE_ZEROCOPY
+static int socket_zerocopy_setup(void *opaque)
+{
+    QEMUFileSocket *s = opaque;
+    int one = 1;
+
+    if (setsockopt(s->fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one))) {
+        return -errno;
+    }
+    return 0;
 }
 
+/*
+ * Collect the completions queued on the socket, without blocking.
+ * Returns how many sends completed, or -errno.
+ */
+static int socket_zerocopy_reap(QEMUFileSocket *s)
+{
+    union {
+        char buf[CMSG_SPACE(sizeof(struct sock_extended_err) +
+                            sizeof(struct sockaddr_in6))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg;
+    struct cmsghdr *cm;
+    struct sock_extended_err *serr;
+    uint32_t id, n;
+    int reaped = 0;
+
+    for (;;) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        if (recvmsg(s->fd, &msg, MSG_ERRQUEUE) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK ? reaped : -errno;
+        }
+
+        cm = CMSG_FIRSTHDR(&msg);
+        if (!cm || !((cm->cmsg_level == SOL_IP &&
+                      cm->cmsg_type == IP_RECVERR) ||
+                     (cm->cmsg_level == SOL_IPV6 &&
+                      cm->cmsg_type == IPV6_RECVERR))) {
+            continue;
+        }
+        serr = (struct sock_extended_err *)CMSG_DATA(cm);
+        if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+            return serr->ee_errno ? -serr->ee_errno : -EIO;
+        }
+
+        /* Completions come as ranges [ee_info, ee_data] of send numbers */
+        n = serr->ee_data - serr->ee_info + 1;
+        for (id = serr->ee_info; id != serr->ee_data + 1; id++) {
+            if (id - s->zc_done >= s->zc_sent - s->zc_done) {
+                /* Not in flight: already accounted for, or bogus */
+                n--;
+                continue;
+            }
+            set_bit(id % ZEROCOPY_WINDOW, s->zc_completed);
+        }
+        while (s->zc_done != s->zc_sent &&
+               test_bit(s->zc_done % ZEROCOPY_WINDOW, s->zc_completed)) {
+            clear_bit(s->zc_done % ZEROCOPY_WINDOW, s->zc_completed);
+            s->zc_done++;
+        }
+        reaped += n;
+        if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+            s->file->zerocopy_fallbacks += n;
+        }
+    }
+}
+
+/* Wait until all the sends before @end have completed */
+static int socket_zerocopy_wait_until(QEMUFileSocket *s, uint32_t end)
+{
+    bool woken = false;
+    int ret, err;
+    socklen_t errlen = sizeof(err);
+
+    for (;;) {
+        ret = socket_zerocopy_reap(s);
+        if (ret < 0) {
+            return ret;
+        }
+        if ((int32_t)(s->zc_done - end) >= 0) {
+            return 0;
+        }
+        if (woken && !ret) {
+            /* Woken up by something else: the connection is gone */
+            if (getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &err, &errlen) ||
+                !err) {
+                err = EPIPE;
+            }
+            return -err;
+        }
+
+        /* Completions are signalled as an error condition */
+        socket_wait_fd(s->fd, 0);
+        woken = true;
+    }
+}
+
+static int socket_zerocopy_wait(void *opaque, bool all)
+{
+    QEMUFileSocket *s = opaque;
+
+    return socket_zerocopy_wait_until(s, all ? s->zc_sent : s->zc_flush_start);
+}
+
+static ssize_t socket_writev_zerocopy(void *opaque, struct iovec *iov,
+                                      int iovcnt, int64_t pos)
+{
+    QEMUFileSocket *s = opaque;
+    struct iovec local[MAX_IOV_SIZE];
+    struct msghdr msg;
+    ssize_t size = iov_size(iov, iovcnt);
+    ssize_t offset = 0;
+    ssize_t len;
+    int ret, err;
+
+    assert(iovcnt <= MAX_IOV_SIZE);
+    s->zc_flush_start = s->zc_sent;
+    while (offset < size) {
+        if (s->zc_sent - s->zc_done >= ZEROCOPY_WINDOW) {
+            ret = socket_zerocopy_wait_until(s, s->zc_done + 1);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = local;
+        msg.msg_iovlen = iov_copy(local, iovcnt, iov, iovcnt,
+                                  offset, size - offset);
+        len = sendmsg(s->fd, &msg, MSG_ZEROCOPY);
+        if (len > 0) {
+            offset += len;
+            s->zc_sent++;
+            s->file->zerocopy_sends++;
+            continue;
+        }
+
+        err = len < 0 ? errno : EIO;
+        switch (err) {
+        case EINTR:
+            break;
+        case ENOBUFS:
+            /* Too much memory is pinned; wait for something to complete */
+            if (s->zc_sent == s->zc_done) {
+                return -ENOBUFS;
+            }
+            ret = socket_zerocopy_wait_until(s, s->zc_done + 1);
+            if (ret < 0) {
+                return ret;
+            }
+            break;
+        case EAGAIN:
+#if EAGAIN != EWOULDBLOCK
+        case EWOULDBLOCK:
+#endif
+            /* Reap first: pending completions would wake the poll */
+            ret = socket_zerocopy_reap(s);
+            if (ret < 0) {
+                return ret;
+            }
+            socket_wait_fd(s->fd, G_IO_OUT);
+            break;
+        default:
+            return -err;
+        }
+    }
+
+    return offset;
+}
+#endif
+
 static int socket_get_fd(void *opaque)
 {
     QEMUFileSocket *s = opaque;
@@ -65,7 +296,11 @@ static int socket_get_buffer(void *opaque, uint8_t *buf, int64_t pos, int size)
             break;
         }
         if (socket_error() == EAGAIN) {
-            yield_until_fd_readable(s->fd);
+            if (qemu_in_coroutine()) {
+                yield_until_fd_readable(s->fd);
+            } else {
+                socket_wait_fd(s->fd, G_IO_IN);
+            }
         } else if (socket_error() != EINTR) {
             break;
         }
@@ -203,21 +438,71 @@ QEMUFile *qemu_fdopen(int fd, const char *mode)
     return s->file;
 }
 
-static const QEMUFileOps socket_read_ops = {
+/*
+ * A return path shares the fd of the file it was opened from; closing it
+ * leaves the fd alone, the forward file still owns it.
+ */
+static int socket_return_close(void *opaque)
+{
+    g_free(opaque);
+    return 0;
+}
+
+static const QEMUFileOps socket_return_read_ops = {
     .get_fd     = socket_get_fd,
     .get_buffer = socket_get_buffer,
-    .close      = socket_close,
+    .close      = socket_return_close,
     .shut_down  = socket_shutdown
-
 };
 
-static const QEMUFileOps socket_write_ops = {
+static const QEMUFileOps socket_return_write_ops = {
     .get_fd        = socket_get_fd,
     .writev_buffer = socket_writev_buffer,
-    .close         = socket_close,
+    .close         = socket_return_close,
     .shut_down     = socket_shutdown
 };
 
+static QEMUFile *socket_get_return_path(void *opaque)
+{
+    QEMUFileSocket *forward = opaque;
+    QEMUFileSocket *reverse;
+
+    if (qemu_file_get_error(forward->file)) {
+        /* If the forward file is in error, don't try and open a return */
+        return NULL;
+    }
+
+    reverse = g_malloc0(sizeof(QEMUFileSocket));
+    reverse->fd = forward->fd;
+    if (qemu_file_is_writable(forward->file)) {
+        reverse->file = qemu_fopen_ops(reverse, &socket_return_read_ops);
+    } else {
+        reverse->file = qemu_fopen_ops(reverse, &socket_return_write_ops);
+    }
+    return reverse->file;
+}
+
+static const QEMUFileOps socket_read_ops = {
+    .get_fd          = socket_get_fd,
+    .get_buffer      = socket_get_buffer,
+    .close           = socket_close,
+    .shut_down       = socket_shutdown,
+    .get_return_path = socket_get_return_path
+};
+
+static const QEMUFileOps socket_write_ops = {
+    .get_fd          = socket_get_fd,
+    .writev_buffer   = socket_writev_buffer,
+    .close           = socket_close,
+    .shut_down       = socket_shutdown,
+    .get_return_path = socket_get_return_path,
+#ifdef QEMU_FILE_ZEROCOPY
+    .zerocopy_setup  = socket_zerocopy_setup,
+    .writev_zerocopy = socket_writev_zerocopy,
+    .zerocopy_wait   = socket_zerocopy_wait,
+#endif
+};
+
 QEMUFile *qemu_fopen_socket(int fd, const char *mode)
 {
     QEMUFileSocket *s;
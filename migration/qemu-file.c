@@ -21,7 +21,6 @@
  * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
  * THE SOFTWARE.
  */
-#include <zlib.h>
 #include "qemu-common.h"
 #include "qemu/iov.h"
 #include "qemu/sockets.h"
@@ -43,6 +42,18 @@ int qemu_file_shutdown(QEMUFile *f)
     return f->ops->shut_down(f->opaque, true, true);
 }
 
+/*
+ * Result: QEMUFile* for a 'return path' for comms in the opposite direction
+ *         NULL if not available
+ */
+QEMUFile *qemu_file_get_return_path(QEMUFile *f)
+{
+    if (!f->ops->get_return_path) {
+        return NULL;
+    }
+    return f->ops->get_return_path(f->opaque);
+}
+
 bool qemu_file_mode_is_not_valid(const char *mode)
 {
     if (mode == NULL ||
@@ -63,6 +74,7 @@ QEMUFile *qemu_fopen_ops(void *opaque, const QEMUFileOps *ops)
 
     f->opaque = opaque;
     f->ops = ops;
+    f->buf_limit = IO_BUF_SIZE;
     return f;
 }
 
@@ -104,7 +116,12 @@ void qemu_fflush(QEMUFile *f)
         return;
     }
 
-    if (f->ops->writev_buffer) {
+    if (f->zerocopy) {
+        if (f->iovcnt > 0) {
+            ret = f->ops->writev_zerocopy(f->opaque, f->iov, f->iovcnt,
+                                          f->pos);
+        }
+    } else if (f->ops->writev_buffer) {
         if (f->iovcnt > 0) {
             ret = f->ops->writev_buffer(f->opaque, f->iov, f->iovcnt, f->pos);
         }
@@ -118,11 +135,79 @@ void qemu_fflush(QEMUFile *f)
     }
     f->buf_index = 0;
     f->iovcnt = 0;
+    if (f->zerocopy) {
+        /* Switch halves; the one we switch to was used by the previous
+         * send, which must be complete before it is overwritten.
+         */
+        if (f->buf_limit == IO_BUF_SIZE) {
+            f->buf_limit = IO_BUF_SIZE / 2;
+        } else {
+            f->buf_index = IO_BUF_SIZE / 2;
+            f->buf_limit = IO_BUF_SIZE;
+        }
+        if (ret >= 0) {
+            ret = f->ops->zerocopy_wait(f->opaque, false);
+        }
+    }
+    if (ret < 0) {
+        qemu_file_set_error(f, ret);
+    }
+}
+
+/*
+ * Send data from guest RAM without copying it, where the transport
+ * supports it.  Returns 0 or -errno, in which case @f stays as it was.
+ */
+int qemu_file_enable_zerocopy(QEMUFile *f)
+{
+    int ret;
+
+    if (!f->ops->zerocopy_setup) {
+        return -ENOTSUP;
+    }
+    ret = f->ops->zerocopy_setup(f->opaque);
+    if (ret < 0) {
+        return ret;
+    }
+    qemu_fflush(f);
+    f->zerocopy = true;
+    f->buf_limit = IO_BUF_SIZE / 2;
+    return 0;
+}
+
+/*
+ * Flush @f and wait until the kernel is done with everything sent so
+ * far.  Pages that were in flight can be safely dirtied and queued again
+ * after this.
+ */
+void qemu_file_zerocopy_sync(QEMUFile *f)
+{
+    int ret;
+
+    if (!f->zerocopy) {
+        return;
+    }
+    qemu_fflush(f);
+    ret = f->ops->zerocopy_wait(f->opaque, true);
     if (ret < 0) {
         qemu_file_set_error(f, ret);
     }
 }
 
+/*
+ * Returns how many bytes went through the buffer of @f instead of being
+ * sent in place, and for zero-copy sends how many the kernel made and
+ * how many of those it ended up copying anyway.
+ */
+void qemu_file_get_copy_stats(QEMUFile *f, uint64_t *copied_bytes,
+                              uint64_t *zerocopy_sends,
+                              uint64_t *zerocopy_fallbacks)
+{
+    *copied_bytes = f->copied_bytes;
+    *zerocopy_sends = f->zerocopy_sends;
+    *zerocopy_fallbacks = f->zerocopy_fallbacks;
+}
+
 void ram_control_before_iterate(QEMUFile *f, uint64_t flags)
 {
     int ret = 0;
@@ -244,6 +329,10 @@ int qemu_fclose(QEMUFile *f)
 {
     int ret;
     qemu_fflush(f);
+    if (!qemu_file_get_error(f)) {
+        /* buf is about to be freed; the kernel may still be reading it */
+        qemu_file_zerocopy_sync(f);
+    }
     ret = qemu_file_get_error(f);
 
     if (f->ops->close) {
@@ -303,17 +392,18 @@ void qemu_put_buffer(QEMUFile *f, const uint8_t *buf, int size)
     }
 
     while (size > 0) {
-        l = IO_BUF_SIZE - f->buf_index;
+        l = f->buf_limit - f->buf_index;
         if (l > size) {
             l = size;
         }
         memcpy(f->buf + f->buf_index, buf, l);
         f->bytes_xfer += l;
+        f->copied_bytes += l;
         if (f->ops->writev_buffer) {
             add_to_iovec(f, f->buf + f->buf_index, l);
         }
         f->buf_index += l;
-        if (f->buf_index == IO_BUF_SIZE) {
+        if (f->buf_index == f->buf_limit) {
             qemu_fflush(f);
         }
         if (qemu_file_get_error(f)) {
@@ -332,11 +422,12 @@ void qemu_put_byte(QEMUFile *f, int v)
 
     f->buf[f->buf_index] = v;
     f->bytes_xfer++;
+    f->copied_bytes++;
     if (f->ops->writev_buffer) {
         add_to_iovec(f, f->buf + f->buf_index, 1);
     }
     f->buf_index++;
-    if (f->buf_index == IO_BUF_SIZE) {
+    if (f->buf_index == f->buf_limit) {
         qemu_fflush(f);
     }
 }
@@ -502,6 +593,12 @@ void qemu_file_reset_rate_limit(QEMUFile *f)
     f->bytes_xfer = 0;
 }
 
+/* Account for data sent on behalf of @f by other means (multifd) */
+void qemu_file_update_transfer(QEMUFile *f, int64_t len)
+{
+    f->bytes_xfer += len;
+}
+
 void qemu_put_be16(QEMUFile *f, unsigned int v)
 {
     qemu_put_byte(f, v >> 8);
@@ -547,41 +644,3 @@ uint64_t qemu_get_be64(QEMUFile *f)
     v |= qemu_get_be32(f);
     return v;
 }
-
-/* compress size bytes of data start at p with specific compression
- * level and store the compressed data to the buffer of f.
- */
-
-ssize_t qemu_put_compression_data(QEMUFile *f, const uint8_t *p, size_t size,
-                                  int level)
-{
-    ssize_t blen = IO_BUF_SIZE - f->buf_index - sizeof(int32_t);
-
-    if (blen < compressBound(size)) {
-        return 0;
-    }
-    if (compress2(f->buf + f->buf_index + sizeof(int32_t), (uLongf *)&blen,
-                  (Bytef *)p, size, level) != Z_OK) {
-        error_report("Compress Failed!");
-        return 0;
-    }
-    qemu_put_be32(f, blen);
-    f->buf_index += blen;
-    return blen + sizeof(int32_t);
-}
-
-/* Put the data in the buffer of f_src to the buffer of f_des, and
- * then reset the buf_index of f_src to 0.
- */
-
-int qemu_put_qemu_file(QEMUFile *f_des, QEMUFile *f_src)
-{
-    int len = 0;
-
-    if (f_src->buf_index > 0) {
-        len = f_src->buf_index;
-        qemu_put_buffer(f_des, f_src->buf, f_src->buf_index);
-        f_src->buf_index = 0;
-    }
-    return len;
-}
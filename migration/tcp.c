@@ -50,9 +50,17 @@ static void tcp_wait_for_connect(int fd, Error *err, void *opaque)
 
 void tcp_start_outgoing_migration(MigrationState *s, const char *host_port, Error **errp)
 {
+    if (migrate_use_multifd()) {
+        /* The multifd channels connect to the same address later on */
+        g_free(s->multifd_host_port);
+        s->multifd_host_port = g_strdup(host_port);
+    }
     inet_nonblocking_connect(host_port, tcp_wait_for_connect, s, errp);
 }
 
+/* With multifd, the main stream is held back until all channels are in */
+static QEMUFile *multifd_main_file;
+
 static void tcp_accept_incoming_migration(void *opaque)
 {
     struct sockaddr_in addr;
@@ -65,23 +73,52 @@ static void tcp_accept_incoming_migration(void *opaque)
         c = qemu_accept(s, (struct sockaddr *)&addr, &addrlen);
         err = socket_error();
     } while (c < 0 && err == EINTR);
-    qemu_set_fd_handler2(s, NULL, NULL, NULL, NULL);
-    closesocket(s);
-
-    DPRINTF("accepted migration\n");
 
     if (c < 0) {
+        qemu_set_fd_handler2(s, NULL, NULL, NULL, NULL);
+        closesocket(s);
         error_report("could not accept migration connection (%s)",
                      strerror(err));
+        if (multifd_main_file) {
+            multifd_load_cleanup();
+            qemu_fclose(multifd_main_file);
+            multifd_main_file = NULL;
+        }
+        return;
+    }
+
+    if (multifd_main_file) {
+        DPRINTF("accepted multifd channel\n");
+        if (!multifd_recv_new_channel(c)) {
+            /* Keep listening for the remaining channels */
+            return;
+        }
+        qemu_set_fd_handler2(s, NULL, NULL, NULL, NULL);
+        closesocket(s);
+        f = multifd_main_file;
+        multifd_main_file = NULL;
+        process_incoming_migration(f);
         return;
     }
 
+    DPRINTF("accepted migration\n");
+
     f = qemu_fopen_socket(c, "rb");
     if (f == NULL) {
+        qemu_set_fd_handler2(s, NULL, NULL, NULL, NULL);
+        closesocket(s);
         error_report("could not qemu_fopen socket");
         goto out;
     }
 
+    if (migrate_use_multifd()) {
+        /* The channels connect after the main stream */
+        multifd_main_file = f;
+        return;
+    }
+
+    qemu_set_fd_handler2(s, NULL, NULL, NULL, NULL);
+    closesocket(s);
     process_incoming_migration(f);
     return;
 
@@ -73,7 +73,6 @@ static void *vmstate_base_addr(void *opaque, VMStateField *field, bool alloc)
 int vmstate_load_state(QEMUFile *f, const VMStateDescription *vmsd,
                        void *opaque, int version_id)
 {
-    VMStateField *field = vmsd->fields;
     int ret = 0;
 
     trace_vmstate_load_state(vmsd->name, version_id);
@@ -97,6 +96,27 @@ int vmstate_load_state(QEMUFile *f, const VMStateDescription *vmsd,
             return ret;
         }
     }
+    ret = vmstate_load_state_fields(f, vmsd, opaque, version_id);
+    if (ret != 0) {
+        return ret;
+    }
+    if (vmsd->post_load) {
+        ret = vmsd->post_load(opaque, version_id);
+    }
+    trace_vmstate_load_state_end(vmsd->name, "end", ret);
+    return ret;
+}
+
+/*
+ * The body of vmstate_load_state(), without the version checks and the
+ * top level pre_load/post_load hooks, which are up to the caller.
+ */
+int vmstate_load_state_fields(QEMUFile *f, const VMStateDescription *vmsd,
+                              void *opaque, int version_id)
+{
+    VMStateField *field = vmsd->fields;
+    int ret = 0;
+
     while (field->name) {
         trace_vmstate_load_state_field(vmsd->name, field->name);
         if ((field->field_exists &&
@@ -136,15 +156,7 @@ int vmstate_load_state(QEMUFile *f, const VMStateDescription *vmsd,
         }
         field++;
     }
-    ret = vmstate_subsection_load(f, vmsd, opaque);
-    if (ret != 0) {
-        return ret;
-    }
-    if (vmsd->post_load) {
-        ret = vmsd->post_load(opaque, version_id);
-    }
-    trace_vmstate_load_state_end(vmsd->name, "end", ret);
-    return ret;
+    return vmstate_subsection_load(f, vmsd, opaque);
 }
 
 static int vmfield_name_num(VMStateField *start, VMStateField *search)
@@ -279,11 +291,17 @@ static void vmsd_desc_field_end(const VMStateDescription *vmsd, QJSON *vmdesc,
 void vmstate_save_state(QEMUFile *f, const VMStateDescription *vmsd,
                         void *opaque, QJSON *vmdesc)
 {
-    VMStateField *field = vmsd->fields;
-
     if (vmsd->pre_save) {
         vmsd->pre_save(opaque);
     }
+    vmstate_save_state_fields(f, vmsd, opaque, vmdesc);
+}
+
+/* vmstate_save_state() without the top level pre_save hook */
+void vmstate_save_state_fields(QEMUFile *f, const VMStateDescription *vmsd,
+                               void *opaque, QJSON *vmdesc)
+{
+    VMStateField *field = vmsd->fields;
 
     if (vmdesc) {
         json_prop_str(vmdesc, "vmsd_name", vmsd->name);
@@ -340,6 +358,31 @@ void vmstate_save_state(QEMUFile *f, const VMStateDescription *vmsd,
     vmstate_subsection_save(f, vmsd, opaque, vmdesc);
 }
 
+/*
+ * Returns true if @vmsd, or any description used by its fields or
+ * subsections, is marked as ordered.
+ */
+bool vmstate_is_ordered(const VMStateDescription *vmsd)
+{
+    VMStateField *field;
+    const VMStateSubsection *sub;
+
+    if (vmsd->ordered) {
+        return true;
+    }
+    for (field = vmsd->fields; field->name; field++) {
+        if ((field->flags & VMS_STRUCT) && vmstate_is_ordered(field->vmsd)) {
+            return true;
+        }
+    }
+    for (sub = vmsd->subsections; sub && sub->needed; sub++) {
+        if (vmstate_is_ordered(sub->vmsd)) {
+            return true;
+        }
+    }
+    return false;
+}
+
 static const VMStateDescription *
     vmstate_get_subsection(const VMStateSubsection *sub, char *idstr)
 {
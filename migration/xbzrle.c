@@ -12,6 +12,7 @@
  */
 #include "qemu-common.h"
 #include "include/migration/migration.h"
+#include "qemu/host-utils.h"
 
 /*
   page = zrun nzrun
@@ -23,13 +24,186 @@
 
   length = uleb128 encoded integer
  */
+
+/*
+ * Run scanners: return the length of the run of equal (zrun) or
+ * differing (nzrun) bytes at the start of the two buffers, up to len.
+ * The buffers need not be aligned, but they must be misaligned by the
+ * same amount, which holds for any offset into two aligned pages.
+ */
+static uint32_t zrun_len_long(const uint8_t *old_buf, const uint8_t *new_buf,
+                              uint32_t len)
+{
+    uint32_t i = 0;
+
+    /* byte at a time up to a long boundary */
+    while (i < len && ((uintptr_t)(old_buf + i) % sizeof(long))) {
+        if (old_buf[i] != new_buf[i]) {
+            return i;
+        }
+        i++;
+    }
+
+    /* word at a time for speed */
+    while (len - i >= sizeof(long) &&
+           *(long *)(old_buf + i) == *(long *)(new_buf + i)) {
+        i += sizeof(long);
+    }
+
+    /* go over the rest */
+    while (i < len && old_buf[i] == new_buf[i]) {
+        i++;
+    }
+
+    return i;
+}
+
+static uint32_t nzrun_len_long(const uint8_t *old_buf, const uint8_t *new_buf,
+                               uint32_t len)
+{
+    /* truncation to 32-bit long okay */
+    unsigned long mask = (unsigned long)0x0101010101010101ULL;
+    uint32_t i = 0;
+
+    /* byte at a time up to a long boundary */
+    while (i < len && ((uintptr_t)(old_buf + i) % sizeof(long))) {
+        if (old_buf[i] == new_buf[i]) {
+            return i;
+        }
+        i++;
+    }
+
+    /* word at a time for speed, use of 32-bit long okay */
+    while (len - i >= sizeof(long)) {
+        unsigned long xor;
+        xor = *(unsigned long *)(old_buf + i)
+            ^ *(unsigned long *)(new_buf + i);
+        if ((xor - mask) & ~xor & (mask << 7)) {
+            /* found the end of an nzrun within the current long */
+            break;
+        }
+        i += sizeof(long);
+    }
+
+    while (i < len && old_buf[i] != new_buf[i]) {
+        i++;
+    }
+
+    return i;
+}
+
+#ifdef __SSE2__
+/* 16 bytes at a time: one bit per byte, set where the bytes are equal */
+static uint32_t zrun_len_sse2(const uint8_t *old_buf, const uint8_t *new_buf,
+                              uint32_t len)
+{
+    uint32_t i = 0;
+
+    while (len - i >= 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(old_buf + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(new_buf + i));
+        uint32_t eq = _mm_movemask_epi8(_mm_cmpeq_epi8(a, b));
+
+        if (eq != 0xffff) {
+            return i + ctz32(~eq);
+        }
+        i += 16;
+    }
+
+    return i + zrun_len_long(old_buf + i, new_buf + i, len - i);
+}
+
+static uint32_t nzrun_len_sse2(const uint8_t *old_buf, const uint8_t *new_buf,
+                               uint32_t len)
+{
+    uint32_t i = 0;
+
+    while (len - i >= 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(old_buf + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(new_buf + i));
+        uint32_t eq = _mm_movemask_epi8(_mm_cmpeq_epi8(a, b));
+
+        if (eq) {
+            return i + ctz32(eq);
+        }
+        i += 16;
+    }
+
+    return i + nzrun_len_long(old_buf + i, new_buf + i, len - i);
+}
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+static uint32_t zrun_len_avx2(const uint8_t *old_buf, const uint8_t *new_buf,
+                              uint32_t len)
+{
+    uint32_t i = 0;
+
+    while (len - i >= 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(old_buf + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(new_buf + i));
+        uint32_t eq = _mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b));
+
+        if (eq != 0xffffffff) {
+            return i + ctz32(~eq);
+        }
+        i += 32;
+    }
+
+    return i + zrun_len_long(old_buf + i, new_buf + i, len - i);
+}
+
+static uint32_t nzrun_len_avx2(const uint8_t *old_buf, const uint8_t *new_buf,
+                               uint32_t len)
+{
+    uint32_t i = 0;
+
+    while (len - i >= 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(old_buf + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(new_buf + i));
+        uint32_t eq = _mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b));
+
+        if (eq) {
+            return i + ctz32(eq);
+        }
+        i += 32;
+    }
+
+    return i + nzrun_len_long(old_buf + i, new_buf + i, len - i);
+}
+#pragma GCC pop_options
+#endif
+
+typedef uint32_t (*XBZRLERunLen)(const uint8_t *old_buf,
+                                 const uint8_t *new_buf, uint32_t len);
+
+#ifdef __SSE2__
+static XBZRLERunLen zrun_len = zrun_len_sse2;
+static XBZRLERunLen nzrun_len = nzrun_len_sse2;
+#else
+static XBZRLERunLen zrun_len = zrun_len_long;
+static XBZRLERunLen nzrun_len = nzrun_len_long;
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+static void __attribute__((constructor)) init_xbzrle_avx2(void)
+{
+    if (host_cpu_has_avx2()) {
+        zrun_len = zrun_len_avx2;
+        nzrun_len = nzrun_len_avx2;
+    }
+}
+#endif
+
 int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
                          uint8_t *dst, int dlen)
 {
-    uint32_t zrun_len = 0, nzrun_len = 0;
+    uint32_t zrun, nzrun;
     int d = 0, i = 0;
-    long res;
-    uint8_t *nzrun_start = NULL;
 
     g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
                sizeof(long)));
@@ -40,31 +214,11 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
             return -1;
         }
 
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] == new_buf[i]) {
-            zrun_len++;
-            i++;
-            res--;
-        }
-
-        /* word at a time for speed */
-        if (!res) {
-            while (i < slen &&
-                   (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
-                i += sizeof(long);
-                zrun_len += sizeof(long);
-            }
-
-            /* go over the rest */
-            while (i < slen && old_buf[i] == new_buf[i]) {
-                zrun_len++;
-                i++;
-            }
-        }
+        zrun = zrun_len(old_buf + i, new_buf + i, slen - i);
+        i += zrun;
 
         /* buffer unchanged */
-        if (zrun_len == slen) {
+        if (zrun == slen) {
             return 0;
         }
 
@@ -73,53 +227,23 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
             return d;
         }
 
-        d += uleb128_encode_small(dst + d, zrun_len);
-
-        zrun_len = 0;
-        nzrun_start = new_buf + i;
+        d += uleb128_encode_small(dst + d, zrun);
 
         /* overflow */
         if (d + 2 > dlen) {
             return -1;
         }
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] != new_buf[i]) {
-            i++;
-            nzrun_len++;
-            res--;
-        }
-
-        /* word at a time for speed, use of 32-bit long okay */
-        if (!res) {
-            /* truncation to 32-bit long okay */
-            unsigned long mask = (unsigned long)0x0101010101010101ULL;
-            while (i < slen) {
-                unsigned long xor;
-                xor = *(unsigned long *)(old_buf + i)
-                    ^ *(unsigned long *)(new_buf + i);
-                if ((xor - mask) & ~xor & (mask << 7)) {
-                    /* found the end of an nzrun within the current long */
-                    while (old_buf[i] != new_buf[i]) {
-                        nzrun_len++;
-                        i++;
-                    }
-                    break;
-                } else {
-                    i += sizeof(long);
-                    nzrun_len += sizeof(long);
-                }
-            }
-        }
-
-        d += uleb128_encode_small(dst + d, nzrun_len);
+
+        nzrun = nzrun_len(old_buf + i, new_buf + i, slen - i);
+
+        d += uleb128_encode_small(dst + d, nzrun);
         /* overflow */
-        if (d + nzrun_len > dlen) {
+        if (d + nzrun > dlen) {
             return -1;
         }
-        memcpy(dst + d, nzrun_start, nzrun_len);
-        d += nzrun_len;
-        nzrun_len = 0;
+        memcpy(dst + d, new_buf + i, nzrun);
+        d += nzrun;
+        i += nzrun;
     }
 
     return d;
@@ -1,6 +1,6 @@
 /*
  * Page cache for QEMU
- * The cache is base on a hash of the page address
+ * The cache is set associative, sets are picked by page address
  *
  * Copyright 2012 Red Hat, Inc. and/or its affiliates
  *
@@ -23,6 +23,7 @@
 #include <glib.h>
 
 #include "qemu-common.h"
+#include "qemu/bitmap.h"
 #include "migration/page_cache.h"
 
 #ifdef DEBUG_CACHE
@@ -36,11 +37,29 @@
 /* the page in cache will not be replaced in two cycles */
 #define CACHED_PAGE_LIFETIME 2
 
+/* Pages map to a set by address and may use any of its ways */
+#define CACHE_WAYS 8
+
+/*
+ * Each set also remembers the addresses of the pages it recently evicted
+ * (or refused), most recent first, CACHE_GHOST_SCALE - 1 per way.  A miss
+ * found there would have been a hit in a cache up to CACHE_GHOST_SCALE
+ * times bigger.
+ */
+#define CACHE_GHOST_SCALE 4
+
+/* Share of the reuses a suggested size should turn into hits */
+#define CACHE_SUGGEST_HIT_PERCENT 90
+
+/* Old sets moved over on each cache operation while a resize is pending */
+#define CACHE_RESIZE_SETS_PER_OP 2
+
 typedef struct CacheItem CacheItem;
 
 struct CacheItem {
     uint64_t it_addr;
     uint64_t it_age;
+    uint64_t it_lru;
     uint8_t *it_data;
 };
 
@@ -50,127 +69,354 @@ struct PageCache {
     int64_t max_num_items;
     uint64_t max_item_age;
     int64_t num_items;
+
+    int64_t num_sets;
+    unsigned int ways;
+    /* Bumped on every access, orders the ways of a set for LRU */
+    uint64_t lru_clock;
+
+    /* num_sets * ways * (CACHE_GHOST_SCALE - 1) addresses */
+    uint64_t *ghost;
+    /*
+     * reuses[0] counts hits; reuses[i] counts the misses that a cache
+     * (i + 1) times bigger would have turned into hits.
+     */
+    uint64_t reuses[CACHE_GHOST_SCALE];
+
+    /* Previous table while a resize is in progress, moved a set at a time */
+    CacheItem *old_cache;
+    int64_t old_num_sets;
+    unsigned int old_ways;
+    unsigned long *old_moved;
+    int64_t old_next;
+    int64_t old_left;
 };
 
-PageCache *cache_init(int64_t num_pages, unsigned int page_size)
+static void cache_reset_items(CacheItem *items, int64_t count)
 {
     int64_t i;
 
-    PageCache *cache;
-
-    if (num_pages <= 0) {
-        DPRINTF("invalid number of pages\n");
-        return NULL;
+    for (i = 0; i < count; i++) {
+        items[i].it_data = NULL;
+        items[i].it_age = 0;
+        items[i].it_lru = 0;
+        items[i].it_addr = -1;
     }
+}
+
+/*
+ * Allocate the table for num_pages (rounded down to a power of 2).
+ * Returns: 0 on success, -1 if out of memory
+ */
+static int cache_alloc_table(PageCache *cache, int64_t num_pages)
+{
+    int64_t i, ghosts;
 
-    /* We prefer not to abort if there is no memory */
-    cache = g_try_malloc(sizeof(*cache));
-    if (!cache) {
-        DPRINTF("Failed to allocate cache\n");
-        return NULL;
-    }
-    /* round down to the nearest power of 2 */
     if (!is_power_of_2(num_pages)) {
         num_pages = pow2floor(num_pages);
         DPRINTF("rounding down to %" PRId64 "\n", num_pages);
     }
-    cache->page_size = page_size;
-    cache->num_items = 0;
-    cache->max_item_age = 0;
     cache->max_num_items = num_pages;
+    cache->ways = MIN(CACHE_WAYS, num_pages);
+    cache->num_sets = num_pages / cache->ways;
 
-    DPRINTF("Setting cache buckets to %" PRId64 "\n", cache->max_num_items);
+    DPRINTF("Setting cache to %" PRId64 " sets of %u ways\n",
+            cache->num_sets, cache->ways);
 
     /* We prefer not to abort if there is no memory */
     cache->page_cache = g_try_malloc((cache->max_num_items) *
                                      sizeof(*cache->page_cache));
     if (!cache->page_cache) {
         DPRINTF("Failed to allocate cache->page_cache\n");
-        g_free(cache);
+        return -1;
+    }
+    cache_reset_items(cache->page_cache, cache->max_num_items);
+
+    ghosts = cache->max_num_items * (CACHE_GHOST_SCALE - 1);
+    cache->ghost = g_try_malloc(ghosts * sizeof(*cache->ghost));
+    if (!cache->ghost) {
+        DPRINTF("Failed to allocate cache->ghost\n");
+        g_free(cache->page_cache);
+        cache->page_cache = NULL;
+        return -1;
+    }
+    for (i = 0; i < ghosts; i++) {
+        cache->ghost[i] = -1;
+    }
+    memset(cache->reuses, 0, sizeof(cache->reuses));
+
+    return 0;
+}
+
+PageCache *cache_init(int64_t num_pages, unsigned int page_size)
+{
+    PageCache *cache;
+
+    if (num_pages <= 0) {
+        DPRINTF("invalid number of pages\n");
+        return NULL;
+    }
+
+    /* We prefer not to abort if there is no memory */
+    cache = g_try_malloc0(sizeof(*cache));
+    if (!cache) {
+        DPRINTF("Failed to allocate cache\n");
         return NULL;
     }
+    cache->page_size = page_size;
 
-    for (i = 0; i < cache->max_num_items; i++) {
-        cache->page_cache[i].it_data = NULL;
-        cache->page_cache[i].it_age = 0;
-        cache->page_cache[i].it_addr = -1;
+    if (cache_alloc_table(cache, num_pages)) {
+        g_free(cache);
+        return NULL;
     }
 
     return cache;
 }
 
-void cache_fini(PageCache *cache)
+static void cache_free_items(CacheItem *items, int64_t count)
 {
     int64_t i;
 
+    for (i = 0; i < count; i++) {
+        g_free(items[i].it_data);
+    }
+    g_free(items);
+}
+
+static void cache_free_old(PageCache *cache)
+{
+    g_free(cache->old_cache);
+    cache->old_cache = NULL;
+    g_free(cache->old_moved);
+    cache->old_moved = NULL;
+    cache->old_left = 0;
+}
+
+void cache_fini(PageCache *cache)
+{
     g_assert(cache);
     g_assert(cache->page_cache);
 
-    for (i = 0; i < cache->max_num_items; i++) {
-        g_free(cache->page_cache[i].it_data);
+    if (cache->old_cache) {
+        int64_t i;
+
+        /* Pages not moved over yet are still owned by the old table */
+        for (i = 0; i < cache->old_num_sets; i++) {
+            if (!test_bit(i, cache->old_moved)) {
+                int64_t j;
+
+                for (j = 0; j < cache->old_ways; j++) {
+                    g_free(cache->old_cache[i * cache->old_ways + j].it_data);
+                }
+            }
+        }
+        cache_free_old(cache);
     }
 
-    g_free(cache->page_cache);
+    cache_free_items(cache->page_cache, cache->max_num_items);
     cache->page_cache = NULL;
+    g_free(cache->ghost);
     g_free(cache);
 }
 
-static size_t cache_get_cache_pos(const PageCache *cache,
-                                  uint64_t address)
+static int64_t cache_get_set(const PageCache *cache, uint64_t address,
+                             int64_t num_sets)
+{
+    g_assert(num_sets);
+    return (address / cache->page_size) & (num_sets - 1);
+}
+
+static CacheItem *cache_get_set_items(const PageCache *cache, uint64_t addr)
+{
+    return &cache->page_cache[cache_get_set(cache, addr, cache->num_sets) *
+                              cache->ways];
+}
+
+static uint64_t *cache_get_set_ghosts(const PageCache *cache, uint64_t addr)
+{
+    return &cache->ghost[cache_get_set(cache, addr, cache->num_sets) *
+                         cache->ways * (CACHE_GHOST_SCALE - 1)];
+}
+
+/* Remember a page that is not (or no longer) cached */
+static void cache_ghost_push(PageCache *cache, uint64_t addr)
 {
-    size_t pos;
+    uint64_t *ghosts = cache_get_set_ghosts(cache, addr);
+    unsigned int n = cache->ways * (CACHE_GHOST_SCALE - 1);
 
-    g_assert(cache->max_num_items);
-    pos = (address / cache->page_size) & (cache->max_num_items - 1);
-    return pos;
+    memmove(ghosts + 1, ghosts, (n - 1) * sizeof(*ghosts));
+    ghosts[0] = addr;
 }
 
-static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
+/* Account for a miss on addr, which is then forgotten from the ghosts */
+static void cache_ghost_lookup(PageCache *cache, uint64_t addr)
 {
-    size_t pos;
+    uint64_t *ghosts = cache_get_set_ghosts(cache, addr);
+    unsigned int n = cache->ways * (CACHE_GHOST_SCALE - 1);
+    unsigned int i;
+
+    for (i = 0; i < n; i++) {
+        if (ghosts[i] == addr) {
+            cache->reuses[1 + i / cache->ways]++;
+            memmove(ghosts + i, ghosts + i + 1, (n - i - 1) * sizeof(*ghosts));
+            ghosts[n - 1] = -1;
+            return;
+        }
+    }
+}
+
+/*
+ * Place an item from the old table into the current one, keeping the
+ * most recently used page on conflicts; the page data is moved, not
+ * copied.
+ */
+static void cache_move_item(PageCache *cache, CacheItem *old_it)
+{
+    CacheItem *set = cache_get_set_items(cache, old_it->it_addr);
+    CacheItem *victim = &set[0];
+    unsigned int i;
+
+    for (i = 0; i < cache->ways; i++) {
+        if (!set[i].it_data) {
+            victim = &set[i];
+            break;
+        }
+        if (set[i].it_lru < victim->it_lru) {
+            victim = &set[i];
+        }
+    }
+
+    if (victim->it_data) {
+        if (victim->it_lru >= old_it->it_lru) {
+            g_free(old_it->it_data);
+            return;
+        }
+        g_free(victim->it_data);
+    } else {
+        cache->num_items++;
+    }
+    *victim = *old_it;
+}
+
+static void cache_move_old_set(PageCache *cache, int64_t old_set)
+{
+    CacheItem *items = &cache->old_cache[old_set * cache->old_ways];
+    unsigned int i;
+
+    if (test_bit(old_set, cache->old_moved)) {
+        return;
+    }
+    for (i = 0; i < cache->old_ways; i++) {
+        if (items[i].it_data) {
+            cache_move_item(cache, &items[i]);
+        }
+    }
+    set_bit(old_set, cache->old_moved);
+    if (--cache->old_left == 0) {
+        cache_free_old(cache);
+    }
+}
+
+/*
+ * Make sure the old set addr used to map to has been moved over, and
+ * make some progress with the others, so that the resize completes
+ * within a bounded number of cache operations.
+ */
+static void cache_resize_step(PageCache *cache, uint64_t addr)
+{
+    int i;
+
+    if (!cache->old_cache) {
+        return;
+    }
+    cache_move_old_set(cache, cache_get_set(cache, addr,
+                                            cache->old_num_sets));
+    for (i = 0; i < CACHE_RESIZE_SETS_PER_OP && cache->old_cache; i++) {
+        while (test_bit(cache->old_next, cache->old_moved)) {
+            cache->old_next++;
+        }
+        cache_move_old_set(cache, cache->old_next);
+    }
+}
+
+static CacheItem *cache_get_by_addr(PageCache *cache, uint64_t addr)
+{
+    CacheItem *set;
+    unsigned int i;
 
     g_assert(cache);
     g_assert(cache->page_cache);
 
-    pos = cache_get_cache_pos(cache, addr);
+    cache_resize_step(cache, addr);
+
+    set = cache_get_set_items(cache, addr);
+    for (i = 0; i < cache->ways; i++) {
+        if (set[i].it_addr == addr) {
+            return &set[i];
+        }
+    }
 
-    return &cache->page_cache[pos];
+    return NULL;
 }
 
-uint8_t *get_cached_data(const PageCache *cache, uint64_t addr)
+uint8_t *get_cached_data(PageCache *cache, uint64_t addr)
 {
-    return cache_get_by_addr(cache, addr)->it_data;
+    CacheItem *it = cache_get_by_addr(cache, addr);
+
+    return it ? it->it_data : NULL;
 }
 
-bool cache_is_cached(const PageCache *cache, uint64_t addr,
-                     uint64_t current_age)
+bool cache_is_cached(PageCache *cache, uint64_t addr, uint64_t current_age)
 {
     CacheItem *it;
 
     it = cache_get_by_addr(cache, addr);
 
-    if (it->it_addr == addr) {
+    if (it) {
         /* update the it_age when the cache hit */
         it->it_age = current_age;
+        it->it_lru = ++cache->lru_clock;
+        cache->reuses[0]++;
         return true;
     }
+    cache_ghost_lookup(cache, addr);
     return false;
 }
 
 int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
                  uint64_t current_age)
 {
-
-    CacheItem *it;
+    CacheItem *set, *it;
+    unsigned int i;
 
     /* actual update of entry */
     it = cache_get_by_addr(cache, addr);
 
-    if (it->it_data && it->it_addr != addr &&
-        it->it_age + CACHED_PAGE_LIFETIME > current_age) {
-        /* the cache page is fresh, don't replace it */
-        return -1;
+    if (!it) {
+        /* prefer a free way, then the least recently used one */
+        set = cache_get_set_items(cache, addr);
+        it = &set[0];
+        for (i = 0; i < cache->ways; i++) {
+            if (!set[i].it_data) {
+                it = &set[i];
+                break;
+            }
+            if (set[i].it_lru < it->it_lru) {
+                it = &set[i];
+            }
+        }
+
+        if (it->it_data &&
+            it->it_age + CACHED_PAGE_LIFETIME > current_age) {
+            /* the cache page is fresh, don't replace it */
+            cache_ghost_push(cache, addr);
+            return -1;
+        }
+        if (it->it_data) {
+            cache_ghost_push(cache, it->it_addr);
+        }
     }
+
     /* allocate page */
     if (!it->it_data) {
         it->it_data = g_try_malloc(cache->page_size);
@@ -184,6 +430,7 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
     memcpy(it->it_data, pdata, cache->page_size);
 
     it->it_age = current_age;
+    it->it_lru = ++cache->lru_clock;
     it->it_addr = addr;
 
     return 0;
@@ -191,10 +438,10 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
 
 int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
 {
-    PageCache *new_cache;
-    int64_t i;
-
-    CacheItem *old_it, *new_it;
+    CacheItem *old_cache;
+    uint64_t *old_ghost;
+    int64_t old_num_items, old_num_sets, old_items;
+    unsigned int old_ways;
 
     g_assert(cache);
 
@@ -203,44 +450,79 @@ int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
         return -1;
     }
 
+    if (new_num_pages <= 0) {
+        return -1;
+    }
+
     /* same size */
     if (pow2floor(new_num_pages) == cache->max_num_items) {
         return cache->max_num_items;
     }
 
-    new_cache = cache_init(new_num_pages, cache->page_size);
-    if (!(new_cache)) {
+    /* Only one resize is carried out at a time */
+    while (cache->old_cache) {
+        cache_move_old_set(cache, cache->old_next++);
+    }
+
+    old_cache = cache->page_cache;
+    old_ghost = cache->ghost;
+    old_num_items = cache->max_num_items;
+    old_num_sets = cache->num_sets;
+    old_ways = cache->ways;
+    old_items = cache->num_items;
+
+    if (cache_alloc_table(cache, new_num_pages)) {
         DPRINTF("Error creating new cache\n");
+        cache->page_cache = old_cache;
+        cache->ghost = old_ghost;
+        cache->max_num_items = old_num_items;
+        cache->num_sets = old_num_sets;
+        cache->ways = old_ways;
         return -1;
     }
+    g_free(old_ghost);
+
+    /*
+     * Rather than rehashing every page now, keep the old table and move
+     * its sets over as they are used.
+     */
+    cache->old_moved = bitmap_new(old_num_sets);
+    cache->old_cache = old_cache;
+    cache->old_num_sets = old_num_sets;
+    cache->old_ways = old_ways;
+    cache->old_next = 0;
+    cache->old_left = old_num_sets;
+    cache->num_items = 0;
+    if (!old_items) {
+        cache_free_old(cache);
+    }
 
-    /* move all data from old cache */
-    for (i = 0; i < cache->max_num_items; i++) {
-        old_it = &cache->page_cache[i];
-        if (old_it->it_addr != -1) {
-            /* check for collision, if there is, keep MRU page */
-            new_it = cache_get_by_addr(new_cache, old_it->it_addr);
-            if (new_it->it_data && new_it->it_age >= old_it->it_age) {
-                /* keep the MRU page */
-                g_free(old_it->it_data);
-            } else {
-                if (!new_it->it_data) {
-                    new_cache->num_items++;
-                }
-                g_free(new_it->it_data);
-                new_it->it_data = old_it->it_data;
-                new_it->it_age = old_it->it_age;
-                new_it->it_addr = old_it->it_addr;
-            }
-        }
+    return cache->max_num_items;
+}
+
+int64_t cache_suggest_size(PageCache *cache)
+{
+    uint64_t total = 0, covered = 0;
+    int i, scale;
+
+    for (i = 0; i < CACHE_GHOST_SCALE; i++) {
+        total += cache->reuses[i];
+    }
+    if (!total) {
+        return cache->max_num_items;
     }
 
-    g_free(cache->page_cache);
-    cache->page_cache = new_cache->page_cache;
-    cache->max_num_items = new_cache->max_num_items;
-    cache->num_items = new_cache->num_items;
+    for (scale = 1; scale < CACHE_GHOST_SCALE; scale++) {
+        covered += cache->reuses[scale - 1];
+        if (covered * 100 >= total * CACHE_SUGGEST_HIT_PERCENT) {
+            break;
+        }
+    }
 
-    g_free(new_cache);
+    /* Let the older lookups fade out, so the advice follows the guest */
+    for (i = 0; i < CACHE_GHOST_SCALE; i++) {
+        cache->reuses[i] /= 2;
+    }
 
-    return cache->max_num_items;
+    return pow2ceil(cache->max_num_items * scale);
 }
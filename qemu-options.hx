@@ -3127,6 +3127,24 @@ the guest clock runs ahead of the host clock. Typically this happens
 when the shift value is high (how high depends on the host machine).
 ETEXI
 
+DEF("tcg", HAS_ARG, QEMU_OPTION_tcg, \
+    "-tcg [thread=single|multi]\n" \
+    "                run all TCG vCPUs in one host thread (default) or give\n" \
+    "                each vCPU its own thread\n", QEMU_ARCH_ALL)
+STEXI
+@item -tcg [thread=single|multi]
+@findex -tcg
+Select how the TCG accelerator runs the guest CPUs.  With @option{single},
+the default, all vCPUs take turns in one host thread.  @option{multi} runs
+each vCPU in its own host thread, so an SMP guest can use several host
+cores.
+
+@option{multi} is refused unless the guest architecture emulates its atomic
+instructions with host atomics (currently 32-bit ARM only) and the host
+orders memory accesses strongly (x86 and s390x).  It cannot be combined
+with @option{-icount}.
+ETEXI
+
 DEF("watchdog", HAS_ARG, QEMU_OPTION_watchdog, \
     "-watchdog i6300esb|ib700\n" \
     "                enable virtual hardware watchdog [default=none]\n",
@@ -3229,6 +3247,31 @@ STEXI
 Set TB size.
 ETEXI
 
+DEF("tb-cache", HAS_ARG, QEMU_OPTION_tb_cache, \
+    "-tb-cache file  reuse translations saved in file by an earlier run\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -tb-cache @var{file}
+@findex -tb-cache
+Keep the translated guest code in @var{file} across runs.  Translations
+found in the file are reused instead of decoding the guest code again, and
+the file is updated when QEMU exits.  The file is only valid for the QEMU
+binary and CPU model that wrote it; it is silently discarded otherwise.
+ETEXI
+
+DEF("tb-trace", HAS_ARG, QEMU_OPTION_tb_trace, \
+    "-tb-trace n     retranslate blocks run n times as multi-block traces\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -tb-trace @var{n}
+@findex -tb-trace
+Count how often each translated block runs, and retranslate a block that
+ran @var{n} times as a trace that follows direct jumps and the fall-through
+path of forward branches, so that the whole path is optimized together.
+Only some targets (currently x86) build traces.  0, the default, disables
+the counting.
+ETEXI
+
 DEF("incoming", HAS_ARG, QEMU_OPTION_incoming, \
     "-incoming tcp:[host]:port[,to=maxport][,ipv4][,ipv6]\n" \
     "-incoming rdma:host:port[,ipv4][,ipv6]\n" \
@@ -82,6 +82,13 @@ void json_prop_str(QJSON *json, const char *name, const char *str)
     qstring_append_chr(json->str, '"');
 }
 
+/* Append the finished object @obj as an element of @json */
+void json_prop_qjson(QJSON *json, const char *name, QJSON *obj)
+{
+    json_emit_element(json, name);
+    qstring_append(json->str, qjson_get_str(obj));
+}
+
 const char *qjson_get_str(QJSON *json)
 {
     return qstring_get_str(json->str);
@@ -609,7 +609,7 @@ EQMP
 
     {
         .name       = "migrate",
-        .args_type  = "detach:-d,blk:-b,inc:-i,uri:s",
+        .args_type  = "detach:-d,blk:-b,inc:-i,uri:s,bitmap:s?",
         .mhandler.cmd_new = qmp_marshal_input_migrate,
     },
 
@@ -624,6 +624,8 @@ Arguments:
 - "blk": block migration, full disk copy (json-bool, optional)
 - "inc": incremental disk copy (json-bool, optional)
 - "uri": Destination URI (json-string)
+- "bitmap": block migration copying only the sectors marked in the dirty
+            bitmap of this name (json-string, optional)
 
 Example:
 
@@ -659,6 +661,28 @@ Example:
 -> { "execute": "migrate_cancel" }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "migrate-start-postcopy",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_migrate_start_postcopy,
+    },
+
+SQMP
+migrate-start-postcopy
+----------------------
+
+Switch an ongoing migration with the x-postcopy-ram capability to postcopy
+mode.
+
+Arguments: None.
+
+Example:
+
+-> { "execute": "migrate-start-postcopy" }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -2462,6 +2486,9 @@ Each json-object contain the following:
             protocol (e.g. the host file for a qcow2 image). If there is
             no underlying protocol, this field is omitted
             (json-object, optional)
+- "driver-specific": Statistics specific to the image format, e.g. the
+                     size and hit rate of the qcow2 metadata caches
+                     (json-object, optional)
 
 Example:
 
@@ -2623,6 +2650,15 @@ Return a json-array. Each iothread is represented by a json-object, which contai
 
 - "id": name of iothread (json-str)
 - "thread-id": ID of the underlying host thread (json-int)
+- "poll-max-ns": maximum polling time in ns, 0 if polling is disabled
+  (json-int)
+- "poll-grow": polling time growth factor, 0 for the default (json-int)
+- "poll-shrink": polling time shrink factor, 0 to stop polling as soon as
+  it does not pay off (json-int)
+- "poll-ns": current polling time in ns (json-int)
+- "poll-hits": number of times polling found work to do (json-int)
+- "poll-misses": number of times polling gave up (json-int)
+- "poll-sleeps": number of times the iothread waited in the kernel (json-int)
 
 Example:
 
@@ -2631,11 +2667,25 @@ Example:
       "return":[
          {
             "id":"iothread0",
-            "thread-id":3134
+            "thread-id":3134,
+            "poll-max-ns":32768,
+            "poll-grow":0,
+            "poll-shrink":0,
+            "poll-ns":8000,
+            "poll-hits":10327,
+            "poll-misses":412,
+            "poll-sleeps":433
          },
          {
             "id":"iothread1",
-            "thread-id":3135
+            "thread-id":3135,
+            "poll-max-ns":0,
+            "poll-grow":0,
+            "poll-shrink":0,
+            "poll-ns":0,
+            "poll-hits":0,
+            "poll-misses":0,
+            "poll-sleeps":2051
          }
       ]
    }
@@ -3227,7 +3277,8 @@ block migration status.
 The main json-object contains the following:
 
 - "status": migration status (json-string)
-     - Possible values: "setup", "active", "completed", "failed", "cancelled"
+     - Possible values: "setup", "active", "postcopy-active", "completed",
+                        "failed", "cancelled"
 - "total-time": total amount of ms since migration started.  If
                 migration has ended, it returns the total migration
                 time (json-int)
@@ -3242,6 +3293,9 @@ The main json-object contains the following:
 - "expected-downtime": only present while migration is active
                 total amount in ms for downtime that was calculated on
                 the last bitmap round (json-int)
+- "x-cpu-throttle-percentage": only present while auto-converge is
+                throttling the guest; percentage of time the guest
+                cpus are kept from running (json-int)
 - "ram": only present if "status" is "active", it is a json-object with the
   following RAM information:
          - "transferred": amount transferred in bytes (json-int)
@@ -3258,6 +3312,12 @@ The main json-object contains the following:
             but this way upper levels don't need to care about page
             size (json-int)
          - "dirty-sync-count": times that dirty ram was synchronized (json-int)
+         - "copied-bytes": bytes copied into a staging buffer before
+            being sent; only present with x-zerocopy (json-int)
+         - "zero-copy-sends": number of zero-copy socket writes; only
+            present with x-zerocopy (json-int)
+         - "zero-copy-fallbacks": number of zero-copy socket writes the
+            kernel copied anyway; only present with x-zerocopy (json-int)
 - "disk": only present if "status" is "active" and it is a block migration,
   it is a json-object with the following disk information:
          - "transferred": amount transferred in bytes (json-int)
@@ -3274,6 +3334,8 @@ The main json-object contains the following:
            that the XBZRLE encoding was bigger than just sent the
            whole page, and then we sent the whole page instead (as as
            normal page).
+         - "suggested-cache-size": cache size in bytes that would have
+           avoided most misses on reused pages (json-int)
 
 Examples:
 
@@ -3379,7 +3441,8 @@ Examples:
             "pages":2444343,
             "cache-miss":2244,
             "cache-miss-rate":0.123,
-            "overflow":34434
+            "overflow":34434,
+            "suggested-cache-size":134217728
          }
       }
    }
@@ -3402,6 +3465,10 @@ Enable/Disable migration capabilities
 - "rdma-pin-all": pin all pages when using RDMA during migration
 - "auto-converge": throttle down guest to help convergence of migration
 - "zero-blocks": compress zero blocks during block migration
+- "x-postcopy-ram": postcopy mode for RAM migration, started with
+                    migrate-start-postcopy
+- "x-multifd": send RAM pages over several connections in parallel
+- "x-zerocopy": send guest RAM with MSG_ZEROCOPY where supported
 
 Arguments:
 
@@ -3429,6 +3496,9 @@ Query current migration capabilities
          - "rdma-pin-all" : RDMA Pin Page state (json-bool)
          - "auto-converge" : Auto Converge state (json-bool)
          - "zero-blocks" : Zero Blocks state (json-bool)
+         - "x-postcopy-ram" : Postcopy RAM state (json-bool)
+         - "x-multifd" : Multifd state (json-bool)
+         - "x-zerocopy" : Zero-copy send state (json-bool)
 
 Arguments:
 
@@ -3454,6 +3524,17 @@ Set migration parameters
 - "compress-level": set compression level during migration (json-int)
 - "compress-threads": set compression thread count for migration (json-int)
 - "decompress-threads": set decompression thread count for migration (json-int)
+- "x-multifd-channels": set the number of multifd connections (json-int)
+- "x-cpu-throttle-initial": set initial percentage of time guest cpus are
+                            throttled for auto-converge (json-int)
+- "x-cpu-throttle-increment": set smallest step by which auto-converge raises
+                              the throttle percentage (json-int)
+- "x-cpu-throttle-max": set the highest throttle percentage auto-converge
+                        may use (json-int)
+- "x-compress-method": set the codec for compressed pages, one of "zlib",
+                       "lz4" or "zstd" (json-string)
+- "x-vmstate-threads": set the number of threads saving and loading device
+                       state, 0 for none (json-int)
 
 Arguments:
 
@@ -3467,7 +3548,10 @@ EQMP
     {
         .name       = "migrate-set-parameters",
         .args_type  =
-            "compress-level:i?,compress-threads:i?,decompress-threads:i?",
+            "compress-level:i?,compress-threads:i?,decompress-threads:i?,"
+            "x-multifd-channels:i?,x-cpu-throttle-initial:i?,"
+            "x-cpu-throttle-increment:i?,x-cpu-throttle-max:i?,"
+            "x-compress-method:s?,x-vmstate-threads:i?",
 	.mhandler.cmd_new = qmp_marshal_input_migrate_set_parameters,
     },
 SQMP
@@ -3480,6 +3564,12 @@ Query current migration parameters
          - "compress-level" : compression level value (json-int)
          - "compress-threads" : compression thread count value (json-int)
          - "decompress-threads" : decompression thread count value (json-int)
+         - "x-multifd-channels" : number of multifd connections (json-int)
+         - "x-cpu-throttle-initial" : initial throttle percentage (json-int)
+         - "x-cpu-throttle-increment" : smallest throttle step (json-int)
+         - "x-cpu-throttle-max" : maximum throttle percentage (json-int)
+         - "x-compress-method" : codec for compressed pages (json-string)
+         - "x-vmstate-threads" : device state thread count (json-int)
 
 Arguments:
 
@@ -3488,8 +3578,14 @@ Example:
 -> { "execute": "query-migrate-parameters" }
 <- {
       "return": {
-         "decompress-threads", 2,
-         "compress-threads", 8,
+         "x-vmstate-threads", 0,
+         "x-compress-method", "zlib",
+         "x-cpu-throttle-max", 99,
+         "x-cpu-throttle-increment", 10,
+         "x-cpu-throttle-initial", 20,
+         "x-multifd-channels", 2,
+         "decompress-threads", 0,
+         "compress-threads", 0,
          "compress-level", 1
       }
    }
@@ -33,6 +33,7 @@
 #include "qemu/timer.h"
 #include "audio/audio.h"
 #include "migration/migration.h"
+#include "migration/postcopy-ram.h"
 #include "qemu/sockets.h"
 #include "qemu/queue.h"
 #include "sysemu/cpus.h"
@@ -42,6 +43,10 @@
 #include "qemu/iov.h"
 #include "block/snapshot.h"
 #include "block/qapi.h"
+#include "qemu/bswap.h"
+#include "qemu/error-report.h"
+#include "qemu/thread.h"
+#include "qemu/atomic.h"
 
 
 #ifndef ETH_P_RARP
@@ -602,6 +607,139 @@ static void vmstate_save(QEMUFile *f, SaveStateEntry *se, QJSON *vmdesc)
     vmstate_save_state(f, se->vmsd, se->opaque, vmdesc);
 }
 
+/*
+ * Device state sections handled by the x-vmstate-threads workers.
+ *
+ * A run of sections that don't use an ordered VMStateDescription is
+ * collected into a batch.  The top level pre_save/pre_load hooks are run
+ * by the migration thread as each section is queued; the workers then
+ * save or load the fields of the queued sections concurrently, while the
+ * migration thread waits for them holding the iothread lock, and the
+ * post_load hooks run afterwards in stream order.
+ */
+typedef struct VMStateJob {
+    SaveStateEntry *se;
+    uint32_t instance_id;
+    int version_id;
+    /* Saving: the worker buffer holding the section, and where */
+    int worker;
+    int64_t start;
+    int64_t len;
+    QJSON *vmdesc;
+    /* Loading: the section, read in full from the stream */
+    QEMUSizedBuffer *qsb;
+    QEMUFile *f;
+    int ret;
+} VMStateJob;
+
+typedef struct VMStateWorker VMStateWorker;
+
+typedef struct VMStateBatch {
+    bool load;
+    int count;
+    int next;               /* next job to be picked by a worker */
+    VMStateJob *jobs;
+    VMStateWorker *workers;
+    int nr_workers;
+} VMStateBatch;
+
+struct VMStateWorker {
+    QemuThread thread;
+    VMStateBatch *batch;
+    int index;
+    QEMUFile *f;            /* saving only, holds all the worker's jobs */
+};
+
+static VMStateJob *vmstate_batch_add(VMStateBatch *batch, SaveStateEntry *se)
+{
+    VMStateJob *job;
+
+    batch->jobs = g_renew(VMStateJob, batch->jobs, batch->count + 1);
+    job = &batch->jobs[batch->count++];
+    memset(job, 0, sizeof(*job));
+    job->se = se;
+
+    return job;
+}
+
+static void *vmstate_worker_thread(void *opaque)
+{
+    VMStateWorker *w = opaque;
+    VMStateBatch *batch = w->batch;
+    int i;
+
+    while ((i = atomic_fetch_inc(&batch->next)) < batch->count) {
+        VMStateJob *job = &batch->jobs[i];
+        SaveStateEntry *se = job->se;
+
+        if (batch->load) {
+            job->ret = vmstate_load_state_fields(job->f, se->vmsd, se->opaque,
+                                                 job->version_id);
+            if (!job->ret) {
+                job->ret = qemu_file_get_error(job->f);
+            }
+            continue;
+        }
+
+        job->worker = w->index;
+        job->start = qemu_ftell_fast(w->f);
+        if (se->vmsd) {
+            vmstate_save_state_fields(w->f, se->vmsd, se->opaque,
+                                      job->vmdesc);
+        } else {
+            vmstate_save_old_style(w->f, se, job->vmdesc);
+        }
+        job->len = qemu_ftell_fast(w->f) - job->start;
+    }
+
+    return NULL;
+}
+
+/*
+ * Run the queued jobs of @batch on up to x-vmstate-threads workers and
+ * wait for them to finish.  When saving, the worker files are left open
+ * for the caller.
+ */
+static void vmstate_batch_run(VMStateBatch *batch)
+{
+    int i;
+
+    batch->nr_workers = MIN(migrate_vmstate_threads(), batch->count);
+    batch->workers = g_new0(VMStateWorker, batch->nr_workers);
+    batch->next = 0;
+    trace_vmstate_batch_run(batch->count, batch->nr_workers);
+
+    for (i = 0; i < batch->nr_workers; i++) {
+        VMStateWorker *w = &batch->workers[i];
+
+        w->batch = batch;
+        w->index = i;
+        if (!batch->load) {
+            w->f = qemu_bufopen("w", NULL);
+        }
+        qemu_thread_create(&w->thread, "vmstate", vmstate_worker_thread, w,
+                           QEMU_THREAD_JOINABLE);
+    }
+    for (i = 0; i < batch->nr_workers; i++) {
+        qemu_thread_join(&batch->workers[i].thread);
+    }
+}
+
+static void vmstate_batch_reset(VMStateBatch *batch)
+{
+    int i;
+
+    for (i = 0; i < batch->nr_workers; i++) {
+        if (batch->workers[i].f) {
+            qemu_fclose(batch->workers[i].f);
+        }
+    }
+    g_free(batch->workers);
+    batch->workers = NULL;
+    batch->nr_workers = 0;
+    batch->count = 0;
+}
+
 bool qemu_savevm_state_blocked(Error **errp)
 {
     SaveStateEntry *se;
@@ -616,6 +754,194 @@ bool qemu_savevm_state_blocked(Error **errp)
     return false;
 }
 
+static const struct {
+    ssize_t len; /* -1 = variable */
+    const char *name;
+} mig_cmd_args[] = {
+    [MIG_CMD_INVALID]          = { .len = -1, .name = "INVALID" },
+    [MIG_CMD_OPEN_RETURN_PATH] = { .len =  0, .name = "OPEN_RETURN_PATH" },
+    [MIG_CMD_POSTCOPY_ADVISE]  = { .len = 16, .name = "POSTCOPY_ADVISE" },
+    [MIG_CMD_POSTCOPY_LISTEN]  = { .len =  0, .name = "POSTCOPY_LISTEN" },
+    [MIG_CMD_POSTCOPY_RUN]     = { .len =  0, .name = "POSTCOPY_RUN" },
+    [MIG_CMD_POSTCOPY_RAM_DISCARD] = {
+                                   .len = -1, .name = "POSTCOPY_RAM_DISCARD" },
+    [MIG_CMD_PACKAGED]         = { .len =  4, .name = "PACKAGED" },
+    [MIG_CMD_MAX]              = { .len = -1, .name = "MAX" },
+};
+
+/* Write the header of a section that carries the device's whole state */
+static void save_section_header(QEMUFile *f, SaveStateEntry *se,
+                                uint8_t section_type)
+{
+    int len;
+
+    /* Section type */
+    qemu_put_byte(f, section_type);
+    qemu_put_be32(f, se->section_id);
+
+    /* ID string */
+    len = strlen(se->idstr);
+    qemu_put_byte(f, len);
+    qemu_put_buffer(f, (uint8_t *)se->idstr, len);
+
+    qemu_put_be32(f, se->instance_id);
+    qemu_put_be32(f, se->version_id);
+}
+
+/* Copy @len bytes of @qsb, starting at @start, into @f */
+static void qemu_put_qsb_range(QEMUFile *f, const QEMUSizedBuffer *qsb,
+                               size_t start, size_t len)
+{
+    size_t cur_iov;
+
+    for (cur_iov = 0; cur_iov < qsb->n_iov && len; cur_iov++) {
+        /* The iov entries are partially filled */
+        size_t iov_len = qsb->iov[cur_iov].iov_len;
+        size_t towrite;
+
+        if (start >= iov_len) {
+            start -= iov_len;
+            continue;
+        }
+        towrite = MIN(iov_len - start, len);
+        qemu_put_buffer(f, (uint8_t *)qsb->iov[cur_iov].iov_base + start,
+                        towrite);
+        start = 0;
+        len -= towrite;
+    }
+}
+
+void qemu_savevm_state_header(QEMUFile *f)
+{
+    trace_savevm_state_header();
+    qemu_put_be32(f, QEMU_VM_FILE_MAGIC);
+    qemu_put_be32(f, QEMU_VM_FILE_VERSION);
+}
+
+/* Send a 'QEMU_VM_COMMAND' type element with the command
+ * and associated data.
+ */
+void qemu_savevm_command_send(QEMUFile *f,
+                              enum qemu_vm_cmd command,
+                              uint16_t len,
+                              uint8_t *data)
+{
+    trace_savevm_command_send(command, len);
+    qemu_put_byte(f, QEMU_VM_COMMAND);
+    qemu_put_be16(f, (uint16_t)command);
+    qemu_put_be16(f, len);
+    qemu_put_buffer(f, data, len);
+    qemu_fflush(f);
+}
+
+void qemu_savevm_send_open_return_path(QEMUFile *f)
+{
+    trace_savevm_send_open_return_path();
+    qemu_savevm_command_send(f, MIG_CMD_OPEN_RETURN_PATH, 0, NULL);
+}
+
+/* We have a buffer of data to send; we don't want that all to be loaded
+ * by the command itself, whose length is only 16 bits, so the command
+ * contains just the length of the extra buffer that we then send straight
+ * after it.
+ *
+ * Returns:
+ *    0 on success
+ *    -ve on error
+ */
+int qemu_savevm_send_packaged(QEMUFile *f, const QEMUSizedBuffer *qsb)
+{
+    size_t len = qsb_get_length(qsb);
+    uint32_t tmp;
+
+    if (len > MAX_VM_CMD_PACKAGED_SIZE) {
+        error_report("%s: Unreasonably large packaged state: %zu",
+                     __func__, len);
+        return -1;
+    }
+
+    tmp = cpu_to_be32(len);
+
+    trace_qemu_savevm_send_packaged();
+    qemu_savevm_command_send(f, MIG_CMD_PACKAGED, 4, (uint8_t *)&tmp);
+
+    /* all the data follows (concatinating the iov's) */
+    qemu_put_qsb_range(f, qsb, 0, len);
+
+    return 0;
+}
+
+/* Send prior to any postcopy transfer */
+void qemu_savevm_send_postcopy_advise(QEMUFile *f)
+{
+    uint64_t tmp[2];
+    tmp[0] = cpu_to_be64(getpagesize());
+    tmp[1] = cpu_to_be64(TARGET_PAGE_SIZE);
+
+    trace_qemu_savevm_send_postcopy_advise();
+    qemu_savevm_command_send(f, MIG_CMD_POSTCOPY_ADVISE, 16, (uint8_t *)tmp);
+}
+
+/* Sent prior to starting the destination running in postcopy, discard pages
+ * that have already been sent but redirtied on the source.
+ * CMD_POSTCOPY_RAM_DISCARD consist of:
+ *      byte   version (0)
+ *      byte   Length of name field (not including 0)
+ *  n x byte   RAM block name
+ *      byte   0 terminator (just for safety)
+ *  n x        Byte ranges within the named RAMBlock
+ *      be64   Start of the range
+ *      be64   Length
+ *
+ *  name:  RAMBlock name that these entries are part of
+ *  len: Number of page entries
+ *  start_list: 'len' addresses
+ *  length_list: 'len' addresses
+ *
+ */
+void qemu_savevm_send_postcopy_ram_discard(QEMUFile *f, const char *name,
+                                           uint16_t len,
+                                           uint64_t *start_list,
+                                           uint64_t *length_list)
+{
+    uint8_t *buf;
+    uint16_t tmplen;
+    uint16_t t;
+    size_t name_len = strlen(name);
+
+    trace_qemu_savevm_send_postcopy_ram_discard(name, len);
+    assert(name_len < 256);
+    buf = g_malloc0(1 + 1 + name_len + 1 + (8 + 8) * len);
+    buf[0] = 0; /* Version */
+    buf[1] = name_len;
+    memcpy(buf + 2, name, name_len);
+    tmplen = 2 + name_len;
+    buf[tmplen++] = '\0';
+
+    for (t = 0; t < len; t++) {
+        stq_be_p(buf + tmplen, start_list[t]);
+        tmplen += 8;
+        stq_be_p(buf + tmplen, length_list[t]);
+        tmplen += 8;
+    }
+    qemu_savevm_command_send(f, MIG_CMD_POSTCOPY_RAM_DISCARD, tmplen, buf);
+    g_free(buf);
+}
+
+/* Get the destination into a state where it can receive postcopy data. */
+void qemu_savevm_send_postcopy_listen(QEMUFile *f)
+{
+    trace_savevm_send_postcopy_listen();
+    qemu_savevm_command_send(f, MIG_CMD_POSTCOPY_LISTEN, 0, NULL);
+}
+
+/* Kick the destination into running */
+void qemu_savevm_send_postcopy_run(QEMUFile *f)
+{
+    trace_savevm_send_postcopy_run();
+    qemu_savevm_command_send(f, MIG_CMD_POSTCOPY_RUN, 0, NULL);
+}
+
 void qemu_savevm_state_begin(QEMUFile *f,
                              const MigrationParams *params)
 {
@@ -630,9 +956,6 @@ void qemu_savevm_state_begin(QEMUFile *f,
         se->ops->set_params(params, se->opaque);
     }
 
-    qemu_put_be32(f, QEMU_VM_FILE_MAGIC);
-    qemu_put_be32(f, QEMU_VM_FILE_VERSION);
-
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
         int len;
 
@@ -670,9 +993,17 @@ void qemu_savevm_state_begin(QEMUFile *f,
  *   0 : We haven't finished, caller have to go again
  *   1 : We have finished, we can go to complete phase
  */
+/* True if @se keeps running into the postcopy phase */
+static bool savevm_se_can_postcopy(SaveStateEntry *se)
+{
+    return se->ops && se->ops->can_postcopy &&
+           se->ops->can_postcopy(se->opaque);
+}
+
 int qemu_savevm_state_iterate(QEMUFile *f)
 {
     SaveStateEntry *se;
+    bool in_postcopy = migration_in_postcopy(migrate_get_current());
     int ret = 1;
 
     trace_savevm_state_iterate();
@@ -685,6 +1016,10 @@ int qemu_savevm_state_iterate(QEMUFile *f)
                 continue;
             }
         }
+        if (in_postcopy && !savevm_se_can_postcopy(se)) {
+            /* Already completed by postcopy_start */
+            continue;
+        }
         if (qemu_file_rate_limit(f)) {
             return 0;
         }
@@ -716,11 +1051,42 @@ static bool should_send_vmdesc(void)
     return !machine->suppress_vmdesc;
 }
 
+/*
+ * Save the sections queued in @batch concurrently, then write them out
+ * in order, each as a QEMU_VM_SECTION_FULL_SIZED section.
+ */
+static void savevm_batch_save(QEMUFile *f, VMStateBatch *batch, QJSON *vmdesc)
+{
+    int i;
+
+    if (!batch->count) {
+        return;
+    }
+    vmstate_batch_run(batch);
+
+    for (i = 0; i < batch->count; i++) {
+        VMStateJob *job = &batch->jobs[i];
+        SaveStateEntry *se = job->se;
+
+        save_section_header(f, se, QEMU_VM_SECTION_FULL_SIZED);
+        qemu_put_be32(f, job->len);
+        qemu_put_qsb_range(f, qemu_buf_get(batch->workers[job->worker].f),
+                           job->start, job->len);
+
+        qjson_finish(job->vmdesc);
+        json_prop_qjson(vmdesc, NULL, job->vmdesc);
+        object_unref(OBJECT(job->vmdesc));
+        trace_savevm_section_end(se->idstr, se->section_id, 0);
+    }
+    vmstate_batch_reset(batch);
+}
+
 void qemu_savevm_state_complete(QEMUFile *f)
 {
     QJSON *vmdesc;
     int vmdesc_len;
     SaveStateEntry *se;
+    VMStateBatch batch = { .load = false };
     int ret;
 
     trace_savevm_state_complete();
@@ -753,34 +1119,38 @@ void qemu_savevm_state_complete(QEMUFile *f)
     json_prop_int(vmdesc, "page_size", TARGET_PAGE_SIZE);
     json_start_array(vmdesc, "devices");
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
-        int len;
-
         if ((!se->ops || !se->ops->save_state) && !se->vmsd) {
             continue;
         }
         trace_savevm_section_start(se->idstr, se->section_id);
 
+        if (migrate_vmstate_threads() &&
+            !(se->vmsd && vmstate_is_ordered(se->vmsd))) {
+            VMStateJob *job = vmstate_batch_add(&batch, se);
+
+            trace_vmstate_save(se->idstr, se->vmsd ? se->vmsd->name : "(old)");
+            if (se->vmsd && se->vmsd->pre_save) {
+                se->vmsd->pre_save(se->opaque);
+            }
+            job->vmdesc = qjson_new();
+            json_prop_str(job->vmdesc, "name", se->idstr);
+            json_prop_int(job->vmdesc, "instance_id", se->instance_id);
+            continue;
+        }
+        savevm_batch_save(f, &batch, vmdesc);
+
         json_start_object(vmdesc, NULL);
         json_prop_str(vmdesc, "name", se->idstr);
         json_prop_int(vmdesc, "instance_id", se->instance_id);
 
-        /* Section type */
-        qemu_put_byte(f, QEMU_VM_SECTION_FULL);
-        qemu_put_be32(f, se->section_id);
-
-        /* ID string */
-        len = strlen(se->idstr);
-        qemu_put_byte(f, len);
-        qemu_put_buffer(f, (uint8_t *)se->idstr, len);
-
-        qemu_put_be32(f, se->instance_id);
-        qemu_put_be32(f, se->version_id);
-
+        save_section_header(f, se, QEMU_VM_SECTION_FULL);
         vmstate_save(f, se, vmdesc);
 
         json_end_object(vmdesc);
         trace_savevm_section_end(se->idstr, se->section_id, 0);
     }
+    savevm_batch_save(f, &batch, vmdesc);
+    g_free(batch.jobs);
 
     qemu_put_byte(f, QEMU_VM_EOF);
 
@@ -798,9 +1168,100 @@ void qemu_savevm_state_complete(QEMUFile *f)
     qemu_fflush(f);
 }
 
+/*
+ * Calls the save_live_complete method for the iterable devices
+ * (i.e. RAM) to finish off the data they still hold once the
+ * destination is already running in postcopy, then ends the stream.
+ */
+/*
+ * Send the final section of each live handler whose ability to carry on
+ * in postcopy matches @postcopy.
+ */
+static void qemu_savevm_state_complete_live(QEMUFile *f, bool postcopy)
+{
+    SaveStateEntry *se;
+    int ret;
+
+    QTAILQ_FOREACH(se, &savevm_handlers, entry) {
+        if (!se->ops || !se->ops->save_live_complete) {
+            continue;
+        }
+        if (se->ops && se->ops->is_active) {
+            if (!se->ops->is_active(se->opaque)) {
+                continue;
+            }
+        }
+        if (savevm_se_can_postcopy(se) != postcopy) {
+            continue;
+        }
+        trace_savevm_section_start(se->idstr, se->section_id);
+        /* Section type */
+        qemu_put_byte(f, QEMU_VM_SECTION_END);
+        qemu_put_be32(f, se->section_id);
+
+        ret = se->ops->save_live_complete(f, se->opaque);
+        trace_savevm_section_end(se->idstr, se->section_id, ret);
+        if (ret < 0) {
+            qemu_file_set_error(f, ret);
+            return;
+        }
+    }
+}
+
+/*
+ * Called as we switch to postcopy: live sections that can't carry on
+ * once the destination is running send their final data now.
+ */
+void qemu_savevm_state_complete_nonpostcopy(QEMUFile *f)
+{
+    qemu_savevm_state_complete_live(f, false);
+}
+
+/* Called at the very end of postcopy, once everything has been sent */
+void qemu_savevm_state_complete_postcopy(QEMUFile *f)
+{
+    qemu_savevm_state_complete_live(f, true);
+    if (qemu_file_get_error(f)) {
+        return;
+    }
+
+    qemu_put_byte(f, QEMU_VM_EOF);
+    qemu_fflush(f);
+}
+
+/*
+ * Save the state of all the non-iterable devices, as used for the
+ * package that switches the destination into postcopy.  The iterable
+ * (RAM) sections stay open and are finished later by
+ * qemu_savevm_state_complete_postcopy(); no EOF is written.
+ */
+int qemu_savevm_state_device_only(QEMUFile *f)
+{
+    SaveStateEntry *se;
+
+    cpu_synchronize_all_states();
+
+    QTAILQ_FOREACH(se, &savevm_handlers, entry) {
+        if (se->is_ram) {
+            continue;
+        }
+        if ((!se->ops || !se->ops->save_state) && !se->vmsd) {
+            continue;
+        }
+        trace_savevm_section_start(se->idstr, se->section_id);
+
+        save_section_header(f, se, QEMU_VM_SECTION_FULL);
+        vmstate_save(f, se, NULL);
+        trace_savevm_section_end(se->idstr, se->section_id, 0);
+    }
+
+    return qemu_file_get_error(f);
+}
+
 uint64_t qemu_savevm_state_pending(QEMUFile *f, uint64_t max_size)
 {
     SaveStateEntry *se;
+    bool in_postcopy = migration_in_postcopy(migrate_get_current());
     uint64_t ret = 0;
 
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
@@ -812,6 +1273,9 @@ uint64_t qemu_savevm_state_pending(QEMUFile *f, uint64_t max_size)
                 continue;
             }
         }
+        if (in_postcopy && !savevm_se_can_postcopy(se)) {
+            continue;
+        }
         ret += se->ops->save_live_pending(f, se->opaque, max_size);
     }
     return ret;
@@ -842,6 +1306,7 @@ static int qemu_savevm_state(QEMUFile *f, Error **errp)
     }
 
     qemu_mutex_unlock_iothread();
+    qemu_savevm_state_header(f);
     qemu_savevm_state_begin(f, &params);
     qemu_mutex_lock_iothread();
 
@@ -865,37 +1330,9 @@ static int qemu_savevm_state(QEMUFile *f, Error **errp)
 
 static int qemu_save_device_state(QEMUFile *f)
 {
-    SaveStateEntry *se;
-
-    qemu_put_be32(f, QEMU_VM_FILE_MAGIC);
-    qemu_put_be32(f, QEMU_VM_FILE_VERSION);
-
-    cpu_synchronize_all_states();
+    qemu_savevm_state_header(f);
 
-    QTAILQ_FOREACH(se, &savevm_handlers, entry) {
-        int len;
-
-        if (se->is_ram) {
-            continue;
-        }
-        if ((!se->ops || !se->ops->save_state) && !se->vmsd) {
-            continue;
-        }
-
-        /* Section type */
-        qemu_put_byte(f, QEMU_VM_SECTION_FULL);
-        qemu_put_be32(f, se->section_id);
-
-        /* ID string */
-        len = strlen(se->idstr);
-        qemu_put_byte(f, len);
-        qemu_put_buffer(f, (uint8_t *)se->idstr, len);
-
-        qemu_put_be32(f, se->instance_id);
-        qemu_put_be32(f, se->version_id);
-
-        vmstate_save(f, se, NULL);
-    }
+    qemu_savevm_state_device_only(f);
 
     qemu_put_byte(f, QEMU_VM_EOF);
 
@@ -922,55 +1359,542 @@ static SaveStateEntry *find_se(const char *idstr, int instance_id)
     return NULL;
 }
 
-typedef struct LoadStateEntry {
+struct LoadStateEntry {
     QLIST_ENTRY(LoadStateEntry) entry;
     SaveStateEntry *se;
     int section_id;
     int version_id;
-} LoadStateEntry;
+};
 
-int qemu_loadvm_state(QEMUFile *f)
+void loadvm_free_handlers(MigrationIncomingState *mis)
 {
-    QLIST_HEAD(, LoadStateEntry) loadvm_handlers =
-        QLIST_HEAD_INITIALIZER(loadvm_handlers);
     LoadStateEntry *le, *new_le;
+
+    QLIST_FOREACH_SAFE(le, &mis->loadvm_handlers, entry, new_le) {
+        QLIST_REMOVE(le, entry);
+        g_free(le);
+    }
+}
+
+/* Returned by a command to stop the (possibly nested) loadvm loops */
+#define LOADVM_QUIT     1
+
+/* Handle a 'POSTCOPY_ADVISE' command: the source may want to postcopy later */
+static int loadvm_postcopy_handle_advise(MigrationIncomingState *mis,
+                                         QEMUFile *f)
+{
+    PostcopyState ps = postcopy_state_set(POSTCOPY_INCOMING_ADVISE);
+    uint64_t remote_hps, remote_tps;
+
+    trace_loadvm_postcopy_handle_advise();
+    remote_hps = qemu_get_be64(f);
+    remote_tps = qemu_get_be64(f);
+
+    if (ps != POSTCOPY_INCOMING_NONE) {
+        error_report("CMD_POSTCOPY_ADVISE in wrong postcopy state (%d)", ps);
+        return -1;
+    }
+
+    if (!postcopy_ram_supported_by_host()) {
+        return -1;
+    }
+
+    /*
+     * Pages are placed atomically one at a time, so a host page must hold
+     * exactly one target page, and both sides must agree on the sizes.
+     */
+    if (remote_hps != getpagesize() || remote_tps != TARGET_PAGE_SIZE ||
+        TARGET_PAGE_SIZE != getpagesize()) {
+        error_report("Postcopy needs matching host and target page sizes "
+                     "(s=%" PRIu64 "/%" PRIu64 " d=%d/%d)",
+                     remote_hps, remote_tps, getpagesize(),
+                     (int)TARGET_PAGE_SIZE);
+        return -1;
+    }
+
+    if (postcopy_ram_incoming_init(mis)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* After postcopy we will be told to throw some pages away since they're
+ * dirty and will have to be demand fetched.  Must happen before CPU is
+ * started.
+ * There can be 0..many of these messages, each encoding multiple pages.
+ */
+static int loadvm_postcopy_ram_handle_discard(MigrationIncomingState *mis,
+                                              QEMUFile *f, uint16_t len)
+{
+    int tmp;
+    char ramid[256];
+    PostcopyState ps = postcopy_state_set(POSTCOPY_INCOMING_DISCARD);
+
+    trace_loadvm_postcopy_ram_handle_discard();
+
+    if (ps != POSTCOPY_INCOMING_ADVISE && ps != POSTCOPY_INCOMING_DISCARD) {
+        error_report("CMD_POSTCOPY_RAM_DISCARD in wrong postcopy state (%d)",
+                     ps);
+        return -1;
+    }
+    /* We're expecting a
+     *    Version (0)
+     *    a RAM ID string (length byte, name, 0 term)
+     *    then at least 1 16 byte chunk
+    */
+    if (len < (1 + 1 + 1 + 1 + 2 * 8)) {
+        error_report("CMD_POSTCOPY_RAM_DISCARD invalid length (%d)", len);
+        return -1;
+    }
+
+    tmp = qemu_get_byte(f);
+    if (tmp != 0) {
+        error_report("CMD_POSTCOPY_RAM_DISCARD invalid version (%d)", tmp);
+        return -1;
+    }
+
+    tmp = qemu_get_byte(f);
+    qemu_get_buffer(f, (uint8_t *)ramid, tmp);
+    ramid[tmp] = 0;
+    len -= 2 + tmp;
+
+    tmp = qemu_get_byte(f);
+    if (tmp != 0) {
+        error_report("CMD_POSTCOPY_RAM_DISCARD missing nil (%d)", tmp);
+        return -1;
+    }
+    len--;
+
+    if (len % 16) {
+        error_report("CMD_POSTCOPY_RAM_DISCARD invalid length (%d)", len);
+        return -1;
+    }
+    trace_loadvm_postcopy_ram_handle_discard_header(ramid, len);
+    while (len) {
+        uint64_t start_addr, block_length;
+        int ret;
+
+        start_addr = qemu_get_be64(f);
+        block_length = qemu_get_be64(f);
+
+        len -= 16;
+        ret = ram_discard_range(mis, ramid, start_addr, block_length);
+        if (ret) {
+            return ret;
+        }
+    }
+    trace_loadvm_postcopy_ram_handle_discard_end();
+
+    return 0;
+}
+
+/*
+ * Triggered by a postcopy_listen command; this thread takes over reading
+ * the input stream, leaving the main thread free to carry on loading the rest
+ * of the device state (from RAM).
+ */
+static void *postcopy_ram_listen_thread(void *opaque)
+{
+    QEMUFile *f = opaque;
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    int load_res;
+
+    rcu_register_thread();
+    qemu_sem_post(&mis->listen_thread_sem);
+    trace_postcopy_ram_listen_thread_start();
+
+    load_res = qemu_loadvm_state_main(f, mis);
+    if (load_res == 0) {
+        load_res = qemu_file_get_error(f);
+    }
+
+    trace_postcopy_ram_listen_thread_exit();
+    if (load_res < 0) {
+        error_report("%s: loadvm failed: %d", __func__, load_res);
+        qemu_file_set_error(f, load_res);
+    } else {
+        /*
+         * This looks good, but it's possible that the device loading in the
+         * main thread hasn't finished yet, and so we might not be in 'RUN'
+         * state yet; wait for the end of the main thread.
+         */
+        qemu_event_wait(&mis->main_thread_load_event);
+    }
+    postcopy_ram_incoming_cleanup(mis);
+
+    if (load_res < 0) {
+        /*
+         * If something went wrong then we have a bad state so exit;
+         * the guest may already be running here and there's no copy
+         * of its missing pages to fall back on.
+         */
+        exit(EXIT_FAILURE);
+    }
+
+    migrate_send_rp_shut(mis, 0);
+
+    /*
+     * If everything has worked fine, then the main thread has waited
+     * for us to start, and we're the last use of the mis.
+     * (If something broke then qemu will have to exit anyway since it's
+     * got a bad migration state).
+     */
+    migration_incoming_state_destroy();
+    rcu_unregister_thread();
+
+    return NULL;
+}
+
+/* After this message we must be able to immediately receive postcopy data */
+static int loadvm_postcopy_handle_listen(MigrationIncomingState *mis)
+{
+    PostcopyState ps = postcopy_state_set(POSTCOPY_INCOMING_LISTENING);
+
+    trace_loadvm_postcopy_handle_listen();
+    if (ps != POSTCOPY_INCOMING_ADVISE && ps != POSTCOPY_INCOMING_DISCARD) {
+        error_report("CMD_POSTCOPY_LISTEN in wrong postcopy state (%d)", ps);
+        return -1;
+    }
+
+    if (!mis->to_src_file) {
+        error_report("CMD_POSTCOPY_LISTEN without a return path");
+        return -1;
+    }
+
+    if (mis->have_listen_thread) {
+        error_report("CMD_POSTCOPY_RAM_LISTEN already has a listen thread");
+        return -1;
+    }
+
+    /*
+     * Sensitise RAM - can now generate requests for blocks that don't exist
+     * However, at this point the CPU shouldn't be running, and the IO
+     * shouldn't be doing anything yet so don't actually expect requests
+     */
+    if (postcopy_ram_enable_notify(mis)) {
+        return -1;
+    }
+
+    mis->have_listen_thread = true;
+    /* Start up the listening thread and wait for it to signal ready */
+    qemu_sem_init(&mis->listen_thread_sem, 0);
+    qemu_thread_create(&mis->listen_thread, "postcopy/listen",
+                       postcopy_ram_listen_thread, mis->from_src_file,
+                       QEMU_THREAD_DETACHED);
+    qemu_sem_wait(&mis->listen_thread_sem);
+    qemu_sem_destroy(&mis->listen_thread_sem);
+
+    return 0;
+}
+
+static void loadvm_postcopy_handle_run_bh(void *opaque)
+{
     Error *local_err = NULL;
-    uint8_t section_type;
-    unsigned int v;
-    int ret;
-    int file_error_after_eof = -1;
+    MigrationIncomingState *mis = opaque;
 
-    if (qemu_savevm_state_blocked(&local_err)) {
+    cpu_synchronize_all_post_init();
+
+    qemu_announce_self();
+
+    /* Make sure all file formats flush their mutable metadata */
+    bdrv_invalidate_cache_all(&local_err);
+    if (local_err) {
         error_report_err(local_err);
-        return -EINVAL;
+        exit(EXIT_FAILURE);
     }
 
-    v = qemu_get_be32(f);
-    if (v != QEMU_VM_FILE_MAGIC) {
-        error_report("Not a migration stream");
+    trace_loadvm_postcopy_handle_run_vmstart();
+
+    if (autostart) {
+        /* Hold onto your hats, starting the CPU */
+        vm_start();
+    } else {
+        /* leave it paused and let management decide when to start the CPU */
+        runstate_set(RUN_STATE_PAUSED);
+    }
+
+    qemu_bh_delete(mis->run_bh);
+    mis->run_bh = NULL;
+}
+
+/* After all discards we can start running and asking for pages */
+static int loadvm_postcopy_handle_run(MigrationIncomingState *mis)
+{
+    PostcopyState ps = postcopy_state_set(POSTCOPY_INCOMING_RUNNING);
+
+    trace_loadvm_postcopy_handle_run();
+    if (ps != POSTCOPY_INCOMING_LISTENING) {
+        error_report("CMD_POSTCOPY_RUN in wrong postcopy state (%d)", ps);
+        return -1;
+    }
+
+    mis->run_bh = qemu_bh_new(loadvm_postcopy_handle_run_bh, mis);
+    qemu_bh_schedule(mis->run_bh);
+
+    /* We need to finish reading the stream from the package
+     * and also stop reading anything more from the stream that loaded the
+     * package (since it's now being read by the listener thread).
+     * LOADVM_QUIT will quit all the layers of nested loadvm loops.
+     */
+    return LOADVM_QUIT;
+}
+
+/*
+ * Immediately following this command is a blob of data containing an embedded
+ * chunk of migration stream; read it and load it.
+ */
+/*
+ * Read @length bytes of @f into a new QEMUSizedBuffer with @spare zeroed
+ * bytes after them.
+ *
+ * Returns 0 on success, or a negative errno.
+ */
+static int loadvm_get_qsb(QEMUFile *f, uint32_t length, size_t spare,
+                          QEMUSizedBuffer **qsbp)
+{
+    size_t remain, cur_iov;
+    QEMUSizedBuffer *qsb;
+
+    qsb = qsb_create(NULL, length + spare);
+    if (!qsb) {
+        error_report("Unable to allocate qsb for %u bytes of state", length);
+        return -ENOMEM;
+    }
+
+    remain = length;
+    for (cur_iov = 0; cur_iov < qsb->n_iov && remain; cur_iov++) {
+        size_t thischunk = MIN(qsb->iov[cur_iov].iov_len, remain);
+        size_t read_len;
+
+        read_len = qemu_get_buffer(f, qsb->iov[cur_iov].iov_base, thischunk);
+        if (read_len != thischunk) {
+            error_report("%s: read (%zu) != thischunk (%zu)", __func__,
+                         read_len, thischunk);
+            qsb_free(qsb);
+            return -EIO;
+        }
+        remain -= thischunk;
+    }
+    qsb_set_length(qsb, length + spare);
+
+    *qsbp = qsb;
+    return 0;
+}
+
+static int loadvm_handle_cmd_packaged(MigrationIncomingState *mis,
+                                      QEMUFile *f)
+{
+    int ret;
+    uint32_t length;
+    QEMUSizedBuffer *qsb;
+    QEMUFile *packf;
+
+    length = qemu_get_be32(f);
+    trace_loadvm_handle_cmd_packaged(length);
+
+    if (length > MAX_VM_CMD_PACKAGED_SIZE) {
+        error_report("Unreasonably large packaged state: %u", length);
+        return -1;
+    }
+    ret = loadvm_get_qsb(f, length, 0, &qsb);
+    if (ret < 0) {
+        return ret;
+    }
+
+    packf = qemu_bufopen("r", qsb);
+
+    ret = qemu_loadvm_state_main(packf, mis);
+    trace_loadvm_handle_cmd_packaged_main(ret);
+    qemu_fclose(packf);
+    qsb_free(qsb);
+
+    return ret;
+}
+
+/*
+ * Process an incoming 'QEMU_VM_COMMAND'
+ * 0           just a normal return
+ * LOADVM_QUIT All good, but exit the loop
+ * <0          Error
+ */
+static int loadvm_process_command(QEMUFile *f)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    uint16_t cmd;
+    uint16_t len;
+
+    cmd = qemu_get_be16(f);
+    len = qemu_get_be16(f);
+
+    trace_loadvm_process_command(cmd, len);
+    if (cmd >= MIG_CMD_MAX || cmd == MIG_CMD_INVALID) {
+        error_report("MIG_CMD 0x%x unknown (len 0x%x)", cmd, len);
         return -EINVAL;
     }
 
-    v = qemu_get_be32(f);
-    if (v == QEMU_VM_FILE_VERSION_COMPAT) {
-        error_report("SaveVM v2 format is obsolete and don't work anymore");
-        return -ENOTSUP;
+    if (mig_cmd_args[cmd].len != -1 && mig_cmd_args[cmd].len != len) {
+        error_report("%s received with bad length - expecting %zu, got %d",
+                     mig_cmd_args[cmd].name,
+                     (size_t)mig_cmd_args[cmd].len, len);
+        return -ERANGE;
     }
-    if (v != QEMU_VM_FILE_VERSION) {
-        error_report("Unsupported migration stream version");
-        return -ENOTSUP;
+
+    switch (cmd) {
+    case MIG_CMD_OPEN_RETURN_PATH:
+        if (mis->to_src_file) {
+            error_report("CMD_OPEN_RETURN_PATH called when RP already open");
+            /* Not really a problem, so don't give up */
+            return 0;
+        }
+        mis->to_src_file = qemu_file_get_return_path(f);
+        if (!mis->to_src_file) {
+            error_report("CMD_OPEN_RETURN_PATH failed");
+            return -1;
+        }
+        break;
+
+    case MIG_CMD_PACKAGED:
+        return loadvm_handle_cmd_packaged(mis, f);
+
+    case MIG_CMD_POSTCOPY_ADVISE:
+        return loadvm_postcopy_handle_advise(mis, f);
+
+    case MIG_CMD_POSTCOPY_LISTEN:
+        return loadvm_postcopy_handle_listen(mis);
+
+    case MIG_CMD_POSTCOPY_RUN:
+        return loadvm_postcopy_handle_run(mis);
+
+    case MIG_CMD_POSTCOPY_RAM_DISCARD:
+        return loadvm_postcopy_ram_handle_discard(mis, f, len);
+    }
+
+    return 0;
+}
+
+/*
+ * Finish the sections queued in @batch: if @run, load their fields
+ * concurrently and then call their post_load hooks in stream order.
+ */
+static int loadvm_batch_finish(VMStateBatch *batch, bool run)
+{
+    int i, ret = 0;
+
+    if (!batch->count) {
+        return 0;
     }
+    if (run) {
+        vmstate_batch_run(batch);
+    }
+
+    for (i = 0; i < batch->count; i++) {
+        VMStateJob *job = &batch->jobs[i];
+        SaveStateEntry *se = job->se;
+
+        if (run && !ret) {
+            ret = job->ret;
+            if (!ret && se->vmsd->post_load) {
+                ret = se->vmsd->post_load(se->opaque, job->version_id);
+            }
+            if (ret < 0) {
+                error_report("error while loading state for instance 0x%x of"
+                             " device '%s'", job->instance_id, se->idstr);
+            }
+        }
+        qemu_fclose(job->f);
+        qsb_free(job->qsb);
+    }
+    vmstate_batch_reset(batch);
+
+    return ret;
+}
+
+/*
+ * Load a QEMU_VM_SECTION_FULL_SIZED section, whose header has been read.
+ * The section is read in full; its fields are loaded now, or queued in
+ * @batch if they can be loaded concurrently with its neighbours.
+ */
+static int loadvm_section_sized(QEMUFile *f, VMStateBatch *batch,
+                                SaveStateEntry *se, uint32_t instance_id,
+                                uint32_t version_id)
+{
+    const VMStateDescription *vmsd = se->vmsd;
+    uint32_t length = qemu_get_be32(f);
+    QEMUSizedBuffer *qsb;
+    QEMUFile *secf;
+    VMStateJob *job;
+    int ret;
+
+    /*
+     * A zero byte after the section ends the subsection list of the
+     * device, rather than running into the end of the buffer.
+     */
+    ret = loadvm_get_qsb(f, length, 1, &qsb);
+    if (ret < 0) {
+        return ret;
+    }
+    secf = qemu_bufopen("r", qsb);
+
+    if (!migrate_vmstate_threads() || !vmsd || vmstate_is_ordered(vmsd) ||
+        version_id > vmsd->version_id ||
+        version_id < vmsd->minimum_version_id) {
+        ret = loadvm_batch_finish(batch, true);
+        if (ret == 0) {
+            ret = vmstate_load(secf, se, version_id);
+        }
+        if (ret == 0) {
+            ret = qemu_file_get_error(secf);
+        }
+        qemu_fclose(secf);
+        qsb_free(qsb);
+        return ret;
+    }
+
+    trace_vmstate_load(se->idstr, vmsd->name);
+    if (vmsd->pre_load) {
+        ret = vmsd->pre_load(se->opaque);
+        if (ret) {
+            qemu_fclose(secf);
+            qsb_free(qsb);
+            return ret;
+        }
+    }
+
+    job = vmstate_batch_add(batch, se);
+    job->instance_id = instance_id;
+    job->version_id = version_id;
+    job->qsb = qsb;
+    job->f = secf;
+
+    return 0;
+}
+
+/* The loop of qemu_loadvm_state_main(), queueing sections in @batch */
+static int qemu_loadvm_state_sections(QEMUFile *f, MigrationIncomingState *mis,
+                                      VMStateBatch *batch)
+{
+    uint8_t section_type;
+    int ret;
 
     while ((section_type = qemu_get_byte(f)) != QEMU_VM_EOF) {
         uint32_t instance_id, version_id, section_id;
         SaveStateEntry *se;
+        LoadStateEntry *le;
         char idstr[257];
         int len;
 
         trace_qemu_loadvm_state_section(section_type);
+        if (section_type != QEMU_VM_SECTION_FULL_SIZED) {
+            ret = loadvm_batch_finish(batch, true);
+            if (ret < 0) {
+                return ret;
+            }
+        }
         switch (section_type) {
         case QEMU_VM_SECTION_START:
         case QEMU_VM_SECTION_FULL:
+        case QEMU_VM_SECTION_FULL_SIZED:
             /* Read section start */
             section_id = qemu_get_be32(f);
             len = qemu_get_byte(f);
@@ -986,31 +1910,40 @@ int qemu_loadvm_state(QEMUFile *f)
             if (se == NULL) {
                 error_report("Unknown savevm section or instance '%s' %d",
                              idstr, instance_id);
-                ret = -EINVAL;
-                goto out;
+                return -EINVAL;
             }
 
             /* Validate version */
             if (version_id > se->version_id) {
                 error_report("savevm: unsupported version %d for '%s' v%d",
                              version_id, idstr, se->version_id);
-                ret = -EINVAL;
-                goto out;
+                return -EINVAL;
             }
 
-            /* Add entry */
-            le = g_malloc0(sizeof(*le));
-
-            le->se = se;
-            le->section_id = section_id;
-            le->version_id = version_id;
-            QLIST_INSERT_HEAD(&loadvm_handlers, le, entry);
+            /*
+             * Only live sections are continued by later PART/END sections;
+             * a FULL section is not remembered, which keeps the list stable
+             * while the postcopy listen thread is looking entries up.
+             */
+            if (section_type == QEMU_VM_SECTION_START) {
+                le = g_malloc0(sizeof(*le));
+
+                le->se = se;
+                le->section_id = section_id;
+                le->version_id = version_id;
+                QLIST_INSERT_HEAD(&mis->loadvm_handlers, le, entry);
+            }
 
-            ret = vmstate_load(f, le->se, le->version_id);
+            if (section_type == QEMU_VM_SECTION_FULL_SIZED) {
+                ret = loadvm_section_sized(f, batch, se, instance_id,
+                                           version_id);
+            } else {
+                ret = vmstate_load(f, se, version_id);
+            }
             if (ret < 0) {
                 error_report("error while loading state for instance 0x%x of"
                              " device '%s'", instance_id, idstr);
-                goto out;
+                return ret;
             }
             break;
         case QEMU_VM_SECTION_PART:
@@ -1018,64 +1951,125 @@ int qemu_loadvm_state(QEMUFile *f)
             section_id = qemu_get_be32(f);
 
             trace_qemu_loadvm_state_section_partend(section_id);
-            QLIST_FOREACH(le, &loadvm_handlers, entry) {
+            QLIST_FOREACH(le, &mis->loadvm_handlers, entry) {
                 if (le->section_id == section_id) {
                     break;
                 }
             }
             if (le == NULL) {
                 error_report("Unknown savevm section %d", section_id);
-                ret = -EINVAL;
-                goto out;
+                return -EINVAL;
             }
 
             ret = vmstate_load(f, le->se, le->version_id);
             if (ret < 0) {
                 error_report("error while loading state section id %d(%s)",
                              section_id, le->se->idstr);
-                goto out;
+                return ret;
+            }
+            break;
+        case QEMU_VM_COMMAND:
+            ret = loadvm_process_command(f);
+            trace_qemu_loadvm_state_section_command(ret);
+            if ((ret < 0) || (ret & LOADVM_QUIT)) {
+                return ret;
             }
             break;
         default:
             error_report("Unknown savevm section type %d", section_type);
-            ret = -EINVAL;
-            goto out;
+            return -EINVAL;
         }
     }
 
-    file_error_after_eof = qemu_file_get_error(f);
+    return 0;
+}
 
-    /*
-     * Try to read in the VMDESC section as well, so that dumping tools that
-     * intercept our migration stream have the chance to see it.
-     */
-    if (qemu_get_byte(f) == QEMU_VM_VMDESCRIPTION) {
-        uint32_t size = qemu_get_be32(f);
-        uint8_t *buf = g_malloc(0x1000);
+/*
+ * Load sections and commands from @f until the end of the stream, an
+ * error, or a command asking us to stop.  The live (iterable) sections
+ * that are started are remembered in @mis so that a later loop, possibly
+ * in another thread, can carry on with them.
+ */
+int qemu_loadvm_state_main(QEMUFile *f, MigrationIncomingState *mis)
+{
+    VMStateBatch batch = { .load = true };
+    int ret, batch_ret;
 
-        while (size > 0) {
-            uint32_t read_chunk = MIN(size, 0x1000);
-            qemu_get_buffer(f, buf, read_chunk);
-            size -= read_chunk;
-        }
-        g_free(buf);
+    ret = qemu_loadvm_state_sections(f, mis, &batch);
+    batch_ret = loadvm_batch_finish(&batch, ret >= 0);
+    g_free(batch.jobs);
+    if (ret >= 0 && batch_ret < 0) {
+        ret = batch_ret;
     }
 
-    cpu_synchronize_all_post_init();
+    return ret;
+}
 
-    ret = 0;
+int qemu_loadvm_state(QEMUFile *f)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    Error *local_err = NULL;
+    unsigned int v;
+    int ret;
 
-out:
-    QLIST_FOREACH_SAFE(le, &loadvm_handlers, entry, new_le) {
-        QLIST_REMOVE(le, entry);
-        g_free(le);
+    if (qemu_savevm_state_blocked(&local_err)) {
+        error_report_err(local_err);
+        return -EINVAL;
+    }
+
+    v = qemu_get_be32(f);
+    if (v != QEMU_VM_FILE_MAGIC) {
+        error_report("Not a migration stream");
+        return -EINVAL;
+    }
+
+    v = qemu_get_be32(f);
+    if (v == QEMU_VM_FILE_VERSION_COMPAT) {
+        error_report("SaveVM v2 format is obsolete and don't work anymore");
+        return -ENOTSUP;
+    }
+    if (v != QEMU_VM_FILE_VERSION) {
+        error_report("Unsupported migration stream version");
+        return -ENOTSUP;
+    }
+
+    ret = qemu_loadvm_state_main(f, mis);
+    qemu_event_set(&mis->main_thread_load_event);
+
+    trace_qemu_loadvm_state_post_main(ret);
+
+    if (mis->have_listen_thread) {
+        /* Listen thread still going, can't clean up yet */
+        return ret;
     }
 
     if (ret == 0) {
+        int file_error_after_eof = qemu_file_get_error(f);
+
+        /*
+         * Try to read in the VMDESC section as well, so that dumping tools
+         * that intercept our migration stream have the chance to see it.
+         */
+        if (qemu_get_byte(f) == QEMU_VM_VMDESCRIPTION) {
+            uint32_t size = qemu_get_be32(f);
+            uint8_t *buf = g_malloc(0x1000);
+
+            while (size > 0) {
+                uint32_t read_chunk = MIN(size, 0x1000);
+                qemu_get_buffer(f, buf, read_chunk);
+                size -= read_chunk;
+            }
+            g_free(buf);
+        }
+
+        cpu_synchronize_all_post_init();
+
         /* We may not have a VMDESC section, so ignore relative errors */
         ret = file_error_after_eof;
     }
 
+    loadvm_free_handlers(mis);
+
     return ret;
 }
 
@@ -474,6 +474,7 @@ class MigrationDump(object):
     QEMU_VM_SECTION_FULL  = 0x04
     QEMU_VM_SUBSECTION    = 0x05
     QEMU_VM_VMDESCRIPTION = 0x06
+    QEMU_VM_SECTION_FULL_SIZED = 0x09
 
     def __init__(self, filename):
         self.section_classes = { ( 'ram', 0 ) : [ RamSection, None ],
@@ -513,7 +514,7 @@ class MigrationDump(object):
             section_type = file.read8()
             if section_type == self.QEMU_VM_EOF:
                 break
-            elif section_type == self.QEMU_VM_SECTION_START or section_type == self.QEMU_VM_SECTION_FULL:
+            elif section_type == self.QEMU_VM_SECTION_START or section_type == self.QEMU_VM_SECTION_FULL or section_type == self.QEMU_VM_SECTION_FULL_SIZED:
                 section_id = file.read32()
                 name = file.readstr()
                 instance_id = file.read32()
@@ -522,7 +523,15 @@ class MigrationDump(object):
                 classdesc = self.section_classes[section_key]
                 section = classdesc[0](file, version_id, classdesc[1], section_key)
                 self.sections[section_id] = section
-                section.read()
+                if section_type == self.QEMU_VM_SECTION_FULL_SIZED:
+                    # Saved by a vmstate thread, prefixed with its length
+                    length = file.read32()
+                    end = file.tell() + length
+                    section.read()
+                    if file.tell() != end:
+                        raise Exception("Section %s ends at 0x%x, expected 0x%x" % (name, file.tell(), end))
+                else:
+                    section.read()
             elif section_type == self.QEMU_VM_SECTION_PART or section_type == self.QEMU_VM_SECTION_END:
                 section_id = file.read32()
                 self.sections[section_id].read()
@@ -38,6 +38,14 @@ static void arm_cpu_set_pc(CPUState *cs, vaddr value)
     cpu->env.regs[15] = value;
 }
 
+static void arm_cpu_translator_features(CPUState *cs, GByteArray *buf)
+{
+    ARMCPU *cpu = ARM_CPU(cs);
+
+    g_byte_array_append(buf, (guint8 *)&cpu->env.features,
+                        sizeof(cpu->env.features));
+}
+
 static bool arm_cpu_has_work(CPUState *cs)
 {
     ARMCPU *cpu = ARM_CPU(cs);
@@ -1215,6 +1223,7 @@ static void arm_cpu_class_init(ObjectClass *oc, void *data)
     cc->cpu_exec_interrupt = arm_cpu_exec_interrupt;
     cc->dump_state = arm_cpu_dump_state;
     cc->set_pc = arm_cpu_set_pc;
+    cc->translator_features = arm_cpu_translator_features;
     cc->gdb_read_register = arm_cpu_gdb_read_register;
     cc->gdb_write_register = arm_cpu_gdb_write_register;
 #ifdef CONFIG_USER_ONLY
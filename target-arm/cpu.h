@@ -1481,6 +1481,10 @@ bool write_cpustate_to_list(ARMCPU *cpu);
 #else
 #  define TARGET_PHYS_ADDR_SPACE_BITS 40
 #  define TARGET_VIRT_ADDR_SPACE_BITS 32
+/* In system mode STREX is a host compare-and-swap (see HELPER(strex)), so
+   the vCPUs can run in parallel threads.  The AArch64 exclusives still
+   assume a single thread.  */
+#  define TARGET_SUPPORTS_MTTCG
 #endif
 
 static inline bool arm_excp_unmasked(CPUState *cs, unsigned int excp_idx)
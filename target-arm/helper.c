@@ -405,15 +405,18 @@ static void tlbimvaa_write(CPUARMState *env, const ARMCPRegInfo *ri,
     tlb_flush_page(CPU(cpu), value & TARGET_PAGE_MASK);
 }
 
-/* IS variants of TLB operations must affect all cores */
+/* IS variants of TLB operations must affect all cores, and be complete
+ * on all of them before the core that issued them continues.
+ */
 static void tlbiall_is_write(CPUARMState *env, const ARMCPRegInfo *ri,
                              uint64_t value)
 {
     CPUState *other_cs;
 
     CPU_FOREACH(other_cs) {
-        tlb_flush(other_cs, 1);
+        tlb_flush_async(other_cs, 1);
     }
+    tlb_flush_async_wait();
 }
 
 static void tlbiasid_is_write(CPUARMState *env, const ARMCPRegInfo *ri,
@@ -422,8 +425,9 @@ static void tlbiasid_is_write(CPUARMState *env, const ARMCPRegInfo *ri,
     CPUState *other_cs;
 
     CPU_FOREACH(other_cs) {
-        tlb_flush(other_cs, value == 0);
+        tlb_flush_async(other_cs, value == 0);
     }
+    tlb_flush_async_wait();
 }
 
 static void tlbimva_is_write(CPUARMState *env, const ARMCPRegInfo *ri,
@@ -432,8 +436,9 @@ static void tlbimva_is_write(CPUARMState *env, const ARMCPRegInfo *ri,
     CPUState *other_cs;
 
     CPU_FOREACH(other_cs) {
-        tlb_flush_page(other_cs, value & TARGET_PAGE_MASK);
+        tlb_flush_page_async(other_cs, value & TARGET_PAGE_MASK);
     }
+    tlb_flush_async_wait();
 }
 
 static void tlbimvaa_is_write(CPUARMState *env, const ARMCPRegInfo *ri,
@@ -442,8 +447,9 @@ static void tlbimvaa_is_write(CPUARMState *env, const ARMCPRegInfo *ri,
     CPUState *other_cs;
 
     CPU_FOREACH(other_cs) {
-        tlb_flush_page(other_cs, value & TARGET_PAGE_MASK);
+        tlb_flush_page_async(other_cs, value & TARGET_PAGE_MASK);
     }
+    tlb_flush_async_wait();
 }
 
 static const ARMCPRegInfo cp_reginfo[] = {
@@ -2177,8 +2183,9 @@ static void tlbi_aa64_va_is_write(CPUARMState *env, const ARMCPRegInfo *ri,
     uint64_t pageaddr = sextract64(value << 12, 0, 56);
 
     CPU_FOREACH(other_cs) {
-        tlb_flush_page(other_cs, pageaddr);
+        tlb_flush_page_async(other_cs, pageaddr);
     }
+    tlb_flush_async_wait();
 }
 
 static void tlbi_aa64_vaa_is_write(CPUARMState *env, const ARMCPRegInfo *ri,
@@ -2188,8 +2195,9 @@ static void tlbi_aa64_vaa_is_write(CPUARMState *env, const ARMCPRegInfo *ri,
     uint64_t pageaddr = sextract64(value << 12, 0, 56);
 
     CPU_FOREACH(other_cs) {
-        tlb_flush_page(other_cs, pageaddr);
+        tlb_flush_page_async(other_cs, pageaddr);
     }
+    tlb_flush_async_wait();
 }
 
 static void tlbi_aa64_asid_is_write(CPUARMState *env, const ARMCPRegInfo *ri,
@@ -2199,8 +2207,9 @@ static void tlbi_aa64_asid_is_write(CPUARMState *env, const ARMCPRegInfo *ri,
     int asid = extract64(value, 48, 16);
 
     CPU_FOREACH(other_cs) {
-        tlb_flush(other_cs, asid == 0);
+        tlb_flush_async(other_cs, asid == 0);
     }
+    tlb_flush_async_wait();
 }
 
 static CPAccessResult aa64_zva_access(CPUARMState *env, const ARMCPRegInfo *ri)
@@ -20,6 +20,7 @@
 #include "exec/helper-proto.h"
 #include "internals.h"
 #include "exec/cpu_ldst.h"
+#include "qemu/main-loop.h"
 
 #define SIGNBIT (uint32_t)0x80000000
 #define SIGNBIT64 ((uint64_t)1 << 63)
@@ -78,6 +79,111 @@ void tlb_fill(CPUState *cs, target_ulong addr, int is_write, int mmu_idx,
         raise_exception(env, cs->exception_index);
     }
 }
+
+/* Store exclusive: LDREX saved the value it loaded in exclusive_val, and
+ * the store succeeds if memory still holds that value.  The comparison
+ * and the store are a single host compare-and-swap, so the result is
+ * right even when other vCPU threads write the location at the same time.
+ * @info is the access size (3 for the STREXD pair) with the MMU index
+ * above it.  Returns the status written to Rd: 0 on success, 1 on failure.
+ */
+uint32_t HELPER(strex)(CPUARMState *env, uint32_t addr, uint64_t newval,
+                       uint32_t info)
+{
+    CPUState *cs = CPU(arm_env_get_cpu(env));
+    int size = info & 0xf;
+    int mmu_idx = info >> 4;
+    uint64_t oldval = env->exclusive_val;
+    uint64_t cur;
+    void *haddr = NULL;
+    bool unlock = false;
+
+    if (((addr ^ (addr + (1 << size) - 1)) & TARGET_PAGE_MASK) == 0) {
+        haddr = tlb_vaddr_to_host(env, addr, 1, mmu_idx);
+        if (!haddr) {
+            /* raises the guest fault if the page is not writable */
+            tlb_fill(cs, addr, 1, mmu_idx, GETPC());
+            haddr = tlb_vaddr_to_host(env, addr, 1, mmu_idx);
+        }
+    }
+
+    if (haddr) {
+        switch (size) {
+        case 0:
+            return atomic_cmpxchg((uint8_t *)haddr, (uint8_t)oldval,
+                                  (uint8_t)newval) != (uint8_t)oldval;
+        case 1:
+            return atomic_cmpxchg((uint16_t *)haddr, tswap16(oldval),
+                                  tswap16(newval)) != tswap16(oldval);
+        case 2:
+            return atomic_cmpxchg((uint32_t *)haddr, tswap32(oldval),
+                                  tswap32(newval)) != tswap32(oldval);
+        case 3:
+#ifdef TARGET_WORDS_BIGENDIAN
+            /* Rt is at the lower address */
+            oldval = rol64(oldval, 32);
+            newval = rol64(newval, 32);
+#endif
+            return atomic_cmpxchg((uint64_t *)haddr, tswap64(oldval),
+                                  tswap64(newval)) != tswap64(oldval);
+        default:
+            g_assert_not_reached();
+        }
+    }
+
+    /* MMIO, pages holding translated code, watchpoints, or a pair that
+     * crosses a page boundary: go through the slow path helpers and make
+     * the access atomic with respect to other slow path accesses only.
+     */
+    if (!qemu_mutex_iothread_locked()) {
+        qemu_mutex_lock_iothread();
+        unlock = true;
+    }
+    switch (size) {
+    case 0:
+        cur = helper_ret_ldub_mmu(env, addr,
+                                  make_memop_idx(MO_UB, mmu_idx), GETRA());
+        break;
+    case 1:
+        cur = helper_ret_lduw_mmu(env, addr,
+                                  make_memop_idx(MO_TEUW, mmu_idx), GETRA());
+        break;
+    default:
+        cur = helper_ret_ldul_mmu(env, addr,
+                                  make_memop_idx(MO_TEUL, mmu_idx), GETRA());
+        if (size == 3) {
+            cur |= (uint64_t)helper_ret_ldul_mmu(env, addr + 4,
+                                                 make_memop_idx(MO_TEUL,
+                                                                mmu_idx),
+                                                 GETRA()) << 32;
+        }
+        break;
+    }
+    if (cur == oldval) {
+        switch (size) {
+        case 0:
+            helper_ret_stb_mmu(env, addr, newval,
+                               make_memop_idx(MO_UB, mmu_idx), GETRA());
+            break;
+        case 1:
+            helper_ret_stw_mmu(env, addr, newval,
+                               make_memop_idx(MO_TEUW, mmu_idx), GETRA());
+            break;
+        default:
+            helper_ret_stl_mmu(env, addr, newval,
+                               make_memop_idx(MO_TEUL, mmu_idx), GETRA());
+            if (size == 3) {
+                helper_ret_stl_mmu(env, addr + 4, newval >> 32,
+                                   make_memop_idx(MO_TEUL, mmu_idx), GETRA());
+            }
+            break;
+        }
+    }
+    if (unlock) {
+        qemu_mutex_unlock_iothread();
+    }
+    return cur != oldval;
+}
 #endif
 
 uint32_t HELPER(add_setq)(CPUARMState *env, uint32_t a, uint32_t b)
@@ -327,32 +433,65 @@ void HELPER(access_check_cp_reg)(CPUARMState *env, void *rip, uint32_t syndrome)
     raise_exception(env, EXCP_UDEF);
 }
 
+/* Registers marked ARM_CP_IO reach into devices such as the generic
+ * timers, which need the BQL; with multi-threaded TCG the vCPU does not
+ * hold it while running guest code.
+ */
+static bool cp_reg_lock(const ARMCPRegInfo *ri)
+{
+    if ((ri->type & ARM_CP_IO) && !qemu_mutex_iothread_locked()) {
+        qemu_mutex_lock_iothread();
+        return true;
+    }
+    return false;
+}
+
 void HELPER(set_cp_reg)(CPUARMState *env, void *rip, uint32_t value)
 {
     const ARMCPRegInfo *ri = rip;
+    bool unlock = cp_reg_lock(ri);
 
     ri->writefn(env, ri, value);
+    if (unlock) {
+        qemu_mutex_unlock_iothread();
+    }
 }
 
 uint32_t HELPER(get_cp_reg)(CPUARMState *env, void *rip)
 {
     const ARMCPRegInfo *ri = rip;
+    bool unlock = cp_reg_lock(ri);
+    uint32_t res;
 
-    return ri->readfn(env, ri);
+    res = ri->readfn(env, ri);
+    if (unlock) {
+        qemu_mutex_unlock_iothread();
+    }
+    return res;
 }
 
 void HELPER(set_cp_reg64)(CPUARMState *env, void *rip, uint64_t value)
 {
     const ARMCPRegInfo *ri = rip;
+    bool unlock = cp_reg_lock(ri);
 
     ri->writefn(env, ri, value);
+    if (unlock) {
+        qemu_mutex_unlock_iothread();
+    }
 }
 
 uint64_t HELPER(get_cp_reg64)(CPUARMState *env, void *rip)
 {
     const ARMCPRegInfo *ri = rip;
+    bool unlock = cp_reg_lock(ri);
+    uint64_t res;
 
-    return ri->readfn(env, ri);
+    res = ri->readfn(env, ri);
+    if (unlock) {
+        qemu_mutex_unlock_iothread();
+    }
+    return res;
 }
 
 void HELPER(msr_i_pstate)(CPUARMState *env, uint32_t op, uint32_t imm)
@@ -28,6 +28,7 @@
 #include "internals.h"
 #include "disas/disas.h"
 #include "tcg-op.h"
+#include "tcg-op-gvec.h"
 #include "qemu/log.h"
 #include "qemu/bitops.h"
 #include "arm_ldst.h"
@@ -5070,6 +5071,56 @@ static const uint8_t neon_2rm_sizes[] = {
     [NEON_2RM_VCVT_UF] = 0x4,
 };
 
+/* Expand the element-wise three-register-same-length operations that
+   have a direct vector op.  Returns false if the caller must handle the
+   instruction one pass at a time.  */
+static bool gen_neon_3r_vec(int op, int u, int size, int q,
+                            int rd, int rn, int rm)
+{
+    uint32_t dofs = vfp_reg_offset(1, rd);
+    uint32_t nofs = vfp_reg_offset(1, rn);
+    uint32_t mofs = vfp_reg_offset(1, rm);
+    uint32_t oprsz = q ? 16 : 8;
+
+    switch (op) {
+    case NEON_3R_VADD_VSUB:
+        if (u) {
+            tcg_gen_gvec_sub(size, dofs, nofs, mofs, oprsz);
+        } else {
+            tcg_gen_gvec_add(size, dofs, nofs, mofs, oprsz);
+        }
+        return true;
+    case NEON_3R_LOGIC:
+        switch ((u << 2) | size) {
+        case 0: /* VAND */
+            tcg_gen_gvec_and(dofs, nofs, mofs, oprsz);
+            return true;
+        case 1: /* BIC */
+            tcg_gen_gvec_andc(dofs, nofs, mofs, oprsz);
+            return true;
+        case 2: /* VORR */
+            tcg_gen_gvec_or(dofs, nofs, mofs, oprsz);
+            return true;
+        case 4: /* VEOR */
+            tcg_gen_gvec_xor(dofs, nofs, mofs, oprsz);
+            return true;
+        }
+        return false;
+    case NEON_3R_VTST_VCEQ:
+        if (!u) {
+            return false;
+        }
+        tcg_gen_gvec_cmp(TCG_COND_EQ, size, dofs, nofs, mofs, oprsz);
+        return true;
+    case NEON_3R_VCGT:
+        tcg_gen_gvec_cmp(u ? TCG_COND_GTU : TCG_COND_GT, size,
+                         dofs, nofs, mofs, oprsz);
+        return true;
+    default:
+        return false;
+    }
+}
+
 /* Translate a NEON data processing instruction.  Return nonzero if the
    instruction is invalid.
    We process data in a mixture of 32-bit and 64-bit chunks.
@@ -5234,6 +5285,9 @@ static int disas_neon_data_insn(DisasContext *s, uint32_t insn)
             }
             return 0;
         }
+        if (gen_neon_3r_vec(op, u, size, q, rd, rn, rm)) {
+            return 0;
+        }
         pairwise = 0;
         switch (op) {
         case NEON_3R_VSHL:
@@ -7438,7 +7492,7 @@ static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
 static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
                                 TCGv_i32 addr, int size)
 {
-    TCGv_i32 tmp;
+    TCGv_i32 tmp, info;
     TCGv_i64 val64, extaddr;
     TCGLabel *done_label;
     TCGLabel *fail_label;
@@ -7448,7 +7502,9 @@ static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
          {Rd} = 0;
        } else {
          {Rd} = 1;
-       } */
+       }
+       The compare and the store are done atomically by the strex helper,
+       which keeps this correct with multi-threaded TCG.  */
     fail_label = gen_new_label();
     done_label = gen_new_label();
     extaddr = tcg_temp_new_i64();
@@ -7456,62 +7512,21 @@ static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
     tcg_gen_brcond_i64(TCG_COND_NE, extaddr, cpu_exclusive_addr, fail_label);
     tcg_temp_free_i64(extaddr);
 
-    tmp = tcg_temp_new_i32();
-    switch (size) {
-    case 0:
-        gen_aa32_ld8u(tmp, addr, get_mem_index(s));
-        break;
-    case 1:
-        gen_aa32_ld16u(tmp, addr, get_mem_index(s));
-        break;
-    case 2:
-    case 3:
-        gen_aa32_ld32u(tmp, addr, get_mem_index(s));
-        break;
-    default:
-        abort();
-    }
-
     val64 = tcg_temp_new_i64();
+    tmp = load_reg(s, rt);
     if (size == 3) {
-        TCGv_i32 tmp2 = tcg_temp_new_i32();
-        TCGv_i32 tmp3 = tcg_temp_new_i32();
-        tcg_gen_addi_i32(tmp2, addr, 4);
-        gen_aa32_ld32u(tmp3, tmp2, get_mem_index(s));
+        TCGv_i32 tmp2 = load_reg(s, rt2);
+        tcg_gen_concat_i32_i64(val64, tmp, tmp2);
         tcg_temp_free_i32(tmp2);
-        tcg_gen_concat_i32_i64(val64, tmp, tmp3);
-        tcg_temp_free_i32(tmp3);
     } else {
         tcg_gen_extu_i32_i64(val64, tmp);
     }
     tcg_temp_free_i32(tmp);
 
-    tcg_gen_brcond_i64(TCG_COND_NE, val64, cpu_exclusive_val, fail_label);
+    info = tcg_const_i32(size | (get_mem_index(s) << 4));
+    gen_helper_strex(cpu_R[rd], cpu_env, addr, val64, info);
+    tcg_temp_free_i32(info);
     tcg_temp_free_i64(val64);
-
-    tmp = load_reg(s, rt);
-    switch (size) {
-    case 0:
-        gen_aa32_st8(tmp, addr, get_mem_index(s));
-        break;
-    case 1:
-        gen_aa32_st16(tmp, addr, get_mem_index(s));
-        break;
-    case 2:
-    case 3:
-        gen_aa32_st32(tmp, addr, get_mem_index(s));
-        break;
-    default:
-        abort();
-    }
-    tcg_temp_free_i32(tmp);
-    if (size == 3) {
-        tcg_gen_addi_i32(addr, addr, 4);
-        tmp = load_reg(s, rt2);
-        gen_aa32_st32(tmp, addr, get_mem_index(s));
-        tcg_temp_free_i32(tmp);
-    }
-    tcg_gen_movi_i32(cpu_R[rd], 0);
     tcg_gen_br(done_label);
     gen_set_label(fail_label);
     tcg_gen_movi_i32(cpu_R[rd], 1);
@@ -2924,6 +2924,21 @@ static void x86_cpu_synchronize_from_tb(CPUState *cs, TranslationBlock *tb)
     cpu->env.eip = tb->pc - tb->cs_base;
 }
 
+static void x86_cpu_translator_features(CPUState *cs, GByteArray *buf)
+{
+    X86CPU *cpu = X86_CPU(cs);
+    CPUX86State *env = &cpu->env;
+
+    g_byte_array_append(buf, (guint8 *)env->features,
+                        sizeof(env->features));
+    g_byte_array_append(buf, (guint8 *)&env->cpuid_vendor1,
+                        sizeof(env->cpuid_vendor1));
+    g_byte_array_append(buf, (guint8 *)&env->cpuid_vendor2,
+                        sizeof(env->cpuid_vendor2));
+    g_byte_array_append(buf, (guint8 *)&env->cpuid_vendor3,
+                        sizeof(env->cpuid_vendor3));
+}
+
 static bool x86_cpu_has_work(CPUState *cs)
 {
     X86CPU *cpu = X86_CPU(cs);
@@ -2982,6 +2997,7 @@ static void x86_cpu_common_class_init(ObjectClass *oc, void *data)
     cc->dump_state = x86_cpu_dump_state;
     cc->set_pc = x86_cpu_set_pc;
     cc->synchronize_from_tb = x86_cpu_synchronize_from_tb;
+    cc->translator_features = x86_cpu_translator_features;
     cc->gdb_read_register = x86_cpu_gdb_read_register;
     cc->gdb_write_register = x86_cpu_gdb_write_register;
     cc->get_arch_id = x86_cpu_get_arch_id;
@@ -35,6 +35,9 @@
    close to the modifying instruction */
 #define TARGET_HAS_PRECISE_SMC
 
+/* the translator builds multi-block traces for CF_TRACE */
+#define TARGET_HAS_TB_TRACE
+
 #ifdef TARGET_X86_64
 #define ELF_MACHINE     EM_X86_64
 #define ELF_MACHINE_UNAME "x86_64"
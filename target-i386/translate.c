@@ -27,6 +27,7 @@
 #include "cpu.h"
 #include "disas/disas.h"
 #include "tcg-op.h"
+#include "tcg-op-gvec.h"
 #include "exec/cpu_ldst.h"
 
 #include "exec/helper-proto.h"
@@ -126,6 +127,7 @@ typedef struct DisasContext {
     int cpuid_ext2_features;
     int cpuid_ext3_features;
     int cpuid_7_0_ebx_features;
+    bool trace_exit; /* goto_tb slot 1 used by a side exit of the trace */
 } DisasContext;
 
 static void gen_eob(DisasContext *s);
@@ -2222,12 +2224,58 @@ static inline void gen_goto_tb(DisasContext *s, int tb_num, target_ulong eip)
     }
 }
 
+/* Whether a trace can go on translating at @eip instead of ending the TB:
+   the target must lie ahead of the current insn on the first page of the
+   TB, so that the TB still covers [pc, pc + size[ of a single page.  */
+static bool trace_can_follow(DisasContext *s, target_ulong eip)
+{
+    target_ulong pc = s->cs_base + eip;
+
+    return (s->tb->cflags & CF_TRACE) && s->jmp_opt && pc > s->pc &&
+           (pc & TARGET_PAGE_MASK) == (s->tb->pc & TARGET_PAGE_MASK);
+}
+
 static inline void gen_jcc(DisasContext *s, int b,
                            target_ulong val, target_ulong next_eip)
 {
     TCGLabel *l1, *l2;
 
-    if (s->jmp_opt) {
+    if (!s->trace_exit && trace_can_follow(s, val)) {
+        /* Forward branch in a trace: assume it is not taken and keep
+           translating the fall-through path, with a chained side exit
+           to the target.  The static cc_op stays valid on both paths.  */
+        CCPrepare cc;
+
+        l1 = gen_new_label();
+        cc = gen_prepare_cc(s, b ^ 1, cpu_T[0]);
+        gen_update_cc_op(s);
+        if (cc.mask != -1) {
+            tcg_gen_andi_tl(cpu_T[0], cc.reg, cc.mask);
+            cc.reg = cpu_T[0];
+        }
+        if (cc.use_reg2) {
+            tcg_gen_brcond_tl(cc.cond, cc.reg, cc.reg2, l1);
+        } else {
+            tcg_gen_brcondi_tl(cc.cond, cc.reg, cc.imm, l1);
+        }
+        tcg_gen_goto_tb(1);
+        gen_jmp_im(val);
+        tcg_gen_exit_tb((uintptr_t)s->tb + 1);
+        gen_set_label(l1);
+        s->trace_exit = true;
+    } else if (s->jmp_opt && s->trace_exit) {
+        /* Slot 1 belongs to a side exit, so only the taken path, which
+           is the likely one for a backward branch, can be chained.  */
+        l1 = gen_new_label();
+        gen_jcc1(s, b, l1);
+
+        gen_jmp_im(next_eip);
+        tcg_gen_exit_tb(0);
+
+        gen_set_label(l1);
+        gen_goto_tb(s, 0, val);
+        s->is_jmp = DISAS_TB_JUMP;
+    } else if (s->jmp_opt) {
         l1 = gen_new_label();
         gen_jcc1(s, b, l1);
 
@@ -2571,7 +2619,7 @@ static void gen_jmp_tb(DisasContext *s, target_ulong eip, int tb_num)
 {
     gen_update_cc_op(s);
     set_cc_op(s, CC_OP_DYNAMIC);
-    if (s->jmp_opt) {
+    if (s->jmp_opt && !(tb_num == 1 && s->trace_exit)) {
         gen_goto_tb(s, tb_num, eip);
         s->is_jmp = DISAS_TB_JUMP;
     } else {
@@ -2585,6 +2633,17 @@ static void gen_jmp(DisasContext *s, target_ulong eip)
     gen_jmp_tb(s, eip, 0);
 }
 
+/* Direct jump or call to eip.  A trace simply carries on at the target
+   when it can, so that the whole path is optimized as one block.  */
+static void gen_jmp_direct(DisasContext *s, target_ulong eip)
+{
+    if (trace_can_follow(s, eip)) {
+        s->pc = s->cs_base + eip;
+    } else {
+        gen_jmp(s, eip);
+    }
+}
+
 static inline void gen_ldq_env_A0(DisasContext *s, int offset)
 {
     tcg_gen_qemu_ld_i64(cpu_tmp1_i64, cpu_A0, s->mem_index, MO_LEQ);
@@ -2973,6 +3032,62 @@ static const struct SSEOpHelper_eppi sse_op_table7[256] = {
     [0xdf] = AESNI_OP(aeskeygenassist),
 };
 
+/* Expand the simple integer MMX/SSE operations inline as vector ops.
+   Returns false if the instruction must go through its helper.  */
+static bool gen_sse_vec(CPUX86State *env, DisasContext *s, int b, int b1,
+                        int is_xmm, int op1_offset, int op2_offset)
+{
+    uint32_t oprsz = is_xmm ? 16 : 8;
+
+    switch (b) {
+    case 0xfc ... 0xfe: /* paddb, paddw, paddd */
+        tcg_gen_gvec_add(b - 0xfc, op1_offset, op1_offset, op2_offset, oprsz);
+        break;
+    case 0xd4: /* paddq */
+        tcg_gen_gvec_add(MO_64, op1_offset, op1_offset, op2_offset, oprsz);
+        break;
+    case 0xf8 ... 0xfb: /* psubb, psubw, psubd, psubq */
+        tcg_gen_gvec_sub(b - 0xf8, op1_offset, op1_offset, op2_offset, oprsz);
+        break;
+    case 0x74 ... 0x76: /* pcmpeqb, pcmpeqw, pcmpeql */
+        tcg_gen_gvec_cmp(TCG_COND_EQ, b - 0x74,
+                         op1_offset, op1_offset, op2_offset, oprsz);
+        break;
+    case 0x64 ... 0x66: /* pcmpgtb, pcmpgtw, pcmpgtl */
+        tcg_gen_gvec_cmp(TCG_COND_GT, b - 0x64,
+                         op1_offset, op1_offset, op2_offset, oprsz);
+        break;
+    case 0xdb: /* pand */
+    case 0x54: /* andps, andpd */
+        tcg_gen_gvec_and(op1_offset, op1_offset, op2_offset, oprsz);
+        break;
+    case 0xdf: /* pandn */
+    case 0x55: /* andnps, andnpd */
+        tcg_gen_gvec_andc(op1_offset, op2_offset, op1_offset, oprsz);
+        break;
+    case 0xeb: /* por */
+    case 0x56: /* orps, orpd */
+        tcg_gen_gvec_or(op1_offset, op1_offset, op2_offset, oprsz);
+        break;
+    case 0xef: /* pxor */
+    case 0x57: /* xorps, xorpd */
+        tcg_gen_gvec_xor(op1_offset, op1_offset, op2_offset, oprsz);
+        break;
+#ifndef HOST_WORDS_BIGENDIAN
+    case 0x70: /* pshufd */
+        if (b1 != 1) {
+            return false;
+        }
+        tcg_gen_gvec_shuf32(op1_offset, op2_offset,
+                            cpu_ldub_code(env, s->pc++));
+        break;
+#endif
+    default:
+        return false;
+    }
+    return true;
+}
+
 static void gen_sse(CPUX86State *env, DisasContext *s, int b,
                     target_ulong pc_start, int rex_r)
 {
@@ -4341,6 +4456,9 @@ static void gen_sse(CPUX86State *env, DisasContext *s, int b,
                 op2_offset = offsetof(CPUX86State,fpregs[rm].mmx);
             }
         }
+        if (gen_sse_vec(env, s, b, b1, is_xmm, op1_offset, op2_offset)) {
+            return;
+        }
         switch(b) {
         case 0x0f: /* 3DNow! data insns */
             if (!(s->cpuid_ext2_features & CPUID_EXT2_3DNOW))
@@ -6465,7 +6583,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
             }
             tcg_gen_movi_tl(cpu_T[0], next_eip);
             gen_push_v(s, cpu_T[0]);
-            gen_jmp(s, tval);
+            gen_jmp_direct(s, tval);
         }
         break;
     case 0x9a: /* lcall im */
@@ -6494,7 +6612,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
         } else if (!CODE64(s)) {
             tval &= 0xffffffff;
         }
-        gen_jmp(s, tval);
+        gen_jmp_direct(s, tval);
         break;
     case 0xea: /* ljmp im */
         {
@@ -6516,7 +6634,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
         if (dflag == MO_16) {
             tval &= 0xffff;
         }
-        gen_jmp(s, tval);
+        gen_jmp_direct(s, tval);
         break;
     case 0x70 ... 0x7f: /* jcc Jb */
         tval = (int8_t)insn_get(env, s, MO_8);
@@ -7940,6 +8058,7 @@ static inline void gen_intermediate_code_internal(X86CPU *cpu,
     dc->cs_base = cs_base;
     dc->tb = tb;
     dc->popl_esp_hack = 0;
+    dc->trace_exit = false;
     /* select memory access functions */
     dc->mem_index = 0;
     if (flags & HF_SOFTMMU_MASK) {
@@ -129,9 +129,10 @@ static bool have_movbe;
 # define have_movbe 0
 #endif
 
-/* We need this symbol in tcg-target.h, and we can't properly conditionalize
-   it there.  Therefore we always define the variable.  */
+/* We need these symbols in tcg-target.h, and we can't properly conditionalize
+   them there.  Therefore we always define the variables.  */
 bool have_bmi1;
+bool have_sse2;
 
 #if defined(CONFIG_CPUID_H) && defined(bit_BMI2)
 static bool have_bmi2;
@@ -348,6 +349,31 @@ static inline int tcg_target_const_match(tcg_target_long val, TCGType type,
 #define OPC_TESTL	(0x85)
 #define OPC_XCHG_ax_r32	(0x90)
 
+/* SSE2, for the vector ops */
+#define OPC_MOVDQU_VxWx (0x6f | P_EXT | P_SIMDF3)
+#define OPC_MOVDQU_WxVx (0x7f | P_EXT | P_SIMDF3)
+#define OPC_MOVQ_VqWq   (0x7e | P_EXT | P_SIMDF3)
+#define OPC_MOVQ_WqVq   (0xd6 | P_EXT | P_DATA16)
+#define OPC_PADDB       (0xfc | P_EXT | P_DATA16)
+#define OPC_PADDW       (0xfd | P_EXT | P_DATA16)
+#define OPC_PADDD       (0xfe | P_EXT | P_DATA16)
+#define OPC_PADDQ       (0xd4 | P_EXT | P_DATA16)
+#define OPC_PAND        (0xdb | P_EXT | P_DATA16)
+#define OPC_PANDN       (0xdf | P_EXT | P_DATA16)
+#define OPC_PCMPEQB     (0x74 | P_EXT | P_DATA16)
+#define OPC_PCMPEQW     (0x75 | P_EXT | P_DATA16)
+#define OPC_PCMPEQD     (0x76 | P_EXT | P_DATA16)
+#define OPC_PCMPGTB     (0x64 | P_EXT | P_DATA16)
+#define OPC_PCMPGTW     (0x65 | P_EXT | P_DATA16)
+#define OPC_PCMPGTD     (0x66 | P_EXT | P_DATA16)
+#define OPC_POR         (0xeb | P_EXT | P_DATA16)
+#define OPC_PSHUFD      (0x70 | P_EXT | P_DATA16)
+#define OPC_PSUBB       (0xf8 | P_EXT | P_DATA16)
+#define OPC_PSUBW       (0xf9 | P_EXT | P_DATA16)
+#define OPC_PSUBD       (0xfa | P_EXT | P_DATA16)
+#define OPC_PSUBQ       (0xfb | P_EXT | P_DATA16)
+#define OPC_PXOR        (0xef | P_EXT | P_DATA16)
+
 #define OPC_GRP3_Ev	(0xf7)
 #define OPC_GRP5	(0xff)
 
@@ -431,6 +457,11 @@ static void tcg_out_opc(TCGContext *s, int opc, int r, int rm, int x)
     if (opc & P_ADDR32) {
         tcg_out8(s, 0x67);
     }
+    if (opc & P_SIMDF3) {
+        tcg_out8(s, 0xf3);
+    } else if (opc & P_SIMDF2) {
+        tcg_out8(s, 0xf2);
+    }
 
     rex = 0;
     rex |= (opc & P_REXW) ? 0x8 : 0x0;  /* REX.W */
@@ -465,6 +496,11 @@ static void tcg_out_opc(TCGContext *s, int opc)
     if (opc & P_DATA16) {
         tcg_out8(s, 0x66);
     }
+    if (opc & P_SIMDF3) {
+        tcg_out8(s, 0xf3);
+    } else if (opc & P_SIMDF2) {
+        tcg_out8(s, 0xf2);
+    }
     if (opc & (P_EXT | P_EXT38)) {
         tcg_out8(s, 0x0f);
         if (opc & P_EXT38) {
@@ -1717,6 +1753,48 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args, bool is64)
 #endif
 }
 
+/* The vector ops work on the CPU state in memory, through two scratch
+   registers that are otherwise unused by generated code.  */
+#define TCG_VEC_TMP0    0       /* %xmm0 */
+#define TCG_VEC_TMP1    1       /* %xmm1 */
+
+static const int vec_add_insn[4] = {
+    OPC_PADDB, OPC_PADDW, OPC_PADDD, OPC_PADDQ
+};
+static const int vec_sub_insn[4] = {
+    OPC_PSUBB, OPC_PSUBW, OPC_PSUBD, OPC_PSUBQ
+};
+/* There is no 64-bit element compare before SSE4; the generic expansion
+   never emits one.  */
+static const int vec_cmpeq_insn[3] = {
+    OPC_PCMPEQB, OPC_PCMPEQW, OPC_PCMPEQD
+};
+static const int vec_cmpgt_insn[3] = {
+    OPC_PCMPGTB, OPC_PCMPGTW, OPC_PCMPGTD
+};
+
+static void tcg_out_vec_ld(TCGContext *s, int xmm, intptr_t ofs, int oprsz)
+{
+    tcg_out_modrm_offset(s, oprsz == 8 ? OPC_MOVQ_VqWq : OPC_MOVDQU_VxWx,
+                         xmm, TCG_AREG0, ofs);
+}
+
+static void tcg_out_vec_st(TCGContext *s, int xmm, intptr_t ofs, int oprsz)
+{
+    tcg_out_modrm_offset(s, oprsz == 8 ? OPC_MOVQ_WqVq : OPC_MOVDQU_WxVx,
+                         xmm, TCG_AREG0, ofs);
+}
+
+/* dofs = aofs <insn> bofs */
+static void tcg_out_vec_op(TCGContext *s, int insn, intptr_t dofs,
+                           intptr_t aofs, intptr_t bofs, int oprsz)
+{
+    tcg_out_vec_ld(s, TCG_VEC_TMP0, aofs, oprsz);
+    tcg_out_vec_ld(s, TCG_VEC_TMP1, bofs, oprsz);
+    tcg_out_modrm(s, insn, TCG_VEC_TMP0, TCG_VEC_TMP1);
+    tcg_out_vec_st(s, TCG_VEC_TMP0, dofs, oprsz);
+}
+
 static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
                               const TCGArg *args, const int *const_args)
 {
@@ -2058,6 +2136,42 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
         }
         break;
 
+    case INDEX_op_add_vec:
+        tcg_out_vec_op(s, vec_add_insn[args[3]],
+                       args[0], args[1], args[2], args[4]);
+        break;
+    case INDEX_op_sub_vec:
+        tcg_out_vec_op(s, vec_sub_insn[args[3]],
+                       args[0], args[1], args[2], args[4]);
+        break;
+    case INDEX_op_cmpeq_vec:
+        tcg_out_vec_op(s, vec_cmpeq_insn[args[3]],
+                       args[0], args[1], args[2], args[4]);
+        break;
+    case INDEX_op_cmpgt_vec:
+        tcg_out_vec_op(s, vec_cmpgt_insn[args[3]],
+                       args[0], args[1], args[2], args[4]);
+        break;
+    case INDEX_op_and_vec:
+        tcg_out_vec_op(s, OPC_PAND, args[0], args[1], args[2], args[3]);
+        break;
+    case INDEX_op_or_vec:
+        tcg_out_vec_op(s, OPC_POR, args[0], args[1], args[2], args[3]);
+        break;
+    case INDEX_op_xor_vec:
+        tcg_out_vec_op(s, OPC_PXOR, args[0], args[1], args[2], args[3]);
+        break;
+    case INDEX_op_andc_vec:
+        /* pandn complements its destination operand */
+        tcg_out_vec_op(s, OPC_PANDN, args[0], args[2], args[1], args[3]);
+        break;
+    case INDEX_op_shuf32_vec:
+        tcg_out_vec_ld(s, TCG_VEC_TMP1, args[1], 16);
+        tcg_out_modrm(s, OPC_PSHUFD, TCG_VEC_TMP0, TCG_VEC_TMP1);
+        tcg_out8(s, args[2]);
+        tcg_out_vec_st(s, TCG_VEC_TMP0, args[0], 16);
+        break;
+
     case INDEX_op_mov_i32:  /* Always emitted via tcg_out_mov.  */
     case INDEX_op_mov_i64:
     case INDEX_op_movi_i32: /* Always emitted via tcg_out_movi.  */
@@ -2196,6 +2310,16 @@ static const TCGTargetOpDef x86_op_defs[] = {
     { INDEX_op_qemu_ld_i64, { "r", "r", "L", "L" } },
     { INDEX_op_qemu_st_i64, { "L", "L", "L", "L" } },
 #endif
+
+    { INDEX_op_add_vec, { } },
+    { INDEX_op_sub_vec, { } },
+    { INDEX_op_cmpeq_vec, { } },
+    { INDEX_op_cmpgt_vec, { } },
+    { INDEX_op_and_vec, { } },
+    { INDEX_op_or_vec, { } },
+    { INDEX_op_xor_vec, { } },
+    { INDEX_op_andc_vec, { } },
+    { INDEX_op_shuf32_vec, { } },
     { -1 },
 };
 
@@ -2301,6 +2425,9 @@ static void tcg_target_init(TCGContext *s)
         /* MOVBE is only available on Intel Atom and Haswell CPUs, so we
            need to probe for it.  */
         have_movbe = (c & bit_MOVBE) != 0;
+#endif
+#ifdef bit_SSE2
+        have_sse2 = (d & bit_SSE2) != 0;
 #endif
     }
 
@@ -74,6 +74,7 @@ typedef enum {
 #endif
 
 extern bool have_bmi1;
+extern bool have_sse2;
 
 /* optional instructions */
 #define TCG_TARGET_HAS_div2_i32         1
@@ -130,6 +131,13 @@ extern bool have_bmi1;
 #define TCG_TARGET_HAS_mulsh_i64        0
 #endif
 
+/* vector ops are lowered to SSE2, which every x86_64 host has */
+#if TCG_TARGET_REG_BITS == 64
+#define TCG_TARGET_HAS_vec              1
+#else
+#define TCG_TARGET_HAS_vec              have_sse2
+#endif
+
 #define TCG_TARGET_deposit_i32_valid(ofs, len) \
     (((ofs) == 0 && (len) == 8) || ((ofs) == 8 && (len) == 8) || \
      ((ofs) == 0 && (len) == 16))
@@ -47,6 +47,7 @@ struct tcg_temp_info {
     uint16_t next_copy;
     tcg_target_ulong val;
     tcg_target_ulong mask;
+    uint32_t version;
 };
 
 static struct tcg_temp_info temps[TCG_MAX_TEMPS];
@@ -65,6 +66,7 @@ static void reset_temp(TCGArg temp)
     }
     temps[temp].state = TCG_TEMP_UNDEF;
     temps[temp].mask = -1;
+    temps[temp].version++;
 }
 
 static TCGOp *insert_op_before(TCGContext *s, TCGOp *old_op,
@@ -563,6 +565,150 @@ static bool swap_commutative2(TCGArg *p1, TCGArg *p2)
     return false;
 }
 
+/* Local value numbering.  Every pure op is recorded under its opcode and
+   its (copy propagated) inputs, together with the version of each temp it
+   mentions; a temp's version changes whenever the temp is redefined.  An
+   op that matches a recorded one whose temps are all unchanged computes
+   the same value again, and becomes a move from the earlier output.
+
+   Guest loads are only pure in user mode, where nothing can be mapped as
+   MMIO; there they are also numbered, and forgotten after any guest
+   store, call or other op with side effects.  */
+
+#define CSE_TABLE_BITS 7
+#define CSE_MAX_ARGS 6
+
+typedef struct CSEEntry {
+    uint64_t gen;
+    uint64_t mem_gen;
+    TCGOpcode opc;
+    TCGArg args[CSE_MAX_ARGS];
+    uint32_t version[CSE_MAX_ARGS];
+} CSEEntry;
+
+static CSEEntry cse_table[1 << CSE_TABLE_BITS];
+static uint64_t cse_gen, cse_mem_gen;
+
+/* Defined with the env access forwarding below.  */
+static int env_access_size(TCGOpcode opc, bool *is_store);
+
+static inline bool temp_is_env(TCGContext *s, TCGArg arg)
+{
+    return s->temps[arg].fixed_reg && s->temps[arg].reg == TCG_AREG0;
+}
+
+static bool cse_candidate(TCGOpcode opc, const TCGOpDef *def)
+{
+    bool is_store;
+
+    if (def->nb_oargs != 1 || def->nb_args > CSE_MAX_ARGS) {
+        return false;
+    }
+    switch (opc) {
+    case INDEX_op_qemu_ld_i32:
+    case INDEX_op_qemu_ld_i64:
+#ifdef CONFIG_USER_ONLY
+        return true;
+#else
+        return false;
+#endif
+    default:
+        break;
+    }
+    if (def->flags & (TCG_OPF_BB_END | TCG_OPF_CALL_CLOBBER
+                      | TCG_OPF_SIDE_EFFECTS | TCG_OPF_NOT_PRESENT)) {
+        return false;
+    }
+    /* Host loads are left to tcg_env_access_forwarding.  */
+    return env_access_size(opc, &is_store) == 0;
+}
+
+static bool cse_clobbers_memory(TCGContext *s, TCGOpcode opc,
+                                const TCGOpDef *def, const TCGArg *args)
+{
+    bool is_store;
+
+    switch (opc) {
+    case INDEX_op_qemu_ld_i32:
+    case INDEX_op_qemu_ld_i64:
+        return false;
+    case INDEX_op_call:
+        return true;
+    default:
+        if (def->flags & TCG_OPF_SIDE_EFFECTS) {
+            return true;
+        }
+        return env_access_size(opc, &is_store) != 0 && is_store
+               && !temp_is_env(s, args[1]);
+    }
+}
+
+/* Build the lookup key for OP into KEY and return its hash bucket.  */
+static CSEEntry *cse_make_key(TCGOpcode opc, const TCGOpDef *def,
+                              const TCGArg *args, CSEEntry *key)
+{
+    int nb_args = def->nb_args;
+    uint32_t h = opc;
+    int i;
+
+    key->gen = cse_gen;
+    key->mem_gen = cse_mem_gen;
+    key->opc = opc;
+    memset(key->args, 0, sizeof(key->args));
+    memset(key->version, 0, sizeof(key->version));
+    for (i = 1; i < nb_args; i++) {
+        key->args[i] = args[i];
+    }
+
+    /* Commutative inputs are compared in a canonical order.  */
+    switch (opc) {
+    CASE_OP_32_64(add):
+    CASE_OP_32_64(mul):
+    CASE_OP_32_64(and):
+    CASE_OP_32_64(or):
+    CASE_OP_32_64(xor):
+    CASE_OP_32_64(eqv):
+    CASE_OP_32_64(nand):
+    CASE_OP_32_64(nor):
+    CASE_OP_32_64(muluh):
+    CASE_OP_32_64(mulsh):
+        if (key->args[1] > key->args[2]) {
+            key->args[1] = args[2];
+            key->args[2] = args[1];
+        }
+        break;
+    default:
+        break;
+    }
+
+    for (i = 1; i < nb_args; i++) {
+        if (i <= def->nb_iargs) {
+            key->version[i] = temps[key->args[i]].version;
+        }
+        h = h * 31 + key->args[i];
+    }
+    h ^= h >> CSE_TABLE_BITS;
+    return &cse_table[h & ((1 << CSE_TABLE_BITS) - 1)];
+}
+
+/* Return the temp already holding the value computed by KEY, or -1.  */
+static TCGArg cse_lookup(const CSEEntry *e, const CSEEntry *key,
+                         const TCGOpDef *def)
+{
+    if (e->gen != key->gen || e->opc != key->opc
+        || memcmp(&e->args[1], &key->args[1],
+                  (CSE_MAX_ARGS - 1) * sizeof(TCGArg))
+        || memcmp(&e->version[1], &key->version[1],
+                  (CSE_MAX_ARGS - 1) * sizeof(uint32_t))
+        || e->version[0] != temps[e->args[0]].version) {
+        return -1;
+    }
+    if ((def->flags & TCG_OPF_SIDE_EFFECTS) && e->mem_gen != key->mem_gen) {
+        return -1;
+    }
+    return e->args[0];
+}
+
 /* Propagate constants and copies, fold constant expressions. */
 static void tcg_constant_folding(TCGContext *s)
 {
@@ -576,11 +722,13 @@ static void tcg_constant_folding(TCGContext *s)
     nb_temps = s->nb_temps;
     nb_globals = s->nb_globals;
     reset_all_temps(nb_temps);
+    cse_gen++;
 
     for (oi = s->gen_first_op_idx; oi >= 0; oi = oi_next) {
         tcg_target_ulong mask, partmask, affected;
         int nb_oargs, nb_iargs, i;
         TCGArg tmp;
+        CSEEntry cse_key, *cse_slot = NULL;
 
         TCGOp * const op = &s->gen_op_buf[oi];
         TCGArg * const args = &s->gen_opparam_buf[op->args];
@@ -596,6 +744,10 @@ static void tcg_constant_folding(TCGContext *s)
             nb_iargs = def->nb_iargs;
         }
 
+        if (cse_clobbers_memory(s, opc, def, args)) {
+            cse_mem_gen++;
+        }
+
         /* Do copy propagation */
         for (i = nb_oargs; i < nb_oargs + nb_iargs; i++) {
             if (temps[args[i]].state == TCG_TEMP_COPY) {
@@ -1332,6 +1484,18 @@ static void tcg_constant_folding(TCGContext *s)
 
         default:
         do_default:
+            if (cse_candidate(opc, def)) {
+                cse_slot = cse_make_key(opc, def, args, &cse_key);
+                tmp = cse_lookup(cse_slot, &cse_key, def);
+                if (tmp == args[0]) {
+                    tcg_op_remove(s, op);
+                    break;
+                } else if (tmp != (TCGArg)-1) {
+                    tcg_opt_gen_mov(s, op, args, opc, args[0], tmp);
+                    break;
+                }
+            }
+
             /* Default case: we know nothing about operation (or were unable
                to compute the operation result) so no propagation is done.
                We trash everything if the operation is the end of a basic
@@ -1339,6 +1503,7 @@ static void tcg_constant_folding(TCGContext *s)
                the non-zero bits mask for the first output arg.  */
             if (def->flags & TCG_OPF_BB_END) {
                 reset_all_temps(nb_temps);
+                cse_gen++;
             } else {
         do_reset_output:
                 for (i = 0; i < nb_oargs; i++) {
@@ -1349,13 +1514,231 @@ static void tcg_constant_folding(TCGContext *s)
                         temps[args[i]].mask = mask;
                     }
                 }
+                if (cse_slot) {
+                    cse_key.args[0] = args[0];
+                    cse_key.version[0] = temps[args[0]].version;
+                    *cse_slot = cse_key;
+                }
             }
             break;
         }
     }
 }
 
+/* Forwarding of explicit loads and stores to the CPU state.
+
+   Frontends keep most of the guest state in env fields that are not TCG
+   globals and access them with plain ld/st ops relative to TCG_AREG0, so
+   the same field is often loaded several times, or stored and then
+   reloaded, within one basic block.  Track the known contents of such
+   fields to turn the redundant loads into moves, drop stores of a value
+   that memory already holds, and drop stores that are overwritten before
+   anything could observe them.
+
+   Everything is forgotten at basic block ends, calls and ops with side
+   effects: helpers may read or write env through their env argument, and
+   qemu_ld/st may raise an exception that exposes the CPU state.  Accesses
+   through any other base pointer are assumed to alias env.  */
+
+#define ENV_ACCESS_SLOTS 16
+
+typedef struct EnvAccess {
+    tcg_target_long ofs;
+    int size;
+    TCGOpcode ld_opc;   /* load reproducing VAL; unused for stores */
+    TCGArg val;         /* temp holding the contents; oi for stores */
+} EnvAccess;
+
+static EnvAccess env_vals[ENV_ACCESS_SLOTS];
+static EnvAccess env_stores[ENV_ACCESS_SLOTS];
+static int nb_env_vals, nb_env_stores;
+
+/* Return the size in bytes of a load or store op, or 0 for other ops.  */
+static int env_access_size(TCGOpcode opc, bool *is_store)
+{
+    *is_store = false;
+    switch (opc) {
+    case INDEX_op_st8_i32:
+    case INDEX_op_st8_i64:
+        *is_store = true;
+        /* fall through */
+    case INDEX_op_ld8u_i32:
+    case INDEX_op_ld8s_i32:
+    case INDEX_op_ld8u_i64:
+    case INDEX_op_ld8s_i64:
+        return 1;
+    case INDEX_op_st16_i32:
+    case INDEX_op_st16_i64:
+        *is_store = true;
+        /* fall through */
+    case INDEX_op_ld16u_i32:
+    case INDEX_op_ld16s_i32:
+    case INDEX_op_ld16u_i64:
+    case INDEX_op_ld16s_i64:
+        return 2;
+    case INDEX_op_st_i32:
+    case INDEX_op_st32_i64:
+        *is_store = true;
+        /* fall through */
+    case INDEX_op_ld_i32:
+    case INDEX_op_ld32u_i64:
+    case INDEX_op_ld32s_i64:
+        return 4;
+    case INDEX_op_st_i64:
+        *is_store = true;
+        /* fall through */
+    case INDEX_op_ld_i64:
+        return 8;
+    default:
+        return 0;
+    }
+}
+
+static inline bool env_access_overlap(const EnvAccess *e,
+                                      tcg_target_long ofs, int size)
+{
+    return e->ofs < ofs + size && ofs < e->ofs + e->size;
+}
+
+static void env_access_add(EnvAccess *tab, int *nb, tcg_target_long ofs,
+                           int size, TCGOpcode ld_opc, TCGArg val)
+{
+    /* When full, forget the oldest entry; that only loses an
+       optimization opportunity.  */
+    if (*nb == ENV_ACCESS_SLOTS) {
+        memmove(tab, tab + 1, (ENV_ACCESS_SLOTS - 1) * sizeof(*tab));
+        (*nb)--;
+    }
+    tab[*nb] = (EnvAccess){ .ofs = ofs, .size = size,
+                            .ld_opc = ld_opc, .val = val };
+    (*nb)++;
+}
+
+static inline void env_access_del(EnvAccess *tab, int *nb, int i)
+{
+    tab[i] = tab[--(*nb)];
+}
+
+static void tcg_env_access_forwarding(TCGContext *s)
+{
+    int oi, oi_next, i;
+
+    nb_env_vals = nb_env_stores = 0;
+
+    for (oi = s->gen_first_op_idx; oi >= 0; oi = oi_next) {
+        TCGOp * const op = &s->gen_op_buf[oi];
+        TCGArg * const args = &s->gen_opparam_buf[op->args];
+        TCGOpcode opc = op->opc;
+        const TCGOpDef *def = &tcg_op_defs[opc];
+        int nb_oargs, size;
+        tcg_target_long ofs;
+        bool is_store, is_env;
+
+        oi_next = op->next;
+
+        if (opc == INDEX_op_call
+            || (def->flags & (TCG_OPF_BB_END | TCG_OPF_SIDE_EFFECTS
+                              | TCG_OPF_VECTOR))) {
+            nb_env_vals = nb_env_stores = 0;
+            continue;
+        }
+
+        size = env_access_size(opc, &is_store);
+        if (size == 0) {
+            /* Whatever was cached in the outputs is stale now.  */
+            nb_oargs = def->nb_oargs;
+            for (i = nb_env_vals - 1; i >= 0; i--) {
+                int k;
+                for (k = 0; k < nb_oargs; k++) {
+                    if (env_vals[i].val == args[k]) {
+                        env_access_del(env_vals, &nb_env_vals, i);
+                        break;
+                    }
+                }
+            }
+            continue;
+        }
+
+        ofs = args[2];
+        is_env = temp_is_env(s, args[1]);
+
+        if (is_store) {
+            TCGOpcode ld_opc = (opc == INDEX_op_st_i32 ? INDEX_op_ld_i32
+                                : opc == INDEX_op_st_i64 ? INDEX_op_ld_i64
+                                : NB_OPS);
+
+            if (!is_env) {
+                nb_env_vals = 0;
+                continue;
+            }
+
+            /* Memory already holds this value.  */
+            for (i = 0; i < nb_env_vals; i++) {
+                if (env_vals[i].ofs == ofs && env_vals[i].ld_opc == ld_opc
+                    && env_vals[i].val == args[0]) {
+                    break;
+                }
+            }
+            if (i < nb_env_vals) {
+                tcg_op_remove(s, op);
+                continue;
+            }
+
+            /* Earlier stores that this one fully overwrites are dead.  */
+            for (i = nb_env_stores - 1; i >= 0; i--) {
+                if (env_stores[i].ofs >= ofs
+                    && env_stores[i].ofs + env_stores[i].size <= ofs + size) {
+                    tcg_op_remove(s, &s->gen_op_buf[env_stores[i].val]);
+                    env_access_del(env_stores, &nb_env_stores, i);
+                }
+            }
+            for (i = nb_env_vals - 1; i >= 0; i--) {
+                if (env_access_overlap(&env_vals[i], ofs, size)) {
+                    env_access_del(env_vals, &nb_env_vals, i);
+                }
+            }
+            if (ld_opc != NB_OPS) {
+                env_access_add(env_vals, &nb_env_vals, ofs, size,
+                               ld_opc, args[0]);
+            }
+            env_access_add(env_stores, &nb_env_stores, ofs, size, NB_OPS, oi);
+            continue;
+        }
+
+        /* A load observes the pending stores it overlaps.  */
+        for (i = nb_env_stores - 1; i >= 0; i--) {
+            if (!is_env || env_access_overlap(&env_stores[i], ofs, size)) {
+                env_access_del(env_stores, &nb_env_stores, i);
+            }
+        }
+
+        /* The destination is redefined.  */
+        for (i = nb_env_vals - 1; i >= 0; i--) {
+            if (env_vals[i].val == args[0]) {
+                env_access_del(env_vals, &nb_env_vals, i);
+            }
+        }
+        if (!is_env) {
+            continue;
+        }
+
+        for (i = 0; i < nb_env_vals; i++) {
+            if (env_vals[i].ofs == ofs && env_vals[i].ld_opc == opc) {
+                break;
+            }
+        }
+        if (i < nb_env_vals) {
+            op->opc = def->flags & TCG_OPF_64BIT ? INDEX_op_mov_i64
+                                                 : INDEX_op_mov_i32;
+            args[1] = env_vals[i].val;
+        } else {
+            env_access_add(env_vals, &nb_env_vals, ofs, size, opc, args[0]);
+        }
+    }
+}
+
 void tcg_optimize(TCGContext *s)
 {
+    tcg_env_access_forwarding(s);
     tcg_constant_folding(s);
 }
@@ -0,0 +1,342 @@
+/*
+ * Generic vector operation expansion
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * Without host vector support, each 64-bit chunk of a vector is loaded
+ * into an i64 temp and the elements are processed in parallel within it
+ * ("SIMD within a register").  Lane-wise operations do not care how the
+ * elements of a chunk are laid out in memory, so the same expansion is
+ * correct for either host byte order.
+ */
+
+#include "tcg.h"
+#include "tcg-op.h"
+#include "tcg-op-gvec.h"
+
+static inline TCGv_ptr gvec_env(void)
+{
+    return tcg_ctx.tcg_env;
+}
+
+/* Replicate the low VECE-sized element of C across 64 bits.  */
+static uint64_t dup_const(unsigned vece, uint64_t c)
+{
+    switch (vece) {
+    case MO_8:
+        return 0x0101010101010101ull * (uint8_t)c;
+    case MO_16:
+        return 0x0001000100010001ull * (uint16_t)c;
+    case MO_32:
+        return 0x0000000100000001ull * (uint32_t)c;
+    default:
+        return c;
+    }
+}
+
+static void gvec_check(uint32_t oprsz)
+{
+    tcg_debug_assert(oprsz == 8 || oprsz == 16);
+}
+
+typedef void GVecGen3Fn(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b);
+
+/* Expand a lane-wise operation one 64-bit chunk at a time.  */
+static void gvec_expand3(GVecGen3Fn *fn, unsigned vece, uint32_t dofs,
+                         uint32_t aofs, uint32_t bofs, uint32_t oprsz)
+{
+    TCGv_i64 t0 = tcg_temp_new_i64();
+    TCGv_i64 t1 = tcg_temp_new_i64();
+    uint32_t i;
+
+    for (i = 0; i < oprsz; i += 8) {
+        tcg_gen_ld_i64(t0, gvec_env(), aofs + i);
+        tcg_gen_ld_i64(t1, gvec_env(), bofs + i);
+        fn(vece, t0, t0, t1);
+        tcg_gen_st_i64(t0, gvec_env(), dofs + i);
+    }
+    tcg_temp_free_i64(t0);
+    tcg_temp_free_i64(t1);
+}
+
+static void gen_addv_i64(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    TCGv_i64 m, t1, t2, t3;
+
+    if (vece == MO_64) {
+        tcg_gen_add_i64(d, a, b);
+        return;
+    }
+
+    /* Add without the top bit of each element, so that no carry crosses
+       into the next one, then fix up the top bits.  */
+    m = tcg_const_i64(dup_const(vece, 1ull << ((8 << vece) - 1)));
+    t1 = tcg_temp_new_i64();
+    t2 = tcg_temp_new_i64();
+    t3 = tcg_temp_new_i64();
+    tcg_gen_andc_i64(t1, a, m);
+    tcg_gen_andc_i64(t2, b, m);
+    tcg_gen_xor_i64(t3, a, b);
+    tcg_gen_add_i64(d, t1, t2);
+    tcg_gen_and_i64(t3, t3, m);
+    tcg_gen_xor_i64(d, d, t3);
+    tcg_temp_free_i64(m);
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(t2);
+    tcg_temp_free_i64(t3);
+}
+
+static void gen_subv_i64(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    TCGv_i64 m, t1, t2, t3;
+
+    if (vece == MO_64) {
+        tcg_gen_sub_i64(d, a, b);
+        return;
+    }
+
+    /* Subtract with the top bit of each minuend element set and of each
+       subtrahend element clear, so that no borrow crosses into the next
+       element, then fix up the top bits.  */
+    m = tcg_const_i64(dup_const(vece, 1ull << ((8 << vece) - 1)));
+    t1 = tcg_temp_new_i64();
+    t2 = tcg_temp_new_i64();
+    t3 = tcg_temp_new_i64();
+    tcg_gen_or_i64(t1, a, m);
+    tcg_gen_andc_i64(t2, b, m);
+    tcg_gen_eqv_i64(t3, a, b);
+    tcg_gen_sub_i64(d, t1, t2);
+    tcg_gen_and_i64(t3, t3, m);
+    tcg_gen_xor_i64(d, d, t3);
+    tcg_temp_free_i64(m);
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(t2);
+    tcg_temp_free_i64(t3);
+}
+
+static void gen_cmpeqv_i64(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    int bits = 8 << vece;
+    TCGv_i64 m, t1, t2;
+
+    if (vece == MO_64) {
+        tcg_gen_setcond_i64(TCG_COND_EQ, d, a, b);
+        tcg_gen_neg_i64(d, d);
+        return;
+    }
+
+    /* The top bit of each element of t1 is set iff the element of a ^ b
+       is nonzero; adding the low bits cannot carry out of the element.
+       Shift the complement of that bit down and multiply it into a mask
+       of the whole element.  */
+    m = tcg_const_i64(dup_const(vece, 1ull << (bits - 1)));
+    t1 = tcg_temp_new_i64();
+    t2 = tcg_temp_new_i64();
+    tcg_gen_xor_i64(t2, a, b);
+    tcg_gen_andc_i64(t1, t2, m);
+    tcg_gen_addi_i64(t1, t1, ~dup_const(vece, 1ull << (bits - 1)));
+    tcg_gen_or_i64(t1, t1, t2);
+    tcg_gen_andc_i64(t1, m, t1);
+    tcg_gen_shri_i64(t1, t1, bits - 1);
+    tcg_gen_muli_i64(d, t1, (1ull << bits) - 1);
+    tcg_temp_free_i64(m);
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(t2);
+}
+
+static void gen_and_i64(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_and_i64(d, a, b);
+}
+
+static void gen_or_i64(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_or_i64(d, a, b);
+}
+
+static void gen_xor_i64(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_xor_i64(d, a, b);
+}
+
+static void gen_andc_i64(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_andc_i64(d, a, b);
+}
+
+void tcg_gen_gvec_add(unsigned vece, uint32_t dofs, uint32_t aofs,
+                      uint32_t bofs, uint32_t oprsz)
+{
+    gvec_check(oprsz);
+    if (TCG_TARGET_HAS_vec) {
+        tcg_gen_op5(&tcg_ctx, INDEX_op_add_vec, dofs, aofs, bofs, vece, oprsz);
+    } else {
+        gvec_expand3(gen_addv_i64, vece, dofs, aofs, bofs, oprsz);
+    }
+}
+
+void tcg_gen_gvec_sub(unsigned vece, uint32_t dofs, uint32_t aofs,
+                      uint32_t bofs, uint32_t oprsz)
+{
+    gvec_check(oprsz);
+    if (TCG_TARGET_HAS_vec) {
+        tcg_gen_op5(&tcg_ctx, INDEX_op_sub_vec, dofs, aofs, bofs, vece, oprsz);
+    } else {
+        gvec_expand3(gen_subv_i64, vece, dofs, aofs, bofs, oprsz);
+    }
+}
+
+void tcg_gen_gvec_and(uint32_t dofs, uint32_t aofs, uint32_t bofs,
+                      uint32_t oprsz)
+{
+    gvec_check(oprsz);
+    if (TCG_TARGET_HAS_vec) {
+        tcg_gen_op4(&tcg_ctx, INDEX_op_and_vec, dofs, aofs, bofs, oprsz);
+    } else {
+        gvec_expand3(gen_and_i64, MO_64, dofs, aofs, bofs, oprsz);
+    }
+}
+
+void tcg_gen_gvec_or(uint32_t dofs, uint32_t aofs, uint32_t bofs,
+                     uint32_t oprsz)
+{
+    gvec_check(oprsz);
+    if (TCG_TARGET_HAS_vec) {
+        tcg_gen_op4(&tcg_ctx, INDEX_op_or_vec, dofs, aofs, bofs, oprsz);
+    } else {
+        gvec_expand3(gen_or_i64, MO_64, dofs, aofs, bofs, oprsz);
+    }
+}
+
+void tcg_gen_gvec_xor(uint32_t dofs, uint32_t aofs, uint32_t bofs,
+                      uint32_t oprsz)
+{
+    gvec_check(oprsz);
+    if (TCG_TARGET_HAS_vec) {
+        tcg_gen_op4(&tcg_ctx, INDEX_op_xor_vec, dofs, aofs, bofs, oprsz);
+    } else {
+        gvec_expand3(gen_xor_i64, MO_64, dofs, aofs, bofs, oprsz);
+    }
+}
+
+void tcg_gen_gvec_andc(uint32_t dofs, uint32_t aofs, uint32_t bofs,
+                       uint32_t oprsz)
+{
+    gvec_check(oprsz);
+    if (TCG_TARGET_HAS_vec) {
+        tcg_gen_op4(&tcg_ctx, INDEX_op_andc_vec, dofs, aofs, bofs, oprsz);
+    } else {
+        gvec_expand3(gen_andc_i64, MO_64, dofs, aofs, bofs, oprsz);
+    }
+}
+
+/* Compare one element at a time, for the conditions that have no cheap
+   expansion within a register.  */
+static void gvec_cmp_elements(TCGCond cond, unsigned vece, uint32_t dofs,
+                              uint32_t aofs, uint32_t bofs, uint32_t oprsz)
+{
+    TCGv_i64 t0 = tcg_temp_new_i64();
+    TCGv_i64 t1 = tcg_temp_new_i64();
+    bool is_signed = cond == TCG_COND_LT || cond == TCG_COND_LE
+                     || cond == TCG_COND_GT || cond == TCG_COND_GE;
+    uint32_t size = 1 << vece;
+    uint32_t i;
+
+    for (i = 0; i < oprsz; i += size) {
+        switch (vece) {
+        case MO_8:
+            if (is_signed) {
+                tcg_gen_ld8s_i64(t0, gvec_env(), aofs + i);
+                tcg_gen_ld8s_i64(t1, gvec_env(), bofs + i);
+            } else {
+                tcg_gen_ld8u_i64(t0, gvec_env(), aofs + i);
+                tcg_gen_ld8u_i64(t1, gvec_env(), bofs + i);
+            }
+            break;
+        case MO_16:
+            if (is_signed) {
+                tcg_gen_ld16s_i64(t0, gvec_env(), aofs + i);
+                tcg_gen_ld16s_i64(t1, gvec_env(), bofs + i);
+            } else {
+                tcg_gen_ld16u_i64(t0, gvec_env(), aofs + i);
+                tcg_gen_ld16u_i64(t1, gvec_env(), bofs + i);
+            }
+            break;
+        case MO_32:
+            if (is_signed) {
+                tcg_gen_ld32s_i64(t0, gvec_env(), aofs + i);
+                tcg_gen_ld32s_i64(t1, gvec_env(), bofs + i);
+            } else {
+                tcg_gen_ld32u_i64(t0, gvec_env(), aofs + i);
+                tcg_gen_ld32u_i64(t1, gvec_env(), bofs + i);
+            }
+            break;
+        default:
+            tcg_gen_ld_i64(t0, gvec_env(), aofs + i);
+            tcg_gen_ld_i64(t1, gvec_env(), bofs + i);
+            break;
+        }
+        tcg_gen_setcond_i64(cond, t0, t0, t1);
+        tcg_gen_neg_i64(t0, t0);
+        switch (vece) {
+        case MO_8:
+            tcg_gen_st8_i64(t0, gvec_env(), dofs + i);
+            break;
+        case MO_16:
+            tcg_gen_st16_i64(t0, gvec_env(), dofs + i);
+            break;
+        case MO_32:
+            tcg_gen_st32_i64(t0, gvec_env(), dofs + i);
+            break;
+        default:
+            tcg_gen_st_i64(t0, gvec_env(), dofs + i);
+            break;
+        }
+    }
+    tcg_temp_free_i64(t0);
+    tcg_temp_free_i64(t1);
+}
+
+void tcg_gen_gvec_cmp(TCGCond cond, unsigned vece, uint32_t dofs,
+                      uint32_t aofs, uint32_t bofs, uint32_t oprsz)
+{
+    gvec_check(oprsz);
+    if (TCG_TARGET_HAS_vec && vece < MO_64) {
+        if (cond == TCG_COND_EQ) {
+            tcg_gen_op5(&tcg_ctx, INDEX_op_cmpeq_vec,
+                        dofs, aofs, bofs, vece, oprsz);
+            return;
+        } else if (cond == TCG_COND_GT) {
+            tcg_gen_op5(&tcg_ctx, INDEX_op_cmpgt_vec,
+                        dofs, aofs, bofs, vece, oprsz);
+            return;
+        }
+    }
+    if (cond == TCG_COND_EQ) {
+        gvec_expand3(gen_cmpeqv_i64, vece, dofs, aofs, bofs, oprsz);
+    } else {
+        gvec_cmp_elements(cond, vece, dofs, aofs, bofs, oprsz);
+    }
+}
+
+void tcg_gen_gvec_shuf32(uint32_t dofs, uint32_t aofs, unsigned sel)
+{
+    TCGv_i32 t[4];
+    int i;
+
+    if (TCG_TARGET_HAS_vec) {
+        tcg_gen_op3(&tcg_ctx, INDEX_op_shuf32_vec, dofs, aofs, sel & 0xff);
+        return;
+    }
+
+    /* Load every element before storing any, in case dofs == aofs.  */
+    for (i = 0; i < 4; i++) {
+        t[i] = tcg_temp_new_i32();
+        tcg_gen_ld_i32(t[i], gvec_env(), aofs + 4 * ((sel >> (2 * i)) & 3));
+    }
+    for (i = 0; i < 4; i++) {
+        tcg_gen_st_i32(t[i], gvec_env(), dofs + 4 * i);
+        tcg_temp_free_i32(t[i]);
+    }
+}
@@ -0,0 +1,46 @@
+/*
+ * Generic vector operation expansion
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef TCG_OP_GVEC_H
+#define TCG_OP_GVEC_H
+
+/*
+ * Vector operations on the CPU state.  Every operand is given as an offset
+ * from env of a vector of OPRSZ bytes (8 or 16), made of elements of size
+ * VECE (MO_8, MO_16, MO_32 or MO_64).  Destination and sources may be the
+ * same vector.
+ *
+ * When the host backend implements the vector opcodes the operation is a
+ * single TCG op; otherwise it is expanded inline into 64-bit integer ops,
+ * so either way no helper call is made.
+ */
+
+void tcg_gen_gvec_add(unsigned vece, uint32_t dofs, uint32_t aofs,
+                      uint32_t bofs, uint32_t oprsz);
+void tcg_gen_gvec_sub(unsigned vece, uint32_t dofs, uint32_t aofs,
+                      uint32_t bofs, uint32_t oprsz);
+
+void tcg_gen_gvec_and(uint32_t dofs, uint32_t aofs, uint32_t bofs,
+                      uint32_t oprsz);
+void tcg_gen_gvec_or(uint32_t dofs, uint32_t aofs, uint32_t bofs,
+                     uint32_t oprsz);
+void tcg_gen_gvec_xor(uint32_t dofs, uint32_t aofs, uint32_t bofs,
+                      uint32_t oprsz);
+/* dofs = aofs & ~bofs */
+void tcg_gen_gvec_andc(uint32_t dofs, uint32_t aofs, uint32_t bofs,
+                       uint32_t oprsz);
+
+/* Set each element of dofs to all ones if COND holds between the
+   corresponding elements of aofs and bofs, and to zero otherwise.  */
+void tcg_gen_gvec_cmp(TCGCond cond, unsigned vece, uint32_t dofs,
+                      uint32_t aofs, uint32_t bofs, uint32_t oprsz);
+
+/* Shuffle the four 32-bit elements of a 16-byte vector, as laid out in
+   host memory: element i of dofs is element (SEL >> 2 * i) & 3 of aofs.  */
+void tcg_gen_gvec_shuf32(uint32_t dofs, uint32_t aofs, unsigned sel);
+
+#endif
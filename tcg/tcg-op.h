@@ -969,6 +969,8 @@ static inline void tcg_gen_qemu_st64(TCGv_i64 arg, TCGv addr, int mem_index)
 #if UINTPTR_MAX == UINT32_MAX
 # define tcg_gen_ld_ptr(R, A, O) \
     tcg_gen_ld_i32(TCGV_PTR_TO_NAT(R), (A), (O))
+# define tcg_gen_st_ptr(R, A, O) \
+    tcg_gen_st_i32(TCGV_PTR_TO_NAT(R), (A), (O))
 # define tcg_gen_discard_ptr(A) \
     tcg_gen_discard_i32(TCGV_PTR_TO_NAT(A))
 # define tcg_gen_add_ptr(R, A, B) \
@@ -980,6 +982,8 @@ static inline void tcg_gen_qemu_st64(TCGv_i64 arg, TCGv addr, int mem_index)
 #else
 # define tcg_gen_ld_ptr(R, A, O) \
     tcg_gen_ld_i64(TCGV_PTR_TO_NAT(R), (A), (O))
+# define tcg_gen_st_ptr(R, A, O) \
+    tcg_gen_st_i64(TCGV_PTR_TO_NAT(R), (A), (O))
 # define tcg_gen_discard_ptr(A) \
     tcg_gen_discard_i64(TCGV_PTR_TO_NAT(A))
 # define tcg_gen_add_ptr(R, A, B) \
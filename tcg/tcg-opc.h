@@ -167,6 +167,22 @@ DEF(muls2_i64, 2, 2, 0, IMPL64 | IMPL(TCG_TARGET_HAS_muls2_i64))
 DEF(muluh_i64, 1, 2, 0, IMPL(TCG_TARGET_HAS_muluh_i64))
 DEF(mulsh_i64, 1, 2, 0, IMPL(TCG_TARGET_HAS_mulsh_i64))
 
+/* vector ops on the CPU state: dofs, aofs, bofs are offsets from env,
+   then element size (MO_8..MO_64) and vector size in bytes (8 or 16) */
+#define IMPLVEC  TCG_OPF_VECTOR | IMPL(TCG_TARGET_HAS_vec)
+
+DEF(add_vec, 0, 0, 5, IMPLVEC)
+DEF(sub_vec, 0, 0, 5, IMPLVEC)
+DEF(cmpeq_vec, 0, 0, 5, IMPLVEC)
+DEF(cmpgt_vec, 0, 0, 5, IMPLVEC)
+/* dofs, aofs, bofs, vector size */
+DEF(and_vec, 0, 0, 4, IMPLVEC)
+DEF(or_vec, 0, 0, 4, IMPLVEC)
+DEF(xor_vec, 0, 0, 4, IMPLVEC)
+DEF(andc_vec, 0, 0, 4, IMPLVEC)
+/* dofs, aofs, selector; 16 bytes, 32-bit elements */
+DEF(shuf32_vec, 0, 0, 3, IMPLVEC)
+
 /* QEMU specific */
 #if TARGET_LONG_BITS > TCG_TARGET_REG_BITS
 DEF(debug_insn_start, 0, 0, 2, TCG_OPF_NOT_PRESENT)
@@ -192,4 +208,5 @@ DEF(qemu_st_i64, 0, TLADDR_ARGS + DATA64_ARGS, 1,
 #undef DATA64_ARGS
 #undef IMPL
 #undef IMPL64
+#undef IMPLVEC
 #undef DEF
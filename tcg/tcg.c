@@ -403,6 +403,7 @@ void tcg_func_start(TCGContext *s)
 
     s->nb_labels = 0;
     s->current_frame_offset = s->frame_start;
+    s->gen_host_ptr = false;
 
 #ifdef CONFIG_DEBUG_TCG
     s->goto_tb_issue_mask = 0;
@@ -445,6 +446,9 @@ static inline int tcg_global_reg_new_internal(TCGType type, int reg,
     ts->name = name;
     s->nb_globals++;
     tcg_regset_set_reg(s->reserved_regs, reg);
+    if (reg == TCG_AREG0) {
+        s->tcg_env = MAKE_TCGV_PTR(idx);
+    }
     return idx;
 }
 
@@ -979,6 +983,217 @@ static const char * const ldst_name[] =
     [MO_BEQ]  = "beq",
 };
 
+/* Position of the label argument of @c, or -1 if it has none */
+static int tcg_op_label_index(TCGOpcode c)
+{
+    switch (c) {
+    case INDEX_op_set_label:
+    case INDEX_op_br:
+        return 0;
+    case INDEX_op_brcond_i32:
+    case INDEX_op_brcond_i64:
+        return 3;
+    case INDEX_op_brcond2_i32:
+        return 5;
+    default:
+        return -1;
+    }
+}
+
+/* Fingerprint of everything an op stream saved by tcg_op_stream_save()
+   depends on besides the guest code: opcode numbering, the helper table
+   and the global temps.  */
+uint32_t tcg_op_stream_fingerprint(TCGContext *s)
+{
+    uint32_t h = NB_OPS;
+    const char *p;
+    int i;
+
+    h = h * 31 + ARRAY_SIZE(all_helpers);
+    for (i = 0; i < ARRAY_SIZE(all_helpers); i++) {
+        for (p = all_helpers[i].name; *p; p++) {
+            h = h * 31 + *p;
+        }
+        h = h * 31 + all_helpers[i].flags;
+    }
+    for (i = 0; i < s->nb_globals; i++) {
+        h = h * 31 + s->temps[i].base_type;
+        h = h * 31 + s->temps[i].mem_offset;
+    }
+    return h * 31 + TCG_TARGET_REG_BITS;
+}
+
+#define TCG_OP_STREAM_TB_RELOC  (1ULL << 63)
+
+/* Serialize the op stream built by the front end for the TB at address
+   @tb into @buf, replacing host pointers (labels, helpers, the TB itself)
+   with values that stay valid in another process running the same binary.
+   Returns the number of words used, or 0 if the stream does not fit or
+   cannot be made relocatable.  */
+size_t tcg_op_stream_save(TCGContext *s, uintptr_t tb,
+                          uint64_t *buf, size_t max_words)
+{
+    size_t n = 3;
+    int i, oi, nb_ops = 0;
+
+    if (s->gen_host_ptr ||
+        max_words < n + s->nb_temps - s->nb_globals) {
+        return 0;
+    }
+    buf[0] = s->nb_temps - s->nb_globals;
+    buf[1] = s->nb_labels;
+    for (i = s->nb_globals; i < s->nb_temps; i++) {
+        TCGTemp *ts = &s->temps[i];
+
+        buf[n++] = ts->base_type | ts->type << 8 | ts->temp_local << 16;
+    }
+
+    for (oi = s->gen_first_op_idx; oi >= 0; oi = s->gen_op_buf[oi].next) {
+        TCGOp * const op = &s->gen_op_buf[oi];
+        const TCGArg *args = &s->gen_opparam_buf[op->args];
+        const TCGOpDef *def = &tcg_op_defs[op->opc];
+        TCGOpcode c = op->opc;
+        int nb_args, label;
+
+        if (c == INDEX_op_call) {
+            nb_args = op->callo + op->calli + 2;
+        } else {
+            nb_args = def->nb_oargs + def->nb_iargs + def->nb_cargs;
+        }
+        if (max_words - n < nb_args + 1) {
+            return 0;
+        }
+        buf[n++] = c | op->callo << 8 | op->calli << 16 |
+                   (uint64_t)nb_args << 32;
+
+        label = tcg_op_label_index(c);
+        for (i = 0; i < nb_args; i++) {
+            uint64_t v = args[i];
+
+            if (i == label) {
+                v = arg_label(args[i])->id;
+            } else if (c == INDEX_op_call && i == op->callo + op->calli) {
+                TCGHelperInfo *info;
+
+                info = g_hash_table_lookup(s->helpers, (gpointer)args[i]);
+                if (!info) {
+                    return 0;
+                }
+                v = info - all_helpers;
+            } else if (c == INDEX_op_exit_tb && args[i] != 0) {
+                if (args[i] - tb > TB_EXIT_MASK) {
+                    return 0;
+                }
+                v = TCG_OP_STREAM_TB_RELOC | (args[i] - tb);
+            }
+            buf[n++] = v;
+        }
+        nb_ops++;
+    }
+    buf[2] = nb_ops;
+    return n;
+}
+
+/* Rebuild in @s, which must be freshly started with tcg_func_start(), the
+   op stream that tcg_op_stream_save() stored in @buf, for the TB at
+   address @tb.  Returns false if @buf is malformed; @s must then be
+   restarted before use.  */
+bool tcg_op_stream_load(TCGContext *s, uintptr_t tb,
+                        const uint64_t *buf, size_t nb_words)
+{
+    TCGLabel **labels = NULL;
+    size_t n = 3;
+    uint64_t nb_temps, nb_labels, nb_ops, j;
+    int i;
+
+    if (nb_words < n) {
+        return false;
+    }
+    nb_temps = buf[0];
+    nb_labels = buf[1];
+    nb_ops = buf[2];
+    if (nb_temps > TCG_MAX_TEMPS - s->nb_globals ||
+        nb_temps > nb_words - n ||
+        nb_ops == 0 || nb_ops > OPC_BUF_SIZE ||
+        nb_labels > OPC_BUF_SIZE) {
+        return false;
+    }
+
+    for (j = 0; j < nb_temps; j++) {
+        TCGTemp *ts = &s->temps[s->nb_temps++];
+        uint64_t v = buf[n++];
+
+        memset(ts, 0, sizeof(TCGTemp));
+        ts->base_type = v & 0xff;
+        ts->type = (v >> 8) & 0xff;
+        ts->temp_local = (v >> 16) & 1;
+        ts->temp_allocated = 1;
+    }
+
+    if (nb_labels) {
+        labels = tcg_malloc(nb_labels * sizeof(TCGLabel *));
+        for (j = 0; j < nb_labels; j++) {
+            labels[j] = gen_new_label();
+        }
+    }
+
+    for (j = 0; j < nb_ops; j++) {
+        int oi = s->gen_next_op_idx;
+        int pi = s->gen_next_parm_idx;
+        TCGOpcode c;
+        uint64_t hdr;
+        int nb_args, label;
+
+        if (n >= nb_words) {
+            return false;
+        }
+        hdr = buf[n++];
+        c = hdr & 0xff;
+        nb_args = hdr >> 32;
+        if (c >= NB_OPS || nb_args > nb_words - n ||
+            pi + nb_args > OPPARAM_BUF_SIZE) {
+            return false;
+        }
+
+        label = tcg_op_label_index(c);
+        for (i = 0; i < nb_args; i++) {
+            uint64_t v = buf[n++];
+
+            if (i == label) {
+                if (v >= nb_labels) {
+                    return false;
+                }
+                v = label_arg(labels[v]);
+            } else if (c == INDEX_op_call &&
+                       i == ((hdr >> 8) & 0xff) + ((hdr >> 16) & 0xff)) {
+                if (v >= ARRAY_SIZE(all_helpers)) {
+                    return false;
+                }
+                v = (uintptr_t)all_helpers[v].func;
+            } else if (c == INDEX_op_exit_tb && (v & TCG_OP_STREAM_TB_RELOC)) {
+                v = tb + (v & TB_EXIT_MASK);
+            }
+            s->gen_opparam_buf[pi + i] = v;
+        }
+
+        s->gen_op_buf[oi] = (TCGOp){
+            .opc = c,
+            .callo = (hdr >> 8) & 0xff,
+            .calli = (hdr >> 16) & 0xff,
+            .args = nb_args ? pi : -1,
+            .prev = oi - 1,
+            .next = oi + 1
+        };
+        s->gen_last_op_idx = oi;
+        s->gen_next_op_idx = oi + 1;
+        s->gen_next_parm_idx = pi + nb_args;
+    }
+
+    /* Terminate the linked list.  */
+    s->gen_op_buf[s->gen_last_op_idx].next = -1;
+    return n == nb_words;
+}
+
 void tcg_dump_ops(TCGContext *s)
 {
     char buf[128];
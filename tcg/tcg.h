@@ -487,6 +487,7 @@ struct TCGContext {
     int nb_labels;
     int nb_globals;
     int nb_temps;
+    TCGv_ptr tcg_env;   /* the global bound to TCG_AREG0 */
 
     /* goto_tb support */
     tcg_insn_unit *code_buf;
@@ -535,6 +536,9 @@ struct TCGContext {
     int goto_tb_issue_mask;
 #endif
 
+    /* set when the front end put a host pointer in the op stream */
+    bool gen_host_ptr;
+
     int gen_first_op_idx;
     int gen_last_op_idx;
     int gen_next_op_idx;
@@ -690,6 +694,9 @@ enum {
     /* Instruction is optional and not implemented by the host, or insn
        is generic and should not be implemened by the host.  */
     TCG_OPF_NOT_PRESENT  = 0x10,
+    /* Instruction reads and writes vectors in the CPU state, at constant
+       offsets from TCG_AREG0.  These must not be backed by globals.  */
+    TCG_OPF_VECTOR       = 0x20,
 };
 
 typedef struct TCGOpDef {
@@ -732,7 +739,8 @@ void tcg_add_target_add_op_defs(const TCGTargetOpDef *tdefs);
 #define TCGV_NAT_TO_PTR(n) MAKE_TCGV_PTR(GET_TCGV_I32(n))
 #define TCGV_PTR_TO_NAT(n) MAKE_TCGV_I32(GET_TCGV_PTR(n))
 
-#define tcg_const_ptr(V) TCGV_NAT_TO_PTR(tcg_const_i32((intptr_t)(V)))
+#define tcg_const_ptr(V) (tcg_ctx.gen_host_ptr = true, \
+                          TCGV_NAT_TO_PTR(tcg_const_i32((intptr_t)(V))))
 #define tcg_global_reg_new_ptr(R, N) \
     TCGV_NAT_TO_PTR(tcg_global_reg_new_i32((R), (N)))
 #define tcg_global_mem_new_ptr(R, O, N) \
@@ -743,7 +751,8 @@ void tcg_add_target_add_op_defs(const TCGTargetOpDef *tdefs);
 #define TCGV_NAT_TO_PTR(n) MAKE_TCGV_PTR(GET_TCGV_I64(n))
 #define TCGV_PTR_TO_NAT(n) MAKE_TCGV_I64(GET_TCGV_PTR(n))
 
-#define tcg_const_ptr(V) TCGV_NAT_TO_PTR(tcg_const_i64((intptr_t)(V)))
+#define tcg_const_ptr(V) (tcg_ctx.gen_host_ptr = true, \
+                          TCGV_NAT_TO_PTR(tcg_const_i64((intptr_t)(V))))
 #define tcg_global_reg_new_ptr(R, N) \
     TCGV_NAT_TO_PTR(tcg_global_reg_new_i64((R), (N)))
 #define tcg_global_mem_new_ptr(R, O, N) \
@@ -761,6 +770,12 @@ void tcg_optimize(TCGContext *s);
 /* only used for debugging purposes */
 void tcg_dump_ops(TCGContext *s);
 
+uint32_t tcg_op_stream_fingerprint(TCGContext *s);
+size_t tcg_op_stream_save(TCGContext *s, uintptr_t tb,
+                          uint64_t *buf, size_t max_words);
+bool tcg_op_stream_load(TCGContext *s, uintptr_t tb,
+                        const uint64_t *buf, size_t nb_words);
+
 void dump_ops(const uint16_t *opc_buf, const TCGArg *opparam_buf);
 TCGv_i32 tcg_const_i32(int32_t val);
 TCGv_i64 tcg_const_i64(int64_t val);
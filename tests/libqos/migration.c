@@ -0,0 +1,122 @@
+/*
+ * libqos helpers for migration tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "libqtest.h"
+#include "libqos/migration.h"
+
+/* Send a command and return its reply, skipping events such as STOP */
+QDict *migrate_qmp(QTestState *s, const char *fmt, ...)
+{
+    va_list ap;
+    QDict *response;
+
+    va_start(ap, fmt);
+    qtest_async_qmpv(s, fmt, ap);
+    va_end(ap);
+
+    do {
+        response = qtest_qmp_receive(s);
+        if (!qdict_haskey(response, "event")) {
+            break;
+        }
+        QDECREF(response);
+    } while (true);
+
+    g_assert(!qdict_haskey(response, "error"));
+    return response;
+}
+
+/* Poll query-migrate until the migration reaches @status */
+void migrate_wait_for_status(QTestState *s, const char *status)
+{
+    QDict *response, *ret;
+    const char *cur;
+    bool done;
+
+    do {
+        g_usleep(10 * 1000);
+        response = migrate_qmp(s, "{ 'execute': 'query-migrate' }");
+        ret = qdict_get_qdict(response, "return");
+        cur = qdict_get_try_str(ret, "status");
+        g_assert(cur);
+        g_assert_cmpstr(cur, !=, "failed");
+        done = !strcmp(cur, status);
+        if (!done) {
+            /* it will never get there */
+            g_assert_cmpstr(cur, !=, "completed");
+        }
+        QDECREF(response);
+    } while (!done);
+}
+
+/* Wait until the destination has loaded the state and started the guest.
+ * The source reports completion as soon as it has sent everything.  */
+void migrate_wait_for_dest(QTestState *s)
+{
+    QDict *response;
+    bool running;
+
+    do {
+        response = migrate_qmp(s, "{ 'execute': 'query-status' }");
+        running = qdict_get_bool(qdict_get_qdict(response, "return"),
+                                 "running");
+        QDECREF(response);
+        if (!running) {
+            g_usleep(10 * 1000);
+        }
+    } while (!running);
+}
+
+int migrate_find_free_port(void)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    int fd, port;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    g_assert(fd >= 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    g_assert(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    g_assert(getsockname(fd, (struct sockaddr *)&addr, &len) == 0);
+    port = ntohs(addr.sin_port);
+    close(fd);
+
+    return port;
+}
+
+/* Give each page its own contents so misplaced pages are caught */
+void migrate_fill_pattern(QTestState *s)
+{
+    uint64_t addr;
+
+    for (addr = MIGRATE_RAM_START; addr < MIGRATE_RAM_END;
+         addr += MIGRATE_PAGE_SIZE) {
+        qtest_memset(s, addr + 8, (addr / MIGRATE_PAGE_SIZE) & 0xff,
+                     MIGRATE_PAGE_SIZE - 8);
+        qtest_writeq(s, addr, addr);
+    }
+}
+
+void migrate_check_pattern(QTestState *s)
+{
+    uint64_t addr;
+
+    for (addr = MIGRATE_RAM_START; addr < MIGRATE_RAM_END;
+         addr += MIGRATE_PAGE_SIZE) {
+        g_assert_cmphex(qtest_readq(s, addr), ==, addr);
+        g_assert_cmphex(qtest_readb(s, addr + MIGRATE_PAGE_SIZE - 1), ==,
+                        (addr / MIGRATE_PAGE_SIZE) & 0xff);
+    }
+}
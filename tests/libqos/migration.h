@@ -0,0 +1,25 @@
+/*
+ * libqos helpers for migration tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef LIBQOS_MIGRATION_H
+#define LIBQOS_MIGRATION_H
+
+#include "libqtest.h"
+
+/* The guest RAM that migrate_fill_pattern() fills; the VMs need -m 16 */
+#define MIGRATE_RAM_START (1 * 1024 * 1024)
+#define MIGRATE_RAM_END   (9 * 1024 * 1024)
+#define MIGRATE_PAGE_SIZE 4096
+
+QDict *migrate_qmp(QTestState *s, const char *fmt, ...);
+void migrate_wait_for_status(QTestState *s, const char *status);
+void migrate_wait_for_dest(QTestState *s);
+int migrate_find_free_port(void);
+void migrate_fill_pattern(QTestState *s);
+void migrate_check_pattern(QTestState *s);
+
+#endif
@@ -0,0 +1,55 @@
+/*
+ * QTest testcase for multifd migration
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "libqtest.h"
+#include "libqos/migration.h"
+#include "qemu/osdep.h"
+
+static void migrate_setup(QTestState *s)
+{
+    QDECREF(migrate_qmp(s, "{ 'execute': 'migrate-set-capabilities',"
+                           "  'arguments': { 'capabilities': ["
+                           "    { 'capability': 'x-multifd',"
+                           "      'state': true } ] } }"));
+    QDECREF(migrate_qmp(s, "{ 'execute': 'migrate-set-parameters',"
+                           "  'arguments': { 'x-multifd-channels': 4 } }"));
+}
+
+static void test_multifd(void)
+{
+    QTestState *from, *to;
+    char *uri;
+
+    to = qtest_init("-m 16 -incoming defer");
+    from = qtest_init("-m 16");
+    migrate_setup(to);
+    migrate_setup(from);
+
+    uri = g_strdup_printf("tcp:127.0.0.1:%d", migrate_find_free_port());
+    QDECREF(migrate_qmp(to, "{ 'execute': 'migrate-incoming',"
+                            "  'arguments': { 'uri': %s } }", uri));
+
+    migrate_fill_pattern(from);
+    QDECREF(migrate_qmp(from, "{ 'execute': 'migrate',"
+                              "  'arguments': { 'uri': %s } }", uri));
+    migrate_wait_for_status(from, "completed");
+    migrate_wait_for_dest(to);
+    migrate_check_pattern(to);
+
+    g_free(uri);
+    qtest_quit(from);
+    qtest_quit(to);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    qtest_add_func("/multifd/loopback", test_multifd);
+
+    return g_test_run();
+}
@@ -0,0 +1,98 @@
+/*
+ * QTest testcase for postcopy migration
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include "libqtest.h"
+#include "libqos/migration.h"
+#include "qemu/osdep.h"
+
+/* The destination needs userfaultfd, which may be missing or restricted */
+static bool ufd_available(void)
+{
+#if defined(__linux__) && defined(__NR_userfaultfd)
+    int ufd = syscall(__NR_userfaultfd, O_CLOEXEC);
+
+    if (ufd >= 0) {
+        close(ufd);
+        return true;
+    }
+#endif
+    return false;
+}
+
+static void migrate_set_speed(QTestState *s, int speed)
+{
+    QDECREF(migrate_qmp(s, "{ 'execute': 'migrate_set_speed',"
+                           "  'arguments': { 'value': %d } }", speed));
+}
+
+static void migrate_setup(QTestState *s)
+{
+    QDECREF(migrate_qmp(s, "{ 'execute': 'migrate-set-capabilities',"
+                           "  'arguments': { 'capabilities': ["
+                           "    { 'capability': 'x-postcopy-ram',"
+                           "      'state': true } ] } }"));
+}
+
+static void test_postcopy(void)
+{
+    QTestState *from, *to;
+    char *uri;
+    uint64_t addr;
+
+    if (!ufd_available()) {
+        g_test_message("Skipping test: userfaultfd not available");
+        return;
+    }
+
+    to = qtest_init("-m 16 -incoming defer");
+    from = qtest_init("-m 16");
+    migrate_setup(to);
+    migrate_setup(from);
+
+    uri = g_strdup_printf("tcp:127.0.0.1:%d", migrate_find_free_port());
+    QDECREF(migrate_qmp(to, "{ 'execute': 'migrate-incoming',"
+                            "  'arguments': { 'uri': %s } }", uri));
+
+    migrate_fill_pattern(from);
+
+    /* Slow enough that most of RAM is still on the source after the
+     * switch to postcopy */
+    migrate_set_speed(from, 1024 * 1024);
+    QDECREF(migrate_qmp(from, "{ 'execute': 'migrate',"
+                              "  'arguments': { 'uri': %s } }", uri));
+    migrate_wait_for_status(from, "active");
+    QDECREF(migrate_qmp(from, "{ 'execute': 'migrate-start-postcopy' }"));
+    migrate_wait_for_status(from, "postcopy-active");
+
+    /* Touch pages on the destination, so that they fault and are
+     * requested from the source ahead of the background transfer */
+    for (addr = MIGRATE_RAM_END - MIGRATE_PAGE_SIZE; addr >= MIGRATE_RAM_START;
+         addr -= 64 * MIGRATE_PAGE_SIZE) {
+        g_assert_cmphex(qtest_readq(to, addr), ==, addr);
+    }
+
+    migrate_set_speed(from, 1024 * 1024 * 1024);
+    migrate_wait_for_status(from, "completed");
+    migrate_wait_for_dest(to);
+    migrate_check_pattern(to);
+
+    g_free(uri);
+    qtest_quit(from);
+    qtest_quit(to);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    qtest_add_func("/postcopy/loopback", test_postcopy);
+
+    return g_test_run();
+}
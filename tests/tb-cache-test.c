@@ -0,0 +1,94 @@
+/*
+ * QTest testcase for the persistent translation cache
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include <string.h>
+#include <unistd.h>
+#include "libqtest.h"
+#include "qemu/osdep.h"
+
+static char tb_cache_path[] = "/tmp/qtest-tb-cache.XXXXXX";
+
+/* Read one counter from the "TB cache ..." lines of "info jit" */
+static uint64_t tb_cache_stat(const char *name)
+{
+    QDict *response;
+    const char *out, *p;
+    uint64_t val;
+
+    response = qmp("{ 'execute': 'human-monitor-command',"
+                   "  'arguments': { 'command-line': 'info jit' } }");
+    g_assert(qdict_haskey(response, "return"));
+    out = qdict_get_str(response, "return");
+    p = strstr(out, name);
+    g_assert(p);
+    val = g_ascii_strtoull(p + strlen(name), NULL, 10);
+    QDECREF(response);
+
+    return val;
+}
+
+/* Boot the firmware with TCG until it has translated some code, and
+   return the number of translations that came from the cache.  */
+static uint64_t run_firmware(const char *cpu_model)
+{
+    char *args;
+    uint64_t hits;
+    int i;
+
+    args = g_strdup_printf("-machine accel=tcg -cpu %s -tb-cache %s",
+                           cpu_model, tb_cache_path);
+    qtest_start(args);
+    for (i = 0; i < 1000; i++) {
+        if (tb_cache_stat("TB cache hits") + tb_cache_stat("TB cache stores")
+            >= 200) {
+            break;
+        }
+        g_usleep(10 * 1000);
+    }
+    hits = tb_cache_stat("TB cache hits");
+    /* the cache file is written when QEMU exits */
+    qtest_end();
+    g_free(args);
+
+    return hits;
+}
+
+static void test_tb_cache_reuse(void)
+{
+    run_firmware("qemu64");
+    g_assert_cmpint(run_firmware("qemu64"), >, 0);
+}
+
+/* The translator checks the CPUID feature bits, so op streams saved with
+   one feature set must not be replayed with another.  */
+static void test_tb_cache_features(void)
+{
+    run_firmware("qemu64");
+    g_assert_cmpint(run_firmware("qemu64,+ssse3"), ==, 0);
+    g_assert_cmpint(run_firmware("qemu64,+ssse3"), >, 0);
+    g_assert_cmpint(run_firmware("qemu64,+ssse3,vendor=GenuineIntel"), ==, 0);
+}
+
+int main(int argc, char **argv)
+{
+    int fd, ret;
+
+    g_test_init(&argc, &argv, NULL);
+
+    fd = mkstemp(tb_cache_path);
+    g_assert(fd >= 0);
+    close(fd);
+
+    qtest_add_func("/tb-cache/reuse", test_tb_cache_reuse);
+    qtest_add_func("/tb-cache/cpu-features", test_tb_cache_features);
+
+    ret = g_test_run();
+    unlink(tb_cache_path);
+
+    return ret;
+}
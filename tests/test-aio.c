@@ -11,6 +11,7 @@
  */
 
 #include <glib.h>
+#include <sys/resource.h>
 #include "block/aio.h"
 #include "qemu/timer.h"
 #include "qemu/sockets.h"
@@ -484,6 +485,186 @@ static void test_timer_schedule(void)
     timer_del(&data.timer);
 }
 
+/* Many handlers at once.  This goes past the point where aio_poll
+ * switches from ppoll to epoll, so adding, firing and removing handlers
+ * must keep working across the switch.
+ */
+#define MANY_HANDLERS 200
+
+static void test_many_event_notifiers(void)
+{
+    EventNotifierTestData *data = g_new0(EventNotifierTestData,
+                                         MANY_HANDLERS);
+    int i;
+
+    for (i = 0; i < MANY_HANDLERS; i++) {
+        event_notifier_init(&data[i].e, false);
+        aio_set_event_notifier(ctx, &data[i].e, event_ready_cb);
+    }
+    g_assert(!aio_poll(ctx, false));
+
+    for (i = 0; i < MANY_HANDLERS; i += 3) {
+        data[i].active = 1;
+        event_notifier_set(&data[i].e);
+    }
+    for (i = 0; i < MANY_HANDLERS; i += 3) {
+        wait_until_inactive(&data[i]);
+    }
+    for (i = 0; i < MANY_HANDLERS; i++) {
+        g_assert_cmpint(data[i].n, ==, i % 3 == 0);
+    }
+
+    /* removed handlers must not fire anymore */
+    for (i = 0; i < MANY_HANDLERS; i += 2) {
+        aio_set_event_notifier(ctx, &data[i].e, NULL);
+        event_notifier_set(&data[i].e);
+    }
+    data[1].active = 1;
+    event_notifier_set(&data[1].e);
+    wait_until_inactive(&data[1]);
+    while (aio_poll(ctx, false)) {
+        /* nothing */
+    }
+    for (i = 0; i < MANY_HANDLERS; i++) {
+        g_assert_cmpint(data[i].n, ==, (i % 3 == 0) + (i == 1));
+    }
+
+    for (i = 0; i < MANY_HANDLERS; i++) {
+        if (i & 1) {
+            aio_set_event_notifier(ctx, &data[i].e, NULL);
+        }
+        event_notifier_cleanup(&data[i].e);
+    }
+    g_assert(!aio_poll(ctx, false));
+    g_free(data);
+}
+
+typedef struct {
+    EventNotifierTestData e;
+    bool work;              /* work visible to io_poll, no kick needed */
+    int polled;
+} PollTestData;
+
+static bool poll_test_cb(void *opaque)
+{
+    PollTestData *data = container_of(opaque, PollTestData, e.e);
+
+    data->polled++;
+    if (!data->work) {
+        return false;
+    }
+    data->work = false;
+    return true;
+}
+
+static void test_poll_event_notifier(void)
+{
+    PollTestData data = { .e = { .n = 0, .active = 0 } };
+    TimerTestData timer = { .n = 0, .ctx = ctx, .ns = SCALE_US * 50LL,
+                            .max = 1, .clock_type = QEMU_CLOCK_REALTIME };
+    uint64_t hits, misses;
+
+    event_notifier_init(&data.e.e, false);
+    aio_set_event_notifier(ctx, &data.e.e, event_ready_cb);
+    aio_set_event_notifier_poll(ctx, &data.e.e, poll_test_cb);
+    aio_context_set_poll_params(ctx, 10 * SCALE_MS, 0, 0, &error_abort);
+    do {} while (aio_poll(ctx, false));
+    g_assert_cmpint(ctx->poll_ns, ==, 0);
+
+    /* A short wait makes polling worthwhile */
+    aio_timer_init(ctx, &timer.timer, timer.clock_type,
+                   SCALE_NS, timer_test_cb, &timer);
+    timer_mod(&timer.timer, qemu_clock_get_ns(timer.clock_type) + timer.ns);
+    while (timer.n == 0) {
+        aio_poll(ctx, true);
+    }
+    g_assert_cmpint(ctx->poll_ns, >, 0);
+    g_assert_cmpint(ctx->poll_ns, <=, 10 * SCALE_MS);
+
+    /* Work found by io_poll is processed without kicking the notifier */
+    hits = ctx->poll_hits;
+    data.work = true;
+    data.polled = 0;
+    g_assert(aio_poll(ctx, true));
+    g_assert(!data.work);
+    g_assert_cmpint(data.polled, >, 0);
+    g_assert_cmpint(data.e.n, ==, 0);
+    g_assert_cmpint(ctx->poll_hits, ==, hits + 1);
+
+    /* When polling finds nothing, aio_poll still waits for the fd */
+    misses = ctx->poll_misses;
+    event_notifier_set(&data.e.e);
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(data.e.n, ==, 1);
+    g_assert_cmpint(ctx->poll_misses, ==, misses + 1);
+
+    /* Polling is disabled with poll_max_ns == 0 */
+    aio_context_set_poll_params(ctx, 0, 0, 0, &error_abort);
+    data.polled = 0;
+    event_notifier_set(&data.e.e);
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(data.polled, ==, 0);
+    g_assert_cmpint(data.e.n, ==, 2);
+
+    timer_del(&timer.timer);
+    aio_set_event_notifier(ctx, &data.e.e, NULL);
+    g_assert_cmpint(ctx->poll_handlers, ==, 0);
+    g_assert(!aio_poll(ctx, false));
+    event_notifier_cleanup(&data.e.e);
+}
+
+/* Benchmark: the cost of one aio_poll wakeup as the number of idle
+ * handlers grows.  Only run with -m perf.
+ */
+static void test_poll_scaling(gconstpointer opaque)
+{
+    int nr = GPOINTER_TO_INT(opaque);
+    int iterations = 20000;
+    EventNotifierTestData *data = g_new0(EventNotifierTestData, nr);
+    struct rlimit rl;
+    double duration;
+    int i;
+
+    /* each handler is an eventfd; leave room for the rest of the test */
+    getrlimit(RLIMIT_NOFILE, &rl);
+    if (rl.rlim_cur < nr + 64 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    if (rl.rlim_cur < nr + 64) {
+        g_test_message("skipped, RLIMIT_NOFILE too low for %d handlers", nr);
+        g_free(data);
+        return;
+    }
+
+    for (i = 0; i < nr; i++) {
+        event_notifier_init(&data[i].e, false);
+        aio_set_event_notifier(ctx, &data[i].e, event_ready_cb);
+    }
+    while (aio_poll(ctx, false)) {
+        /* nothing */
+    }
+
+    g_test_timer_start();
+    for (i = 0; i < iterations; i++) {
+        event_notifier_set(&data[0].e);
+        while (data[0].n == i) {
+            aio_poll(ctx, true);
+        }
+    }
+    duration = g_test_timer_elapsed();
+
+    g_test_minimized_result(duration * 1e9 / iterations,
+                            "%d handlers: %.0f ns per aio_poll",
+                            nr, duration * 1e9 / iterations);
+
+    for (i = 0; i < nr; i++) {
+        aio_set_event_notifier(ctx, &data[i].e, NULL);
+        event_notifier_cleanup(&data[i].e);
+    }
+    g_free(data);
+}
+
 /* Now the same tests, using the context as a GSource.  They are
  * very similar to the ones above, with g_main_context_iteration
  * replacing aio_poll.  However:
@@ -847,6 +1028,20 @@ int main(int argc, char **argv)
     g_test_add_func("/aio/event/wait/no-flush-cb",  test_wait_event_notifier_noflush);
     g_test_add_func("/aio/event/flush",             test_flush_event_notifier);
     g_test_add_func("/aio/timer/schedule",          test_timer_schedule);
+    g_test_add_func("/aio/event/many",              test_many_event_notifiers);
+    g_test_add_func("/aio/event/poll",              test_poll_event_notifier);
+    if (g_test_perf()) {
+        static const int nr_handlers[] = { 1, 16, 64, 256, 1024, 4096 };
+        int i;
+
+        for (i = 0; i < ARRAY_SIZE(nr_handlers); i++) {
+            char *path = g_strdup_printf("/aio/perf/poll/%d",
+                                         nr_handlers[i]);
+            g_test_add_data_func(path, GINT_TO_POINTER(nr_handlers[i]),
+                                 test_poll_scaling);
+            g_free(path);
+        }
+    }
 
     g_test_add_func("/aio-gsource/notify",                  test_source_notify);
     g_test_add_func("/aio-gsource/flush",                   test_source_flush);
@@ -10,6 +10,7 @@
 #include <stdint.h>
 #include "qemu/osdep.h"
 #include "qemu/bitops.h"
+#include "qemu/bitmap.h"
 
 typedef struct {
     uint32_t value;
@@ -67,10 +68,41 @@ static void test_sextract64(void)
     }
 }
 
+static void test_bitmap_atomic(void)
+{
+    unsigned long *map = bitmap_new(4 * BITS_PER_LONG);
+    long start, nr;
+
+    for (start = 0; start < BITS_PER_LONG + 3; start += 3) {
+        for (nr = 1; start + nr < 4 * BITS_PER_LONG; nr += 7) {
+            bitmap_set_atomic(map, start, nr);
+            g_assert_cmpint(find_first_bit(map, 4 * BITS_PER_LONG), ==,
+                            start);
+            g_assert_cmpint(find_next_zero_bit(map, 4 * BITS_PER_LONG,
+                                               start), ==, start + nr);
+
+            /* Bits just outside the range must not be reported or cleared */
+            set_bit_atomic(start + nr, map);
+            if (start) {
+                g_assert(!bitmap_test_and_clear_atomic(map, 0, start));
+            }
+            g_assert(bitmap_test_and_clear_atomic(map, start, nr));
+            g_assert(!bitmap_test_and_clear_atomic(map, start, nr));
+            g_assert_cmpint(find_first_bit(map, 4 * BITS_PER_LONG), ==,
+                            start + nr);
+            clear_bit(start + nr, map);
+            g_assert(bitmap_empty(map, 4 * BITS_PER_LONG));
+        }
+    }
+
+    g_free(map);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
     g_test_add_func("/bitops/sextract32", test_sextract32);
     g_test_add_func("/bitops/sextract64", test_sextract64);
+    g_test_add_func("/bitops/bitmap_atomic", test_bitmap_atomic);
     return g_test_run();
 }
@@ -0,0 +1,141 @@
+/*
+ * Page cache unit tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include <stdint.h>
+#include <string.h>
+#include <glib.h>
+#include "qemu-common.h"
+#include "migration/page_cache.h"
+
+#define PAGE_SIZE 4096
+
+static void fill_page(uint8_t *page, uint64_t addr)
+{
+    memset(page, addr / PAGE_SIZE, PAGE_SIZE);
+}
+
+static bool check_page(PageCache *cache, uint64_t addr)
+{
+    uint8_t expected[PAGE_SIZE];
+    uint8_t *data = get_cached_data(cache, addr);
+
+    fill_page(expected, addr);
+    return data && memcmp(data, expected, PAGE_SIZE) == 0;
+}
+
+static void test_insert_lookup(void)
+{
+    PageCache *cache = cache_init(64, PAGE_SIZE);
+    uint8_t page[PAGE_SIZE];
+    uint64_t addr;
+
+    for (addr = 0; addr < 64 * PAGE_SIZE; addr += PAGE_SIZE) {
+        fill_page(page, addr);
+        g_assert(cache_insert(cache, addr, page, 0) == 0);
+    }
+    for (addr = 0; addr < 64 * PAGE_SIZE; addr += PAGE_SIZE) {
+        g_assert(cache_is_cached(cache, addr, 0));
+        g_assert(check_page(cache, addr));
+    }
+    g_assert(!cache_is_cached(cache, 64 * PAGE_SIZE, 0));
+
+    cache_fini(cache);
+}
+
+/* Pages that map to the same set no longer evict each other */
+static void test_conflicts(void)
+{
+    PageCache *cache = cache_init(64, PAGE_SIZE);
+    uint64_t stride = 8 * PAGE_SIZE;  /* 64 pages, 8 ways: 8 sets */
+    uint8_t page[PAGE_SIZE];
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        fill_page(page, i * stride);
+        g_assert(cache_insert(cache, i * stride, page, 0) == 0);
+    }
+    for (i = 0; i < 8; i++) {
+        g_assert(cache_is_cached(cache, i * stride, 0));
+    }
+
+    /* A fresh set refuses to evict */
+    fill_page(page, 8 * stride);
+    g_assert(cache_insert(cache, 8 * stride, page, 1) == -1);
+
+    /* Once old enough, the least recently used page goes */
+    g_assert(cache_is_cached(cache, 0, 0));
+    g_assert(cache_insert(cache, 8 * stride, page, 2) == 0);
+    g_assert(cache_is_cached(cache, 0, 2));
+    g_assert(!cache_is_cached(cache, stride, 2));
+    g_assert(check_page(cache, 8 * stride));
+
+    cache_fini(cache);
+}
+
+static void test_resize(void)
+{
+    PageCache *cache = cache_init(64, PAGE_SIZE);
+    uint8_t page[PAGE_SIZE];
+    uint64_t addr;
+
+    for (addr = 0; addr < 64 * PAGE_SIZE; addr += PAGE_SIZE) {
+        fill_page(page, addr);
+        g_assert(cache_insert(cache, addr, page, 0) == 0);
+    }
+
+    /* Growing keeps everything */
+    g_assert(cache_resize(cache, 256) == 256);
+    for (addr = 0; addr < 64 * PAGE_SIZE; addr += PAGE_SIZE) {
+        g_assert(cache_is_cached(cache, addr, 0));
+        g_assert(check_page(cache, addr));
+    }
+
+    /* Shrinking keeps what fits, and nothing stale */
+    g_assert(cache_resize(cache, 16) == 16);
+    g_assert(cache_resize(cache, 32) == 32);
+    for (addr = 0; addr < 64 * PAGE_SIZE; addr += PAGE_SIZE) {
+        if (cache_is_cached(cache, addr, 0)) {
+            g_assert(check_page(cache, addr));
+        }
+    }
+
+    /* Resizing with moves still pending frees everything on fini */
+    cache_fini(cache);
+}
+
+/* A loop over twice as many pages as fit should ask for twice the size */
+static void test_suggest_size(void)
+{
+    PageCache *cache = cache_init(64, PAGE_SIZE);
+    uint8_t page[PAGE_SIZE];
+    uint64_t addr, age;
+
+    g_assert_cmpint(cache_suggest_size(cache), ==, 64);
+
+    /* Each pass is two ages later, so the previous pages may be evicted */
+    for (age = 0; age < 20; age += 2) {
+        for (addr = 0; addr < 128 * PAGE_SIZE; addr += PAGE_SIZE) {
+            if (!cache_is_cached(cache, addr, age)) {
+                fill_page(page, addr);
+                cache_insert(cache, addr, page, age);
+            }
+        }
+    }
+    g_assert_cmpint(cache_suggest_size(cache), ==, 128);
+
+    cache_fini(cache);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/page_cache/insert_lookup", test_insert_lookup);
+    g_test_add_func("/page_cache/conflicts", test_conflicts);
+    g_test_add_func("/page_cache/resize", test_resize);
+    g_test_add_func("/page_cache/suggest_size", test_suggest_size);
+
+    return g_test_run();
+}
@@ -0,0 +1,79 @@
+/*
+ * Migration page compression codec unit tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include <stdint.h>
+#include <string.h>
+#include <glib.h>
+#include "qemu-common.h"
+#include "migration/page-compress.h"
+
+#define PAGE_SIZE 4096
+
+static void fill_page(uint8_t *page, int seed)
+{
+    int i;
+
+    for (i = 0; i < PAGE_SIZE; i++) {
+        page[i] = (i / 64) ^ seed;
+    }
+}
+
+static void test_round_trip(gconstpointer opaque)
+{
+    MigrationCompressMethod method = GPOINTER_TO_INT(opaque);
+    size_t bound = page_compress_bound(method, PAGE_SIZE);
+    PageCompressor *comp = page_compressor_new(method, 1);
+    PageCompressor *decomp = page_compressor_new(method, 0);
+    uint8_t *src = g_malloc(PAGE_SIZE);
+    uint8_t *dst = g_malloc(PAGE_SIZE);
+    uint8_t *buf = g_malloc(bound);
+    ssize_t clen;
+    int seed;
+
+    g_assert(comp && decomp);
+
+    /* The same state is reused across pages */
+    for (seed = 0; seed < 4; seed++) {
+        fill_page(src, seed);
+        clen = page_compress(comp, buf, bound, src, PAGE_SIZE);
+        g_assert_cmpint(clen, >, 0);
+        g_assert_cmpint(clen, <, PAGE_SIZE);
+        g_assert_cmpint(page_decompress(decomp, dst, PAGE_SIZE, buf, clen),
+                        ==, PAGE_SIZE);
+        g_assert(memcmp(src, dst, PAGE_SIZE) == 0);
+    }
+
+    /* Corrupt input fails without writing past the page */
+    memset(buf, 0xa5, bound);
+    g_assert_cmpint(page_decompress(decomp, dst, PAGE_SIZE, buf, bound),
+                    ==, -1);
+
+    page_compressor_free(comp);
+    page_compressor_free(decomp);
+    g_free(src);
+    g_free(dst);
+    g_free(buf);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_data_func("/page_compress/zlib",
+                         GINT_TO_POINTER(MIGRATION_COMPRESS_METHOD_ZLIB),
+                         test_round_trip);
+    if (page_compress_method_supported(MIGRATION_COMPRESS_METHOD_LZ4)) {
+        g_test_add_data_func("/page_compress/lz4",
+                             GINT_TO_POINTER(MIGRATION_COMPRESS_METHOD_LZ4),
+                             test_round_trip);
+    }
+    if (page_compress_method_supported(MIGRATION_COMPRESS_METHOD_ZSTD)) {
+        g_test_add_data_func("/page_compress/zstd",
+                             GINT_TO_POINTER(MIGRATION_COMPRESS_METHOD_ZSTD),
+                             test_round_trip);
+    }
+
+    return g_test_run();
+}
@@ -0,0 +1,160 @@
+/*
+ * Concurrent hash table unit-tests
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "qemu/qht.h"
+#include "qemu/rcu.h"
+
+#define N 5000
+
+static QHT ht;
+static int32_t arr[N * 2];
+
+static bool is_equal(const void *obj, const void *userp)
+{
+    const int32_t *a = obj;
+    const int32_t *b = userp;
+
+    return *a == *b;
+}
+
+/* Deliberately weak so that chains get long and resizes happen */
+static uint32_t hash_func(int32_t v)
+{
+    return v & 0xff;
+}
+
+static void insert(int a, int b)
+{
+    int i;
+
+    for (i = a; i < b; i++) {
+        arr[i] = i;
+        g_assert(qht_insert(&ht, &arr[i], hash_func(i)));
+    }
+}
+
+static void rm(int init, int end)
+{
+    int i;
+
+    for (i = init; i < end; i++) {
+        g_assert(qht_remove(&ht, &arr[i], hash_func(arr[i])));
+    }
+}
+
+static void check(int a, int b, bool expected)
+{
+    int i;
+
+    rcu_read_lock();
+    for (i = a; i < b; i++) {
+        int32_t val = i;
+        void *p = qht_lookup(&ht, is_equal, &val, hash_func(val));
+
+        if (expected) {
+            g_assert(p == &arr[i]);
+        } else {
+            g_assert(p == NULL);
+        }
+    }
+    rcu_read_unlock();
+}
+
+static void count_func(QHT *ht, void *p, uint32_t hash, void *userp)
+{
+    unsigned int *curr = userp;
+
+    (*curr)++;
+}
+
+static void check_n(size_t expected)
+{
+    QHTStats stats;
+    unsigned int curr = 0;
+    size_t i, chains = 0;
+
+    qht_statistics(&ht, &stats);
+    g_assert_cmpuint(stats.entries, ==, expected);
+    for (i = 0; i < QHT_STATS_CHAIN_MAX; i++) {
+        chains += stats.chain_hist[i];
+    }
+    g_assert_cmpuint(chains, ==, stats.used_head_buckets);
+    g_assert_cmpuint(stats.used_head_buckets, <=, stats.head_buckets);
+
+    qht_iter(&ht, count_func, &curr);
+    g_assert_cmpuint(curr, ==, expected);
+}
+
+static void qht_do_test(unsigned int mode, size_t init_entries)
+{
+    qht_init(&ht, init_entries, mode);
+
+    insert(0, N);
+    check(0, N, true);
+    check_n(N);
+    check(-N, -1, false);
+
+    /* duplicates are refused */
+    g_assert(!qht_insert(&ht, &arr[0], hash_func(0)));
+
+    rm(10, 20);
+    check(10, 20, false);
+    check(0, 10, true);
+    check(20, N, true);
+    check_n(N - 10);
+    g_assert(!qht_remove(&ht, &arr[10], hash_func(10)));
+
+    /* removed slots are reused */
+    insert(10, 20);
+    check(0, N, true);
+    check_n(N);
+
+    qht_resize(&ht, init_entries * 4 + 1);
+    check(0, N, true);
+    check_n(N);
+
+    insert(N, 2 * N);
+    check(0, 2 * N, true);
+    check_n(2 * N);
+
+    qht_reset(&ht);
+    check(0, 2 * N, false);
+    check_n(0);
+
+    insert(0, N);
+    qht_reset_size(&ht, 0);
+    check(0, N, false);
+    check_n(0);
+
+    qht_destroy(&ht);
+}
+
+static void test_default(void)
+{
+    qht_do_test(0, 0);
+}
+
+static void test_resize(void)
+{
+    qht_do_test(QHT_MODE_AUTO_RESIZE, 0);
+}
+
+static void test_large(void)
+{
+    qht_do_test(QHT_MODE_AUTO_RESIZE, N * 4);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/qht/mode/default", test_default);
+    g_test_add_func("/qht/mode/resize", test_resize);
+    g_test_add_func("/qht/mode/large", test_large);
+    return g_test_run();
+}
@@ -482,6 +482,113 @@ static void test_load_skip(void)
     qsb_free(qsb);
 }
 
+static int hooks_called;
+
+static int test_hooks_pre_load(void *opaque)
+{
+    hooks_called++;
+    return 0;
+}
+
+static int test_hooks_post_load(void *opaque, int version_id)
+{
+    hooks_called++;
+    return 0;
+}
+
+static const VMStateDescription vmstate_hooks = {
+    .name = "test/hooks",
+    .version_id = 2,
+    .minimum_version_id = 1,
+    .pre_load = test_hooks_pre_load,
+    .post_load = test_hooks_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(a, TestStruct),
+        VMSTATE_UINT64_V(f, TestStruct, 2),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static void test_load_fields(void)
+{
+    uint8_t buf[] = {
+        0, 0, 0, 10,             /* a */
+        0, 0, 0, 0, 0, 0, 0, 60, /* f */
+        QEMU_VM_EOF, /* just to ensure we won't get EOF reported prematurely */
+    };
+
+    QEMUSizedBuffer *qsb = qsb_create(buf, sizeof(buf));
+    g_assert(qsb);
+    QEMUFile *loading = qemu_bufopen("r", qsb);
+    TestStruct obj = { };
+    hooks_called = 0;
+    g_assert_cmpint(vmstate_load_state_fields(loading, &vmstate_hooks,
+                                              &obj, 2), ==, 0);
+    g_assert(!qemu_file_get_error(loading));
+    g_assert_cmpint(obj.a, ==, 10);
+    g_assert_cmpint(obj.f, ==, 60);
+    g_assert_cmpint(hooks_called, ==, 0);
+    qemu_fclose(loading);
+    qsb_free(qsb);
+}
+
+static const VMStateDescription vmstate_ordered_sub = {
+    .name = "test/ordered/sub",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .ordered = true,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(b, TestStruct),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static bool test_sub_needed(void *opaque)
+{
+    return true;
+}
+
+static const VMStateDescription vmstate_ordered_by_sub = {
+    .name = "test/ordered/by_sub",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(a, TestStruct),
+        VMSTATE_END_OF_LIST()
+    },
+    .subsections = (const VMStateSubsection[]) {
+        {
+            .vmsd = &vmstate_ordered_sub,
+            .needed = test_sub_needed,
+        }, {
+            /* empty */
+        }
+    }
+};
+
+typedef struct TestOuter {
+    TestStruct inner;
+} TestOuter;
+
+static const VMStateDescription vmstate_ordered_by_struct = {
+    .name = "test/ordered/by_struct",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_STRUCT(inner, TestOuter, 1, vmstate_ordered_by_sub,
+                       TestStruct),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static void test_ordered(void)
+{
+    g_assert(!vmstate_is_ordered(&vmstate_skipping));
+    g_assert(vmstate_is_ordered(&vmstate_ordered_sub));
+    g_assert(vmstate_is_ordered(&vmstate_ordered_by_sub));
+    g_assert(vmstate_is_ordered(&vmstate_ordered_by_struct));
+}
+
 int main(int argc, char **argv)
 {
     temp_fd = mkstemp(temp_file);
@@ -494,6 +601,8 @@ int main(int argc, char **argv)
     g_test_add_func("/vmstate/field_exists/load/skip", test_load_skip);
     g_test_add_func("/vmstate/field_exists/save/noskip", test_save_noskip);
     g_test_add_func("/vmstate/field_exists/save/skip", test_save_skip);
+    g_test_add_func("/vmstate/fields/load", test_load_fields);
+    g_test_add_func("/vmstate/ordered", test_ordered);
     g_test_run();
 
     close(temp_fd);
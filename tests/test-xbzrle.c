@@ -179,6 +179,112 @@ static void test_encode_decode(void)
     }
 }
 
+/* Many short runs, so that they start and end anywhere in a vector */
+static void test_encode_decode_random(void)
+{
+    uint8_t *buffer = g_malloc(PAGE_SIZE);
+    uint8_t *test = g_malloc(PAGE_SIZE);
+    uint8_t *compressed = g_malloc(2 * PAGE_SIZE);
+    int i, j, dlen, rc;
+
+    for (i = 0; i < 1000; i++) {
+        int changes = g_test_rand_int_range(1, 200);
+
+        for (j = 0; j < PAGE_SIZE; j++) {
+            buffer[j] = g_test_rand_int();
+        }
+        memcpy(test, buffer, PAGE_SIZE);
+        for (j = 0; j < changes; j++) {
+            int start = g_test_rand_int_range(0, PAGE_SIZE);
+            int end = start + g_test_rand_int_range(1, 40);
+
+            end = MIN(end, PAGE_SIZE);
+
+            for (; start < end; start++) {
+                test[start] ^= g_test_rand_int_range(1, 256);
+            }
+        }
+
+        dlen = xbzrle_encode_buffer(buffer, test, PAGE_SIZE, compressed,
+                                    2 * PAGE_SIZE);
+        g_assert(dlen > 0);
+
+        rc = xbzrle_decode_buffer(compressed, dlen, buffer, PAGE_SIZE);
+        g_assert(rc > 0 && rc <= PAGE_SIZE);
+        g_assert(memcmp(test, buffer, PAGE_SIZE) == 0);
+    }
+
+    g_free(buffer);
+    g_free(compressed);
+    g_free(test);
+}
+
+#define PERF_PAGES 256
+#define PERF_ITERATIONS 200
+
+/*
+ * Encoding throughput over pages with a few scattered changes, which is
+ * the case XBZRLE is meant for and where the run scans dominate.
+ */
+static void test_encode_perf(void)
+{
+    uint8_t *old = g_malloc(PERF_PAGES * PAGE_SIZE);
+    uint8_t *new = g_malloc(PERF_PAGES * PAGE_SIZE);
+    uint8_t *compressed = g_malloc(PAGE_SIZE);
+    uint64_t bytes = 0;
+    double elapsed;
+    int i, j;
+
+    for (i = 0; i < PERF_PAGES * PAGE_SIZE; i++) {
+        old[i] = g_test_rand_int();
+    }
+    memcpy(new, old, PERF_PAGES * PAGE_SIZE);
+    for (i = 0; i < PERF_PAGES * PAGE_SIZE; i += 512) {
+        new[i] ^= 0xff;
+    }
+
+    g_test_timer_start();
+    for (i = 0; i < PERF_ITERATIONS; i++) {
+        for (j = 0; j < PERF_PAGES; j++) {
+            xbzrle_encode_buffer(old + j * PAGE_SIZE, new + j * PAGE_SIZE,
+                                 PAGE_SIZE, compressed, PAGE_SIZE);
+            bytes += PAGE_SIZE;
+        }
+    }
+    elapsed = g_test_timer_elapsed();
+    g_test_maximized_result(bytes / elapsed / 1000000,
+                            "xbzrle encode: %.0f MB/s",
+                            bytes / elapsed / 1000000);
+
+    g_free(old);
+    g_free(new);
+    g_free(compressed);
+}
+
+/* Zero page detection throughput, as done for every page sent */
+static void test_zero_perf(void)
+{
+    uint8_t *buf = g_malloc0(PERF_PAGES * PAGE_SIZE);
+    uint64_t bytes = 0;
+    double elapsed;
+    int i, j;
+
+    g_test_timer_start();
+    for (i = 0; i < PERF_ITERATIONS; i++) {
+        for (j = 0; j < PERF_PAGES; j++) {
+            g_assert(buffer_find_nonzero_offset(buf + j * PAGE_SIZE,
+                                                PAGE_SIZE) == PAGE_SIZE);
+            bytes += PAGE_SIZE;
+        }
+    }
+    elapsed = g_test_timer_elapsed();
+    g_test_maximized_result(bytes / elapsed / 1000000,
+                            "zero page check: %.0f MB/s",
+                            bytes / elapsed / 1000000);
+
+    g_free(buf);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -191,6 +297,12 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    g_test_add_func("/xbzrle/encode_decode_random",
+                    test_encode_decode_random);
+    if (g_test_perf()) {
+        g_test_add_func("/xbzrle/perf/encode", test_encode_perf);
+        g_test_add_func("/xbzrle/perf/zero", test_zero_perf);
+    }
 
     return g_test_run();
 }
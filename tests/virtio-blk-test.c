@@ -33,6 +33,7 @@
 #define QVIRTIO_BLK_F_WCE           0x00000200
 #define QVIRTIO_BLK_F_TOPOLOGY      0x00000400
 #define QVIRTIO_BLK_F_CONFIG_WCE    0x00000800
+#define QVIRTIO_BLK_F_MQ            0x00001000
 
 #define QVIRTIO_BLK_T_IN            0
 #define QVIRTIO_BLK_T_OUT           1
@@ -76,7 +77,7 @@ static char *drive_create(void)
     return tmp_path;
 }
 
-static QPCIBus *pci_test_start(void)
+static QPCIBus *pci_test_start_opts(const char *device_opts)
 {
     char *cmdline;
     char *tmp_path;
@@ -86,8 +87,8 @@ static QPCIBus *pci_test_start(void)
     cmdline = g_strdup_printf("-drive if=none,id=drive0,file=%s,format=raw "
                         "-drive if=none,id=drive1,file=/dev/null,format=raw "
                         "-device virtio-blk-pci,id=drv0,drive=drive0,"
-                        "addr=%x.%x",
-                        tmp_path, PCI_SLOT, PCI_FN);
+                        "addr=%x.%x%s",
+                        tmp_path, PCI_SLOT, PCI_FN, device_opts);
     qtest_start(cmdline);
     unlink(tmp_path);
     g_free(tmp_path);
@@ -96,6 +97,11 @@ static QPCIBus *pci_test_start(void)
     return qpci_init_pc();
 }
 
+static QPCIBus *pci_test_start(void)
+{
+    return pci_test_start_opts("");
+}
+
 static void arm_test_start(void)
 {
     char *cmdline;
@@ -702,6 +708,58 @@ static void pci_idx(void)
     test_end();
 }
 
+static void pci_mq_common(const char *device_opts, int queue)
+{
+    QVirtioPCIDevice *dev;
+    QPCIBus *bus;
+    QVirtQueuePCI *vqpci;
+    QGuestAllocator *alloc;
+    void *addr;
+    uint32_t features;
+    uint16_t num_queues;
+
+    bus = pci_test_start_opts(device_opts);
+    dev = virtio_blk_pci_init(bus, PCI_SLOT);
+
+    /* MSI-X is not enabled */
+    addr = dev->addr + QVIRTIO_PCI_DEVICE_SPECIFIC_NO_MSIX;
+
+    features = qvirtio_get_features(&qvirtio_pci, &dev->vdev);
+    g_assert(features & QVIRTIO_BLK_F_MQ);
+    num_queues = qvirtio_config_readw(&qvirtio_pci, &dev->vdev,
+                                      (uint64_t)(uintptr_t)addr + 34);
+    g_assert_cmpint(num_queues, ==, 4);
+
+    /* Requests on any queue complete on that queue */
+    alloc = pc_alloc_init();
+    vqpci = (QVirtQueuePCI *)qvirtqueue_setup(&qvirtio_pci, &dev->vdev,
+                                                                alloc, queue);
+
+    test_basic(&qvirtio_pci, &dev->vdev, alloc, &vqpci->vq,
+                                                    (uint64_t)(uintptr_t)addr);
+
+    /* End test */
+    guest_free(alloc, vqpci->vq.desc);
+    pc_alloc_uninit(alloc);
+    qvirtio_pci_device_disable(dev);
+    g_free(dev);
+    qpci_free_pc(bus);
+    test_end();
+}
+
+static void pci_mq(void)
+{
+    pci_mq_common(",num-queues=4", 2);
+}
+
+static void pci_mq_iothreads(void)
+{
+    /* Queue 3 is processed by io1.  qtest has no ioeventfd, so the kicks
+     * are passed on to the iothreads by virtio_blk_handle_output() */
+    pci_mq_common(",num-queues=4,iothreads=io0:io1 "
+                  "-object iothread,id=io0 -object iothread,id=io1", 3);
+}
+
 static void pci_hotplug(void)
 {
     QPCIBus *bus;
@@ -778,6 +836,8 @@ int main(int argc, char **argv)
         qtest_add_func("/virtio/blk/pci/config", pci_config);
         qtest_add_func("/virtio/blk/pci/msix", pci_msix);
         qtest_add_func("/virtio/blk/pci/idx", pci_idx);
+        qtest_add_func("/virtio/blk/pci/mq", pci_mq);
+        qtest_add_func("/virtio/blk/pci/mq-iothreads", pci_mq_iothreads);
         qtest_add_func("/virtio/blk/pci/hotplug", pci_hotplug);
     } else if (strcmp(arch, "arm") == 0) {
         qtest_add_func("/virtio/blk/mmio/basic", mmio_basic);
@@ -0,0 +1,80 @@
+/*
+ * QTest testcase for saving and loading device state in threads
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "libqtest.h"
+#include "libqos/migration.h"
+#include "qemu/osdep.h"
+
+/* Unused CMOS bytes, part of the RTC's device state */
+#define CMOS_FIRST 0x38
+#define CMOS_LAST  0x3f
+
+static void cmos_write(QTestState *s, uint8_t reg, uint8_t val)
+{
+    qtest_outb(s, 0x70, reg);
+    qtest_outb(s, 0x71, val);
+}
+
+static uint8_t cmos_read(QTestState *s, uint8_t reg)
+{
+    qtest_outb(s, 0x70, reg);
+    return qtest_inb(s, 0x71);
+}
+
+static void migrate_setup(QTestState *s)
+{
+    QDECREF(migrate_qmp(s, "{ 'execute': 'migrate-set-parameters',"
+                           "  'arguments': { 'x-vmstate-threads': 4 } }"));
+}
+
+/*
+ * Besides RAM, check a register backed device (the RTC, which is loaded
+ * concurrently with the other ISA devices and the CPU) and a virtio one
+ * (still loaded on its own between them) made it across.
+ */
+static void test_vmstate_threads(void)
+{
+    QTestState *from, *to;
+    char *uri;
+    int reg;
+
+    to = qtest_init("-m 16 -device virtio-balloon-pci -incoming defer");
+    from = qtest_init("-m 16 -device virtio-balloon-pci");
+    migrate_setup(to);
+    migrate_setup(from);
+
+    uri = g_strdup_printf("tcp:127.0.0.1:%d", migrate_find_free_port());
+    QDECREF(migrate_qmp(to, "{ 'execute': 'migrate-incoming',"
+                            "  'arguments': { 'uri': %s } }", uri));
+
+    migrate_fill_pattern(from);
+    for (reg = CMOS_FIRST; reg <= CMOS_LAST; reg++) {
+        cmos_write(from, reg, reg ^ 0xa5);
+    }
+    QDECREF(migrate_qmp(from, "{ 'execute': 'migrate',"
+                              "  'arguments': { 'uri': %s } }", uri));
+    migrate_wait_for_status(from, "completed");
+    migrate_wait_for_dest(to);
+
+    migrate_check_pattern(to);
+    for (reg = CMOS_FIRST; reg <= CMOS_LAST; reg++) {
+        g_assert_cmphex(cmos_read(to, reg), ==, reg ^ 0xa5);
+    }
+
+    g_free(uri);
+    qtest_quit(from);
+    qtest_quit(to);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    qtest_add_func("/vmstate-threads/loopback", test_vmstate_threads);
+
+    return g_test_run();
+}
@@ -55,12 +55,14 @@
 #endif
 #else
 #include "exec/address-spaces.h"
+#include "sysemu/cpus.h"
 #endif
 
 #include "exec/cputlb.h"
 #include "translate-all.h"
 #include "qemu/bitmap.h"
 #include "qemu/timer.h"
+#include "qemu/atomic.h"
 
 //#define DEBUG_TB_INVALIDATE
 //#define DEBUG_FLUSH
@@ -81,6 +83,9 @@ typedef struct PageDesc {
        of lookups we do to a given page to use a bitmap */
     unsigned int code_write_count;
     unsigned long *code_bitmap;
+    /* TBs of this page dropped by code region eviction and not yet
+       translated again */
+    unsigned int evicted_tbs;
 #if defined(CONFIG_USER_ONLY)
     unsigned long flags;
 #endif
@@ -127,13 +132,55 @@ static void *l1_map[V_L1_SIZE];
 /* code generation context */
 TCGContext tcg_ctx;
 
+/* Executions after which a TB is retranslated as a trace, 0 to disable */
+int tb_trace_threshold;
+
+/* Nesting depth of tb_lock in the current thread.  The TB state can be
+   entered recursively (tb_find_slow -> tb_gen_code -> tb_flush), so only
+   the outermost tb_lock/tb_unlock pair touches the mutex.  */
+static __thread int have_tb_lock;
+
+/* Serialize access to the translation buffer, the TB hash tables and the
+   page descriptors.  May be held across a longjmp out of the translator;
+   cpu_exec() drops it again with tb_lock_reset().  Without TCG (e.g. the
+   gdbstub calling tb_flush under KVM) there is nothing to protect and the
+   mutex is not even initialized.  */
+void tb_lock(void)
+{
+    if (tcg_enabled() && have_tb_lock++ == 0) {
+        qemu_mutex_lock(&tcg_ctx.tb_ctx.tb_lock);
+    }
+}
+
+void tb_unlock(void)
+{
+    if (!tcg_enabled()) {
+        return;
+    }
+    assert(have_tb_lock > 0);
+    if (--have_tb_lock == 0) {
+        qemu_mutex_unlock(&tcg_ctx.tb_ctx.tb_lock);
+    }
+}
+
+void tb_lock_reset(void)
+{
+    if (have_tb_lock) {
+        have_tb_lock = 0;
+        qemu_mutex_unlock(&tcg_ctx.tb_ctx.tb_lock);
+    }
+}
+
 static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
                          tb_page_addr_t phys_page2);
 static TranslationBlock *tb_find_pc(uintptr_t tc_ptr);
 
 void cpu_gen_init(void)
 {
-    tcg_context_init(&tcg_ctx); 
+    tcg_context_init(&tcg_ctx);
+    qemu_mutex_init(&tcg_ctx.tb_ctx.tb_lock);
+    qht_init(&tcg_ctx.tb_ctx.htable, CODE_GEN_HTABLE_SIZE,
+             QHT_MODE_AUTO_RESIZE);
 }
 
 /* return non zero if the very first instruction is invalid so that
@@ -158,7 +205,10 @@ int cpu_gen_code(CPUArchState *env, TranslationBlock *tb, int *gen_code_size_ptr
 #endif
     tcg_func_start(s);
 
-    gen_intermediate_code(env, tb);
+    if (!tb_cache_lookup(ENV_GET_CPU(env), tb)) {
+        gen_intermediate_code(env, tb);
+        tb_cache_store(ENV_GET_CPU(env), tb);
+    }
 
     trace_translate_block(tb, tb->pc, tb->tc_ptr);
 
@@ -261,7 +311,9 @@ static int cpu_restore_state_from_tb(CPUState *cpu, TranslationBlock *tb,
 bool cpu_restore_state(CPUState *cpu, uintptr_t retaddr)
 {
     TranslationBlock *tb;
+    bool found = false;
 
+    tb_lock();
     tb = tb_find_pc(retaddr);
     if (tb) {
         cpu_restore_state_from_tb(cpu, tb, retaddr);
@@ -271,9 +323,10 @@ bool cpu_restore_state(CPUState *cpu, uintptr_t retaddr)
             tb_phys_invalidate(tb, -1);
             tb_free(tb);
         }
-        return true;
+        found = true;
     }
-    return false;
+    tb_unlock();
+    return found;
 }
 
 #ifdef _WIN32
@@ -478,6 +531,16 @@ static inline PageDesc *page_find(tb_page_addr_t index)
   (DEFAULT_CODE_GEN_BUFFER_SIZE_1 < MAX_CODE_GEN_BUFFER_SIZE \
    ? DEFAULT_CODE_GEN_BUFFER_SIZE_1 : MAX_CODE_GEN_BUFFER_SIZE)
 
+/* Room that must be left at the end of a region for the largest TB */
+#define CODE_GEN_REGION_SLACK  (TCG_MAX_OP_SIZE * OPC_BUF_SIZE)
+
+/* The buffer is split into at most CODE_GEN_MAX_REGIONS regions, each at
+   least CODE_GEN_REGION_MIN_SLACKS times the slack so that the slack does
+   not waste too much of it.  A small buffer ends up as a single region,
+   which degenerates into flushing everything when it is full.  */
+#define CODE_GEN_MAX_REGIONS        16
+#define CODE_GEN_REGION_MIN_SLACKS  8
+
 static inline size_t size_code_gen_buffer(size_t tb_size)
 {
     /* Size the buffer.  */
@@ -645,6 +708,51 @@ static inline void *alloc_code_gen_buffer(void)
 }
 #endif /* USE_STATIC_CODE_GEN_BUFFER, USE_MMAP */
 
+static void tb_regions_reset(void)
+{
+    TBContext *tb_ctx = &tcg_ctx.tb_ctx;
+    int i;
+
+    for (i = 0; i < tb_ctx->nb_regions; i++) {
+        tb_ctx->regions[i].nb_tbs = 0;
+        tb_ctx->regions[i].ptr = tb_ctx->regions[i].start;
+    }
+    tb_ctx->nb_tbs = 0;
+    tb_ctx->cur_region = 0;
+    tcg_ctx.code_gen_ptr = tb_ctx->regions[0].start;
+}
+
+static void tb_regions_init(void)
+{
+    TBContext *tb_ctx = &tcg_ctx.tb_ctx;
+    size_t size = tcg_ctx.code_gen_buffer_size;
+    int tbs_per_region;
+    int i, n;
+
+    n = size / (CODE_GEN_REGION_MIN_SLACKS * CODE_GEN_REGION_SLACK);
+    n = MAX(MIN(n, CODE_GEN_MAX_REGIONS), 1);
+    tb_ctx->nb_regions = n;
+    tb_ctx->region_size = (size / n) & ~(CODE_GEN_ALIGN - 1);
+    tb_ctx->regions = g_new0(TBRegion, n);
+    tbs_per_region = tcg_ctx.code_gen_max_blocks / n;
+
+    for (i = 0; i < n; i++) {
+        TBRegion *r = &tb_ctx->regions[i];
+
+        r->start = tcg_ctx.code_gen_buffer + i * tb_ctx->region_size;
+        r->end = r->start + tb_ctx->region_size - CODE_GEN_REGION_SLACK;
+        r->tbs = tb_ctx->tbs + i * tbs_per_region;
+        r->max_tbs = tbs_per_region;
+    }
+    /* the last region also gets whatever the division left over */
+    tb_ctx->regions[n - 1].end = tcg_ctx.code_gen_buffer +
+        tcg_ctx.code_gen_buffer_max_size;
+    tb_ctx->regions[n - 1].max_tbs = tcg_ctx.code_gen_max_blocks -
+        (n - 1) * tbs_per_region;
+
+    tb_regions_reset();
+}
+
 static inline void code_gen_alloc(size_t tb_size)
 {
     tcg_ctx.code_gen_buffer_size = size_code_gen_buffer(tb_size);
@@ -672,6 +780,7 @@ static inline void code_gen_alloc(size_t tb_size)
             CODE_GEN_AVG_BLOCK_SIZE;
     tcg_ctx.tb_ctx.tbs =
             g_malloc(tcg_ctx.code_gen_max_blocks * sizeof(TranslationBlock));
+    tb_regions_init();
 }
 
 /* Must be called before using the QEMU cpus. 'tb_size' is the size
@@ -681,7 +790,6 @@ void tcg_exec_init(unsigned long tb_size)
 {
     cpu_gen_init();
     code_gen_alloc(tb_size);
-    tcg_ctx.code_gen_ptr = tcg_ctx.code_gen_buffer;
     tcg_register_jit(tcg_ctx.code_gen_buffer, tcg_ctx.code_gen_buffer_size);
     page_init();
 #if !defined(CONFIG_USER_ONLY) || !defined(CONFIG_USE_GUEST_BASE)
@@ -696,18 +804,18 @@ bool tcg_enabled(void)
     return tcg_ctx.code_gen_buffer != NULL;
 }
 
-/* Allocate a new translation block. Flush the translation buffer if
-   too many translation blocks or too much generated code. */
+/* Allocate a new translation block in the current region.  Returns NULL
+   if the region has run out of translation blocks or code space.  */
 static TranslationBlock *tb_alloc(target_ulong pc)
 {
+    TBRegion *r = &tcg_ctx.tb_ctx.regions[tcg_ctx.tb_ctx.cur_region];
     TranslationBlock *tb;
 
-    if (tcg_ctx.tb_ctx.nb_tbs >= tcg_ctx.code_gen_max_blocks ||
-        (tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer) >=
-         tcg_ctx.code_gen_buffer_max_size) {
+    if (r->nb_tbs >= r->max_tbs || tcg_ctx.code_gen_ptr >= r->end) {
         return NULL;
     }
-    tb = &tcg_ctx.tb_ctx.tbs[tcg_ctx.tb_ctx.nb_tbs++];
+    tb = &r->tbs[r->nb_tbs++];
+    tcg_ctx.tb_ctx.nb_tbs++;
     tb->pc = pc;
     tb->cflags = 0;
     return tb;
@@ -718,11 +826,16 @@ void tb_free(TranslationBlock *tb)
     /* In practice this is mostly used for single use temporary TB
        Ignore the hard cases and just back up if this TB happens to
        be the last one generated.  */
-    if (tcg_ctx.tb_ctx.nb_tbs > 0 &&
-            tb == &tcg_ctx.tb_ctx.tbs[tcg_ctx.tb_ctx.nb_tbs - 1]) {
+    TBRegion *r;
+
+    tb_lock();
+    r = &tcg_ctx.tb_ctx.regions[tcg_ctx.tb_ctx.cur_region];
+    if (r->nb_tbs > 0 && tb == &r->tbs[r->nb_tbs - 1]) {
         tcg_ctx.code_gen_ptr = tb->tc_ptr;
+        r->nb_tbs--;
         tcg_ctx.tb_ctx.nb_tbs--;
     }
+    tb_unlock();
 }
 
 static inline void invalidate_page_bitmap(PageDesc *p)
@@ -747,6 +860,7 @@ static void page_flush_tb_1(int level, void **lp)
 
         for (i = 0; i < V_L2_SIZE; ++i) {
             pd[i].first_tb = NULL;
+            pd[i].evicted_tbs = 0;
             invalidate_page_bitmap(pd + i);
         }
     } else {
@@ -768,11 +882,11 @@ static void page_flush_tb(void)
 }
 
 /* flush all the translation blocks */
-/* XXX: tb_flush is currently not thread safe */
 void tb_flush(CPUArchState *env1)
 {
     CPUState *cpu = ENV_GET_CPU(env1);
 
+    tb_lock();
 #if defined(DEBUG_FLUSH)
     printf("qemu: flush code_size=%ld nb_tbs=%d avg_tb_size=%ld\n",
            (unsigned long)(tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer),
@@ -784,76 +898,63 @@ void tb_flush(CPUArchState *env1)
         > tcg_ctx.code_gen_buffer_size) {
         cpu_abort(cpu, "Internal error: code buffer overflow\n");
     }
-    tcg_ctx.tb_ctx.nb_tbs = 0;
 
     CPU_FOREACH(cpu) {
         memset(cpu->tb_jmp_cache, 0, sizeof(cpu->tb_jmp_cache));
     }
+    smp_wmb();
 
-    memset(tcg_ctx.tb_ctx.tb_phys_hash, 0, sizeof(tcg_ctx.tb_ctx.tb_phys_hash));
+    qht_reset_size(&tcg_ctx.tb_ctx.htable, CODE_GEN_HTABLE_SIZE);
     page_flush_tb();
 
-    tcg_ctx.code_gen_ptr = tcg_ctx.code_gen_buffer;
+    tb_regions_reset();
     /* XXX: flush processor icache at this point if cache flush is
        expensive */
     tcg_ctx.tb_ctx.tb_flush_count++;
+    tb_unlock();
 }
 
 #ifdef DEBUG_TB_CHECK
 
-static void tb_invalidate_check(target_ulong address)
+static void do_tb_invalidate_check(QHT *ht, void *p, uint32_t hash,
+                                   void *userp)
 {
-    TranslationBlock *tb;
-    int i;
+    TranslationBlock *tb = p;
+    target_ulong addr = *(target_ulong *)userp;
 
-    address &= TARGET_PAGE_MASK;
-    for (i = 0; i < CODE_GEN_PHYS_HASH_SIZE; i++) {
-        for (tb = tb_ctx.tb_phys_hash[i]; tb != NULL; tb = tb->phys_hash_next) {
-            if (!(address + TARGET_PAGE_SIZE <= tb->pc ||
-                  address >= tb->pc + tb->size)) {
-                printf("ERROR invalidate: address=" TARGET_FMT_lx
-                       " PC=%08lx size=%04x\n",
-                       address, (long)tb->pc, tb->size);
-            }
-        }
+    if (!(addr + TARGET_PAGE_SIZE <= tb->pc || addr >= tb->pc + tb->size)) {
+        printf("ERROR invalidate: address=" TARGET_FMT_lx
+               " PC=%08lx size=%04x\n", addr, (long)tb->pc, tb->size);
     }
 }
 
-/* verify that all the pages have correct rights for code */
-static void tb_page_check(void)
+static void tb_invalidate_check(target_ulong address)
 {
-    TranslationBlock *tb;
-    int i, flags1, flags2;
-
-    for (i = 0; i < CODE_GEN_PHYS_HASH_SIZE; i++) {
-        for (tb = tcg_ctx.tb_ctx.tb_phys_hash[i]; tb != NULL;
-                tb = tb->phys_hash_next) {
-            flags1 = page_get_flags(tb->pc);
-            flags2 = page_get_flags(tb->pc + tb->size - 1);
-            if ((flags1 & PAGE_WRITE) || (flags2 & PAGE_WRITE)) {
-                printf("ERROR page flags: PC=%08lx size=%04x f1=%x f2=%x\n",
-                       (long)tb->pc, tb->size, flags1, flags2);
-            }
-        }
-    }
+    address &= TARGET_PAGE_MASK;
+    qht_iter(&tcg_ctx.tb_ctx.htable, do_tb_invalidate_check, &address);
 }
 
-#endif
-
-static inline void tb_hash_remove(TranslationBlock **ptb, TranslationBlock *tb)
+static void do_tb_page_check(QHT *ht, void *p, uint32_t hash, void *userp)
 {
-    TranslationBlock *tb1;
+    TranslationBlock *tb = p;
+    int flags1, flags2;
 
-    for (;;) {
-        tb1 = *ptb;
-        if (tb1 == tb) {
-            *ptb = tb1->phys_hash_next;
-            break;
-        }
-        ptb = &tb1->phys_hash_next;
+    flags1 = page_get_flags(tb->pc);
+    flags2 = page_get_flags(tb->pc + tb->size - 1);
+    if ((flags1 & PAGE_WRITE) || (flags2 & PAGE_WRITE)) {
+        printf("ERROR page flags: PC=%08lx size=%04x f1=%x f2=%x\n",
+               (long)tb->pc, tb->size, flags1, flags2);
     }
 }
 
+/* verify that all the pages have correct rights for code */
+static void tb_page_check(void)
+{
+    qht_iter(&tcg_ctx.tb_ctx.htable, do_tb_page_check, NULL);
+}
+
+#endif
+
 static inline void tb_page_remove(TranslationBlock **ptb, TranslationBlock *tb)
 {
     TranslationBlock *tb1;
@@ -916,10 +1017,20 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
     tb_page_addr_t phys_pc;
     TranslationBlock *tb1, *tb2;
 
+    tb_lock();
+
+    /* a TB can be invalidated more than once, e.g. by its owner and then
+       by the eviction of its code region */
+    if (tb->cflags & CF_INVALID) {
+        tb_unlock();
+        return;
+    }
+    tb->cflags |= CF_INVALID;
+
     /* remove the TB from the hash list */
     phys_pc = tb->page_addr[0] + (tb->pc & ~TARGET_PAGE_MASK);
-    h = tb_phys_hash_func(phys_pc);
-    tb_hash_remove(&tcg_ctx.tb_ctx.tb_phys_hash[h], tb);
+    qht_remove(&tcg_ctx.tb_ctx.htable, tb,
+               tb_hash_func(phys_pc, tb->pc, tb->flags));
 
     /* remove the TB from the page list */
     if (tb->page_addr[0] != page_addr) {
@@ -935,11 +1046,12 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
 
     tcg_ctx.tb_ctx.tb_invalidated_flag = 1;
 
-    /* remove the TB from the hash list */
+    /* remove the TB from the hash list; other vCPUs may be looking
+       up their own jump cache concurrently */
     h = tb_jmp_cache_hash_func(tb->pc);
     CPU_FOREACH(cpu) {
-        if (cpu->tb_jmp_cache[h] == tb) {
-            cpu->tb_jmp_cache[h] = NULL;
+        if (atomic_read(&cpu->tb_jmp_cache[h]) == tb) {
+            atomic_set(&cpu->tb_jmp_cache[h], NULL);
         }
     }
 
@@ -963,6 +1075,7 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
     tb->jmp_first = (TranslationBlock *)((uintptr_t)tb | 2); /* fail safe */
 
     tcg_ctx.tb_ctx.tb_phys_invalidate_count++;
+    tb_unlock();
 }
 
 static void build_page_bitmap(PageDesc *p)
@@ -994,6 +1107,65 @@ static void build_page_bitmap(PageDesc *p)
     }
 }
 
+/* Called with tb_lock held when the current code region is full.  Move to
+   the next region in FIFO order and invalidate every TB still living in
+   it, so that the code buffer is recycled a region at a time instead of
+   being flushed as a whole.  */
+static void tb_region_evict_next(CPUArchState *env)
+{
+    TBContext *tb_ctx = &tcg_ctx.tb_ctx;
+    TBRegion *r;
+    PageDesc *p;
+    int i;
+
+    if (tb_ctx->nb_regions == 1) {
+        tb_flush(env);
+        return;
+    }
+
+    tb_ctx->regions[tb_ctx->cur_region].ptr = tcg_ctx.code_gen_ptr;
+    tb_ctx->cur_region = (tb_ctx->cur_region + 1) % tb_ctx->nb_regions;
+    r = &tb_ctx->regions[tb_ctx->cur_region];
+
+    for (i = 0; i < r->nb_tbs; i++) {
+        TranslationBlock *tb = &r->tbs[i];
+
+        if (tb->cflags & CF_INVALID) {
+            continue;
+        }
+        p = page_find(tb->page_addr[0] >> TARGET_PAGE_BITS);
+        if (p) {
+            p->evicted_tbs++;
+        }
+        tb_phys_invalidate(tb, -1);
+        tb_ctx->tb_evicted_count++;
+    }
+
+    tb_ctx->nb_tbs -= r->nb_tbs;
+    r->nb_tbs = 0;
+    r->ptr = r->start;
+    tcg_ctx.code_gen_ptr = r->start;
+    tb_ctx->tb_region_evict_count++;
+}
+
+bool tb_evict_pending(void)
+{
+    return atomic_read(&tcg_ctx.tb_ctx.evict_pending);
+}
+
+/* Recycle the code region that tb_gen_code() found full in MTTCG mode.
+   The caller guarantees that no vCPU is executing translated code.  */
+void tb_evict_pending_region(CPUState *cpu)
+{
+    tb_lock();
+    if (tcg_ctx.tb_ctx.evict_pending) {
+        tb_region_evict_next(cpu->env_ptr);
+        tcg_ctx.tb_ctx.tb_invalidated_flag = 1;
+        tcg_ctx.tb_ctx.evict_pending = false;
+    }
+    tb_unlock();
+}
+
 TranslationBlock *tb_gen_code(CPUState *cpu,
                               target_ulong pc, target_ulong cs_base,
                               int flags, int cflags)
@@ -1008,19 +1180,40 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     if (use_icount) {
         cflags |= CF_USE_ICOUNT;
     }
+#ifdef TARGET_HAS_TB_TRACE
+    /* ordinary TBs count their executions to find trace heads */
+    if (tb_trace_threshold > 0 && !(cflags & ~CF_USE_ICOUNT)) {
+        cflags |= CF_HOT_COUNT;
+    }
+#endif
+
+    /* Translation itself can fault on the guest code and longjmp back
+       to cpu_exec() with the lock held; cpu_exec() drops it then.  */
+    tb_lock();
     tb = tb_alloc(pc);
     if (!tb) {
-        /* flush must be done */
-        tb_flush(env);
+#if !defined(CONFIG_USER_ONLY)
+        if (qemu_tcg_mttcg_enabled()) {
+            /* other vCPU threads may be running code from the region that
+               would be recycled; leave that to tb_evict_pending_region() */
+            tcg_ctx.tb_ctx.evict_pending = true;
+            cpu->exception_index = EXCP_INTERRUPT;
+            cpu_loop_exit(cpu);
+        }
+#endif
+        /* make room by recycling the oldest code region */
+        tb_region_evict_next(env);
         /* cannot fail at this point */
         tb = tb_alloc(pc);
         /* Don't forget to invalidate previous TB info.  */
         tcg_ctx.tb_ctx.tb_invalidated_flag = 1;
     }
+    tcg_ctx.tb_ctx.tb_gen_count++;
     tb->tc_ptr = tcg_ctx.code_gen_ptr;
     tb->cs_base = cs_base;
     tb->flags = flags;
     tb->cflags = cflags;
+    tb->hot_count = tb_trace_threshold;
     cpu_gen_code(env, tb, &code_gen_size);
     tcg_ctx.code_gen_ptr = (void *)(((uintptr_t)tcg_ctx.code_gen_ptr +
             code_gen_size + CODE_GEN_ALIGN - 1) & ~(CODE_GEN_ALIGN - 1));
@@ -1032,9 +1225,31 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
         phys_page2 = get_page_addr_code(env, virt_page2);
     }
     tb_link_page(tb, phys_pc, phys_page2);
+    tb_unlock();
     return tb;
 }
 
+/* Called from cpu_exec() when @tb, translated with CF_HOT_COUNT, has run
+   tb_trace_threshold times.  Replace it with a trace starting at the same
+   address, which the front end may extend across block boundaries.  */
+void tb_gen_trace(CPUState *cpu, TranslationBlock *tb)
+{
+    tb_lock();
+    /* the TB may have been invalidated, or even recycled for another
+       translation, since it exited */
+    if ((tb->cflags & (CF_HOT_COUNT | CF_INVALID)) == CF_HOT_COUNT &&
+        tb->hot_count == 0) {
+        target_ulong pc = tb->pc;
+        target_ulong cs_base = tb->cs_base;
+        uint64_t flags = tb->flags;
+
+        tb_phys_invalidate(tb, -1);
+        tb_gen_code(cpu, pc, cs_base, flags, CF_TRACE);
+        tcg_ctx.tb_ctx.tb_trace_count++;
+    }
+    tb_unlock();
+}
+
 /*
  * Invalidate all TBs which intersect with the target physical address range
  * [start;end[. NOTE: start and end may refer to *different* physical pages.
@@ -1079,8 +1294,10 @@ void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end,
     int current_flags = 0;
 #endif /* TARGET_HAS_PRECISE_SMC */
 
+    tb_lock();
     p = page_find(start >> TARGET_PAGE_BITS);
     if (!p) {
+        tb_unlock();
         return;
     }
     if (!p->code_bitmap &&
@@ -1173,6 +1390,7 @@ void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end,
         cpu_resume_from_signal(cpu, NULL);
     }
 #endif
+    tb_unlock();
 }
 
 /* len must be <= 8 and start must be a multiple of len */
@@ -1189,8 +1407,10 @@ void tb_invalidate_phys_page_fast(tb_page_addr_t start, int len)
                   (intptr_t)cpu_single_env->segs[R_CS].base);
     }
 #endif
+    tb_lock();
     p = page_find(start >> TARGET_PAGE_BITS);
     if (!p) {
+        tb_unlock();
         return;
     }
     if (p->code_bitmap) {
@@ -1206,6 +1426,7 @@ void tb_invalidate_phys_page_fast(tb_page_addr_t start, int len)
     do_invalidate:
         tb_invalidate_phys_page_range(start, start + len, 1);
     }
+    tb_unlock();
 }
 
 #if !defined(CONFIG_SOFTMMU)
@@ -1227,8 +1448,10 @@ static void tb_invalidate_phys_page(tb_page_addr_t addr,
 #endif
 
     addr &= TARGET_PAGE_MASK;
+    tb_lock();
     p = page_find(addr >> TARGET_PAGE_BITS);
     if (!p) {
+        tb_unlock();
         return;
     }
     tb = p->first_tb;
@@ -1275,6 +1498,7 @@ static void tb_invalidate_phys_page(tb_page_addr_t addr,
         cpu_resume_from_signal(cpu, puc);
     }
 #endif
+    tb_unlock();
 }
 #endif
 
@@ -1295,6 +1519,11 @@ static inline void tb_alloc_page(TranslationBlock *tb,
 #endif
     p->first_tb = (TranslationBlock *)((uintptr_t)tb | n);
     invalidate_page_bitmap(p);
+    if (n == 0 && p->evicted_tbs) {
+        /* code we threw away is needed again */
+        p->evicted_tbs--;
+        tcg_ctx.tb_ctx.tb_retranslate_count++;
+    }
 
 #if defined(CONFIG_USER_ONLY)
     if (p->flags & PAGE_WRITE) {
@@ -1338,17 +1567,11 @@ static inline void tb_alloc_page(TranslationBlock *tb,
 static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
                          tb_page_addr_t phys_page2)
 {
-    unsigned int h;
-    TranslationBlock **ptb;
+    uint32_t h;
 
     /* Grab the mmap lock to stop another thread invalidating this TB
        before we are done.  */
     mmap_lock();
-    /* add in the physical hash table */
-    h = tb_phys_hash_func(phys_pc);
-    ptb = &tcg_ctx.tb_ctx.tb_phys_hash[h];
-    tb->phys_hash_next = *ptb;
-    *ptb = tb;
 
     /* add in the page list */
     tb_alloc_page(tb, 0, phys_pc & TARGET_PAGE_MASK);
@@ -1370,6 +1593,11 @@ static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
         tb_reset_jump(tb, 1);
     }
 
+    /* add in the physical hash table last, so that concurrent lock-free
+       lookups only ever see a fully linked TB */
+    h = tb_hash_func(phys_pc, tb->pc, tb->flags);
+    qht_insert(&tcg_ctx.tb_ctx.htable, tb, h);
+
 #ifdef DEBUG_TB_CHECK
     tb_page_check();
 #endif
@@ -1380,23 +1608,30 @@ static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
    tb[1].tc_ptr. Return NULL if not found */
 static TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
 {
-    int m_min, m_max, m;
-    uintptr_t v;
+    TBContext *tb_ctx = &tcg_ctx.tb_ctx;
+    int m_min, m_max, m, i;
+    uintptr_t v, end;
     TranslationBlock *tb;
+    TBRegion *r;
 
-    if (tcg_ctx.tb_ctx.nb_tbs <= 0) {
+    if (tb_ctx->nb_tbs <= 0 ||
+        tc_ptr < (uintptr_t)tcg_ctx.code_gen_buffer) {
         return NULL;
     }
-    if (tc_ptr < (uintptr_t)tcg_ctx.code_gen_buffer ||
-        tc_ptr >= (uintptr_t)tcg_ctx.code_gen_ptr) {
+    /* TBs are only sorted by tc_ptr within a region */
+    i = (tc_ptr - (uintptr_t)tcg_ctx.code_gen_buffer) / tb_ctx->region_size;
+    i = MIN(i, tb_ctx->nb_regions - 1);
+    r = &tb_ctx->regions[i];
+    end = (uintptr_t)(i == tb_ctx->cur_region ? tcg_ctx.code_gen_ptr : r->ptr);
+    if (r->nb_tbs <= 0 || tc_ptr >= end) {
         return NULL;
     }
     /* binary search (cf Knuth) */
     m_min = 0;
-    m_max = tcg_ctx.tb_ctx.nb_tbs - 1;
+    m_max = r->nb_tbs - 1;
     while (m_min <= m_max) {
         m = (m_min + m_max) >> 1;
-        tb = &tcg_ctx.tb_ctx.tbs[m];
+        tb = &r->tbs[m];
         v = (uintptr_t)tb->tc_ptr;
         if (v == tc_ptr) {
             return tb;
@@ -1406,7 +1641,7 @@ static TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
             m_min = m + 1;
         }
     }
-    return &tcg_ctx.tb_ctx.tbs[m_max];
+    return &r->tbs[m_max];
 }
 
 #if !defined(CONFIG_USER_ONLY)
@@ -1434,6 +1669,7 @@ void tb_check_watchpoint(CPUState *cpu)
 {
     TranslationBlock *tb;
 
+    tb_lock();
     tb = tb_find_pc(cpu->mem_io_pc);
     if (!tb) {
         cpu_abort(cpu, "check_watchpoint: could not find TB for pc=%p",
@@ -1441,6 +1677,7 @@ void tb_check_watchpoint(CPUState *cpu)
     }
     cpu_restore_state_from_tb(cpu, tb, cpu->mem_io_pc);
     tb_phys_invalidate(tb, -1);
+    tb_unlock();
 }
 
 #ifndef CONFIG_USER_ONLY
@@ -1486,6 +1723,8 @@ void cpu_io_recompile(CPUState *cpu, uintptr_t retaddr)
     target_ulong pc, cs_base;
     uint64_t flags;
 
+    /* Released by cpu_exec() after cpu_resume_from_signal() below.  */
+    tb_lock();
     tb = tb_find_pc(retaddr);
     if (!tb) {
         cpu_abort(cpu, "cpu_io_recompile: could not find TB for pc=%p",
@@ -1554,36 +1793,50 @@ void tb_flush_jmp_cache(CPUState *cpu, target_ulong addr)
 
 void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
 {
-    int i, target_code_size, max_target_code_size;
+    TBContext *tb_ctx = &tcg_ctx.tb_ctx;
+    int i, j, target_code_size, max_target_code_size;
     int direct_jmp_count, direct_jmp2_count, cross_page;
+    ptrdiff_t host_code_size;
     TranslationBlock *tb;
+    QHTStats hst;
+
+    tb_lock();
 
     target_code_size = 0;
     max_target_code_size = 0;
     cross_page = 0;
     direct_jmp_count = 0;
     direct_jmp2_count = 0;
-    for (i = 0; i < tcg_ctx.tb_ctx.nb_tbs; i++) {
-        tb = &tcg_ctx.tb_ctx.tbs[i];
-        target_code_size += tb->size;
-        if (tb->size > max_target_code_size) {
-            max_target_code_size = tb->size;
-        }
-        if (tb->page_addr[1] != -1) {
-            cross_page++;
-        }
-        if (tb->tb_next_offset[0] != 0xffff) {
-            direct_jmp_count++;
-            if (tb->tb_next_offset[1] != 0xffff) {
-                direct_jmp2_count++;
+    host_code_size = 0;
+    for (j = 0; j < tb_ctx->nb_regions; j++) {
+        TBRegion *r = &tb_ctx->regions[j];
+
+        host_code_size += (j == tb_ctx->cur_region ?
+                           tcg_ctx.code_gen_ptr : r->ptr) - r->start;
+        for (i = 0; i < r->nb_tbs; i++) {
+            tb = &r->tbs[i];
+            target_code_size += tb->size;
+            if (tb->size > max_target_code_size) {
+                max_target_code_size = tb->size;
+            }
+            if (tb->page_addr[1] != -1) {
+                cross_page++;
+            }
+            if (tb->tb_next_offset[0] != 0xffff) {
+                direct_jmp_count++;
+                if (tb->tb_next_offset[1] != 0xffff) {
+                    direct_jmp2_count++;
+                }
             }
         }
     }
     /* XXX: avoid using doubles ? */
     cpu_fprintf(f, "Translation buffer state:\n");
     cpu_fprintf(f, "gen code size       %td/%zd\n",
-                tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer,
-                tcg_ctx.code_gen_buffer_max_size);
+                host_code_size, tcg_ctx.code_gen_buffer_max_size);
+    cpu_fprintf(f, "code regions        %d of %zd bytes (current %d)\n",
+                tb_ctx->nb_regions, tb_ctx->region_size,
+                tb_ctx->cur_region);
     cpu_fprintf(f, "TB count            %d/%d\n",
             tcg_ctx.tb_ctx.nb_tbs, tcg_ctx.code_gen_max_blocks);
     cpu_fprintf(f, "TB avg target size  %d max=%d bytes\n",
@@ -1591,12 +1844,10 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
                     tcg_ctx.tb_ctx.nb_tbs : 0,
             max_target_code_size);
     cpu_fprintf(f, "TB avg host size    %td bytes (expansion ratio: %0.1f)\n",
-            tcg_ctx.tb_ctx.nb_tbs ? (tcg_ctx.code_gen_ptr -
-                                     tcg_ctx.code_gen_buffer) /
-                                     tcg_ctx.tb_ctx.nb_tbs : 0,
-                target_code_size ? (double) (tcg_ctx.code_gen_ptr -
-                                             tcg_ctx.code_gen_buffer) /
-                                             target_code_size : 0);
+            tcg_ctx.tb_ctx.nb_tbs ? host_code_size /
+                                    tcg_ctx.tb_ctx.nb_tbs : 0,
+                target_code_size ? (double) host_code_size /
+                                            target_code_size : 0);
     cpu_fprintf(f, "cross page TB count %d (%d%%)\n", cross_page,
             tcg_ctx.tb_ctx.nb_tbs ? (cross_page * 100) /
                                     tcg_ctx.tb_ctx.nb_tbs : 0);
@@ -1607,12 +1858,45 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
                 direct_jmp2_count,
                 tcg_ctx.tb_ctx.nb_tbs ? (direct_jmp2_count * 100) /
                         tcg_ctx.tb_ctx.nb_tbs : 0);
+
+    qht_statistics(&tcg_ctx.tb_ctx.htable, &hst);
+    cpu_fprintf(f, "TB hash buckets     %zu/%zu (%0.2f%% head buckets used)\n",
+                hst.used_head_buckets, hst.head_buckets,
+                hst.head_buckets ?
+                (double)hst.used_head_buckets / hst.head_buckets * 100 : 0);
+    cpu_fprintf(f, "TB hash occupancy   %0.2f%% avg chain occ.\n",
+                hst.chain_buckets ? (double)hst.entries /
+                (hst.chain_buckets * QHT_BUCKET_ENTRIES) * 100 : 0);
+    cpu_fprintf(f, "TB hash avg chain   %0.3f buckets\n",
+                hst.used_head_buckets ?
+                (double)hst.chain_buckets / hst.used_head_buckets : 0);
+    cpu_fprintf(f, "TB hash chain hist ");
+    for (i = 0; i < QHT_STATS_CHAIN_MAX; i++) {
+        cpu_fprintf(f, " %d%s:%zu", i + 1,
+                    i == QHT_STATS_CHAIN_MAX - 1 ? "+" : "",
+                    hst.chain_hist[i]);
+    }
+    cpu_fprintf(f, "\n");
+
     cpu_fprintf(f, "\nStatistics:\n");
     cpu_fprintf(f, "TB flush count      %d\n", tcg_ctx.tb_ctx.tb_flush_count);
+    cpu_fprintf(f, "TB region evictions %d (%" PRId64 " TBs evicted)\n",
+                tb_ctx->tb_region_evict_count, tb_ctx->tb_evicted_count);
+    cpu_fprintf(f, "TB traces formed    %d\n", tb_ctx->tb_trace_count);
+    cpu_fprintf(f, "TB retranslations   %" PRId64 " (%0.2f%% of %" PRId64
+                " translations)\n", tb_ctx->tb_retranslate_count,
+                tb_ctx->tb_gen_count ? (double)tb_ctx->tb_retranslate_count /
+                tb_ctx->tb_gen_count * 100 : 0, tb_ctx->tb_gen_count);
     cpu_fprintf(f, "TB invalidate count %d\n",
             tcg_ctx.tb_ctx.tb_phys_invalidate_count);
     cpu_fprintf(f, "TLB flush count     %d\n", tlb_flush_count);
+    cpu_fprintf(f, "TLB remote flushes  %d (%d coalesced)\n",
+                tlb_flush_async_count, tlb_flush_coalesced_count);
+    tlb_dump_statistics(f, cpu_fprintf);
+    tb_cache_dump_info(f, cpu_fprintf);
     tcg_dump_info(f, cpu_fprintf);
+
+    tb_unlock();
 }
 
 void dump_opcount_info(FILE *f, fprintf_function cpu_fprintf)
@@ -24,4 +24,9 @@ void tb_invalidate_phys_page_fast(tb_page_addr_t start, int len);
 void cpu_unlink_tb(CPUState *cpu);
 void tb_check_watchpoint(CPUState *cpu);
 
+/* translate-cache.c */
+bool tb_cache_lookup(CPUState *cpu, TranslationBlock *tb);
+void tb_cache_store(CPUState *cpu, TranslationBlock *tb);
+void tb_cache_dump_info(FILE *f, fprintf_function cpu_fprintf);
+
 #endif /* TRANSLATE_ALL_H */
@@ -0,0 +1,441 @@
+/*
+ *  Persistent translation cache
+ *
+ *  Copyright (c) 2015 QEMU contributors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The cache remembers the op stream that the front end generated for a
+ * TB, keyed by (pc, cs_base, flags, cflags) and by a hash of the guest
+ * code bytes, and saves it to a file at exit.  When a later run asks for
+ * the same TB, tb_cache_lookup() rebuilds the op stream from the cache
+ * and the guest decoder is skipped; optimization and code generation
+ * still run, because host code is not relocatable.
+ *
+ * Only TBs contained in a single guest page are cached, so that the code
+ * hash can be computed without faulting.  The file is tied to the QEMU
+ * binary, CPU model and CPU features that wrote it; any mismatch discards
+ * it.
+ */
+
+#include "config.h"
+#include "qemu-common.h"
+#include "cpu.h"
+#include "tcg.h"
+#include "qemu/error-report.h"
+#if defined(CONFIG_USER_ONLY)
+#include "qemu.h"
+#else
+#include "exec/ram_addr.h"
+#endif
+#include "translate-all.h"
+
+#define TB_CACHE_MAGIC      "QEMUTBC"
+#define TB_CACHE_VERSION    1
+
+/* Upper bound for the op streams held in memory and written to disk */
+#define TB_CACHE_MAX_SIZE   (64 * 1024 * 1024)
+
+/* Different code seen at the same key, e.g. after a module reload */
+#define TB_CACHE_MAX_CHAIN  4
+
+/* Largest op stream that we try to cache, in words */
+#define TB_CACHE_MAX_WORDS  (OPC_BUF_SIZE * 4 + OPPARAM_BUF_SIZE)
+
+typedef struct TBCacheKey {
+    uint64_t pc;
+    uint64_t cs_base;
+    uint64_t flags;
+    uint32_t cflags;
+} TBCacheKey;
+
+typedef struct TBCacheEntry TBCacheEntry;
+
+struct TBCacheEntry {
+    TBCacheKey key;
+    uint64_t code_hash;
+    uint32_t size;              /* guest code bytes covered by the TB */
+    uint32_t icount;
+    uint32_t nb_words;
+    TBCacheEntry *next;         /* same key, other code */
+    uint64_t words[];
+};
+
+/* On-disk layout: a header followed by nb_entries records, each followed
+   by its nb_words op stream words, all in host byte order.  */
+typedef struct TBCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t fingerprint;
+    uint64_t nb_entries;
+} TBCacheHeader;
+
+typedef struct TBCacheRecord {
+    uint64_t pc;
+    uint64_t cs_base;
+    uint64_t flags;
+    uint64_t code_hash;
+    uint32_t cflags;
+    uint32_t size;
+    uint32_t icount;
+    uint32_t nb_words;
+} TBCacheRecord;
+
+static struct {
+    char *path;
+    GHashTable *table;
+    bool loaded;
+    uint32_t fingerprint;
+    size_t size;
+    uint64_t nb_entries;
+    uint64_t *buf;
+    /* statistics */
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t stores;
+    uint64_t load_errors;
+} tb_cache;
+
+static guint tb_cache_key_hash(gconstpointer p)
+{
+    const TBCacheKey *k = p;
+
+    return k->pc ^ (k->pc >> 32) ^ k->flags ^ k->cs_base ^ k->cflags;
+}
+
+static gboolean tb_cache_key_equal(gconstpointer a, gconstpointer b)
+{
+    const TBCacheKey *ka = a;
+    const TBCacheKey *kb = b;
+
+    return ka->pc == kb->pc && ka->cs_base == kb->cs_base &&
+           ka->flags == kb->flags && ka->cflags == kb->cflags;
+}
+
+static void tb_cache_entry_free(gpointer p)
+{
+    TBCacheEntry *e = p;
+
+    while (e) {
+        TBCacheEntry *next = e->next;
+
+        g_free(e);
+        e = next;
+    }
+}
+
+/* FNV-1a */
+static uint64_t tb_cache_hash_code(const uint8_t *p, size_t len)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        h = (h ^ p[i]) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/* Host address of the guest code at @pc, whose page is known to be
+   mapped because get_page_addr_code() already succeeded on it.  */
+static const uint8_t *tb_cache_code_ptr(CPUArchState *env, target_ulong pc)
+{
+#if defined(CONFIG_USER_ONLY)
+    return g2h(pc);
+#else
+    return qemu_get_ram_ptr(get_page_addr_code(env, pc));
+#endif
+}
+
+static uint32_t tb_cache_fingerprint(CPUState *cpu)
+{
+    CPUClass *cc = CPU_GET_CLASS(cpu);
+    const char *p = QEMU_VERSION TARGET_NAME;
+    uint32_t h = tcg_op_stream_fingerprint(&tcg_ctx);
+
+    for (; *p; p++) {
+        h = h * 31 + *p;
+    }
+    for (p = object_get_typename(OBJECT(cpu)); *p; p++) {
+        h = h * 31 + *p;
+    }
+    /* -cpu model,+feature changes the translation without changing the
+       model name */
+    if (cc->translator_features) {
+        GByteArray *buf = g_byte_array_new();
+        guint i;
+
+        cc->translator_features(cpu, buf);
+        for (i = 0; i < buf->len; i++) {
+            h = h * 31 + buf->data[i];
+        }
+        g_byte_array_free(buf, TRUE);
+    }
+    return h;
+}
+
+/* Add @e to the table, ahead of any other code seen at the same key, and
+   drop the oldest such code if there is too much of it.  */
+static void tb_cache_insert(TBCacheEntry *e)
+{
+    TBCacheEntry *head = g_hash_table_lookup(tb_cache.table, &e->key);
+    TBCacheEntry *p;
+    int n;
+
+    if (head) {
+        /* the table's key lives in the head entry, so re-key it */
+        g_hash_table_steal(tb_cache.table, &head->key);
+        e->next = head;
+    }
+    g_hash_table_insert(tb_cache.table, &e->key, e);
+    tb_cache.size += sizeof(*e) + e->nb_words * sizeof(uint64_t);
+    tb_cache.nb_entries++;
+
+    for (p = e, n = 1; p->next; p = p->next, n++) {
+        if (n == TB_CACHE_MAX_CHAIN) {
+            tb_cache.size -= sizeof(*p->next) +
+                             p->next->nb_words * sizeof(uint64_t);
+            tb_cache.nb_entries--;
+            g_free(p->next);
+            p->next = NULL;
+            break;
+        }
+    }
+}
+
+static void tb_cache_load(CPUState *cpu)
+{
+    TBCacheHeader hdr;
+    TBCacheRecord rec;
+    uint64_t i;
+    FILE *f;
+
+    tb_cache.loaded = true;
+    tb_cache.fingerprint = tb_cache_fingerprint(cpu);
+
+    f = fopen(tb_cache.path, "rb");
+    if (!f) {
+        return;
+    }
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+        memcmp(hdr.magic, TB_CACHE_MAGIC, sizeof(hdr.magic)) ||
+        hdr.version != TB_CACHE_VERSION ||
+        hdr.fingerprint != tb_cache.fingerprint) {
+        /* stale or foreign cache, it will be overwritten at exit */
+        goto out;
+    }
+
+    for (i = 0; i < hdr.nb_entries; i++) {
+        TBCacheEntry *e;
+
+        if (fread(&rec, sizeof(rec), 1, f) != 1 ||
+            rec.nb_words > TB_CACHE_MAX_WORDS ||
+            tb_cache.size >= TB_CACHE_MAX_SIZE) {
+            break;
+        }
+        e = g_malloc(sizeof(*e) + rec.nb_words * sizeof(uint64_t));
+        e->key.pc = rec.pc;
+        e->key.cs_base = rec.cs_base;
+        e->key.flags = rec.flags;
+        e->key.cflags = rec.cflags;
+        e->code_hash = rec.code_hash;
+        e->size = rec.size;
+        e->icount = rec.icount;
+        e->nb_words = rec.nb_words;
+        e->next = NULL;
+        if (fread(e->words, sizeof(uint64_t), e->nb_words, f) !=
+            e->nb_words) {
+            g_free(e);
+            break;
+        }
+        tb_cache_insert(e);
+    }
+out:
+    fclose(f);
+}
+
+static void tb_cache_save(void)
+{
+    TBCacheHeader hdr;
+    GHashTableIter iter;
+    gpointer value;
+    char *tmp;
+    FILE *f;
+    bool ok = true;
+
+    if (!tb_cache.loaded) {
+        return;
+    }
+
+    tb_lock();
+    tmp = g_strdup_printf("%s.tmp", tb_cache.path);
+    f = fopen(tmp, "wb");
+    if (!f) {
+        error_report("tb-cache: cannot create '%s': %s", tmp,
+                     strerror(errno));
+        goto out;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, TB_CACHE_MAGIC, sizeof(hdr.magic));
+    hdr.version = TB_CACHE_VERSION;
+    hdr.fingerprint = tb_cache.fingerprint;
+    hdr.nb_entries = tb_cache.nb_entries;
+    ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1;
+
+    g_hash_table_iter_init(&iter, tb_cache.table);
+    while (ok && g_hash_table_iter_next(&iter, NULL, &value)) {
+        TBCacheEntry *e;
+
+        for (e = value; ok && e; e = e->next) {
+            TBCacheRecord rec = {
+                .pc = e->key.pc,
+                .cs_base = e->key.cs_base,
+                .flags = e->key.flags,
+                .code_hash = e->code_hash,
+                .cflags = e->key.cflags,
+                .size = e->size,
+                .icount = e->icount,
+                .nb_words = e->nb_words,
+            };
+
+            ok = fwrite(&rec, sizeof(rec), 1, f) == 1 &&
+                 fwrite(e->words, sizeof(uint64_t), e->nb_words, f) ==
+                 e->nb_words;
+        }
+    }
+    if (fclose(f) != 0 || !ok || rename(tmp, tb_cache.path) < 0) {
+        error_report("tb-cache: cannot write '%s'", tb_cache.path);
+        unlink(tmp);
+    }
+out:
+    g_free(tmp);
+    tb_unlock();
+}
+
+void tb_cache_init(const char *path)
+{
+    tb_cache.path = g_strdup(path);
+    tb_cache.table = g_hash_table_new_full(tb_cache_key_hash,
+                                           tb_cache_key_equal,
+                                           NULL, tb_cache_entry_free);
+    tb_cache.buf = g_new(uint64_t, TB_CACHE_MAX_WORDS);
+    atexit(tb_cache_save);
+}
+
+/* Whether the translation of @tb may be taken from, or stored into, the
+   cache.  Debugging state changes what the front end generates.  */
+static bool tb_cache_usable(CPUState *cpu, TranslationBlock *tb)
+{
+    return tb_cache.table && !(tb->cflags & CF_NOCACHE) &&
+           !singlestep && !cpu->singlestep_enabled &&
+           QTAILQ_EMPTY(&cpu->breakpoints);
+}
+
+/* Called with tb_lock held, right after tcg_func_start().  On a hit the op
+   stream, tb->size and tb->icount are those of the cached translation and
+   the front end must not be run.  */
+bool tb_cache_lookup(CPUState *cpu, TranslationBlock *tb)
+{
+    CPUArchState *env = cpu->env_ptr;
+    TBCacheKey key;
+    TBCacheEntry *e;
+    const uint8_t *code;
+    target_ulong offset = tb->pc & ~TARGET_PAGE_MASK;
+
+    if (!tb_cache_usable(cpu, tb)) {
+        return false;
+    }
+    if (!tb_cache.loaded) {
+        tb_cache_load(cpu);
+    }
+
+    key.pc = tb->pc;
+    key.cs_base = tb->cs_base;
+    key.flags = tb->flags;
+    key.cflags = tb->cflags;
+    code = tb_cache_code_ptr(env, tb->pc);
+
+    for (e = g_hash_table_lookup(tb_cache.table, &key); e; e = e->next) {
+        if (offset + e->size > TARGET_PAGE_SIZE ||
+            tb_cache_hash_code(code, e->size) != e->code_hash) {
+            continue;
+        }
+        if (!tcg_op_stream_load(&tcg_ctx, (uintptr_t)tb, e->words,
+                                e->nb_words)) {
+            tb_cache.load_errors++;
+            tcg_func_start(&tcg_ctx);
+            break;
+        }
+        tb->size = e->size;
+        tb->icount = e->icount;
+        tb_cache.hits++;
+        return true;
+    }
+    tb_cache.misses++;
+    return false;
+}
+
+/* Called with tb_lock held, after the front end translated @tb.  */
+void tb_cache_store(CPUState *cpu, TranslationBlock *tb)
+{
+    CPUArchState *env = cpu->env_ptr;
+    TBCacheEntry *e;
+    size_t n;
+
+    if (!tb_cache_usable(cpu, tb) || tb->size == 0 ||
+        (tb->pc & ~TARGET_PAGE_MASK) + tb->size > TARGET_PAGE_SIZE ||
+        tb_cache.size >= TB_CACHE_MAX_SIZE) {
+        return;
+    }
+    n = tcg_op_stream_save(&tcg_ctx, (uintptr_t)tb, tb_cache.buf,
+                           TB_CACHE_MAX_WORDS);
+    if (n == 0) {
+        return;
+    }
+
+    e = g_malloc(sizeof(*e) + n * sizeof(uint64_t));
+    e->key.pc = tb->pc;
+    e->key.cs_base = tb->cs_base;
+    e->key.flags = tb->flags;
+    e->key.cflags = tb->cflags;
+    e->code_hash = tb_cache_hash_code(tb_cache_code_ptr(env, tb->pc),
+                                      tb->size);
+    e->size = tb->size;
+    e->icount = tb->icount;
+    e->nb_words = n;
+    e->next = NULL;
+    memcpy(e->words, tb_cache.buf, n * sizeof(uint64_t));
+    tb_cache_insert(e);
+    tb_cache.stores++;
+}
+
+void tb_cache_dump_info(FILE *f, fprintf_function cpu_fprintf)
+{
+    uint64_t lookups = tb_cache.hits + tb_cache.misses;
+
+    if (!tb_cache.table) {
+        return;
+    }
+    cpu_fprintf(f, "TB cache entries    %" PRIu64 " (%zu KB)\n",
+                tb_cache.nb_entries, tb_cache.size / 1024);
+    cpu_fprintf(f, "TB cache hits       %" PRIu64 " (%0.2f%% of %" PRIu64
+                " lookups)\n", tb_cache.hits,
+                lookups ? (double)tb_cache.hits / lookups * 100 : 0,
+                lookups);
+    cpu_fprintf(f, "TB cache stores     %" PRIu64 " (%" PRIu64
+                " load errors)\n", tb_cache.stores, tb_cache.load_errors);
+}
@@ -31,6 +31,10 @@
 #include "qemu/iov.h"
 #include "net/net.h"
 
+#ifdef CONFIG_AVX2_OPT
+#include <cpuid.h>
+#endif
+
 void strpadcpy(char *buf, int buf_size, const char *str, char pad)
 {
     int len = qemu_strnlen(str, buf_size);
@@ -166,6 +170,82 @@ int qemu_fdatasync(int fd)
 #endif
 }
 
+/*
+ * Checks whether AVX2 can be used: the CPU has to implement it and the
+ * OS has to save the YMM registers on context switches.
+ */
+bool host_cpu_has_avx2(void)
+{
+#if defined(CONFIG_AVX2_OPT) && defined(bit_AVX2) && defined(bit_OSXSAVE)
+    unsigned a, b, c, d, xcr0_lo, xcr0_hi;
+
+    if (__get_cpuid_max(0, 0) < 7) {
+        return false;
+    }
+    __cpuid(1, a, b, c, d);
+    if (!(c & bit_OSXSAVE)) {
+        return false;
+    }
+    /* xgetbv with ecx = 0: bits 1 and 2 are the SSE and AVX state */
+    asm(".byte 0x0f, 0x01, 0xd0" : "=a" (xcr0_lo), "=d" (xcr0_hi) : "c" (0));
+    if ((xcr0_lo & 6) != 6) {
+        return false;
+    }
+    __cpuid_count(7, 0, a, b, c, d);
+    return (b & bit_AVX2) != 0;
+#else
+    return false;
+#endif
+}
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+/* Same as buffer_find_nonzero_offset(), 32 bytes at a time */
+static size_t buffer_find_nonzero_offset_avx2(const void *buf, size_t len)
+{
+    const __m256i *p = buf;
+    size_t i;
+
+    for (i = 0; i < BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR; i++) {
+        __m256i tmp = _mm256_loadu_si256(p + i);
+        if (!_mm256_testz_si256(tmp, tmp)) {
+            return i * sizeof(__m256i);
+        }
+    }
+
+    for (i = BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR;
+         i < len / sizeof(__m256i);
+         i += BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR) {
+        __m256i tmp0 = _mm256_or_si256(_mm256_loadu_si256(p + i + 0),
+                                       _mm256_loadu_si256(p + i + 1));
+        __m256i tmp1 = _mm256_or_si256(_mm256_loadu_si256(p + i + 2),
+                                       _mm256_loadu_si256(p + i + 3));
+        __m256i tmp2 = _mm256_or_si256(_mm256_loadu_si256(p + i + 4),
+                                       _mm256_loadu_si256(p + i + 5));
+        __m256i tmp3 = _mm256_or_si256(_mm256_loadu_si256(p + i + 6),
+                                       _mm256_loadu_si256(p + i + 7));
+        __m256i tmp = _mm256_or_si256(_mm256_or_si256(tmp0, tmp1),
+                                      _mm256_or_si256(tmp2, tmp3));
+        if (!_mm256_testz_si256(tmp, tmp)) {
+            break;
+        }
+    }
+
+    return i * sizeof(__m256i);
+}
+#pragma GCC pop_options
+
+static bool use_avx2;
+
+static void __attribute__((constructor)) init_buffer_zero_avx2(void)
+{
+    use_avx2 = host_cpu_has_avx2();
+}
+#endif
+
 /*
  * Searches for an area with non-zero content in a buffer
  *
@@ -181,7 +261,8 @@ int qemu_fdatasync(int fd)
  * down to a multiple of sizeof(VECTYPE) for the first
  * BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR chunks and down to
  * BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR * sizeof(VECTYPE)
- * afterwards.
+ * afterwards.  When the host supports AVX2 and len allows it, twice
+ * that vector size is used instead.
  *
  * If the buffer is all zero the return value is equal to len.
  */
@@ -198,6 +279,13 @@ size_t buffer_find_nonzero_offset(const void *buf, size_t len)
         return 0;
     }
 
+#ifdef CONFIG_AVX2_OPT
+    if (use_avx2 &&
+        len % (BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR * 32) == 0) {
+        return buffer_find_nonzero_offset_avx2(buf, len);
+    }
+#endif
+
     for (i = 0; i < BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR; i++) {
         if (!ALL_EQ(p[i], zero)) {
             return i * sizeof(VECTYPE);
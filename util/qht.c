@@ -0,0 +1,353 @@
+/*
+ * Concurrent hash table with lock-free lookups
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ * The table is an array of head buckets, each starting a chain of
+ * fixed-size buckets.  Every bucket holds QHT_BUCKET_ENTRIES (hash,
+ * pointer) pairs so that a lookup usually touches a single cache line.
+ *
+ * Readers walk a chain without taking any lock and retry if the sequence
+ * counter of the head bucket changed meanwhile.  Writers hold ht->lock,
+ * bump the head bucket's sequence around in-place modifications, and
+ * publish new overflow buckets and new bucket arrays with
+ * atomic_rcu_set.  Bucket arrays (and their chains) are only freed after
+ * an RCU grace period, so a reader never touches freed memory.
+ */
+
+#include <assert.h>
+#include <glib.h>
+#include "qemu-common.h"
+#include "qemu/qht.h"
+#include "qemu/atomic.h"
+#include "qemu/rcu.h"
+#include "qemu/seqlock.h"
+
+/* Smallest bucket array we ever allocate */
+#define QHT_MIN_BUCKETS 16
+
+/* With QHT_MODE_AUTO_RESIZE, double the bucket array once there is more
+ * than one overflow bucket per QHT_RESIZE_RATIO head buckets.
+ */
+#define QHT_RESIZE_RATIO 8
+
+typedef struct QHTBucket QHTBucket;
+
+struct QHTBucket {
+    QemuSeqLock sequence;       /* only used in head buckets */
+    uint32_t hashes[QHT_BUCKET_ENTRIES];
+    void *pointers[QHT_BUCKET_ENTRIES];
+    QHTBucket *next;
+};
+
+struct QHTMap {
+    struct rcu_head rcu;
+    QHTBucket *buckets;
+    size_t n_buckets;
+    size_t n_added_buckets;     /* overflow buckets in all chains */
+    size_t n_added_buckets_threshold;
+};
+
+static size_t qht_elems_to_buckets(size_t n_elems)
+{
+    size_t n = n_elems / QHT_BUCKET_ENTRIES;
+
+    if (n < QHT_MIN_BUCKETS) {
+        n = QHT_MIN_BUCKETS;
+    }
+    return pow2ceil(n);
+}
+
+static QHTMap *qht_map_create(size_t n_buckets)
+{
+    QHTMap *map = g_new(QHTMap, 1);
+    size_t i;
+
+    map->n_buckets = n_buckets;
+    map->n_added_buckets = 0;
+    map->n_added_buckets_threshold = MAX(n_buckets / QHT_RESIZE_RATIO, 1);
+    map->buckets = g_new0(QHTBucket, n_buckets);
+    for (i = 0; i < n_buckets; i++) {
+        seqlock_init(&map->buckets[i].sequence, NULL);
+    }
+    return map;
+}
+
+static void qht_map_destroy(QHTMap *map)
+{
+    size_t i;
+
+    for (i = 0; i < map->n_buckets; i++) {
+        QHTBucket *b = map->buckets[i].next;
+
+        while (b) {
+            QHTBucket *next = b->next;
+
+            g_free(b);
+            b = next;
+        }
+    }
+    g_free(map->buckets);
+    g_free(map);
+}
+
+static inline QHTBucket *qht_map_to_bucket(QHTMap *map, uint32_t hash)
+{
+    return &map->buckets[hash & (map->n_buckets - 1)];
+}
+
+/* Replace the bucket array; readers may keep using the old one until
+ * they leave their RCU critical section.  Called with ht->lock held.
+ */
+static void qht_publish_map(QHT *ht, QHTMap *new)
+{
+    QHTMap *old = ht->map;
+
+    atomic_rcu_set(&ht->map, new);
+    call_rcu(old, qht_map_destroy, rcu);
+}
+
+void qht_init(QHT *ht, size_t n_elems, unsigned int mode)
+{
+    qemu_mutex_init(&ht->lock);
+    ht->mode = mode;
+    ht->map = qht_map_create(qht_elems_to_buckets(n_elems));
+}
+
+void qht_destroy(QHT *ht)
+{
+    qht_map_destroy(ht->map);
+    qemu_mutex_destroy(&ht->lock);
+    memset(ht, 0, sizeof(*ht));
+}
+
+static void *qht_do_lookup(QHTBucket *head, QHTLookupFunc func,
+                           const void *userp, uint32_t hash)
+{
+    QHTBucket *b = head;
+    int i;
+
+    do {
+        for (i = 0; i < QHT_BUCKET_ENTRIES; i++) {
+            if (atomic_read(&b->hashes[i]) == hash) {
+                void *p = atomic_rcu_read(&b->pointers[i]);
+
+                if (likely(p) && likely(func(p, userp))) {
+                    return p;
+                }
+            }
+        }
+        b = atomic_rcu_read(&b->next);
+    } while (b);
+
+    return NULL;
+}
+
+void *qht_lookup(QHT *ht, QHTLookupFunc func, const void *userp,
+                 uint32_t hash)
+{
+    QHTMap *map = atomic_rcu_read(&ht->map);
+    QHTBucket *head = qht_map_to_bucket(map, hash);
+    unsigned version;
+    void *ret;
+
+    do {
+        version = seqlock_read_begin(&head->sequence);
+        ret = qht_do_lookup(head, func, userp, hash);
+    } while (seqlock_read_retry(&head->sequence, version));
+
+    return ret;
+}
+
+/* Called with ht->lock held */
+static bool qht_insert__locked(QHTMap *map, void *p, uint32_t hash)
+{
+    QHTBucket *head = qht_map_to_bucket(map, hash);
+    QHTBucket *b = head;
+    QHTBucket *prev = NULL;
+    QHTBucket *free_b = NULL;
+    int free_i = 0;
+    int i;
+
+    do {
+        for (i = 0; i < QHT_BUCKET_ENTRIES; i++) {
+            if (b->pointers[i] == p) {
+                return false;
+            }
+            if (b->pointers[i] == NULL && free_b == NULL) {
+                free_b = b;
+                free_i = i;
+            }
+        }
+        prev = b;
+        b = b->next;
+    } while (b);
+
+    seqlock_write_lock(&head->sequence);
+    if (free_b) {
+        atomic_set(&free_b->hashes[free_i], hash);
+        atomic_set(&free_b->pointers[free_i], p);
+    } else {
+        b = g_new0(QHTBucket, 1);
+        b->hashes[0] = hash;
+        b->pointers[0] = p;
+        atomic_rcu_set(&prev->next, b);
+        map->n_added_buckets++;
+    }
+    seqlock_write_unlock(&head->sequence);
+    return true;
+}
+
+/* Called with ht->lock held */
+static void qht_do_resize(QHT *ht, size_t n_buckets)
+{
+    QHTMap *old = ht->map;
+    QHTMap *new = qht_map_create(n_buckets);
+    size_t i;
+    int j;
+
+    for (i = 0; i < old->n_buckets; i++) {
+        QHTBucket *b = &old->buckets[i];
+
+        do {
+            for (j = 0; j < QHT_BUCKET_ENTRIES; j++) {
+                if (b->pointers[j]) {
+                    qht_insert__locked(new, b->pointers[j], b->hashes[j]);
+                }
+            }
+            b = b->next;
+        } while (b);
+    }
+    qht_publish_map(ht, new);
+}
+
+bool qht_insert(QHT *ht, void *p, uint32_t hash)
+{
+    QHTMap *map;
+    bool ret;
+
+    assert(p);
+    qemu_mutex_lock(&ht->lock);
+    map = ht->map;
+    ret = qht_insert__locked(map, p, hash);
+    if (ret && (ht->mode & QHT_MODE_AUTO_RESIZE) &&
+        map->n_added_buckets > map->n_added_buckets_threshold) {
+        qht_do_resize(ht, map->n_buckets * 2);
+    }
+    qemu_mutex_unlock(&ht->lock);
+    return ret;
+}
+
+bool qht_remove(QHT *ht, const void *p, uint32_t hash)
+{
+    QHTBucket *head;
+    QHTBucket *b;
+    bool ret = false;
+    int i;
+
+    qemu_mutex_lock(&ht->lock);
+    head = qht_map_to_bucket(ht->map, hash);
+    b = head;
+    do {
+        for (i = 0; i < QHT_BUCKET_ENTRIES; i++) {
+            if (b->pointers[i] == p) {
+                assert(b->hashes[i] == hash);
+                seqlock_write_lock(&head->sequence);
+                atomic_set(&b->pointers[i], NULL);
+                atomic_set(&b->hashes[i], 0);
+                seqlock_write_unlock(&head->sequence);
+                ret = true;
+                goto out;
+            }
+        }
+        b = b->next;
+    } while (b);
+ out:
+    qemu_mutex_unlock(&ht->lock);
+    return ret;
+}
+
+void qht_reset(QHT *ht)
+{
+    qemu_mutex_lock(&ht->lock);
+    qht_publish_map(ht, qht_map_create(ht->map->n_buckets));
+    qemu_mutex_unlock(&ht->lock);
+}
+
+void qht_reset_size(QHT *ht, size_t n_elems)
+{
+    qemu_mutex_lock(&ht->lock);
+    qht_publish_map(ht, qht_map_create(qht_elems_to_buckets(n_elems)));
+    qemu_mutex_unlock(&ht->lock);
+}
+
+void qht_resize(QHT *ht, size_t n_elems)
+{
+    size_t n_buckets = qht_elems_to_buckets(n_elems);
+
+    qemu_mutex_lock(&ht->lock);
+    if (n_buckets != ht->map->n_buckets) {
+        qht_do_resize(ht, n_buckets);
+    }
+    qemu_mutex_unlock(&ht->lock);
+}
+
+void qht_iter(QHT *ht, QHTIterFunc func, void *userp)
+{
+    QHTMap *map;
+    size_t i;
+    int j;
+
+    qemu_mutex_lock(&ht->lock);
+    map = ht->map;
+    for (i = 0; i < map->n_buckets; i++) {
+        QHTBucket *b = &map->buckets[i];
+
+        do {
+            for (j = 0; j < QHT_BUCKET_ENTRIES; j++) {
+                if (b->pointers[j]) {
+                    func(ht, b->pointers[j], b->hashes[j], userp);
+                }
+            }
+            b = b->next;
+        } while (b);
+    }
+    qemu_mutex_unlock(&ht->lock);
+}
+
+void qht_statistics(QHT *ht, QHTStats *stats)
+{
+    QHTMap *map;
+    size_t i;
+    int j;
+
+    memset(stats, 0, sizeof(*stats));
+
+    qemu_mutex_lock(&ht->lock);
+    map = ht->map;
+    stats->head_buckets = map->n_buckets;
+    for (i = 0; i < map->n_buckets; i++) {
+        QHTBucket *b = &map->buckets[i];
+        size_t entries = 0;
+        size_t chain = 0;
+
+        do {
+            for (j = 0; j < QHT_BUCKET_ENTRIES; j++) {
+                if (b->pointers[j]) {
+                    entries++;
+                }
+            }
+            chain++;
+            b = b->next;
+        } while (b);
+
+        if (entries) {
+            stats->used_head_buckets++;
+            stats->entries += entries;
+            stats->chain_buckets += chain;
+            stats->chain_hist[MIN(chain, QHT_STATS_CHAIN_MAX) - 1]++;
+        }
+    }
+    qemu_mutex_unlock(&ht->lock);
+}
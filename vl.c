@@ -475,6 +475,20 @@ static QemuOptsList qemu_icount_opts = {
     },
 };
 
+static QemuOptsList qemu_tcg_opts = {
+    .name = "tcg",
+    .implied_opt_name = "thread",
+    .merge_lists = true,
+    .head = QTAILQ_HEAD_INITIALIZER(qemu_tcg_opts.head),
+    .desc = {
+        {
+            .name = "thread",
+            .type = QEMU_OPT_STRING,
+        },
+        { /* end of list */ }
+    },
+};
+
 static QemuOptsList qemu_semihosting_config_opts = {
     .name = "semihosting-config",
     .implied_opt_name = "enable",
@@ -2815,6 +2829,7 @@ int main(int argc, char **argv, char **envp)
     qemu_add_opts(&qemu_name_opts);
     qemu_add_opts(&qemu_numa_opts);
     qemu_add_opts(&qemu_icount_opts);
+    qemu_add_opts(&qemu_tcg_opts);
     qemu_add_opts(&qemu_semihosting_config_opts);
 
     runstate_init();
@@ -3620,6 +3635,15 @@ int main(int argc, char **argv, char **envp)
                     tcg_tb_size = 0;
                 }
                 break;
+            case QEMU_OPTION_tb_cache:
+                tcg_tb_cache = optarg;
+                break;
+            case QEMU_OPTION_tb_trace:
+                tb_trace_threshold = strtol(optarg, NULL, 0);
+                if (tb_trace_threshold < 0) {
+                    tb_trace_threshold = 0;
+                }
+                break;
             case QEMU_OPTION_icount:
                 icount_opts = qemu_opts_parse(qemu_find_opts("icount"),
                                               optarg, 1);
@@ -3627,6 +3651,11 @@ int main(int argc, char **argv, char **envp)
                     exit(1);
                 }
                 break;
+            case QEMU_OPTION_tcg:
+                if (!qemu_opts_parse(qemu_find_opts("tcg"), optarg, 1)) {
+                    exit(1);
+                }
+                break;
             case QEMU_OPTION_incoming:
                 if (!incoming) {
                     runstate_set(RUN_STATE_INMIGRATE);
@@ -4147,6 +4176,16 @@ int main(int argc, char **argv, char **envp)
         qemu_opts_del(icount_opts);
     }
 
+    opts = qemu_opts_find(qemu_find_opts("tcg"), NULL);
+    if (opts) {
+        Error *local_err = NULL;
+        qemu_tcg_configure(opts, &local_err);
+        if (local_err) {
+            error_report_err(local_err);
+            exit(1);
+        }
+    }
+
     /* clean up network at qemu process termination */
     atexit(&net_cleanup);
 